@@ -81,6 +81,10 @@ int main(void) {
   size_t index;
   request = tid_req_new();
   tests = json_load_file(TESTS, JSON_REJECT_DUPLICATES|JSON_DISABLE_EOF_CHECK, NULL);
+  if (!json_is_array(tests)) {
+    tr_debug("Unable to load test cases from %s\n", TESTS);
+    return 1;
+  }
   json_array_foreach(tests, index, tc)
     if (!handle_test_case(tc))
       error = 1;
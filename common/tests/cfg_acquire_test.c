@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <talloc.h>
+#include <assert.h>
+#include <glib.h>
+
+#include <tr_config.h>
+#include <tr_debug.h>
+
+/* Tests that readers keep a valid configuration while a new one is applied */
+
+#define N_READERS 4
+#define N_SWAPS 2000
+
+/* a configuration whose hostname records its generation, so readers can check it */
+static TR_CFG *new_cfg(TR_CFG_MGR *cfg_mgr)
+{
+  TR_CFG *cfg=tr_cfg_new(cfg_mgr);
+
+  assert(cfg!=NULL);
+  cfg->internal=talloc_zero(cfg, TR_CFG_INTERNAL);
+  assert(cfg->internal!=NULL);
+  cfg->internal->log_threshold=LOG_CRIT;
+  cfg->internal->console_threshold=LOG_CRIT;
+  cfg->internal->hostname=talloc_asprintf(cfg, "gen%u", cfg_mgr->generation+1);
+  assert(cfg->internal->hostname!=NULL);
+  return cfg;
+}
+
+static void apply_cfg(TR_CFG_MGR *cfg_mgr)
+{
+  cfg_mgr->new=new_cfg(cfg_mgr);
+  assert(tr_apply_new_config(cfg_mgr)==TR_CFG_SUCCESS);
+}
+
+/* a reference taken before a swap still sees the old configuration */
+static void test_acquire_across_swap(void)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(NULL);
+  TR_CFG *old=NULL;
+  TR_CFG *cur=NULL;
+
+  assert(cfg_mgr!=NULL);
+  assert(tr_cfg_mgr_acquire(cfg_mgr)==NULL);
+
+  apply_cfg(cfg_mgr);
+  old=tr_cfg_mgr_acquire(cfg_mgr);
+  assert(old==cfg_mgr->active);
+  assert(g_atomic_int_get(&(old->refcount))==2);
+
+  apply_cfg(cfg_mgr);
+  assert(cfg_mgr->active!=old);
+  assert(tr_cfg_mgr_reclaim(cfg_mgr)==0); /* no reader was loading it */
+  /* only our reference is left, and the configuration is intact */
+  assert(g_atomic_int_get(&(old->refcount))==1);
+  assert(tr_cfg_get_generation(old)==1);
+  assert(0==strcmp(old->internal->hostname, "gen1"));
+
+  cur=tr_cfg_mgr_acquire(cfg_mgr);
+  assert(tr_cfg_get_generation(cur)==2);
+  assert(0==strcmp(cur->internal->hostname, "gen2"));
+
+  tr_cfg_release(old); /* frees it */
+  tr_cfg_release(cur);
+  assert(g_atomic_int_get(&(cfg_mgr->active->refcount))==1);
+  tr_cfg_mgr_free(cfg_mgr);
+}
+
+/* a reader caught between loading the pointer and taking its reference delays the
+ * release of the old configuration, but applying a new one does not wait for it */
+static void test_deferred_release(void)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(NULL);
+  TR_CFG *old=NULL;
+  TR_CFG *loaded[3];
+  unsigned int slot[3];
+  int ii=0;
+
+  assert(cfg_mgr!=NULL);
+  apply_cfg(cfg_mgr);
+  old=cfg_mgr->active;
+
+  /* stop a reader halfway through tr_cfg_mgr_acquire() */
+  slot[0]=tr_reclaim_enter(cfg_mgr->reclaim);
+  loaded[0]=g_atomic_pointer_get(&(cfg_mgr->active));
+  assert(loaded[0]==old);
+
+  apply_cfg(cfg_mgr);
+  assert(g_atomic_int_get(&(old->refcount))==1); /* still the manager's */
+  assert(tr_cfg_mgr_reclaim(cfg_mgr)==1);
+  assert(tr_cfg_mgr_reclaim(cfg_mgr)==1);
+
+  /* the reader finishes; now the manager lets go */
+  g_atomic_int_inc(&(loaded[0]->refcount));
+  tr_reclaim_exit(cfg_mgr->reclaim, slot[0]);
+  assert(tr_cfg_mgr_reclaim(cfg_mgr)==0);
+  assert(g_atomic_int_get(&(old->refcount))==1); /* the reader's */
+  assert(0==strcmp(old->internal->hostname, "gen1"));
+  tr_cfg_release(old);
+
+  /* readers that overlap so that one is always inside do not hold replaced
+   * configurations back for long */
+  slot[0]=tr_reclaim_enter(cfg_mgr->reclaim);
+  for (ii=1; ii<=100; ii++) {
+    slot[ii%3]=tr_reclaim_enter(cfg_mgr->reclaim);
+    apply_cfg(cfg_mgr);
+    tr_reclaim_exit(cfg_mgr->reclaim, slot[(ii-1)%3]);
+    assert(tr_cfg_mgr_reclaim(cfg_mgr)<=2);
+  }
+  tr_reclaim_exit(cfg_mgr->reclaim, slot[100%3]);
+  assert(tr_cfg_mgr_reclaim(cfg_mgr)==0);
+  assert(tr_cfg_get_generation(cfg_mgr->active)==102);
+
+  /* anything still retired is released with the manager */
+  slot[0]=tr_reclaim_enter(cfg_mgr->reclaim);
+  apply_cfg(cfg_mgr);
+  tr_reclaim_exit(cfg_mgr->reclaim, slot[0]);
+  tr_cfg_mgr_free(cfg_mgr);
+}
+
+struct reader_data {
+  TR_CFG_MGR *cfg_mgr;
+  gint *stop;
+  unsigned int n_acquired;
+};
+
+static void *reader_thread(void *arg)
+{
+  struct reader_data *data=(struct reader_data *)arg;
+  TR_CFG *cfg=NULL;
+  unsigned int last=0;
+  unsigned int gen=0;
+  char expected[32];
+
+  while (!g_atomic_int_get(data->stop)) {
+    cfg=tr_cfg_mgr_acquire(data->cfg_mgr);
+    assert(cfg!=NULL);
+    gen=tr_cfg_get_generation(cfg);
+    assert(gen>=last); /* never goes back to an older configuration */
+    last=gen;
+    /* the configuration must stay intact until we release it, even if it is replaced meanwhile */
+    snprintf(expected, sizeof(expected), "gen%u", gen);
+    assert(0==strcmp(cfg->internal->hostname, expected));
+    sched_yield();
+    assert(0==strcmp(cfg->internal->hostname, expected));
+    assert(g_atomic_int_get(&(cfg->refcount))>0);
+    tr_cfg_release(cfg);
+    data->n_acquired++;
+  }
+  return NULL;
+}
+
+/* readers acquire and release while the main thread keeps applying new configurations */
+static void test_acquire_threaded(void)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(NULL);
+  struct reader_data data[N_READERS];
+  pthread_t threads[N_READERS];
+  gint stop=0;
+  int ii=0;
+
+  assert(cfg_mgr!=NULL);
+  apply_cfg(cfg_mgr);
+  for (ii=0; ii<N_READERS; ii++) {
+    data[ii].cfg_mgr=cfg_mgr;
+    data[ii].stop=&stop;
+    data[ii].n_acquired=0;
+    assert(0==pthread_create(&threads[ii], NULL, reader_thread, &data[ii]));
+  }
+
+  for (ii=0; ii<N_SWAPS; ii++)
+    apply_cfg(cfg_mgr);
+
+  g_atomic_int_set(&stop, 1);
+  for (ii=0; ii<N_READERS; ii++) {
+    assert(0==pthread_join(threads[ii], NULL));
+    assert(data[ii].n_acquired>0);
+  }
+
+  /* every old configuration was freed by its last reader; only the manager's reference is left */
+  assert(tr_cfg_get_generation(cfg_mgr->active)==N_SWAPS+1);
+  assert(tr_cfg_mgr_reclaim(cfg_mgr)==0);
+  assert(g_atomic_int_get(&(cfg_mgr->active->refcount))==1);
+  tr_cfg_mgr_free(cfg_mgr);
+}
+
+int main(void)
+{
+  test_acquire_across_swap();
+  test_deferred_release();
+  test_acquire_threaded();
+  printf("Success.\n");
+  return 0;
+}
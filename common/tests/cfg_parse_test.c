@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <talloc.h>
+#include <assert.h>
+#include <glib.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_config.h>
+#include <tr_debug.h>
+
+/* Tests that config files parsed by several threads give the same results as by one */
+
+#define N_FILES 12
+
+static const char *base_cfg=
+  "{\"serial_number\": 100,\n"
+  " \"tr_internal\": {\"hostname\": \"server.example.com\", \"monitoring\": {\"port\": 12311,\n"
+  "                 \"authorized_credentials\": [\"mon@example.com\"]}},\n"
+  " \"communities\": [{\"community_id\": \"apc.example.com\", \"type\": \"apc\", \"apcs\": [],\n"
+  "                   \"idp_realms\": [\"A.example.com\"], \"rp_realms\": [\"A.example.com\"]}],\n"
+  " \"local_organizations\": [{\"organization_name\": \"test org\", \"realms\": [\n"
+  "   {\"realm\": \"A.example.com\",\n"
+  "    \"identity_provider\": {\"aaa_servers\": [\"rad.A.example.com\"], \"apcs\": [\"apc.example.com\"],\n"
+  "                           \"shared_config\": \"no\"},\n"
+  "    \"gss_names\": [\"gss@example.com\"]}]}]}\n";
+
+/* each other file adds a community */
+static const char *comm_cfg_fmt=
+  "{\"serial_number\": %d,\n"
+  " \"communities\": [{\"community_id\": \"comm%02d.example.com\", \"type\": \"apc\", \"apcs\": [],\n"
+  "                   \"idp_realms\": [\"A.example.com\"], \"rp_realms\": []}]}\n";
+
+static int serial_of(int ii)
+{
+  return 100+ii;
+}
+
+static void write_files(TALLOC_CTX *mem_ctx, const char *dir, char **paths)
+{
+  FILE *f=NULL;
+  int ii=0;
+
+  for (ii=0; ii<N_FILES; ii++) {
+    paths[ii]=talloc_asprintf(mem_ctx, "%s/file%02d.cfg", dir, ii);
+    assert(paths[ii]!=NULL);
+    f=fopen(paths[ii], "w");
+    assert(f!=NULL);
+    if (ii==0)
+      assert(0<=fputs(base_cfg, f));
+    else
+      assert(0<fprintf(f, comm_cfg_fmt, serial_of(ii), ii));
+    assert(0==fclose(f));
+  }
+}
+
+static void break_file(const char *path)
+{
+  FILE *f=fopen(path, "w");
+
+  assert(f!=NULL);
+  assert(0<=fputs("{\"serial_number\": 1,\n \"communities\": [\n", f));
+  assert(0==fclose(f));
+}
+
+/* what a parse produced: files in load order with their serials, and communities in table order */
+struct result {
+  GString *files;
+  GString *comms;
+};
+
+static void parse(char **paths, unsigned int n_threads, struct result *result)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(NULL);
+  TR_CFG_FILE *file=NULL;
+  TR_COMM_ITER *iter=tr_comm_iter_new(NULL);
+  TR_COMM *comm=NULL;
+  char *name=NULL;
+  guint ii=0;
+  int jj=0;
+
+  assert((cfg_mgr!=NULL) && (iter!=NULL));
+  cfg_mgr->parse_threads=n_threads;
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, N_FILES, paths));
+
+  result->files=g_string_new("");
+  assert(cfg_mgr->new->files->len==N_FILES);
+  for (ii=0; ii<cfg_mgr->new->files->len; ii++) {
+    file=&g_array_index(cfg_mgr->new->files, TR_CFG_FILE, ii);
+    /* each file's serial was read from that file */
+    for (jj=0; (jj<N_FILES) && (0!=strcmp(file->name, paths[jj])); jj++) { }
+    assert(jj<N_FILES);
+    assert(file->serial==serial_of(jj));
+    g_string_append_printf(result->files, "%s:%d\n", file->name, (int)file->serial);
+  }
+
+  result->comms=g_string_new("");
+  for (comm=tr_comm_table_iter_first(iter, cfg_mgr->new->ctable);
+       comm!=NULL;
+       comm=tr_comm_table_iter_next(iter)) {
+    name=tr_name_strdup(tr_comm_get_id(comm));
+    g_string_append_printf(result->comms, "%s\n", name);
+    free(name);
+  }
+  assert(tr_comm_table_size(cfg_mgr->new->ctable)==N_FILES);
+
+  tr_comm_iter_free(iter);
+  tr_cfg_mgr_free(cfg_mgr);
+}
+
+static void result_free(struct result *result)
+{
+  g_string_free(result->files, TRUE);
+  g_string_free(result->comms, TRUE);
+}
+
+/* parse, expecting failure, and return what was logged */
+static char *parse_fail(TALLOC_CTX *mem_ctx, char **paths, unsigned int n_threads)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(NULL);
+  FILE *log=tmpfile();
+  int saved_stderr=dup(STDERR_FILENO);
+  char buf[65536];
+  size_t len=0;
+
+  assert((cfg_mgr!=NULL) && (log!=NULL) && (saved_stderr>=0));
+  cfg_mgr->parse_threads=n_threads;
+  fflush(stderr);
+  assert(0<=dup2(fileno(log), STDERR_FILENO));
+  assert(TR_CFG_SUCCESS!=tr_parse_config(cfg_mgr, N_FILES, paths));
+  fflush(stderr);
+  assert(0<=dup2(saved_stderr, STDERR_FILENO));
+  close(saved_stderr);
+  tr_cfg_mgr_free(cfg_mgr);
+
+  rewind(log);
+  len=fread(buf, 1, sizeof(buf)-1, log);
+  buf[len]='\0';
+  fclose(log);
+  return talloc_strdup(mem_ctx, buf);
+}
+
+static const unsigned int thread_counts[]={1, 2, 4, 16};
+#define N_THREAD_COUNTS (sizeof(thread_counts)/sizeof(thread_counts[0]))
+
+/* the files, their order and what they configure do not depend on the number of threads */
+static void test_same_results(char **paths)
+{
+  struct result expected, result;
+  size_t ii=0;
+
+  parse(paths, 1, &expected);
+  for (ii=1; ii<N_THREAD_COUNTS; ii++) {
+    parse(paths, thread_counts[ii], &result);
+    assert(0==strcmp(expected.files->str, result.files->str));
+    assert(0==strcmp(expected.comms->str, result.comms->str));
+    result_free(&result);
+  }
+  result_free(&expected);
+}
+
+/* the first bad file in load order is the one reported, however many threads are used */
+static void test_first_bad_file(char **paths)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(tmp_ctx);
+  const char *first=NULL;
+  const char *second=NULL;
+  char *log=NULL;
+  size_t ii=0;
+
+  /* find the load order */
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, N_FILES, paths));
+  first=talloc_strdup(tmp_ctx, g_array_index(cfg_mgr->new->files, TR_CFG_FILE, 3).name);
+  second=talloc_strdup(tmp_ctx, g_array_index(cfg_mgr->new->files, TR_CFG_FILE, 8).name);
+  break_file(first);
+  break_file(second);
+
+  for (ii=0; ii<N_THREAD_COUNTS; ii++) {
+    log=parse_fail(tmp_ctx, paths, thread_counts[ii]);
+    assert(NULL!=strstr(log, talloc_asprintf(tmp_ctx, "Error parsing JSON in %s\n", first)));
+    assert(NULL==strstr(log, second));
+  }
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  char dir[]="/tmp/cfg_parse_test.XXXXXX";
+  char *paths[N_FILES];
+  int ii=0;
+
+  tr_log_open();
+  assert(mkdtemp(dir)!=NULL);
+  write_files(tmp_ctx, dir, paths);
+  test_same_results(paths);
+  test_first_bad_file(paths);
+
+  for (ii=0; ii<N_FILES; ii++)
+    assert(0==unlink(paths[ii]));
+  assert(0==rmdir(dir));
+  talloc_free(tmp_ctx);
+  printf("Success.\n");
+  return 0;
+}
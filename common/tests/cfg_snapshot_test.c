@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <talloc.h>
+#include <assert.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_config.h>
+#include <tr_debug.h>
+#include <tr_gss_names.h>
+#include <tr_idp.h>
+#include <tr_rp_client.h>
+#include <trp_ptable.h>
+
+/* Tests that a configuration loaded from a snapshot is the one parsed from the files,
+ * and that the snapshot is not used once the files change */
+
+#define N_FILES 2
+
+static const char *internal_cfg=
+  "{\"serial_number\": 7,\n"
+  " \"tr_internal\": {\"hostname\": \"tr.example.com\", \"trps_port\": 12308, \"tids_port\": 12309,\n"
+  "   \"cfg_poll_interval\": 1, \"cfg_settling_time\": 5, \"trp_sweep_interval\": 30,\n"
+  "   \"trp_update_interval\": 30, \"trp_connect_interval\": 10, \"tid_request_timeout\": 5,\n"
+  "   \"tid_response_numerator\": 2, \"tid_response_denominator\": 3,\n"
+  "   \"monitoring\": {\"port\": 12311, \"authorized_credentials\": [\"mon@example.com\"]},\n"
+  "   \"logging\": {\"log_threshold\": \"info\", \"console_threshold\": \"notice\",\n"
+  "                \"debug_sample\": {\"one_in\": 1000, \"gss_names\": [\"rp@example.com\"],\n"
+  "                                 \"realms\": [\"example.org\", \"*.example.net\"]}}}}\n";
+
+static const char *orgs_cfg=
+  "{\"serial_number\": 9,\n"
+  " \"communities\": [\n"
+  "   {\"community_id\": \"apc.x\", \"type\": \"apc\", \"apcs\": [], \"expiration_interval\": 30,\n"
+  "    \"idp_realms\": [\"apc.x\", \"idp.x\"], \"rp_realms\": [\"rp.x\", \"other.rp.x\"]},\n"
+  "   {\"community_id\": \"coi.x\", \"type\": \"coi\", \"apcs\": [\"apc.x\"],\n"
+  "    \"idp_realms\": [\"idp.x\"], \"rp_realms\": [\"rp.x\"]}],\n"
+  " \"local_organizations\": [{\"organization_name\": \"Demo\", \"realms\": [\n"
+  "   {\"realm\": \"apc.x\", \"identity_provider\": {\"aaa_servers\": [\"apc.example.com\"],\n"
+  "                                             \"apcs\": [\"apc.x\"], \"shared_config\": \"no\"}},\n"
+  "   {\"realm\": \"rp.x\", \"gss_names\": [\"rp-cred@apc.x\", \"second-rp-cred@apc.x\"],\n"
+  "    \"filters\": {\"tid_inbound\": [{\"action\": \"accept\", \"domain_constraints\": [\"*.example.com\"],\n"
+  "                                  \"realm_constraints\": [\"rp.x\", \"*.rp.x\"],\n"
+  "                                  \"specs\": [{\"field\": \"rp_realm\", \"match\": [\"rp.x\", \"*.rp.x\"]}]}]}},\n"
+  "   {\"realm\": \"other.rp.x\", \"gss_names\": [\"other-rp-cred@apc.x\"]},\n"
+  "   {\"realm\": \"idp.x\", \"identity_provider\": {\"aaa_servers\": [\"idp.example.com\", \"idp2.example.com:1813\"],\n"
+  "                                             \"apcs\": [\"apc.x\"], \"shared_config\": \"yes\"}}]}],\n"
+  " \"peer_organizations\": [\n"
+  "   {\"hostname\": \"peer.example.com:12308\", \"gss_names\": [\"peer-cred@apc.x\"],\n"
+  "    \"filters\": {\"trp_inbound\": [{\"action\": \"reject\", \"specs\": [{\"field\": \"realm\", \"match\": [\"*.bad.x\"]}]},\n"
+  "                                  {\"action\": \"accept\", \"specs\": [{\"field\": \"realm\", \"match\": [\"*\"]}]}]}},\n"
+  "   {\"hostname\": \"peer2.example.com\", \"gss_names\": [\"peer2-cred@apc.x\"]}],\n"
+  " \"default_servers\": [\"default1.example.com\", \"default2.example.com:1812\"]}\n";
+
+static void write_file(const char *path, const char *contents)
+{
+  FILE *f=fopen(path, "w");
+
+  assert(f!=NULL);
+  assert(0<=fputs(contents, f));
+  assert(0==fclose(f));
+}
+
+/* append a JSON string to buf, freeing it */
+static void append_json(GString *buf, json_t *j)
+{
+  char *s=NULL;
+
+  assert(j!=NULL);
+  s=json_dumps(j, JSON_SORT_KEYS);
+  assert(s!=NULL);
+  g_string_append_printf(buf, "%s\n", s);
+  free(s);
+  json_decref(j);
+}
+
+/* everything a configuration holds, as text */
+static char *describe(TALLOC_CTX *mem_ctx, TR_CFG *cfg)
+{
+  TR_CFG_INTERNAL *internal=cfg->internal;
+  TR_AAA_SERVER *aaa=NULL;
+  GString *buf=g_string_new("");
+  char *s=NULL;
+
+  append_json(buf, tr_cfg_files_to_json_array(cfg));
+  g_string_append_printf(buf, "%s %d %d %d %u %d %d %d %d %u %u %u %u %u %u %u %u\n",
+                         internal->hostname,
+                         internal->tids_port, internal->trps_port, internal->mons_port,
+                         internal->max_tree_depth,
+                         internal->log_threshold, internal->console_threshold,
+                         internal->log_async, (int)internal->log_overflow,
+                         internal->debug_sample_one_in,
+                         internal->cfg_poll_interval, internal->cfg_settling_time,
+                         internal->trp_sweep_interval, internal->trp_update_interval,
+                         internal->trp_connect_interval, internal->tid_req_timeout,
+                         internal->tid_resp_numer*100+internal->tid_resp_denom);
+  append_json(buf, tr_gss_names_to_json_array(internal->monitoring_credentials));
+  append_json(buf, tr_gss_names_to_json_array(internal->debug_sample_gss_names));
+  append_json(buf, tr_rp_clients_to_json(cfg->rp_clients));
+  append_json(buf, trp_ptable_to_json(cfg->peers));
+  for (aaa=cfg->default_servers; aaa!=NULL; aaa=aaa->next)
+    g_string_append_printf(buf, "%.*s:%d\n", aaa->hostname->len, aaa->hostname->buf, aaa->port);
+  append_json(buf, tr_idp_realms_to_json(cfg->ctable->idp_realms));
+  append_json(buf, tr_comm_table_to_json(cfg->ctable));
+
+  s=talloc_strdup(mem_ctx, buf->str);
+  g_string_free(buf, TRUE);
+  return s;
+}
+
+static int sampled(TR_CFG *cfg, const char *realm)
+{
+  TR_NAME *r=tr_new_name(realm);
+  int result=tr_cfg_debug_sampled(cfg->internal, NULL, r);
+
+  tr_free_name(r);
+  return result;
+}
+
+/* load the snapshot, expecting failure */
+static void load_fails(const char *snapshot, unsigned int n_files, char **paths)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(NULL);
+
+  assert(cfg_mgr!=NULL);
+  assert(TR_CFG_SUCCESS!=tr_cfg_load_snapshot(cfg_mgr, snapshot, n_files, paths));
+  assert(cfg_mgr->new==NULL);
+  tr_cfg_mgr_free(cfg_mgr);
+}
+
+/* a snapshot gives back the configuration parsed from the files */
+static void test_round_trip(TALLOC_CTX *mem_ctx, const char *snapshot, char **paths)
+{
+  TR_CFG_MGR *parsed=tr_cfg_mgr_new(mem_ctx);
+  TR_CFG_MGR *loaded=tr_cfg_mgr_new(mem_ctx);
+
+  assert(TR_CFG_SUCCESS==tr_parse_config(parsed, N_FILES, paths));
+  assert(TR_CFG_SUCCESS==tr_cfg_write_snapshot(parsed, snapshot));
+
+  assert(TR_CFG_SUCCESS==tr_cfg_load_snapshot(loaded, snapshot, N_FILES, paths));
+  assert(loaded->new!=NULL);
+  assert(0==strcmp(describe(mem_ctx, parsed->new), describe(mem_ctx, loaded->new)));
+
+  /* the loaded realm patterns and filters work */
+  assert(sampled(loaded->new, "example.org"));
+  assert(sampled(loaded->new, "a.example.net"));
+  assert(!sampled(loaded->new, "example.com"));
+  assert(loaded->new->peers->head->filters->this->compiled!=NULL);
+
+  /* the loaded configuration can be applied */
+  assert(TR_CFG_SUCCESS==tr_apply_new_config(loaded));
+  assert(loaded->active!=NULL);
+}
+
+/* a snapshot for other files is not used */
+static void test_other_files(TALLOC_CTX *mem_ctx, const char *snapshot, char **paths)
+{
+  char *swapped[N_FILES];
+  char *renamed=talloc_asprintf(mem_ctx, "%s.moved.cfg", paths[1]);
+
+  load_fails(snapshot, N_FILES-1, paths);
+
+  swapped[0]=paths[0];
+  swapped[1]=renamed;
+  assert(0==link(paths[1], renamed));
+  load_fails(snapshot, N_FILES, swapped);
+  assert(0==unlink(renamed));
+}
+
+/* a damaged snapshot is not used */
+static void test_damaged(TALLOC_CTX *mem_ctx, const char *snapshot, char **paths)
+{
+  char *damaged=talloc_asprintf(mem_ctx, "%s.damaged", snapshot);
+  FILE *f=NULL;
+  char *buf=NULL;
+  long len=0;
+
+  f=fopen(snapshot, "r");
+  assert(f!=NULL);
+  assert(0==fseek(f, 0, SEEK_END));
+  len=ftell(f);
+  rewind(f);
+  buf=talloc_size(mem_ctx, len);
+  assert(len==fread(buf, 1, len, f));
+  assert(0==fclose(f));
+
+  /* flip a byte in the payload */
+  buf[len-5]^=0x40;
+  f=fopen(damaged, "w");
+  assert((f!=NULL) && (len==fwrite(buf, 1, len, f)) && (0==fclose(f)));
+  load_fails(damaged, N_FILES, paths);
+  buf[len-5]^=0x40;
+
+  /* truncate it */
+  f=fopen(damaged, "w");
+  assert((f!=NULL) && (len-1==fwrite(buf, 1, len-1, f)) && (0==fclose(f)));
+  load_fails(damaged, N_FILES, paths);
+
+  /* not a snapshot at all */
+  write_file(damaged, orgs_cfg);
+  load_fails(damaged, N_FILES, paths);
+
+  /* missing */
+  assert(0==unlink(damaged));
+  load_fails(damaged, N_FILES, paths);
+}
+
+/* once a file changes, the snapshot is not used, and none is written from a stale parse */
+static void test_changed(TALLOC_CTX *mem_ctx, const char *snapshot, char **paths)
+{
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(mem_ctx);
+  char *changed=talloc_strdup(mem_ctx, internal_cfg);
+
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, N_FILES, paths));
+
+  /* same length, so only the contents tell */
+  *strstr(changed, "tr.example.com")='T';
+  write_file(paths[0], changed);
+  load_fails(snapshot, N_FILES, paths);
+
+  write_file(paths[0], internal_cfg);
+  assert(0==unlink(snapshot));
+  write_file(paths[1], " ");
+  assert(TR_CFG_SUCCESS!=tr_cfg_write_snapshot(cfg_mgr, snapshot));
+  assert(0!=access(snapshot, F_OK));
+  write_file(paths[1], orgs_cfg);
+}
+
+int main(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  char dir[]="/tmp/cfg_snapshot_test.XXXXXX";
+  char *paths[N_FILES];
+  char *snapshot=NULL;
+  int ii=0;
+
+  tr_log_open();
+  assert(mkdtemp(dir)!=NULL);
+  paths[0]=talloc_asprintf(tmp_ctx, "%s/internal.cfg", dir);
+  paths[1]=talloc_asprintf(tmp_ctx, "%s/orgs.cfg", dir);
+  snapshot=talloc_asprintf(tmp_ctx, "%s/snapshot", dir);
+  write_file(paths[0], internal_cfg);
+  write_file(paths[1], orgs_cfg);
+
+  test_round_trip(tmp_ctx, snapshot, paths);
+  test_other_files(tmp_ctx, snapshot, paths);
+  test_damaged(tmp_ctx, snapshot, paths);
+  test_changed(tmp_ctx, snapshot, paths);
+
+  for (ii=0; ii<N_FILES; ii++)
+    assert(0==unlink(paths[ii]));
+  assert(0==rmdir(dir));
+  talloc_free(tmp_ctx);
+  printf("Success.\n");
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <talloc.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <jansson.h>
 
 #include <tr_apc.h>
@@ -360,7 +362,6 @@ struct comm_memb_entry {
   const char *realm_name;
   const char *comm_name;
   const char *origin;
-  /* TODO: test provenance */
 };
 
 /* add an existing realm to an existing community (these must
@@ -372,14 +373,20 @@ static int add_comm_membership(TR_COMM_TABLE *ctab, struct comm_memb_entry *entr
   TR_COMM *comm=tr_comm_table_find_comm(ctab, comm_name);
   TR_RP_REALM *rp_realm=(entry->role==TR_ROLE_RP)?(tr_comm_table_find_rp_realm(ctab, realm_name)):(NULL);
   TR_IDP_REALM *idp_realm=(entry->role==TR_ROLE_IDP)?(tr_comm_table_find_idp_realm(ctab, realm_name)):(NULL);
-  json_t *prov=NULL;
+  TR_NAME *origin=NULL;
+  TR_PROVENANCE *prov=NULL;
   
   if ((comm==NULL) || ((rp_realm==NULL)&&(idp_realm==NULL)))
     return 1;
 
-  prov=json_array();
-  if (entry->origin!=NULL)
-    json_array_append(prov, json_string(entry->origin));
+  if (entry->origin!=NULL) {
+    origin=tr_new_name(entry->origin);
+    if (0!=tr_provenance_append(&prov, origin)) {
+      tr_free_name(origin);
+      return 3;
+    }
+    tr_free_name(origin);
+  }
 
   switch (entry->role) {
   case TR_ROLE_IDP:
@@ -389,9 +396,11 @@ static int add_comm_membership(TR_COMM_TABLE *ctab, struct comm_memb_entry *entr
     tr_comm_add_rp_realm(ctab, comm, rp_realm, 0, prov, NULL); /* Expiry!? */
     break;
   default:
+    tr_provenance_unref(prov);
     return 2;
   }
   
+  tr_provenance_unref(prov); /* the table holds its own reference */
   return 0;
 }
 
@@ -453,6 +462,56 @@ cleanup:
   return rc;
 }
 
+/* the table's tail pointer and back links must match its membership list */
+static int verify_memb_tail(TR_COMM_TABLE *ctab)
+{
+  TR_COMM_MEMB *memb=ctab->memberships;
+  TR_COMM_MEMB *dup=NULL;
+
+  if ((memb!=NULL) && (memb->prev!=NULL))
+    return 1;
+  while ((memb!=NULL) && (memb->next!=NULL)) {
+    if (memb->next->prev!=memb)
+      return 1;
+    for (dup=memb->origin_next; dup!=NULL; dup=dup->origin_next) {
+      if (dup->prev!=NULL)
+        return 1; /* not on the main list */
+    }
+    memb=memb->next;
+  }
+  return (memb==ctab->memberships_tail)?0:1;
+}
+
+/* count the realms in a community */
+static size_t count_comm_realms(TR_COMM_TABLE *ctab, const char *comm_name)
+{
+  TR_COMM_ITER *iter=tr_comm_iter_new(NULL);
+  TR_NAME *name=tr_new_name(comm_name);
+  TR_REALM *realm=NULL;
+  size_t n=0;
+
+  for (realm=tr_realm_iter_first(iter, ctab, name); realm!=NULL; realm=tr_realm_iter_next(iter))
+    n++;
+  tr_free_name(name);
+  tr_comm_iter_free(iter);
+  return n;
+}
+
+/* count the communities of a realm, in either role */
+static size_t count_realm_comms(TR_COMM_TABLE *ctab, const char *realm_name)
+{
+  TR_COMM_ITER *iter=tr_comm_iter_new(NULL);
+  TR_NAME *name=tr_new_name(realm_name);
+  TR_COMM *comm=NULL;
+  size_t n=0;
+
+  for (comm=tr_comm_iter_first(iter, ctab, name); comm!=NULL; comm=tr_comm_iter_next(iter))
+    n++;
+  tr_free_name(name);
+  tr_comm_iter_free(iter);
+  return n;
+}
+
 /**********************************************************************/
 /* Test data */
 
@@ -782,16 +841,35 @@ static int membership_test(void)
   assert(0==add_rp_realm_set(ctab, rp_realm_set_1));
   assert(0==add_idp_realm_set(ctab, idp_realm_set_1));
   assert(0==add_member_set(ctab, member_set_1));
+  assert(0==verify_memb_tail(ctab));
+  assert(4==count_comm_realms(ctab, "comm 1"));
+  assert(6==count_comm_realms(ctab, "apc"));
+  assert(3==count_realm_comms(ctab, "rp 2"));
+  assert(3==count_realm_comms(ctab, "idp 1"));
+  assert(3==count_realm_comms(ctab, "idp 2"));
+  assert(1==count_realm_comms(ctab, "idp 3"));
 
   size=tr_comm_table_size(ctab);
   tr_comm_table_sweep(ctab);
   assert(size==tr_comm_table_size(ctab));
+  /* the sweep rebuilds the indexes */
+  assert(0==verify_comm_set(ctab, comm_set_1));
+  assert(0==verify_rp_realm_set(ctab, rp_realm_set_1));
+  assert(0==verify_idp_realm_set(ctab, idp_realm_set_1));
 
   /* now remove memberships */
   for (ii=0; member_set_1[ii].role!=TR_ROLE_UNKNOWN; ii++) {
     assert(0==remove_membership(ctab, member_set_1, ii));
     assert(2==remove_membership(ctab, member_set_1, ii)); /* should not be in the table */
+    assert(0==verify_memb_tail(ctab));
+    if (ii==7) {
+      /* removed rp 2's null-origin record for comm 1, the peer 1 record took its place */
+      assert(3==count_comm_realms(ctab, "comm 1"));
+      assert(2==count_realm_comms(ctab, "rp 2"));
+    }
   }
+  assert(0==count_comm_realms(ctab, "comm 1"));
+  assert(0==count_realm_comms(ctab, "rp 2"));
 
   assert(NULL==ctab->memberships);
 
@@ -806,6 +884,7 @@ static int membership_test(void)
   for(; ii>0; ii--) {
     assert(0==remove_membership(ctab, member_set_1, ii-1));
     assert(2==remove_membership(ctab, member_set_1, ii-1)); /* should not be in the table */
+    assert(0==verify_memb_tail(ctab));
     /* tr_comm_table_print(stdout, ctab); */
   }
 
@@ -814,12 +893,103 @@ static int membership_test(void)
   assert(size==tr_comm_table_size(ctab));
   tr_comm_table_sweep(ctab);
   assert(0==tr_comm_table_size(ctab));
+  assert(0==g_hash_table_size(ctab->comm_index));
+  assert(0==g_hash_table_size(ctab->idp_realm_index));
+  assert(0==g_hash_table_size(ctab->rp_realm_index));
 
   talloc_free(mem_ctx);
   return 0;
 }
 
 
+/**********************************************************************/
+/* Provenance test stuff */
+
+static TR_PROVENANCE *make_provenance(const char **hops)
+{
+  TR_PROVENANCE *prov=NULL;
+  TR_NAME *name=NULL;
+
+  for (; *hops!=NULL; hops++) {
+    name=tr_new_name(*hops);
+    assert(name!=NULL);
+    assert(0==tr_provenance_append(&prov, name));
+    tr_free_name(name);
+  }
+  return prov;
+}
+
+static int provenance_test(void)
+{
+  const char *hops_1[]={"origin", "peer 1", "peer 2", NULL};
+  const char *hops_2[]={"other", "peer 1", "peer 2", NULL};
+  TR_PROVENANCE *p1=make_provenance(hops_1);
+  TR_PROVENANCE *p2=make_provenance(hops_2);
+  TR_PROVENANCE *shared=NULL;
+  TR_PROVENANCE *decoded=NULL;
+  TR_NAME *name=NULL;
+  json_t *jprov=NULL;
+  char *s=NULL;
+
+  assert(3==tr_provenance_len(p1));
+  assert(0==tr_provenance_len(NULL));
+  assert(0==tr_name_cmp_str(tr_provenance_get_origin(p1), "origin"));
+  assert(0==tr_name_cmp_str(tr_provenance_get_last_hop(p1), "peer 2"));
+  assert(NULL==tr_provenance_get_hop(p1, 3));
+
+  name=tr_new_name("peer 1");
+  assert(tr_provenance_contains(p1, name));
+  tr_free_name(name);
+  name=tr_new_name("peer 3");
+  assert(!tr_provenance_contains(p1, name));
+  assert(!tr_provenance_contains(NULL, name));
+
+  /* same last hop, different origin */
+  assert(0==tr_provenance_cmp(p1, p2, 1));
+  assert(0==tr_provenance_cmp(p1, p2, 2));
+  assert(0!=tr_provenance_cmp(p1, p2, 0));
+  assert(0==tr_provenance_cmp(p1, p1, 0));
+  assert(0!=tr_provenance_cmp(p1, NULL, 0));
+  assert(0==tr_provenance_cmp(NULL, NULL, 0));
+
+  /* appending to a shared list must not change the other holder's copy */
+  shared=tr_provenance_ref(p1);
+  assert(0==tr_provenance_append(&shared, name));
+  assert(shared!=p1);
+  assert(3==tr_provenance_len(p1));
+  assert(4==tr_provenance_len(shared));
+  assert(tr_provenance_contains(shared, name));
+  assert(!tr_provenance_contains(p1, name));
+  assert(0!=tr_provenance_cmp(p1, shared, 0));
+  tr_free_name(name);
+
+  /* round trip through JSON */
+  jprov=tr_provenance_to_json(shared);
+  assert(jprov!=NULL);
+  s=json_dumps(jprov, JSON_COMPACT);
+  assert(0==strcmp(s, "[\"origin\",\"peer 1\",\"peer 2\",\"peer 3\"]"));
+  free(s);
+  decoded=tr_provenance_from_json(jprov);
+  assert(decoded!=NULL);
+  assert(0==tr_provenance_cmp(decoded, shared, 0));
+  json_decref(jprov);
+
+  jprov=json_pack("[s, i]", "origin", 3);
+  assert(NULL==tr_provenance_from_json(jprov));
+  json_decref(jprov);
+  assert(NULL==tr_provenance_from_json(NULL));
+
+  jprov=tr_provenance_to_json(NULL);
+  assert(0==json_array_size(jprov));
+  json_decref(jprov);
+
+  tr_provenance_unref(decoded);
+  tr_provenance_unref(shared);
+  tr_provenance_unref(p2);
+  tr_provenance_unref(p1);
+  return 0;
+}
+
 /**********************************************************************/
 /* main */
 int main(void)
@@ -832,5 +1002,7 @@ int main(void)
   printf("IDP realm tests passed.\n");
   assert(0==membership_test());
   printf("Membership tests passed.\n");
+  assert(0==provenance_test());
+  printf("Provenance tests passed.\n");
   return 0;
 }
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+#include <tr_config.h>
+#include <tr_gss_names.h>
+
+/* Parse an internal config whose logging section holds debug_sample_json */
+static TR_CFG_RC parse_sample(TR_CFG *cfg, const char *debug_sample_json)
+{
+  char *s=talloc_asprintf(NULL, "{\"logging\": {\"debug_sample\": %s}}", debug_sample_json);
+  json_t *jint=json_loads(s, 0, NULL);
+  TR_CFG_RC rc=TR_CFG_ERROR;
+
+  assert(jint!=NULL);
+  rc=tr_cfg_parse_internal(cfg, jint);
+  json_decref(jint);
+  talloc_free(s);
+  return rc;
+}
+
+static int sampled(TR_CFG *cfg, const char *gss_name, const char *realm)
+{
+  TR_NAME *gss=(gss_name==NULL)?NULL:tr_new_name(gss_name);
+  TR_NAME *r=(realm==NULL)?NULL:tr_new_name(realm);
+  int result=tr_cfg_debug_sampled(cfg->internal, gss, r);
+
+  if (gss!=NULL)
+    tr_free_name(gss);
+  if (r!=NULL)
+    tr_free_name(r);
+  return result;
+}
+
+static void test_parse(void)
+{
+  TR_CFG *cfg=NULL;
+
+  /* defaults: nothing is sampled */
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_SUCCESS==tr_cfg_parse_internal(cfg, json_object()));
+  assert(cfg->internal->debug_sample_one_in==0);
+  assert(cfg->internal->debug_sample_gss_names==NULL);
+  assert(cfg->internal->debug_sample_realms==NULL);
+  assert(!sampled(cfg, "rp@example.com", "example.org"));
+  tr_cfg_free(cfg);
+
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_SUCCESS==parse_sample(cfg, "{\"one_in\": 1000,"
+                                           " \"gss_names\": [\"rp@example.com\", \"other@example.com\"],"
+                                           " \"realms\": [\"example.org\", \"*.example.net\"]}"));
+  assert(cfg->internal->debug_sample_one_in==1000);
+  assert(cfg->internal->debug_sample_gss_names!=NULL);
+  assert(cfg->internal->debug_sample_realms!=NULL);
+  tr_cfg_free(cfg);
+
+  /* malformed sections are rejected */
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_NOPARSE==parse_sample(cfg, "[]"));
+  tr_cfg_free(cfg);
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_NOPARSE==parse_sample(cfg, "{\"one_in\": \"often\"}"));
+  tr_cfg_free(cfg);
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_NOPARSE==parse_sample(cfg, "{\"realms\": \"example.org\"}"));
+  tr_cfg_free(cfg);
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_NOPARSE==parse_sample(cfg, "{\"realms\": [\"example.org\", 7]}"));
+  tr_cfg_free(cfg);
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_SUCCESS!=parse_sample(cfg, "{\"gss_names\": [3]}"));
+  tr_cfg_free(cfg);
+}
+
+static void test_choice(void)
+{
+  TR_CFG *cfg=tr_cfg_new(NULL);
+
+  /* no random sampling, so only the lists select requests */
+  assert(TR_CFG_SUCCESS==parse_sample(cfg, "{\"gss_names\": [\"rp@example.com\"],"
+                                           " \"realms\": [\"example.org\", \"*.example.net\"]}"));
+  assert(sampled(cfg, "rp@example.com", NULL));
+  assert(sampled(cfg, "rp@example.com", "unlisted.org"));
+  assert(!sampled(cfg, "other@example.com", NULL));
+  assert(!sampled(cfg, NULL, NULL));
+
+  assert(sampled(cfg, NULL, "example.org"));
+  assert(sampled(cfg, "other@example.com", "example.org"));
+  assert(sampled(cfg, NULL, "a.example.net"));
+  assert(sampled(cfg, NULL, "b.a.example.net"));
+  assert(!sampled(cfg, NULL, "example.net"));
+  assert(!sampled(cfg, NULL, "sub.example.org"));
+  assert(!sampled(cfg, NULL, "unlisted.org"));
+  tr_cfg_free(cfg);
+
+  /* one_in of 1 samples everything */
+  cfg=tr_cfg_new(NULL);
+  assert(TR_CFG_SUCCESS==parse_sample(cfg, "{\"one_in\": 1}"));
+  assert(sampled(cfg, NULL, NULL));
+  assert(sampled(cfg, "other@example.com", "unlisted.org"));
+  tr_cfg_free(cfg);
+
+  assert(!tr_cfg_debug_sampled(NULL, NULL, NULL));
+}
+
+/* one_in of N samples about one request in N */
+static void test_one_in(void)
+{
+  TR_CFG *cfg=tr_cfg_new(NULL);
+  int n_sampled=0;
+  int ii=0;
+
+  assert(TR_CFG_SUCCESS==parse_sample(cfg, "{\"one_in\": 4}"));
+  for (ii=0; ii<4000; ii++)
+    n_sampled+=sampled(cfg, NULL, "unlisted.org");
+  /* expect 1000; the bounds are many standard deviations wide */
+  assert(n_sampled>700);
+  assert(n_sampled<1300);
+  tr_cfg_free(cfg);
+}
+
+int main(void)
+{
+  test_parse();
+  test_choice();
+  test_one_in();
+
+  printf("Success.\n");
+  return 0;
+}
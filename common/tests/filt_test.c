@@ -265,12 +265,111 @@ int test_filter(void)
   return 1;
 }
 
+/**
+ * Check that compiled match lists agree with tr_name_prefix_wildcard_match() for every
+ * pair of patterns against a set of values.
+ *
+ * @return 1 on success, does not return otherwise
+ */
+int test_fspec_matcher(void)
+{
+  const char *patterns[]={"*", "*.org", "a.org", "", "*b.a.org", "x", NULL};
+  const char *values[]={"a.org", "b.a.org", "org", "x", "", "xa.org", "a.orgx", NULL};
+  TR_FSPEC *fspec=NULL;
+  TR_NAME *value=NULL;
+  TR_NAME *pat_1=NULL;
+  TR_NAME *pat_2=NULL;
+  int expected=0;
+  size_t ii, jj, kk;
+
+  for (ii=0; patterns[ii]!=NULL; ii++) {
+    for (jj=0; patterns[jj]!=NULL; jj++) {
+      fspec=tr_fspec_new(NULL);
+      assert(fspec);
+      pat_1=tr_fspec_add_match(fspec, tr_new_name(patterns[ii]));
+      pat_2=tr_fspec_add_match(fspec, tr_new_name(patterns[jj]));
+      assert(pat_1 && pat_2);
+      assert(0==tr_fspec_compile(fspec));
+
+      for (kk=0; values[kk]!=NULL; kk++) {
+        value=tr_new_name(values[kk]);
+        expected=tr_name_prefix_wildcard_match(value, pat_1) || tr_name_prefix_wildcard_match(value, pat_2);
+        assert(expected==(NULL!=tr_wildcard_set_find_name(fspec->matcher, value)));
+        tr_free_name(value);
+      }
+      tr_fspec_free(fspec);
+    }
+  }
+  return 1;
+}
 
+/**
+ * Parse a filter set from a JSON string.
+ *
+ * @param filts_str JSON object mapping filter types to filters
+ * @return The filter set
+ */
+static TR_FILTER_SET *parse_filter_set(const char *filts_str)
+{
+  json_t *jfilts=json_loads(filts_str, 0, NULL);
+  TR_FILTER_SET *filts=NULL;
+  TR_CFG_RC rc=TR_CFG_ERROR;
+
+  assert(jfilts);
+  filts=tr_cfg_parse_filters(NULL, jfilts, &rc);
+  assert(rc==TR_CFG_SUCCESS);
+  assert(filts);
+  json_decref(jfilts);
+  return filts;
+}
+
+/**
+ * Test that filter sets are identified by their contents.
+ *
+ * @return 1 if all tests pass
+ */
+static int test_filter_set_id(void)
+{
+  const char *accept_realm="{\"trp_outbound\": [{\"action\": \"accept\", "
+                           "\"specs\": [{\"field\": \"realm\", \"match\": \"*\"}]}]}";
+  const char *accept_realm_spaced="{ \"trp_outbound\" : [ { \"specs\": [ { \"match\": \"*\", "
+                                  "\"field\": \"realm\" } ], \"action\": \"accept\" } ] }";
+  const char *accept_comm="{\"trp_outbound\": [{\"action\": \"accept\", "
+                          "\"specs\": [{\"field\": \"comm\", \"match\": \"*\"}]}]}";
+  const char *both="{\"trp_outbound\": [{\"action\": \"accept\", "
+                   "\"specs\": [{\"field\": \"realm\", \"match\": \"*\"}]}], "
+                   "\"tid_inbound\": [{\"action\": \"accept\", "
+                   "\"specs\": [{\"field\": \"rp_realm\", \"match\": \"*\"}]}]}";
+  TR_FILTER_SET *set1=parse_filter_set(accept_realm);
+  TR_FILTER_SET *set2=parse_filter_set(accept_realm_spaced);
+  TR_FILTER_SET *set3=parse_filter_set(accept_comm);
+  TR_FILTER_SET *set4=parse_filter_set(both);
+  TR_FILTER_SET *empty=tr_filter_set_new(NULL);
+
+  assert(tr_filter_set_get_id(NULL)==NULL);
+  assert(tr_filter_set_get_id(empty)==NULL);
+  assert(tr_filter_set_get_id(set1)!=NULL);
+  /* same filters written differently */
+  assert(0==strcmp(tr_filter_set_get_id(set1), tr_filter_set_get_id(set2)));
+  /* different filters */
+  assert(0!=strcmp(tr_filter_set_get_id(set1), tr_filter_set_get_id(set3)));
+  /* adding a filter changes the id */
+  assert(0!=strcmp(tr_filter_set_get_id(set1), tr_filter_set_get_id(set4)));
+
+  tr_filter_set_free(set1);
+  tr_filter_set_free(set2);
+  tr_filter_set_free(set3);
+  tr_filter_set_free(set4);
+  tr_filter_set_free(empty);
+  return 1;
+}
 
 int main(void)
 {
   assert(test_load_filter());
   assert(test_filter());
+  assert(test_fspec_matcher());
+  assert(test_filter_set_id());
   printf("Success\n");
   return 0;
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <talloc.h>
+#include <assert.h>
+#include <glib.h>
+#include <jansson.h>
+
+#include <tr_config.h>
+#include <tr_debug.h>
+
+/* Tests for the cache of parsed configuration files */
+
+static const char *base_cfg=
+  "{\"tr_internal\": {\"hostname\": \"server.example.com\", \"monitoring\": {\"port\": 12311,\n"
+  "                 \"authorized_credentials\": [\"mon@example.com\"]}},\n"
+  " \"communities\": [{\"community_id\": \"apc.example.com\", \"type\": \"apc\", \"apcs\": [],\n"
+  "                   \"idp_realms\": [\"A.example.com\"], \"rp_realms\": [\"A.example.com\"]}],\n"
+  " \"local_organizations\": [{\"organization_name\": \"test org\", \"realms\": [\n"
+  "   {\"realm\": \"A.example.com\",\n"
+  "    \"identity_provider\": {\"aaa_servers\": [\"rad.A.example.com\"], \"apcs\": [\"apc.example.com\"],\n"
+  "                           \"shared_config\": \"no\"},\n"
+  "    \"gss_names\": [\"gss@example.com\"]}]}]}\n";
+
+static char *write_file(TALLOC_CTX *mem_ctx, const char *dir, const char *name, const char *contents)
+{
+  char *path=talloc_asprintf(mem_ctx, "%s/%s", dir, name);
+  FILE *f=NULL;
+
+  assert(path!=NULL);
+  f=fopen(path, "w");
+  assert(f!=NULL);
+  assert(fputs(contents, f)>=0);
+  assert(0==fclose(f));
+  return path;
+}
+
+static TR_CFG_JCACHE_ENTRY *cached(TR_CFG_MGR *cfg_mgr, const char *path)
+{
+  return g_hash_table_lookup(cfg_mgr->jcfg_cache, path);
+}
+
+/* an entry is current only while the file's inode, size and modification time are unchanged */
+static void test_entry_current(const char *dir)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(tmp_ctx);
+  char *path=write_file(tmp_ctx, dir, "current.cfg", "{}");
+  json_t *jcfg=json_object();
+  struct stat file_status;
+  struct timespec times[2];
+  TR_CFG_JCACHE_ENTRY *entry=NULL;
+
+  assert((cfg_mgr!=NULL) && (jcfg!=NULL));
+  assert(0==stat(path, &file_status));
+  tr_cfg_jcache_store(cfg_mgr, path, &file_status, jcfg);
+  entry=cached(cfg_mgr, path);
+  assert(entry!=NULL);
+  assert(entry->jcfg==jcfg);
+  assert(tr_cfg_jcache_entry_current(entry, &file_status));
+
+  /* touched */
+  times[0].tv_sec=1000000;
+  times[0].tv_nsec=0;
+  times[1]=times[0];
+  assert(0==utimensat(AT_FDCWD, path, times, 0));
+  assert(0==stat(path, &file_status));
+  assert(!tr_cfg_jcache_entry_current(entry, &file_status));
+  tr_cfg_jcache_store(cfg_mgr, path, &file_status, jcfg);
+  entry=cached(cfg_mgr, path);
+  assert(tr_cfg_jcache_entry_current(entry, &file_status));
+
+  /* same time, different size */
+  write_file(tmp_ctx, dir, "current.cfg", "{ }");
+  assert(0==utimensat(AT_FDCWD, path, times, 0));
+  assert(0==stat(path, &file_status));
+  assert(!tr_cfg_jcache_entry_current(entry, &file_status));
+
+  /* replaced by another file with the same size and time */
+  write_file(tmp_ctx, dir, "other.cfg", "{}");
+  assert(0==utimensat(AT_FDCWD, talloc_asprintf(tmp_ctx, "%s/other.cfg", dir), times, 0));
+  assert(0==rename(talloc_asprintf(tmp_ctx, "%s/other.cfg", dir), path));
+  assert(0==stat(path, &file_status));
+  assert(file_status.st_size==2);
+  assert(!tr_cfg_jcache_entry_current(entry, &file_status));
+
+  json_decref(jcfg);
+  assert(0==unlink(path));
+  talloc_free(tmp_ctx);
+}
+
+/* unchanged files are not parsed again, changed ones are, and removed ones are forgotten */
+static void test_reparse(const char *dir)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_CFG_MGR *cfg_mgr=tr_cfg_mgr_new(tmp_ctx);
+  char *paths[2]={NULL, NULL};
+  json_t *jcfg[2]={NULL, NULL};
+  struct stat file_status;
+  TR_CFG_JCACHE_ENTRY *entry=NULL;
+
+  assert(cfg_mgr!=NULL);
+  paths[0]=write_file(tmp_ctx, dir, "a.cfg", base_cfg);
+  paths[1]=write_file(tmp_ctx, dir, "b.cfg", "{\"serial_number\": 1}");
+
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, 2, paths));
+  assert(g_hash_table_size(cfg_mgr->jcfg_cache)==2);
+  jcfg[0]=cached(cfg_mgr, paths[0])->jcfg;
+  jcfg[1]=cached(cfg_mgr, paths[1])->jcfg;
+  assert(json_integer_value(json_object_get(jcfg[1], "serial_number"))==1);
+
+  /* nothing changed, the same JSON is used */
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, 2, paths));
+  assert(g_hash_table_size(cfg_mgr->jcfg_cache)==2);
+  assert(cached(cfg_mgr, paths[0])->jcfg==jcfg[0]);
+  assert(cached(cfg_mgr, paths[1])->jcfg==jcfg[1]);
+
+  /* one file changed, only that one is parsed */
+  write_file(tmp_ctx, dir, "b.cfg", "{\"serial_number\": 22}");
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, 2, paths));
+  assert(cached(cfg_mgr, paths[0])->jcfg==jcfg[0]);
+  entry=cached(cfg_mgr, paths[1]);
+  assert(json_integer_value(json_object_get(entry->jcfg, "serial_number"))==22);
+  assert(0==stat(paths[1], &file_status));
+  assert(tr_cfg_jcache_entry_current(entry, &file_status));
+
+  /* a file that is no longer loaded is dropped from the cache */
+  assert(TR_CFG_SUCCESS==tr_parse_config(cfg_mgr, 1, paths));
+  assert(g_hash_table_size(cfg_mgr->jcfg_cache)==1);
+  assert(cached(cfg_mgr, paths[0])->jcfg==jcfg[0]);
+  assert(cached(cfg_mgr, paths[1])==NULL);
+
+  /* a file that does not parse is not cached and fails the load */
+  write_file(tmp_ctx, dir, "b.cfg", "{\"serial_number\": ");
+  assert(TR_CFG_SUCCESS!=tr_parse_config(cfg_mgr, 2, paths));
+  assert(cached(cfg_mgr, paths[1])==NULL);
+
+  assert(0==unlink(paths[0]));
+  assert(0==unlink(paths[1]));
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  char dir[]="/tmp/jcache_test.XXXXXX";
+
+  tr_log_open();
+  assert(mkdtemp(dir)!=NULL);
+  test_entry_current(dir);
+  test_reparse(dir);
+  assert(0==rmdir(dir));
+  printf("Success.\n");
+  return 0;
+}
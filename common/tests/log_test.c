@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <tr_debug.h>
+
+static int n_evaluated=0;
+
+/* counts how often the log macros evaluate their arguments */
+static int evaluated(void)
+{
+  return ++n_evaluated;
+}
+
+/* Redirect stderr to a temporary file. Returns the original stderr descriptor. */
+static int capture_stderr(FILE **f)
+{
+  int saved=dup(STDERR_FILENO);
+
+  assert(saved>=0);
+  *f=tmpfile();
+  assert(*f!=NULL);
+  fflush(stderr);
+  assert(dup2(fileno(*f), STDERR_FILENO)>=0);
+  return saved;
+}
+
+/* Restore stderr and return what was written to it. Caller must free the result. */
+static char *release_stderr(FILE *f, int saved)
+{
+  char *out=NULL;
+  long len=0;
+
+  fflush(stderr);
+  assert(dup2(saved, STDERR_FILENO)>=0);
+  close(saved);
+  len=ftell(f);
+  assert(len>=0);
+  out=calloc(len+1, 1);
+  assert(out!=NULL);
+  rewind(f);
+  assert(fread(out, 1, len, f)==(size_t)len);
+  fclose(f);
+  return out;
+}
+
+static void test_max_sev(void)
+{
+  /* noisy until configured */
+  assert(tr_log_max_sev==LOG_DEBUG);
+
+  /* the more verbose of the two thresholds wins */
+  tr_log_threshold(LOG_ERR);
+  tr_console_threshold(LOG_WARNING);
+  assert(tr_log_max_sev==LOG_WARNING);
+  tr_log_threshold(LOG_INFO);
+  assert(tr_log_max_sev==LOG_INFO);
+  tr_log_threshold(LOG_EMERG);
+  assert(tr_log_max_sev==LOG_WARNING);
+  tr_console_threshold(LOG_CRIT);
+  assert(tr_log_max_sev==LOG_CRIT);
+
+  assert(tr_log_enabled(LOG_ALERT));
+  assert(tr_log_enabled(LOG_CRIT));
+  assert(!tr_log_enabled(LOG_ERR));
+  assert(!tr_log_enabled(LOG_DEBUG));
+}
+
+static void test_threshold_first(void)
+{
+  tr_log_threshold(LOG_EMERG);
+  tr_console_threshold(LOG_WARNING);
+
+  /* arguments of disabled messages are not evaluated */
+  n_evaluated=0;
+  tr_debug("debug %d", evaluated());
+  tr_info("info %d", evaluated());
+  tr_notice("notice %d", evaluated());
+  assert(n_evaluated==0);
+
+  /* but those of enabled messages are, exactly once */
+  tr_warning("warning %d", evaluated());
+  assert(n_evaluated==1);
+  tr_err("error %d", evaluated());
+  assert(n_evaluated==2);
+
+  /* lowering the threshold enables the macros again */
+  tr_console_threshold(LOG_DEBUG);
+  tr_debug("debug %d", evaluated());
+  assert(n_evaluated==3);
+  tr_console_threshold(LOG_WARNING);
+  tr_debug("debug %d", evaluated());
+  assert(n_evaluated==3);
+}
+
+static void test_console_output(void)
+{
+  FILE *f=NULL;
+  int saved=0;
+  char *out=NULL;
+
+  tr_log_threshold(LOG_EMERG);
+  tr_console_threshold(LOG_NOTICE);
+
+  saved=capture_stderr(&f);
+  tr_info("info message");
+  tr_notice("notice message %d", 1);
+  tr_debug("debug message");
+  tr_err("error message %s", "two");
+  /* calling tr_log() directly still applies the threshold */
+  tr_log(LOG_INFO, "direct info message");
+  out=release_stderr(f, saved);
+
+  assert(0==strcmp(out, "notice message 1\nerror message two\n"));
+  free(out);
+}
+
+static void test_sampled(void)
+{
+  FILE *f=NULL;
+  int saved=0;
+  char *out=NULL;
+
+  tr_log_threshold(LOG_EMERG);
+  tr_console_threshold(LOG_WARNING);
+  n_evaluated=0;
+
+  assert(tr_log_sampling==0);
+  tr_log_set_sampled(1);
+  tr_log_set_sampled(1); /* setting twice counts once */
+  assert(tr_log_sampling==1);
+  assert(tr_log_get_sampled());
+
+  /* debug messages of a sampled thread are formatted, but only go to syslog */
+  saved=capture_stderr(&f);
+  tr_debug("sampled debug %d", evaluated());
+  out=release_stderr(f, saved);
+  assert(n_evaluated==1);
+  assert(out[0]=='\0');
+  free(out);
+
+  tr_log_set_sampled(0);
+  assert(tr_log_sampling==0);
+  assert(!tr_log_get_sampled());
+  tr_debug("unsampled debug %d", evaluated());
+  assert(n_evaluated==1);
+}
+
+/*
+ * Asynchronous logging. stderr goes to a pipe read by a separate thread, which
+ * lets the tests stall the log thread by not reading.
+ */
+
+#define N_ASYNC_MSGS 5000
+#define N_PRODUCERS 4
+#define MSG_PAD "................................................................................"
+
+struct pipe_reader {
+  pthread_t thread;
+  int fd;
+  int saved_stderr;
+  useconds_t delay; /* between reads */
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+static void *pipe_reader_main(void *arg)
+{
+  struct pipe_reader *r=(struct pipe_reader *)arg;
+  ssize_t n=0;
+
+  do {
+    if (r->size-r->len<4096) {
+      r->size=2*r->size+4096;
+      r->buf=realloc(r->buf, r->size+1);
+      assert(r->buf!=NULL);
+    }
+    n=read(r->fd, r->buf+r->len, 4096);
+    assert(n>=0);
+    r->len+=n;
+    if (r->delay>0)
+      usleep(r->delay);
+  } while (n>0);
+  r->buf[r->len]='\0';
+  return NULL;
+}
+
+/* Send stderr to a pipe. Nothing reads it until pipe_reader_start(). */
+static void pipe_capture(struct pipe_reader *r, useconds_t delay)
+{
+  int p[2];
+
+  memset(r, 0, sizeof(*r));
+  r->delay=delay;
+  assert(0==pipe(p));
+  fflush(stderr);
+  r->saved_stderr=dup(STDERR_FILENO);
+  assert(r->saved_stderr>=0);
+  assert(dup2(p[1], STDERR_FILENO)>=0);
+  close(p[1]);
+  r->fd=p[0];
+}
+
+static void pipe_reader_start(struct pipe_reader *r)
+{
+  assert(0==pthread_create(&(r->thread), NULL, pipe_reader_main, r));
+}
+
+/* Restore stderr and wait for the reader to see everything written to the pipe */
+static void pipe_release(struct pipe_reader *r)
+{
+  fflush(stderr);
+  assert(dup2(r->saved_stderr, STDERR_FILENO)>=0);
+  close(r->saved_stderr);
+  assert(0==pthread_join(r->thread, NULL));
+  close(r->fd);
+}
+
+/* Count lines "msg <n> ...". If in_order, also check each n is greater than the last. */
+static int count_msgs(const char *buf, int in_order)
+{
+  const char *line=buf;
+  int count=0;
+  int last=-1;
+  int n=0;
+
+  for (line=buf; line!=NULL && *line!='\0'; line=strchr(line, '\n'), line=(line==NULL)?NULL:line+1) {
+    if (1!=sscanf(line, "msg %d ", &n))
+      continue;
+    if (in_order)
+      assert(n>last);
+    last=n;
+    count++;
+  }
+  return count;
+}
+
+static void log_msgs(int first, int n)
+{
+  int ii=0;
+
+  for (ii=first; ii<first+n; ii++)
+    tr_debug("msg %d %s", ii, MSG_PAD);
+}
+
+/* a reader slower than the producer: nothing is dropped and order is kept */
+static void test_async_block(void)
+{
+  struct pipe_reader r;
+  unsigned long dropped=tr_log_async_dropped();
+
+  pipe_capture(&r, 100);
+  pipe_reader_start(&r);
+  assert(0==tr_log_async_start(TR_LOG_OVERFLOW_BLOCK));
+  log_msgs(0, N_ASYNC_MSGS);
+  tr_log_async_stop();
+  pipe_release(&r);
+
+  assert(count_msgs(r.buf, 1)==N_ASYNC_MSGS);
+  assert(tr_log_async_dropped()==dropped);
+  free(r.buf);
+}
+
+/* with the log thread stuck writing, messages beyond the ring are dropped and reported */
+static void test_async_drop(void)
+{
+  struct pipe_reader r;
+  unsigned long dropped=tr_log_async_dropped();
+  int written=0;
+
+  pipe_capture(&r, 0);
+  assert(0==tr_log_async_start(TR_LOG_OVERFLOW_DROP));
+  log_msgs(0, N_ASYNC_MSGS);
+  dropped=tr_log_async_dropped()-dropped;
+  pipe_reader_start(&r);
+  tr_log_async_stop();
+  pipe_release(&r);
+
+  written=count_msgs(r.buf, 1);
+  assert(dropped>0);
+  assert(written>0);
+  assert(written+dropped==N_ASYNC_MSGS);
+  assert(NULL!=strstr(r.buf, "log messages dropped, queue full."));
+  free(r.buf);
+}
+
+/* messages that do not fit in the ring are written directly, so none are lost */
+static void test_async_sync(void)
+{
+  struct pipe_reader r;
+  unsigned long dropped=tr_log_async_dropped();
+
+  pipe_capture(&r, 0);
+  pipe_reader_start(&r);
+  assert(0==tr_log_async_start(TR_LOG_OVERFLOW_SYNC));
+  log_msgs(0, N_ASYNC_MSGS);
+  tr_log_async_stop();
+  pipe_release(&r);
+
+  assert(count_msgs(r.buf, 0)==N_ASYNC_MSGS);
+  assert(tr_log_async_dropped()==dropped);
+  free(r.buf);
+}
+
+static void *producer_main(void *arg)
+{
+  log_msgs(*(int *)arg, N_ASYNC_MSGS);
+  return NULL;
+}
+
+/* stopping while other threads log loses nothing: each message is queued before the
+ * final drain or written directly afterward */
+static void test_async_stop(void)
+{
+  struct pipe_reader r;
+  pthread_t producer[N_PRODUCERS];
+  int first[N_PRODUCERS];
+  int ii=0;
+
+  pipe_capture(&r, 10);
+  pipe_reader_start(&r);
+  assert(0==tr_log_async_start(TR_LOG_OVERFLOW_BLOCK));
+  for (ii=0; ii<N_PRODUCERS; ii++) {
+    first[ii]=ii*N_ASYNC_MSGS;
+    assert(0==pthread_create(&producer[ii], NULL, producer_main, &first[ii]));
+  }
+  usleep(20000);
+  tr_log_async_stop();
+  for (ii=0; ii<N_PRODUCERS; ii++)
+    assert(0==pthread_join(producer[ii], NULL));
+  pipe_release(&r);
+
+  assert(count_msgs(r.buf, 0)==N_PRODUCERS*N_ASYNC_MSGS);
+  free(r.buf);
+}
+
+/* a forked child gets its own log thread and does not repeat the parent's queued messages */
+static void test_async_fork(void)
+{
+  struct pipe_reader r;
+  pid_t pid=0;
+  int status=0;
+
+  pipe_capture(&r, 0);
+  pipe_reader_start(&r);
+  assert(0==tr_log_async_start(TR_LOG_OVERFLOW_BLOCK));
+  tr_debug("parent message");
+  pid=fork();
+  assert(pid>=0);
+  if (pid==0) {
+    log_msgs(0, 100);
+    tr_log_async_stop();
+    _exit(0);
+  }
+  assert(pid==waitpid(pid, &status, 0));
+  assert(WIFEXITED(status) && (WEXITSTATUS(status)==0));
+  tr_log_async_stop();
+  pipe_release(&r);
+
+  assert(count_msgs(r.buf, 1)==100);
+  assert(NULL!=strstr(r.buf, "parent message\n"));
+  assert(NULL==strstr(strstr(r.buf, "parent message\n")+1, "parent message\n"));
+  free(r.buf);
+}
+
+int main(void)
+{
+  test_max_sev();
+  test_threshold_first();
+  test_console_output();
+  test_sampled();
+
+  /* async tests use the console only */
+  tr_log_threshold(LOG_EMERG);
+  tr_console_threshold(LOG_DEBUG);
+  test_async_block();
+  test_async_drop();
+  test_async_sync();
+  test_async_stop();
+  test_async_fork();
+
+  printf("Success.\n");
+  return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Microbenchmark for TR_MQ. Several producer threads add messages while a
+ * single consumer takes them, as the trps connection threads and main thread
+ * do. Compares the lock-free path used by tr_mq_add() against the locked path
+ * used by tr_mq_add_bounded(), and single pops against batch pops.
+ *
+ * Usage: mq_bench [n_producers [msgs_per_producer]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <tr_mq.h>
+
+#define BENCH_BATCH 64
+
+struct producer_data {
+  TR_MQ *mq;
+  long n_msgs;
+  int locked; /* use the locked path if nonzero */
+};
+
+static void *producer(void *arg)
+{
+  struct producer_data *data=(struct producer_data *)arg;
+  TR_MQ_MSG *msg=NULL;
+  long ii=0;
+
+  for (ii=0; ii<data->n_msgs; ii++) {
+    msg=tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
+    assert(msg!=NULL);
+    if (data->locked)
+      assert(TR_MQ_ADDED==tr_mq_add_bounded(data->mq, msg));
+    else
+      tr_mq_add(data->mq, msg);
+  }
+  return NULL;
+}
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+  return (double)(end->tv_sec-start->tv_sec) + 1e-9*(double)(end->tv_nsec-start->tv_nsec);
+}
+
+static void run(const char *label, int n_producers, long msgs_per_producer, int locked, size_t batch)
+{
+  TR_MQ *mq=tr_mq_new(NULL);
+  pthread_t *threads=calloc(n_producers, sizeof(pthread_t));
+  struct producer_data data;
+  TR_MQ_MSG *msgs[BENCH_BATCH];
+  struct timespec start, end, ts_abort;
+  long total=n_producers*msgs_per_producer;
+  long received=0;
+  size_t n_popped=0, ii=0;
+  int jj=0;
+
+  assert((mq!=NULL) && (threads!=NULL));
+  data.mq=mq;
+  data.n_msgs=msgs_per_producer;
+  data.locked=locked;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (jj=0; jj<n_producers; jj++)
+    pthread_create(&threads[jj], NULL, producer, &data);
+
+  while (received<total) {
+    assert(0==tr_mq_pop_timeout(10, &ts_abort));
+    n_popped=tr_mq_pop_batch(mq, msgs, batch, &ts_abort);
+    assert(n_popped>0); /* timed out if not */
+    for (ii=0; ii<n_popped; ii++)
+      tr_mq_msg_free(msgs[ii]);
+    received+=n_popped;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (jj=0; jj<n_producers; jj++)
+    pthread_join(threads[jj], NULL);
+
+  printf("%-24s %10ld msgs %8.3f s %12.0f msgs/s\n",
+         label, total, elapsed(&start, &end), total/elapsed(&start, &end));
+  tr_mq_free(mq);
+  free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+  int n_producers=4;
+  long msgs_per_producer=250000;
+
+  if (argc>1)
+    n_producers=atoi(argv[1]);
+  if (argc>2)
+    msgs_per_producer=atol(argv[2]);
+  assert((n_producers>0) && (msgs_per_producer>0));
+
+  printf("%d producers, %ld messages each\n", n_producers, msgs_per_producer);
+  run("locked, single pop", n_producers, msgs_per_producer, 1, 1);
+  run("locked, batch pop", n_producers, msgs_per_producer, 1, BENCH_BATCH);
+  run("lock-free, single pop", n_producers, msgs_per_producer, 0, 1);
+  run("lock-free, batch pop", n_producers, msgs_per_producer, 0, BENCH_BATCH);
+  return 0;
+}
@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <poll.h>
 
 #include <tr_mq.h>
 
@@ -45,6 +47,11 @@ static void notify_cb(TR_MQ *mq, void *arg)
   printf("MQ %s no longer empty.\n", s);
 }
 
+static void count_cb(TR_MQ *mq, void *arg)
+{
+  (*(int *)arg)++;
+}
+
 int main(void)
 {
   TR_MQ *mq=NULL;
@@ -53,24 +60,35 @@ int main(void)
   TR_MQ_MSG *msg2=NULL;
   TR_MQ_MSG *msg3=NULL;
   TR_MQ_MSG *msg4=NULL;
+  TR_MQ_MSG *batch[2];
+  TR_MQ_STATS stats;
+  struct pollfd pfd;
   char *mq_name="1";
+  int ii=0;
+  int n_notified=0;
 
   mq=tr_mq_new(NULL);
   mq->notify_cb=notify_cb;
   mq->notify_cb_arg=mq_name;
 
-  msg1= tr_mq_msg_new(NULL, "Message 1");
+  msg1= tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
   assert(asprintf((char **)&(msg1->p), "First message.\n")!=-1);
   msg1->p_free=free;
   tr_mq_add(mq, msg1);
+  /* unkeyed messages wait on the intake stack until the queue is next examined */
+  assert(mq->intake==msg1);
+  assert(mq->head==NULL);
+  assert(tr_mq_get_length(mq)==1);
+  assert(mq->intake==NULL);
   assert(mq->head==msg1);
   assert(mq->tail==msg1);
   assert(msg1->next==NULL);
 
-  msg2= tr_mq_msg_new(NULL, "Message 2");
+  msg2= tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
   assert(asprintf((char **)&(msg2->p), "Second message.\n")!=-1);
   msg2->p_free=free;
   tr_mq_add(mq, msg2);
+  assert(tr_mq_get_length(mq)==2);
   assert(mq->head==msg1);
   assert(msg1->next==msg2);
   assert(mq->tail==msg2);
@@ -87,10 +105,11 @@ int main(void)
   } else
     printf("no message to pop\n");
   
-  msg3= tr_mq_msg_new(NULL, "Message 3");
+  msg3= tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
   assert(asprintf((char **)&(msg3->p), "%s", "Third message.\n")!=-1);
   msg3->p_free=free;
   tr_mq_add(mq, msg3);
+  assert(tr_mq_get_length(mq)==2);
   assert(mq->head==msg2);
   assert(mq->tail==msg3);
   assert(msg2->next==msg3);
@@ -127,10 +146,11 @@ int main(void)
   } else
     printf("no message to pop\n");
 
-  msg4= tr_mq_msg_new(NULL, "Message 4");
+  msg4= tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
   assert(asprintf((char **)&(msg4->p), "%s", "Fourth message.\n")!=-1);
   msg4->p_free=free;
   tr_mq_add(mq, msg4);
+  assert(tr_mq_get_length(mq)==1);
   assert(mq->head==msg4);
   assert(mq->tail==msg4);
   assert(msg4->next==NULL);
@@ -155,6 +175,126 @@ int main(void)
   } else
     printf("no message to pop\n");
 
+  /* batch pop preserves order across several adds */
+  msg1= tr_mq_msg_new(NULL, TR_MQMSG_TRPS_CONNECTED);
+  msg2= tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
+  msg3= tr_mq_msg_new(NULL, TR_MQMSG_TRPS_DISCONNECTED);
+  tr_mq_add(mq, msg1);
+  tr_mq_add(mq, msg2);
+  tr_mq_add(mq, msg3);
+  assert(2==tr_mq_pop_batch(mq, batch, 2, NULL));
+  assert((batch[0]==msg1) && (batch[1]==msg2));
+  assert(tr_mq_msg_get_type(batch[0])==TR_MQMSG_TRPS_CONNECTED);
+  tr_mq_msg_free(batch[0]);
+  tr_mq_msg_free(batch[1]);
+  assert(1==tr_mq_pop_batch(mq, batch, 2, NULL));
+  assert(batch[0]==msg3);
+  tr_mq_msg_free(batch[0]);
+  assert(0==tr_mq_pop_batch(mq, batch, 2, NULL));
+
+  /* a keyed message supersedes a queued message with the same key */
+  msg1= tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+  assert(asprintf((char **)&(msg1->p), "%s", "Old keyed message.\n")!=-1);
+  msg1->p_free=free;
+  assert(0==tr_mq_msg_set_key(msg1, "key"));
+  assert(TR_MQ_ADDED==tr_mq_add_bounded(mq, msg1));
+
+  msg2= tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+  assert(asprintf((char **)&(msg2->p), "%s", "New keyed message.\n")!=-1);
+  msg2->p_free=free;
+  assert(0==tr_mq_msg_set_key(msg2, "key"));
+  assert(TR_MQ_SUPERSEDED==tr_mq_add_bounded(mq, msg2)); /* msg2 is freed */
+  assert(mq->head==msg1);
+  assert(mq->tail==msg1);
+  assert(tr_mq_get_length(mq)==1);
+
+  /* a full queue drops new messages but still allows superseding */
+  tr_mq_set_max_length(mq, 1);
+  msg3= tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+  assert(TR_MQ_FULL==tr_mq_add_bounded(mq, msg3)); /* msg3 is freed */
+  msg4= tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+  assert(asprintf((char **)&(msg4->p), "%s", "Newest keyed message.\n")!=-1);
+  msg4->p_free=free;
+  assert(0==tr_mq_msg_set_key(msg4, "key"));
+  assert(TR_MQ_SUPERSEDED==tr_mq_add_bounded(mq, msg4)); /* msg4 is freed */
+
+  msg=tr_mq_pop(mq, NULL);
+  assert(msg==msg1);
+  assert(0==strcmp((char *)msg->p, "Newest keyed message.\n"));
+  printf("%s",(char *)msg->p);
+  tr_mq_msg_free(msg);
+  assert(tr_mq_get_length(mq)==0);
+
+  tr_mq_get_stats(mq, &stats);
+  assert(stats.n_superseded==2);
+  assert(stats.n_dropped==1);
+  assert(stats.high_water==3);
+
+  /* once popped, the key may be queued again */
+  msg1= tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+  assert(0==tr_mq_msg_set_key(msg1, "key"));
+  assert(TR_MQ_ADDED==tr_mq_add_bounded(mq, msg1));
+  tr_mq_clear(mq);
+  assert(tr_mq_get_length(mq)==0);
+
+  tr_mq_free(mq);
+
+  /* notify callback runs when the queue becomes non-empty, not per message */
+  mq=tr_mq_new(NULL);
+  tr_mq_set_notify_cb(mq, count_cb, &n_notified);
+  for (ii=0; ii<5; ii++)
+    tr_mq_add(mq, tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED));
+  assert(n_notified==1);
+  msg1=tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+  assert(0==tr_mq_msg_set_key(msg1, "key"));
+  tr_mq_add(mq, msg1); /* keyed, queue already non-empty */
+  assert(n_notified==1);
+  while (NULL!=(msg=tr_mq_pop(mq, NULL)))
+    tr_mq_msg_free(msg);
+  tr_mq_add(mq, tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED));
+  assert(n_notified==2);
+  /* a message waiting in the list does not stop a lockless addition from notifying */
+  assert(tr_mq_get_length(mq)==1);
+  tr_mq_add(mq, tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED));
+  assert(n_notified==3);
+  tr_mq_clear(mq);
+  tr_mq_free(mq);
+
+  /* eventfd notification: many additions, one wakeup */
+  mq=tr_mq_new(NULL);
+  assert(tr_mq_get_eventfd(mq)==-1);
+  pfd.fd=tr_mq_enable_eventfd(mq);
+  assert(pfd.fd>=0);
+  assert(tr_mq_enable_eventfd(mq)==pfd.fd);
+  pfd.events=POLLIN;
+  assert(poll(&pfd, 1, 0)==0);
+
+  for (ii=0; ii<10; ii++)
+    tr_mq_add(mq, tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED));
+  assert(poll(&pfd, 1, 0)==1);
+
+  /* take part of the queue, then reschedule for the rest */
+  tr_mq_eventfd_ack(mq);
+  assert(poll(&pfd, 1, 0)==0);
+  assert(2==tr_mq_pop_batch(mq, batch, 2, NULL));
+  tr_mq_msg_free(batch[0]);
+  tr_mq_msg_free(batch[1]);
+  tr_mq_wake(mq);
+  tr_mq_wake(mq);
+  assert(poll(&pfd, 1, 0)==1);
+
+  /* an addition after the ack signals again */
+  tr_mq_eventfd_ack(mq);
+  tr_mq_add(mq, tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED));
+  assert(poll(&pfd, 1, 0)==1);
+  tr_mq_eventfd_ack(mq);
+  while (NULL!=(msg=tr_mq_pop(mq, NULL)))
+    tr_mq_msg_free(msg);
+  assert(poll(&pfd, 1, 0)==0);
+
+  tr_mq_get_stats(mq, &stats);
+  assert(stats.n_added==11);
+  assert(stats.n_wakeups==3);
   tr_mq_free(mq);
 
   printf("success\n");
@@ -36,12 +36,16 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#include <string.h>
+
 #include <tr_name_internal.h>
+#include <tr_wildcard_set.h>
 
 /* returns 1 on success */
 int test_wildcard_prefix_match(const char *s, const char *wcs, int expect);
 
 int test_wildcards(void);
+int test_wildcard_set(void);
 
 int test_wildcards(void)
 {
@@ -81,20 +85,65 @@ int test_wildcard_prefix_match(const char *s, const char *wcs, int expect)
 {
   TR_NAME *str=tr_new_name(s);
   TR_NAME *wc_str=tr_new_name(wcs);
+  TR_WILDCARD_SET *set=NULL;
 
   assert(str);
   assert(wc_str);
 
   assert(expect==tr_name_prefix_wildcard_match(str, wc_str));
 
+  /* a set holding only wc_str must agree */
+  set=tr_wildcard_set_new(NULL);
+  assert(set);
+  assert(0==tr_wildcard_set_add(set, wc_str));
+  assert(expect==(wc_str==tr_wildcard_set_find_name(set, str)));
+  tr_wildcard_set_free(set);
+
   tr_free_name(str);
   tr_free_name(wc_str);
   return 1;
 }
 
+/* check a set with several overlapping patterns */
+int test_wildcard_set(void)
+{
+  const char *patterns[]={"*.org", "*.a.org", "a.org", "b.org", "*c", "", "x.net", NULL};
+  TR_NAME *names[8]={NULL};
+  TR_WILDCARD_SET *set=tr_wildcard_set_new(NULL);
+  TR_NAME *match=NULL;
+  size_t ii=0;
+
+  assert(set);
+  for (ii=0; patterns[ii]!=NULL; ii++) {
+    names[ii]=tr_new_name(patterns[ii]);
+    assert(0==tr_wildcard_set_add(set, names[ii]));
+  }
+  assert(0==tr_wildcard_set_add(set, names[0])); /* duplicates are ignored */
+  assert(6==tr_wildcard_set_size(set)); /* the empty pattern is not counted */
+
+  /* the wildcard with the shortest fixed part wins */
+  assert(names[0]==tr_wildcard_set_find(set, "x.a.org", strlen("x.a.org")));
+  assert(names[0]==tr_wildcard_set_find(set, "a.org", strlen("a.org")));
+  assert(names[0]==tr_wildcard_set_find(set, ".org", strlen(".org")));
+  assert(names[4]==tr_wildcard_set_find(set, "abc", strlen("abc")));
+  assert(names[4]==tr_wildcard_set_find(set, "c", strlen("c")));
+  assert(names[6]==tr_wildcard_set_find(set, "x.net", strlen("x.net")));
+  assert(NULL==tr_wildcard_set_find(set, "y.x.net", strlen("y.x.net")));
+  assert(NULL==tr_wildcard_set_find(set, "org", strlen("org")));
+  assert(NULL==tr_wildcard_set_find(set, "", 0));
+  match=tr_wildcard_set_find(set, "x.net.", strlen("x.net."));
+  assert(match==NULL);
+
+  tr_wildcard_set_free(set);
+  for (ii=0; patterns[ii]!=NULL; ii++)
+    tr_free_name(names[ii]);
+  return 1;
+}
+
 int main(void)
 {
   assert(test_wildcards());
+  assert(test_wildcard_set());
 
   printf("Success.\n");
   return 0;
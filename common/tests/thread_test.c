@@ -53,7 +53,7 @@ struct thread_data {
 static TR_MQ_MSG *make_msg(char *label, int n)
 {
   TR_MQ_MSG *msg=NULL;
-  msg= tr_mq_msg_new(NULL, "Message");
+  msg= tr_mq_msg_new(NULL, TR_MQMSG_MSG_RECEIVED);
   assert(-1!=asprintf((char **)&(msg->p), "%s: %d messages to go...", label, n));
   msg->p_free=free;
   return msg;
@@ -69,6 +69,7 @@ TR_COMM *tr_comm_new(TALLOC_CTX *mem_ctx)
     comm->owner_contact=NULL;
     comm->expiration_interval=0;
     comm->refcount=0;
+    comm->members=NULL;
     talloc_set_destructor((void *)comm, tr_comm_destructor);
   }
   return comm;
@@ -172,26 +173,9 @@ unsigned int tr_comm_get_refcount(TR_COMM *comm)
 /* 0 if equivalent, nonzero if different, only considers
  * nhops last hops (nhops==0 means consider all, nhops==1
  * only considers last hop) */
-static int tr_comm_memb_provenance_cmp(TR_COMM_MEMB *m1, TR_COMM_MEMB *m2, int nhops)
+static int tr_comm_memb_provenance_cmp(TR_COMM_MEMB *m1, TR_COMM_MEMB *m2, size_t nhops)
 {
-  size_t ii;
-
-  if ((m1->provenance==NULL) || (m2->provenance==NULL))
-    return m1->provenance!=m2->provenance; /* return 0 if both null, 1 if only one null */
-
-  if (json_array_size(m1->provenance)!=json_array_size(m2->provenance))
-    return 1;
-
-  if (nhops==0)
-    nhops=json_array_size(m1->provenance); /* same as size(m2->provenance) */
-
-  for (ii=0; ii<json_array_size(m1->provenance); ii++) {
-    if (0==strcmp(json_string_value(json_array_get(m1->provenance, ii)),
-                  json_string_value(json_array_get(m2->provenance, ii)))) {
-      return 0;
-    }
-  }
-  return 1;
+  return tr_provenance_cmp(m1->provenance, m2->provenance, nhops);
 }
 
 /* Accepts an update that either came from the same peer as the previous
@@ -230,7 +214,7 @@ void tr_comm_add_idp_realm(TR_COMM_TABLE *ctab,
                            TR_COMM *comm,
                            TR_IDP_REALM *realm,
                            unsigned int interval,
-                           json_t *provenance,
+                           TR_PROVENANCE *provenance,
                            struct timespec *expiry)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -263,7 +247,7 @@ void tr_comm_add_rp_realm(TR_COMM_TABLE *ctab,
                           TR_COMM *comm,
                           TR_RP_REALM *realm,
                           unsigned int interval,
-                          json_t *provenance,
+                          TR_PROVENANCE *provenance,
                           struct timespec *expiry)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -302,17 +286,22 @@ static TR_COMM *tr_comm_tail(TR_COMM *comm)
 
 /* All list members are in the talloc context of the head.
  * This will require careful thought if entries are ever removed
- * Call like comms=tr_comm_add_func(comms, new_comm);
- * or just use the tr_comm_add(comms, new) macro. */
-#define tr_comm_add(comms, new) ((comms)=tr_comm_add_func((comms), (new)))
-static TR_COMM *tr_comm_add_func(TR_COMM *comms, TR_COMM *new)
-{
-  if (comms==NULL)
+ * Looks for the end of the list starting from *tail (if not null), then points
+ * *tail at the new end, so keeping *tail between calls makes building a long
+ * list linear in its length. *tail must be on the list, or null.
+ * Call like comms=tr_comm_add_tail_func(comms, &tail, new_comm);
+ * or just use the tr_comm_add_tail(comms, tail, new) macro. */
+#define tr_comm_add_tail(comms, tail, new) ((comms)=tr_comm_add_tail_func((comms), &(tail), (new)))
+static TR_COMM *tr_comm_add_tail_func(TR_COMM *comms, TR_COMM **tail, TR_COMM *new)
+{
+  if (comms==NULL) {
     comms=new;
-  else {
-    tr_comm_tail(comms)->next=new;
+    *tail=tr_comm_tail(comms);
+  } else {
+    tr_comm_tail((*tail!=NULL)?(*tail):comms)->next=new;
     while(new!=NULL) {
       talloc_steal(comms, new);
+      *tail=new;
       new=new->next;
     }
   }
@@ -386,65 +375,34 @@ static TR_COMM *tr_comm_sweep_func(TR_COMM *head)
 
 TR_IDP_REALM *tr_comm_find_idp(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *idp_realm)
 {
-  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  TR_COMM_ITER *iter=NULL;
-  TR_IDP_REALM *this_idp=NULL;
+  TR_COMM_MEMB *memb=NULL;
 
-  if ((NULL==ctab) || (NULL==comm) || (NULL==idp_realm)) {
-    talloc_free(tmp_ctx);
+  if ((NULL==ctab) || (NULL==comm) || (NULL==idp_realm))
     return NULL;
-  }
 
-  iter=tr_comm_iter_new(tmp_ctx);
-  for (this_idp=tr_idp_realm_iter_first(iter, ctab, tr_comm_get_id(comm));
-       this_idp!=NULL;
-       this_idp=tr_idp_realm_iter_next(iter)) {
-    if (0==tr_name_cmp(idp_realm, tr_idp_realm_get_id(this_idp))) {
-      tr_debug("tr_comm_find_idp: Found IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
-      talloc_free(tmp_ctx);
-      return this_idp;
-    }
+  memb=tr_comm_table_find_idp_memb(ctab, idp_realm, tr_comm_get_id(comm));
+  if (memb==NULL) {
+    tr_debug("tr_comm_find_idp: Unable to find IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
+    return NULL;
   }
-  tr_debug("tr_comm_find_idp: Unable to find IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
-  talloc_free(tmp_ctx);
-  return NULL;
+  tr_debug("tr_comm_find_idp: Found IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
+  return tr_comm_memb_get_idp_realm(memb);
 }
 
 TR_RP_REALM *tr_comm_find_rp (TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *rp_realm)
 {
-  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  TR_COMM_ITER *iter=NULL;
-  TR_RP_REALM *this_rp=NULL;
+  TR_COMM_MEMB *memb=NULL;
 
-  if ((NULL==ctab) || (NULL==comm) || (NULL==rp_realm)) {
-    talloc_free(tmp_ctx);
+  if ((NULL==ctab) || (NULL==comm) || (NULL==rp_realm))
     return NULL;
-  }
 
-  iter=tr_comm_iter_new(tmp_ctx);
-  for (this_rp=tr_rp_realm_iter_first(iter, ctab, tr_comm_get_id(comm));
-       this_rp!=NULL;
-       this_rp=tr_rp_realm_iter_next(iter)) {
-    if (0==tr_name_cmp(rp_realm, tr_rp_realm_get_id(this_rp))) {
-      tr_debug("tr_comm_find_rp: Found RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
-      talloc_free(tmp_ctx);
-      return this_rp;
-    }
-  }
-  tr_debug("tr_comm_find_rp: Unable to find RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
-  talloc_free(tmp_ctx);
-  return NULL;
-}
-
-static TR_COMM *tr_comm_lookup(TR_COMM *comms, TR_NAME *comm_name) 
-{
-  TR_COMM *cfg_comm = NULL;
-
-  for (cfg_comm = comms; NULL != cfg_comm; cfg_comm = cfg_comm->next) {
-    if (0==tr_name_cmp(cfg_comm->id, comm_name))
-      return cfg_comm;
+  memb=tr_comm_table_find_rp_memb(ctab, rp_realm, tr_comm_get_id(comm));
+  if (memb==NULL) {
+    tr_debug_hot("tr_comm_find_rp: Unable to find RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
+    return NULL;
   }
-  return NULL;
+  tr_debug_hot("tr_comm_find_rp: Found RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
+  return tr_comm_memb_get_rp_realm(memb);
 }
 
 TR_COMM_ITER *tr_comm_iter_new(TALLOC_CTX *mem_ctx)
@@ -454,6 +412,7 @@ TR_COMM_ITER *tr_comm_iter_new(TALLOC_CTX *mem_ctx)
     iter->cur_comm=NULL;
     iter->cur_memb=NULL;
     iter->cur_orig_head=NULL;
+    iter->next_list=NULL;
     iter->match=NULL;
     iter->realm=NULL;
   }
@@ -466,85 +425,86 @@ void tr_comm_iter_free(TR_COMM_ITER *iter)
 }
 
 
-TR_COMM *tr_comm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
+/* Start iterating over membership list first, then over next_list */
+static TR_COMM_MEMB *tr_comm_iter_start(TR_COMM_ITER *iter, TR_COMM_MEMB *first, TR_COMM_MEMB *next_list)
 {
-  iter->match=realm;
+  if (first==NULL) {
+    first=next_list;
+    next_list=NULL;
+  }
+  iter->cur_memb=first;
+  iter->next_list=next_list;
+  return iter->cur_memb;
+}
 
-  /* find memberships for this realm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb)))
-      return tr_comm_memb_get_comm(iter->cur_memb);
+/* Step along the realm's membership list, then on to next_list if there is one */
+static TR_COMM_MEMB *tr_comm_iter_step(TR_COMM_ITER *iter)
+{
+  if (iter->cur_memb==NULL)
+    return NULL;
+
+  iter->cur_memb=iter->cur_memb->realm_link.next;
+  if (iter->cur_memb==NULL) {
+    iter->cur_memb=iter->next_list;
+    iter->next_list=NULL;
   }
-  return NULL;
+  return iter->cur_memb;
+}
+
+static TR_COMM *tr_comm_iter_comm(TR_COMM_ITER *iter)
+{
+  return (iter->cur_memb==NULL)?NULL:tr_comm_memb_get_comm(iter->cur_memb);
+}
+
+/* iterate over communities of both the IdP and RP realms with this name */
+TR_COMM *tr_comm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
+{
+  TR_IDP_REALM *idp=tr_comm_table_find_idp_realm(ctab, realm);
+  TR_RP_REALM *rp=tr_comm_table_find_rp_realm(ctab, realm);
+
+  iter->match=realm;
+  tr_comm_iter_start(iter,
+                     (idp!=NULL)?idp->memberships:NULL,
+                     (rp!=NULL)?rp->memberships:NULL);
+  return tr_comm_iter_comm(iter);
 }
 
 TR_COMM *tr_comm_iter_next(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb)))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  tr_comm_iter_step(iter);
+  return tr_comm_iter_comm(iter);
 }
 
 /* iterate only over RPs */
 TR_COMM *tr_comm_iter_first_rp(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
 {
-  iter->match=realm;
+  TR_RP_REALM *rp=tr_comm_table_find_rp_realm(ctab, realm);
 
-  /* find memberships for this realm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  iter->match=realm;
+  tr_comm_iter_start(iter, (rp!=NULL)?rp->memberships:NULL, NULL);
+  return tr_comm_iter_comm(iter);
 }
 
 TR_COMM *tr_comm_iter_next_rp(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  tr_comm_iter_step(iter);
+  return tr_comm_iter_comm(iter);
 }
 
 /* iterate only over IDPs */
 TR_COMM *tr_comm_iter_first_idp(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
 {
-  iter->match=realm;
+  TR_IDP_REALM *idp=tr_comm_table_find_idp_realm(ctab, realm);
 
-  /* find memberships for this realm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  iter->match=realm;
+  tr_comm_iter_start(iter, (idp!=NULL)?idp->memberships:NULL, NULL);
+  return tr_comm_iter_comm(iter);
 }
 
 TR_COMM *tr_comm_iter_next_idp(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  tr_comm_iter_step(iter);
+  return tr_comm_iter_comm(iter);
 }
 
 static TR_REALM *tr_realm_new(TALLOC_CTX *mem_ctx)
@@ -597,6 +557,27 @@ TR_NAME *tr_realm_dup_id(TR_REALM *realm)
   return tr_dup_name(tr_realm_get_id(realm));
 }
 
+/* first membership in the named community's list */
+static TR_COMM_MEMB *tr_comm_members(TR_COMM_TABLE *ctab, TR_NAME *comm_id)
+{
+  TR_COMM *comm=tr_comm_table_find_comm(ctab, comm_id);
+  return (comm==NULL)?NULL:comm->members;
+}
+
+/* Point iter->realm at cur_memb's realm. Frees it and returns NULL at the end of the list. */
+static TR_REALM *tr_realm_iter_realm(TR_COMM_ITER *iter)
+{
+  if ((iter->cur_memb!=NULL) && (tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL))
+    tr_realm_set_rp(iter->realm, tr_comm_memb_get_rp_realm(iter->cur_memb));
+  else if ((iter->cur_memb!=NULL) && (tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL))
+    tr_realm_set_idp(iter->realm, tr_comm_memb_get_idp_realm(iter->cur_memb));
+  else {
+    tr_realm_free(iter->realm);
+    iter->realm=NULL;
+  }
+  return iter->realm;
+}
+
 /* Iterate over either sort of realm. Do not free the TR_REALM returned. It becomes
  * undefined/invalid after the next operation affecting the iterator. */
 TR_REALM *tr_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *comm)
@@ -607,84 +588,51 @@ TR_REALM *tr_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *
   if (iter->realm==NULL)
     return NULL;
 
-  /* find memberships for this comm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match,
-                       tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))) {
-      /* found a match, determine whether it's an rp realm or an idp realm */
-      if (tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_rp(iter->realm, tr_comm_memb_get_rp_realm(iter->cur_memb));
-      else if (tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_idp(iter->realm, tr_comm_memb_get_idp_realm(iter->cur_memb));
-      else {
-        if (iter->realm!=NULL)
-          tr_realm_free(iter->realm);
-        iter->realm=NULL;
-      }
-      return iter->realm;
-    }
-  }
-  if (iter->realm!=NULL)
-    tr_realm_free(iter->realm);
-  iter->realm=NULL;
-  return NULL;
+  iter->cur_memb=tr_comm_members(ctab, comm);
+  return tr_realm_iter_realm(iter);
 }
 
 TR_REALM *tr_realm_iter_next(TR_COMM_ITER *iter)
 {
-  if (iter->realm==NULL)
+  if ((iter->realm==NULL) || (iter->cur_memb==NULL))
     return NULL;
 
-  /* find memberships for this comm */
-  for (iter->cur_memb=iter->cur_memb->next;
+  iter->cur_memb=iter->cur_memb->comm_link.next;
+  return tr_realm_iter_realm(iter);
+}
+
+/* advance iter->cur_memb along the community's list to the next RP membership, starting with memb */
+static TR_RP_REALM *tr_rp_realm_iter_seek(TR_COMM_ITER *iter, TR_COMM_MEMB *memb)
+{
+  for (iter->cur_memb=memb;
        iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match,
-                       tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))) {
-      /* found a match, determine whether it's an rp realm or an idp realm */
-      if (tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_rp(iter->realm, tr_comm_memb_get_rp_realm(iter->cur_memb));
-      else if (tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_idp(iter->realm, tr_comm_memb_get_idp_realm(iter->cur_memb));
-      else {
-        if (iter->realm!=NULL)
-          tr_realm_free(iter->realm);
-        iter->realm=NULL;
-      }
-      return iter->realm;
-    }
+       iter->cur_memb=iter->cur_memb->comm_link.next) {
+    if (tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL)
+      return tr_comm_memb_get_rp_realm(iter->cur_memb);
   }
-  if (iter->realm!=NULL)
-    tr_realm_free(iter->realm);
-  iter->realm=NULL;
   return NULL;
 }
 
 TR_RP_REALM *tr_rp_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *comm)
 {
   iter->match=comm;
-
-  /* find memberships for this comm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_rp_realm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_rp_realm_iter_seek(iter, tr_comm_members(ctab, comm));
 }
 
 TR_RP_REALM *tr_rp_realm_iter_next(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
+  if (iter->cur_memb==NULL)
+    return NULL;
+  return tr_rp_realm_iter_seek(iter, iter->cur_memb->comm_link.next);
+}
+
+static TR_IDP_REALM *tr_idp_realm_iter_seek(TR_COMM_ITER *iter, TR_COMM_MEMB *memb)
+{
+  for (iter->cur_memb=memb;
        iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_rp_realm(iter->cur_memb);
+       iter->cur_memb=iter->cur_memb->comm_link.next) {
+    if (tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL)
+      return tr_comm_memb_get_idp_realm(iter->cur_memb);
   }
   return NULL;
 }
@@ -692,28 +640,14 @@ TR_RP_REALM *tr_rp_realm_iter_next(TR_COMM_ITER *iter)
 TR_IDP_REALM *tr_idp_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *comm)
 {
   iter->match=comm;
-
-  /* find memberships for this comm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_idp_realm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_idp_realm_iter_seek(iter, tr_comm_members(ctab, comm));
 }
 
 TR_IDP_REALM *tr_idp_realm_iter_next(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_idp_realm(iter->cur_memb);
-  }
-  return NULL;
+  if (iter->cur_memb==NULL)
+    return NULL;
+  return tr_idp_realm_iter_seek(iter, iter->cur_memb->comm_link.next);
 }
 
 /* iterators for all communities in a table */
@@ -843,8 +777,6 @@ TR_COMM_TYPE tr_comm_type_from_str(const char *s)
 static int tr_comm_memb_destructor(void *obj)
 {
   TR_COMM_MEMB *memb=talloc_get_type_abort(obj, TR_COMM_MEMB);
-  if (memb->origin!=NULL)
-    tr_free_name(memb->origin);
 
   if (memb->rp!=NULL)
     tr_rp_realm_decref(memb->rp);
@@ -852,8 +784,7 @@ static int tr_comm_memb_destructor(void *obj)
     tr_idp_realm_decref(memb->idp);
   if (memb->comm!=NULL)
     tr_comm_decref(memb->comm);
-  if (memb->provenance!=NULL)
-    json_decref(memb->provenance);
+  tr_provenance_unref(memb->provenance);
   return 0;
 }
 
@@ -862,14 +793,17 @@ TR_COMM_MEMB *tr_comm_memb_new(TALLOC_CTX *mem_ctx)
   TR_COMM_MEMB *memb=talloc(mem_ctx, TR_COMM_MEMB);
   if (memb!=NULL) {
     memb->next=NULL;
+    memb->prev=NULL;
     memb->origin_next=NULL;
+    memb->comm_link=(TR_COMM_MEMB_LINK){NULL, NULL};
+    memb->realm_link=(TR_COMM_MEMB_LINK){NULL, NULL};
     memb->idp=NULL;
     memb->rp=NULL;
     memb->comm=NULL;
-    memb->origin=NULL;
     memb->provenance=NULL;
     memb->interval=0;
     memb->triggered=0;
+    memb->provisional=0;
     memb->times_expired=0;
     memb->expiry=talloc(memb, struct timespec);
     if (memb->expiry==NULL) {
@@ -888,7 +822,7 @@ void tr_comm_memb_free(TR_COMM_MEMB *memb)
 }
 
 /* Returns 0 if they are the same, nonzero if they differ.
- * Ignores expiry, triggered, and times_expired, next pointers */
+ * Ignores expiry, triggered, provisional, and times_expired, next pointers */
 int tr_comm_memb_cmp(TR_COMM_MEMB *m1, TR_COMM_MEMB *m2)
 {
   if ((m1->idp==m2->idp) &&
@@ -959,81 +893,44 @@ TR_COMM *tr_comm_memb_get_comm(TR_COMM_MEMB *memb)
   return memb->comm;
 }
 
-static void tr_comm_memb_set_origin(TR_COMM_MEMB *memb, TR_NAME *origin)
-{
-  if (memb->origin!=NULL)
-    tr_free_name(memb->origin);
-  memb->origin=origin;
-}
-
+/* the origin is the first hop in the provenance */
 TR_NAME *tr_comm_memb_get_origin(TR_COMM_MEMB *memb)
 {
-  return memb->origin;
+  return tr_provenance_get_origin(memb->provenance);
 }
 
 TR_NAME *tr_comm_memb_dup_origin(TR_COMM_MEMB *memb)
 {
-  if (memb->origin!=NULL)
-    return tr_dup_name(memb->origin);
+  if (tr_comm_memb_get_origin(memb)!=NULL)
+    return tr_dup_name(tr_comm_memb_get_origin(memb));
   return NULL;
 }
 
-json_t *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb)
+/* caller must tr_provenance_ref() the result if it will hold on to it */
+TR_PROVENANCE *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb)
 {
   if (memb!=NULL)
     return memb->provenance;
   return NULL;
 }
 
-void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, json_t *prov)
+/* takes a new reference to prov */
+void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, TR_PROVENANCE *prov)
 {
-  const char *s=NULL;
-
-  if (memb->provenance)
-    json_decref(memb->provenance);
-
+  tr_provenance_ref(prov);
+  tr_provenance_unref(memb->provenance);
   memb->provenance=prov;
-  if (prov!=NULL) {
-    json_incref(prov);
-
-    /* next line sets origin to NULL if provenance is empty because jansson
-     * routines return NULL on error */
-    s=json_string_value(json_array_get(prov, 0));
-    if (s==NULL)
-      tr_comm_memb_set_origin(memb, NULL);
-    else
-      memb->origin=tr_new_name(s);
-  } else {
-    tr_comm_memb_set_origin(memb, NULL);
-  }
 }
 
 void tr_comm_memb_add_to_provenance(TR_COMM_MEMB *memb, TR_NAME *hop)
 {
-  if (memb->provenance==NULL) {
-    memb->provenance=json_array();
-    if (memb->provenance==NULL) {
-      tr_err("tr_comm_memb_add_to_provenance: unable to allocate provenance list.");
-      return;
-    }
-    /* this is the first entry in the provenance, so it is the origin */
-    tr_comm_memb_set_origin(memb,tr_dup_name(hop));
-    if (memb->origin==NULL) {
-      tr_err("tr_comm_memb_add_to_provenance: unable to allocate origin.");
-      json_decref(memb->provenance);
-      memb->provenance=NULL;
-      return;
-    }
-  }
-  if (0!=json_array_append_new(memb->provenance, tr_name_to_json_string(hop)))
+  if (0!=tr_provenance_append(&(memb->provenance), hop))
     tr_err("tr_comm_memb_add_to_provenance: unable to extend provenance list.");
 }
 
 size_t tr_comm_memb_provenance_len(TR_COMM_MEMB *memb)
 {
-  if (memb->provenance==NULL)
-    return 0;
-  return json_array_size(memb->provenance);
+  return tr_provenance_len(memb->provenance);
 }
 
 void tr_comm_memb_set_interval(TR_COMM_MEMB *memb, unsigned int interval)
@@ -1095,6 +992,16 @@ int tr_comm_memb_is_triggered(TR_COMM_MEMB *memb)
   return memb->triggered;
 }
 
+void tr_comm_memb_set_provisional(TR_COMM_MEMB *memb, int provisional)
+{
+  memb->provisional=provisional;
+}
+
+int tr_comm_memb_is_provisional(TR_COMM_MEMB *memb)
+{
+  return memb->provisional;
+}
+
 void tr_comm_memb_reset_times_expired(TR_COMM_MEMB *memb)
 {
   memb->times_expired=0;
@@ -1113,14 +1020,95 @@ unsigned int tr_comm_memb_get_times_expired(TR_COMM_MEMB *memb)
   return memb->times_expired;
 }
 
+/*
+ * Community table indexes
+ *
+ * The lists in the table are the authoritative record and keep their order. The
+ * indexes map each community or realm ID to the first list entry with that ID, and
+ * each (realm ID, community ID) pair to the membership record on the main list. Other
+ * memberships for the same pair, from different origins, hang off that record's
+ * origin_next list, which is short. Index keys point at names owned by the indexed
+ * objects, so an entry must be removed before its object is freed.
+ */
+
+/* key for the membership indexes */
+typedef struct tr_comm_memb_key {
+  TR_NAME *realm;
+  TR_NAME *comm;
+} TR_COMM_MEMB_KEY;
+
+static guint tr_comm_memb_key_hash(gconstpointer key)
+{
+  const TR_COMM_MEMB_KEY *k=(const TR_COMM_MEMB_KEY *)key;
+  return 31*tr_name_hash(k->realm) + tr_name_hash(k->comm);
+}
+
+static gboolean tr_comm_memb_key_equal(gconstpointer key1, gconstpointer key2)
+{
+  const TR_COMM_MEMB_KEY *k1=(const TR_COMM_MEMB_KEY *)key1;
+  const TR_COMM_MEMB_KEY *k2=(const TR_COMM_MEMB_KEY *)key2;
+  return tr_name_equal(k1->realm, k2->realm) && tr_name_equal(k1->comm, k2->comm);
+}
+
+static int tr_comm_table_destructor(void *obj)
+{
+  TR_COMM_TABLE *ctab=talloc_get_type_abort(obj, TR_COMM_TABLE);
+  TR_COMM_MEMB *memb=NULL;
+  TR_COMM_MEMB *next=NULL;
+  TR_COMM_MEMB *dup=NULL;
+
+  /* Memberships drop references to their community and realm when freed, so free them
+   * before talloc gets to the communities and realms. */
+  for (memb=ctab->memberships; memb!=NULL; memb=next) {
+    next=memb->next;
+    while (memb!=NULL) {
+      dup=memb->origin_next;
+      talloc_free(memb);
+      memb=dup;
+    }
+  }
+  ctab->memberships=NULL;
+  ctab->memberships_tail=NULL;
+
+  if (ctab->comm_index!=NULL)
+    g_hash_table_destroy(ctab->comm_index);
+  if (ctab->idp_realm_index!=NULL)
+    g_hash_table_destroy(ctab->idp_realm_index);
+  if (ctab->rp_realm_index!=NULL)
+    g_hash_table_destroy(ctab->rp_realm_index);
+  if (ctab->idp_memb_index!=NULL)
+    g_hash_table_destroy(ctab->idp_memb_index);
+  if (ctab->rp_memb_index!=NULL)
+    g_hash_table_destroy(ctab->rp_memb_index);
+  return 0;
+}
+
 TR_COMM_TABLE *tr_comm_table_new(TALLOC_CTX *mem_ctx)
 {
   TR_COMM_TABLE *ctab=talloc(mem_ctx, TR_COMM_TABLE);
   if (ctab!=NULL) {
     ctab->comms=NULL;
     ctab->memberships=NULL;
+    ctab->memberships_tail=NULL;
     ctab->idp_realms=NULL;
     ctab->rp_realms=NULL;
+    ctab->comms_tail=NULL;
+    ctab->idp_realms_tail=NULL;
+    ctab->rp_realms_tail=NULL;
+    ctab->comm_index=g_hash_table_new(tr_name_hash, tr_name_equal);
+    ctab->idp_realm_index=g_hash_table_new(tr_name_hash, tr_name_equal);
+    ctab->rp_realm_index=g_hash_table_new(tr_name_hash, tr_name_equal);
+    ctab->idp_memb_index=g_hash_table_new_full(tr_comm_memb_key_hash, tr_comm_memb_key_equal, g_free, NULL);
+    ctab->rp_memb_index=g_hash_table_new_full(tr_comm_memb_key_hash, tr_comm_memb_key_equal, g_free, NULL);
+    talloc_set_destructor((void *)ctab, tr_comm_table_destructor);
+    if ((ctab->comm_index==NULL)
+        || (ctab->idp_realm_index==NULL)
+        || (ctab->rp_realm_index==NULL)
+        || (ctab->idp_memb_index==NULL)
+        || (ctab->rp_memb_index==NULL)) {
+      talloc_free(ctab);
+      ctab=NULL;
+    }
   }
   return ctab;
 }
@@ -1140,44 +1128,255 @@ static TR_REALM_ROLE tr_comm_memb_role(TR_COMM_MEMB *memb)
   return TR_ROLE_UNKNOWN;
 }
 
-void tr_comm_table_add_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *new)
+/* index every community in a list that is not shadowed by an earlier one with the same ID */
+static void tr_comm_table_index_comms(TR_COMM_TABLE *ctab, TR_COMM *comm)
 {
-  TR_COMM_MEMB *cur=NULL;
+  for ( ; comm!=NULL; comm=comm->next) {
+    if (NULL==g_hash_table_lookup(ctab->comm_index, tr_comm_get_id(comm)))
+      g_hash_table_insert(ctab->comm_index, tr_comm_get_id(comm), comm);
+  }
+}
 
-  /* TODO: further validate the member (must have valid comm and realm) */
-  if ((new->next!=NULL) || (new->origin_next!=NULL)) {
-    tr_debug("tr_comm_table_add_memb: attempting to add member already in a list.");
+static void tr_comm_table_index_idp_realms(TR_COMM_TABLE *ctab, TR_IDP_REALM *realm)
+{
+  for ( ; realm!=NULL; realm=realm->next) {
+    if (NULL==g_hash_table_lookup(ctab->idp_realm_index, tr_idp_realm_get_id(realm)))
+      g_hash_table_insert(ctab->idp_realm_index, tr_idp_realm_get_id(realm), realm);
+  }
+}
+
+static void tr_comm_table_index_rp_realms(TR_COMM_TABLE *ctab, TR_RP_REALM *realm)
+{
+  for ( ; realm!=NULL; realm=realm->next) {
+    if (NULL==g_hash_table_lookup(ctab->rp_realm_index, tr_rp_realm_get_id(realm)))
+      g_hash_table_insert(ctab->rp_realm_index, tr_rp_realm_get_id(realm), realm);
+  }
+}
+
+/* Call after removing comm from the list. If it was indexed, a later community
+ * with the same ID, if any, takes its place. */
+static void tr_comm_table_unindex_comm(TR_COMM_TABLE *ctab, TR_COMM *comm)
+{
+  TR_COMM *cur=NULL;
+
+  if (g_hash_table_lookup(ctab->comm_index, tr_comm_get_id(comm))!=comm)
+    return;
+
+  g_hash_table_remove(ctab->comm_index, tr_comm_get_id(comm));
+  for (cur=ctab->comms; cur!=NULL; cur=cur->next) {
+    if (tr_name_equal(tr_comm_get_id(cur), tr_comm_get_id(comm))) {
+      g_hash_table_insert(ctab->comm_index, tr_comm_get_id(cur), cur);
+      break;
+    }
   }
+}
+
+static void tr_comm_table_unindex_idp_realm(TR_COMM_TABLE *ctab, TR_IDP_REALM *realm)
+{
+  TR_IDP_REALM *cur=NULL;
 
-  /* handle the empty list case */
-  if (ctab->memberships==NULL) {
-    ctab->memberships=new;
-    talloc_steal(ctab, new);
+  if (g_hash_table_lookup(ctab->idp_realm_index, tr_idp_realm_get_id(realm))!=realm)
     return;
+
+  g_hash_table_remove(ctab->idp_realm_index, tr_idp_realm_get_id(realm));
+  for (cur=ctab->idp_realms; cur!=NULL; cur=cur->next) {
+    if (tr_name_equal(tr_idp_realm_get_id(cur), tr_idp_realm_get_id(realm))) {
+      g_hash_table_insert(ctab->idp_realm_index, tr_idp_realm_get_id(cur), cur);
+      break;
+    }
   }
+}
 
-  /* The list was not empty. See if we already have a membership for this realm/comm/role */
-  switch (tr_comm_memb_role(new)) {
-  case TR_ROLE_RP:
-    cur=tr_comm_table_find_rp_memb(ctab,
-                                   tr_rp_realm_get_id(tr_comm_memb_get_rp_realm(new)),
-                                   tr_comm_get_id(tr_comm_memb_get_comm(new)));
-    break;
+static void tr_comm_table_unindex_rp_realm(TR_COMM_TABLE *ctab, TR_RP_REALM *realm)
+{
+  TR_RP_REALM *cur=NULL;
+
+  if (g_hash_table_lookup(ctab->rp_realm_index, tr_rp_realm_get_id(realm))!=realm)
+    return;
+
+  g_hash_table_remove(ctab->rp_realm_index, tr_rp_realm_get_id(realm));
+  for (cur=ctab->rp_realms; cur!=NULL; cur=cur->next) {
+    if (tr_name_equal(tr_rp_realm_get_id(cur), tr_rp_realm_get_id(realm))) {
+      g_hash_table_insert(ctab->rp_realm_index, tr_rp_realm_get_id(cur), cur);
+      break;
+    }
+  }
+}
+
+static GHashTable *tr_comm_table_memb_index(TR_COMM_TABLE *ctab, TR_REALM_ROLE role)
+{
+  switch (role) {
   case TR_ROLE_IDP:
-    cur=tr_comm_table_find_idp_memb(ctab,
-                                    tr_idp_realm_get_id(tr_comm_memb_get_idp_realm(new)),
-                                    tr_comm_get_id(tr_comm_memb_get_comm(new)));
-    break;
-  case TR_ROLE_UNKNOWN:
+    return ctab->idp_memb_index;
+  case TR_ROLE_RP:
+    return ctab->rp_memb_index;
   default:
+    return NULL;
+  }
+}
+
+/* find the main-list membership for a realm/comm/role */
+static TR_COMM_MEMB *tr_comm_table_lookup_memb(TR_COMM_TABLE *ctab, TR_REALM_ROLE role, TR_NAME *realm, TR_NAME *comm)
+{
+  GHashTable *index=tr_comm_table_memb_index(ctab, role);
+  TR_COMM_MEMB_KEY key={realm, comm};
+
+  if ((index==NULL) || (realm==NULL) || (comm==NULL))
+    return NULL;
+  return g_hash_table_lookup(index, &key);
+}
+
+/* make memb the main-list membership for its realm/comm/role */
+static void tr_comm_table_index_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb)
+{
+  GHashTable *index=tr_comm_table_memb_index(ctab, tr_comm_memb_role(memb));
+  TR_COMM_MEMB_KEY *key=NULL;
+
+  if (index==NULL)
+    return;
+
+  key=g_malloc(sizeof(TR_COMM_MEMB_KEY));
+  key->realm=tr_comm_memb_get_realm_id(memb);
+  key->comm=tr_comm_get_id(tr_comm_memb_get_comm(memb));
+  g_hash_table_replace(index, key, memb); /* replaces the key as well, so it refers to memb's names */
+}
+
+static void tr_comm_table_unindex_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb)
+{
+  GHashTable *index=tr_comm_table_memb_index(ctab, tr_comm_memb_role(memb));
+  TR_COMM_MEMB_KEY key={tr_comm_memb_get_realm_id(memb), tr_comm_get_id(tr_comm_memb_get_comm(memb))};
+
+  if ((index!=NULL) && (g_hash_table_lookup(index, &key)==memb))
+    g_hash_table_remove(index, &key);
+}
+
+/*
+ * Per-community and per-realm membership lists
+ *
+ * Each record on the main membership list is also linked into a list headed by its
+ * community and one headed by its realm, so the realms of a community or the
+ * communities of a realm can be listed without visiting unrelated memberships. The
+ * lists are in main list order. When the main list record is removed and another
+ * origin's record takes its place, that record takes its place in these lists too.
+ */
+typedef enum tr_comm_memb_list {
+  TR_COMM_MEMB_LIST_COMM,
+  TR_COMM_MEMB_LIST_REALM
+} TR_COMM_MEMB_LIST;
+
+static TR_COMM_MEMB_LINK *tr_comm_memb_link(TR_COMM_MEMB *memb, TR_COMM_MEMB_LIST list)
+{
+  return (list==TR_COMM_MEMB_LIST_COMM)?&(memb->comm_link):&(memb->realm_link);
+}
+
+/* pointer to the head of the list memb belongs in, or NULL if it has none */
+static TR_COMM_MEMB **tr_comm_memb_list_head(TR_COMM_MEMB *memb, TR_COMM_MEMB_LIST list)
+{
+  if (list==TR_COMM_MEMB_LIST_COMM)
+    return (memb->comm!=NULL)?&(memb->comm->members):NULL;
+  if (memb->idp!=NULL)
+    return &(memb->idp->memberships);
+  if (memb->rp!=NULL)
+    return &(memb->rp->memberships);
+  return NULL;
+}
+
+static void tr_comm_memb_list_append(TR_COMM_MEMB *memb, TR_COMM_MEMB_LIST list)
+{
+  TR_COMM_MEMB **head=tr_comm_memb_list_head(memb, list);
+  TR_COMM_MEMB_LINK *link=tr_comm_memb_link(memb, list);
+  TR_COMM_MEMB *tail=NULL;
+
+  if (head==NULL)
+    return;
+
+  link->next=NULL;
+  if (*head==NULL) {
+    link->prev=memb;
+    *head=memb;
+  } else {
+    tail=tr_comm_memb_link(*head, list)->prev;
+    tr_comm_memb_link(tail, list)->next=memb;
+    link->prev=tail;
+    tr_comm_memb_link(*head, list)->prev=memb;
+  }
+}
+
+static void tr_comm_memb_list_remove(TR_COMM_MEMB *memb, TR_COMM_MEMB_LIST list)
+{
+  TR_COMM_MEMB **head=tr_comm_memb_list_head(memb, list);
+  TR_COMM_MEMB_LINK *link=tr_comm_memb_link(memb, list);
+
+  if ((head==NULL) || (link->prev==NULL))
+    return; /* not on a list */
+
+  if (*head==memb) {
+    *head=link->next;
+    if (*head!=NULL)
+      tr_comm_memb_link(*head, list)->prev=link->prev; /* the tail */
+  } else {
+    tr_comm_memb_link(link->prev, list)->next=link->next;
+    if (link->next!=NULL)
+      tr_comm_memb_link(link->next, list)->prev=link->prev;
+    else
+      tr_comm_memb_link(*head, list)->prev=link->prev; /* removed the tail */
+  }
+  link->next=NULL;
+  link->prev=NULL;
+}
+
+/* put new in old's place on the list */
+static void tr_comm_memb_list_replace(TR_COMM_MEMB *old, TR_COMM_MEMB *new, TR_COMM_MEMB_LIST list)
+{
+  TR_COMM_MEMB **head=tr_comm_memb_list_head(old, list);
+  TR_COMM_MEMB_LINK *old_link=tr_comm_memb_link(old, list);
+  TR_COMM_MEMB_LINK *new_link=tr_comm_memb_link(new, list);
+
+  if ((head==NULL) || (old_link->prev==NULL))
+    return;
+
+  /* insert new after old, then take old out */
+  new_link->prev=old;
+  new_link->next=old_link->next;
+  if (old_link->next!=NULL)
+    tr_comm_memb_link(old_link->next, list)->prev=new;
+  else
+    tr_comm_memb_link(*head, list)->prev=new;
+  old_link->next=new;
+  tr_comm_memb_list_remove(old, list);
+}
+
+void tr_comm_table_add_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *new)
+{
+  TR_COMM_MEMB *cur=NULL;
+  TR_REALM_ROLE role=tr_comm_memb_role(new);
+
+  /* TODO: further validate the member (must have valid comm and realm) */
+  if ((new->next!=NULL) || (new->origin_next!=NULL)) {
+    tr_debug("tr_comm_table_add_memb: attempting to add member already in a list.");
+  }
+
+  /* See if we already have a membership for this realm/comm/role */
+  if (role==TR_ROLE_UNKNOWN)
     tr_err("tr_comm_table_add_memb: realm with unknown role added.");
-    cur=NULL;
+  else {
+    cur=tr_comm_table_lookup_memb(ctab,
+                                  role,
+                                  tr_comm_memb_get_realm_id(new),
+                                  tr_comm_get_id(tr_comm_memb_get_comm(new)));
   }
 
   if (cur==NULL) {
     /* no entry for this realm/comm/role, tack it on the end */
-    for (cur=ctab->memberships; cur->next!=NULL; cur=cur->next) { }
-    cur->next=new;
+    if (ctab->memberships_tail==NULL)
+      ctab->memberships=new;
+    else
+      ctab->memberships_tail->next=new;
+    new->prev=ctab->memberships_tail;
+    ctab->memberships_tail=new;
+    tr_comm_table_index_memb(ctab, new);
+    tr_comm_memb_list_append(new, TR_COMM_MEMB_LIST_COMM);
+    tr_comm_memb_list_append(new, TR_COMM_MEMB_LIST_REALM);
   } else {
     /* Found an entry. Add to the end of its same-origin list. */
     while (cur->origin_next!=NULL) {
@@ -1192,62 +1391,70 @@ void tr_comm_table_add_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *new)
 /* Remove memb from ctab. Do not free anything. Do nothing if memb not in ctab. */
 void tr_comm_table_remove_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb)
 {
-  TR_COMM_MEMB *cur=NULL; /* for walking the main list */
-  TR_COMM_MEMB *orig_cur=NULL; /* for walking the origin list */
+  TR_COMM_MEMB *head=NULL; /* main list entry for memb's realm/comm/role */
+  TR_COMM_MEMB *cur=NULL;
+  TR_COMM_MEMB *prev=NULL;
+  TR_COMM_MEMB *next=NULL;
+  TR_REALM_ROLE role=TR_ROLE_UNKNOWN;
 
   if ((memb==NULL) || (ctab->memberships==NULL))
     return;
 
-  /* see if it's the first member */
-  if (ctab->memberships==memb) {
-    if (memb->origin_next!=NULL) {
-      memb->origin_next->next=memb->next;
-      ctab->memberships=memb->origin_next;
-    } else
-      ctab->memberships=memb->next;
-
-    return;
-  }
-
-  /* see if it's in first member's origin list */
-  for (orig_cur=ctab->memberships;
-       orig_cur->origin_next!=NULL;
-       orig_cur=orig_cur->origin_next) {
-    if (orig_cur->origin_next==memb) {
-      orig_cur->origin_next=memb->origin_next;
-      return;
-    }
+  role=tr_comm_memb_role(memb);
+  if (role==TR_ROLE_UNKNOWN)
+    head=memb; /* not indexed, so it can only be on the main list */
+  else {
+    head=tr_comm_table_lookup_memb(ctab,
+                                   role,
+                                   tr_comm_memb_get_realm_id(memb),
+                                   tr_comm_get_id(tr_comm_memb_get_comm(memb)));
   }
 
-  /* now we have to walk the rest of the tree */
-  for (cur=ctab->memberships; cur->next!=NULL; cur=cur->next) {
-    if (cur->next==memb) {
-      /* it matched an entry on the main list */
-      if (memb->origin_next==NULL)
-        cur->next=memb->next; /* no origin list, just drop memb */
-      else {
-        /* replace the entry in the main list with the next element on the origin list */
-        memb->origin_next->next=memb->next;
-        cur->next=memb->origin_next;
-      }
-      return;
-    } else {
-      /* it was not on the main list, walk the origin list */
-      for (orig_cur=cur; orig_cur->origin_next!=NULL; orig_cur=orig_cur->origin_next) {
-        if (orig_cur->origin_next==memb) {
-          orig_cur->origin_next=memb->origin_next;
-          return; /* just drop the element from the origin list */
-        }
+  if (head!=memb) {
+    /* not on the main list, just drop it from the origin list */
+    for (cur=head; cur!=NULL; cur=cur->origin_next) {
+      if (cur->origin_next==memb) {
+        cur->origin_next=memb->origin_next;
+        break;
       }
     }
+    return;
   }
-  /* if we got here, cur->next was null. Still have to check the origin_next list */
-  for (orig_cur=cur; orig_cur->origin_next!=NULL; orig_cur=orig_cur->origin_next) {
-    if (orig_cur->origin_next==memb) {
-      orig_cur->origin_next=memb->origin_next;
-      return; /* just drop the element from the origin list */
-    }
+
+  /* it is on the main list */
+  if ((memb->prev==NULL) && (ctab->memberships!=memb))
+    return; /* not in this table */
+  prev=memb->prev;
+
+  if (memb->origin_next!=NULL) {
+    /* replace the entry in the main list with the next element on the origin list */
+    next=memb->origin_next;
+    next->next=memb->next;
+    next->prev=prev;
+    if (next->next!=NULL)
+      next->next->prev=next;
+    tr_comm_table_index_memb(ctab, next);
+    tr_comm_memb_list_replace(memb, next, TR_COMM_MEMB_LIST_COMM);
+    tr_comm_memb_list_replace(memb, next, TR_COMM_MEMB_LIST_REALM);
+    if (ctab->memberships_tail==memb)
+      ctab->memberships_tail=next;
+  } else {
+    next=memb->next;
+    if (next!=NULL)
+      next->prev=prev;
+    tr_comm_table_unindex_memb(ctab, memb);
+    tr_comm_memb_list_remove(memb, TR_COMM_MEMB_LIST_COMM);
+    tr_comm_memb_list_remove(memb, TR_COMM_MEMB_LIST_REALM);
+    if (ctab->memberships_tail==memb)
+      ctab->memberships_tail=prev;
   }
+
+  if (prev==NULL)
+    ctab->memberships=next;
+  else
+    prev->next=next;
+  /* memb->next is left alone so an iterator standing on memb can move on */
+  memb->prev=NULL;
 }
 
 TR_NAME *tr_comm_memb_get_realm_id(TR_COMM_MEMB *memb)
@@ -1258,36 +1465,13 @@ TR_NAME *tr_comm_memb_get_realm_id(TR_COMM_MEMB *memb)
     return tr_idp_realm_get_id(memb->idp);
 }
 
-/* find a membership from any origin */
-TR_COMM_MEMB *tr_comm_table_find_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
-{
-  TR_COMM_MEMB *cur=NULL;
-  TR_NAME *cur_realm_name=NULL;
-
-  for (cur=ctab->memberships; cur!=NULL; cur=cur->next) {
-    cur_realm_name=tr_comm_memb_get_realm_id(cur);
-    if (cur_realm_name==NULL) {
-      tr_warning("tr_comm_table_find: encountered realm with no name.");
-      continue;
-    }
-    if ((0==tr_name_cmp(realm, cur_realm_name)) &&
-        (0==tr_name_cmp(comm, tr_comm_get_id(tr_comm_memb_get_comm(cur))))) {
-      return cur;
-    }
-  }
-  return NULL;
-}
-
-/* find a membership from a particular origin */
-TR_COMM_MEMB *tr_comm_table_find_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm, TR_NAME *origin)
+/* find the membership with a given origin on an origin list */
+static TR_COMM_MEMB *tr_comm_memb_find_origin(TR_COMM_MEMB *cur, TR_NAME *origin)
 {
   TR_NAME *cur_orig=NULL;
-  TR_COMM_MEMB *cur=tr_comm_table_find_memb(ctab, realm, comm);
-  if (cur==NULL)
-    return NULL; /* no match */
 
-  /* had a match for comm/realm; find origin match */
   while (cur!=NULL) {
+    cur_orig=tr_comm_memb_get_origin(cur);
     if (((origin==NULL) && (cur_orig==NULL)) ||
         ((origin!=NULL) && (cur_orig!=NULL) && (0==tr_name_cmp(origin, cur_orig))))
       return cur; /* found a match */
@@ -1296,86 +1480,55 @@ TR_COMM_MEMB *tr_comm_table_find_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *realm
   return NULL; /* no match */
 }
 
+/* find a membership from any origin */
+TR_COMM_MEMB *tr_comm_table_find_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
+{
+  TR_COMM_MEMB *memb=tr_comm_table_find_idp_memb(ctab, realm, comm);
 
-/* find an idp membership regardless of its origin */
-TR_COMM_MEMB *tr_comm_table_find_idp_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
+  if (memb==NULL)
+    memb=tr_comm_table_find_rp_memb(ctab, realm, comm);
+  return memb;
+}
+
+/* find a membership from a particular origin */
+TR_COMM_MEMB *tr_comm_table_find_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm, TR_NAME *origin)
 {
-  TR_COMM_MEMB *cur=NULL;
-  TR_IDP_REALM *idp_realm=NULL;
+  TR_COMM_MEMB *memb=tr_comm_table_find_idp_memb_origin(ctab, realm, comm, origin);
 
-  for (cur=ctab->memberships; cur!=NULL; cur=cur->next) {
-    idp_realm=tr_comm_memb_get_idp_realm(cur);
-    if (idp_realm==NULL)
-      continue; /* was not an idp */
+  if (memb==NULL)
+    memb=tr_comm_table_find_rp_memb_origin(ctab, realm, comm, origin);
+  return memb;
+}
 
-    if ((0==tr_name_cmp(realm, idp_realm->realm_id)) &&
-        (0==tr_name_cmp(comm, tr_comm_get_id(tr_comm_memb_get_comm(cur))))) {
-      return cur;
-    }
-  }
-  return NULL;
+/* find an idp membership regardless of its origin */
+TR_COMM_MEMB *tr_comm_table_find_idp_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
+{
+  return tr_comm_table_lookup_memb(ctab, TR_ROLE_IDP, realm, comm);
 }
 
 /* find an idp membership from a particular origin */
 TR_COMM_MEMB *tr_comm_table_find_idp_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm, TR_NAME *origin)
 {
-  TR_NAME *cur_orig=NULL;
-  TR_COMM_MEMB *cur=tr_comm_table_find_idp_memb(ctab, realm, comm);
-  if (cur==NULL)
-    return NULL; /* no match */
-
-  /* had a match for comm/realm; find origin match */
-  while (cur!=NULL) {
-    cur_orig=tr_comm_memb_get_origin(cur);
-    if (((origin==NULL) && (cur_orig==NULL)) ||
-        ((origin!=NULL) && (cur_orig!=NULL) && (0==tr_name_cmp(origin, cur_orig))))
-      return cur; /* found a match */
-    cur=cur->origin_next;
-  }
-  return NULL; /* no match */
+  return tr_comm_memb_find_origin(tr_comm_table_find_idp_memb(ctab, realm, comm), origin);
 }
 
 /* find an rp membership from any origin */
 TR_COMM_MEMB *tr_comm_table_find_rp_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
 {
-  TR_COMM_MEMB *cur=NULL;
-  TR_RP_REALM *rp_realm=NULL;
-
-  for (cur=ctab->memberships; cur!=NULL; cur=cur->next) {
-    rp_realm=tr_comm_memb_get_rp_realm(cur);
-    if (rp_realm==NULL)
-      continue; /* was not an rp */
-
-    if ((0==tr_name_cmp(realm, tr_rp_realm_get_id(rp_realm))) &&
-        (0==tr_name_cmp(comm, tr_comm_get_id(tr_comm_memb_get_comm(cur))))) {
-      return cur;
-    }
-  }
-  return NULL;
+  return tr_comm_table_lookup_memb(ctab, TR_ROLE_RP, realm, comm);
 }
 
 /* find an rp membership from a particular origin */
 TR_COMM_MEMB *tr_comm_table_find_rp_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm, TR_NAME *origin)
 {
-  TR_NAME *cur_orig=NULL;
-  TR_COMM_MEMB *cur=tr_comm_table_find_rp_memb(ctab, realm, comm);
-  if (cur==NULL)
-    return NULL; /* no match */
-
-  /* had a match for comm/realm; find origin match */
-  while (cur!=NULL) {
-    cur_orig=tr_comm_memb_get_origin(cur);
-    if (((origin==NULL) && (cur_orig==NULL)) ||
-        ((origin!=NULL) && (cur_orig!=NULL) && (0==tr_name_cmp(origin, cur_orig))))
-      return cur; /* found a match */
-    cur=cur->origin_next;
-  }
-  return NULL; /* no match */
+  return tr_comm_memb_find_origin(tr_comm_table_find_rp_memb(ctab, realm, comm), origin);
 }
 
 TR_COMM *tr_comm_table_find_comm(TR_COMM_TABLE *ctab, TR_NAME *comm_id)
 {
-  return tr_comm_lookup(ctab->comms, comm_id);
+  if (comm_id==NULL)
+    return NULL;
+  return g_hash_table_lookup(ctab->comm_index, comm_id);
 }
 
 /**
@@ -1392,49 +1545,64 @@ int tr_comm_table_add_comm(TR_COMM_TABLE *ctab, TR_COMM *new)
   if (tr_comm_table_find_comm(ctab, tr_comm_get_id(new)) != NULL)
     return -1;
 
-  tr_comm_add(ctab->comms, new);
+  tr_comm_add_tail(ctab->comms, ctab->comms_tail, new);
   if (ctab->comms!=NULL)
     talloc_steal(ctab, ctab->comms); /* make sure it's in the right context */
+  tr_comm_table_index_comms(ctab, new);
   return 0;
 }
 
 void tr_comm_table_remove_comm(TR_COMM_TABLE *ctab, TR_COMM *comm)
 {
+  ctab->comms_tail=NULL; /* might have been comm */
   tr_comm_remove(ctab->comms, comm);
+  tr_comm_table_unindex_comm(ctab, comm);
 }
 
 TR_RP_REALM *tr_comm_table_find_rp_realm(TR_COMM_TABLE *ctab, TR_NAME *realm_id)
 {
-  return tr_rp_realm_lookup(ctab->rp_realms, realm_id);
+  if (realm_id==NULL)
+    return NULL;
+  return g_hash_table_lookup(ctab->rp_realm_index, realm_id);
 }
 
+/* Adds new and any realms linked after it */
 void tr_comm_table_add_rp_realm(TR_COMM_TABLE *ctab, TR_RP_REALM *new)
 {
-  tr_rp_realm_add(ctab->rp_realms, new);
+  tr_rp_realm_add_tail(ctab->rp_realms, ctab->rp_realms_tail, new);
   if (ctab->rp_realms!=NULL)
     talloc_steal(ctab, ctab->rp_realms); /* make sure it's in the right context */
+  tr_comm_table_index_rp_realms(ctab, new);
 }
 
 void tr_comm_table_remove_rp_realm(TR_COMM_TABLE *ctab, TR_RP_REALM *realm)
 {
+  ctab->rp_realms_tail=NULL; /* might have been realm */
   tr_rp_realm_remove(ctab->rp_realms, realm);
+  tr_comm_table_unindex_rp_realm(ctab, realm);
 }
 
 TR_IDP_REALM *tr_comm_table_find_idp_realm(TR_COMM_TABLE *ctab, TR_NAME *realm_id)
 {
-  return tr_idp_realm_lookup(ctab->idp_realms, realm_id);
+  if (realm_id==NULL)
+    return NULL;
+  return g_hash_table_lookup(ctab->idp_realm_index, realm_id);
 }
 
+/* Adds new and any realms linked after it */
 void tr_comm_table_add_idp_realm(TR_COMM_TABLE *ctab, TR_IDP_REALM *new)
 {
-  tr_idp_realm_add(ctab->idp_realms, new);
+  tr_idp_realm_add_tail(ctab->idp_realms, ctab->idp_realms_tail, new);
   if (ctab->idp_realms!=NULL)
     talloc_steal(ctab, ctab->idp_realms); /* make sure it's in the right context */
+  tr_comm_table_index_idp_realms(ctab, new);
 }
 
 void tr_comm_table_remove_idp_realm(TR_COMM_TABLE *ctab, TR_IDP_REALM *realm)
 {
+  ctab->idp_realms_tail=NULL; /* might have been realm */
   tr_idp_realm_remove(ctab->idp_realms, realm);
+  tr_comm_table_unindex_idp_realm(ctab, realm);
 }
 
 
@@ -1453,9 +1621,22 @@ size_t tr_comm_table_size(TR_COMM_TABLE *ctab)
 /* clean up unreferenced realms, etc */
 void tr_comm_table_sweep(TR_COMM_TABLE *ctab)
 {
+  /* The sweep frees the objects whose names key the indexes, so rebuild them
+   * afterward. Memberships hold references, so their index is unaffected. */
+  g_hash_table_remove_all(ctab->rp_realm_index);
+  g_hash_table_remove_all(ctab->idp_realm_index);
+  g_hash_table_remove_all(ctab->comm_index);
+
   tr_rp_realm_sweep(ctab->rp_realms);
   tr_idp_realm_sweep(ctab->idp_realms);
   tr_comm_sweep(ctab->comms);
+  ctab->rp_realms_tail=NULL;
+  ctab->idp_realms_tail=NULL;
+  ctab->comms_tail=NULL;
+
+  tr_comm_table_index_rp_realms(ctab, ctab->rp_realms);
+  tr_comm_table_index_idp_realms(ctab, ctab->idp_realms);
+  tr_comm_table_index_comms(ctab, ctab->comms);
 }
 
 
@@ -1480,20 +1661,19 @@ TR_REALM_ROLE tr_realm_role_from_str(const char *s)
   return TR_ROLE_UNKNOWN;
 }
 
-static char *tr_comm_table_append_provenance(char *ctable_s, json_t *prov)
+static char *tr_comm_table_append_provenance(char *ctable_s, TR_PROVENANCE *prov)
 {
-  const char *s=NULL;
+  TR_NAME *hop=NULL;
   char *tmp=NULL;
   size_t ii=0;
 
-  for (ii=0; ii<json_array_size(prov); ii++) {
-    s=json_string_value(json_array_get(prov, ii));
-    if (s!=NULL) {
-      tmp=talloc_asprintf_append(ctable_s, "%s%s", s, ((ii + 1) == json_array_size(prov)) ? "" : ", ");
-      if (tmp==NULL)
-        return NULL;
-      ctable_s=tmp;
-    }
+  for (ii=0; ii<tr_provenance_len(prov); ii++) {
+    hop=tr_provenance_get_hop(prov, ii);
+    tmp=talloc_asprintf_append(ctable_s, "%.*s%s", (int) hop->len, hop->buf,
+                               ((ii + 1) == tr_provenance_len(prov)) ? "" : ", ");
+    if (tmp==NULL)
+      return NULL;
+    ctable_s=tmp;
   }
   return ctable_s;
 }
@@ -64,14 +64,7 @@ static json_t *expiry_to_json_string(TR_COMM_MEMB *memb)
  */
 static json_t *provenance_to_json(TR_COMM_MEMB *memb)
 {
-  json_t *prov = tr_comm_memb_get_provenance(memb);
-
-  if (prov) {
-    json_incref(prov);
-    return prov;
-  } else {
-    return json_array();
-  }
+  return tr_provenance_to_json(tr_comm_memb_get_provenance(memb));
 }
 
 /* helper for below */
@@ -36,6 +36,8 @@
 #include <string.h>
 #include <jansson.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <talloc.h>
 
 #include <tr_cfgwatch.h>
@@ -140,6 +142,8 @@ TR_CFG *tr_cfg_new(TALLOC_CTX *mem_ctx)
     cfg->rp_clients=NULL;
     cfg->peers=NULL;
     cfg->default_servers=NULL;
+    cfg->generation=0;
+    cfg->refcount=1; /* the creator's reference */
     cfg->ctable=tr_comm_table_new(cfg);
     if (cfg->ctable==NULL) {
       talloc_free(cfg);
@@ -160,29 +164,151 @@ void tr_cfg_free (TR_CFG *cfg)
   talloc_free(cfg);
 }
 
+unsigned int tr_cfg_get_generation(TR_CFG *cfg)
+{
+  return cfg->generation;
+}
+
+/**
+ * Drop a reference to a configuration
+ *
+ * The configuration is freed when its last reference is released. This
+ * may happen in any thread.
+ *
+ * @param cfg Configuration obtained from tr_cfg_mgr_acquire(), may be null
+ */
+void tr_cfg_release(TR_CFG *cfg)
+{
+  if ((cfg!=NULL) && g_atomic_int_dec_and_test(&(cfg->refcount)))
+    tr_cfg_free(cfg);
+}
+
+static void tr_cfg_jcache_entry_destroy(gpointer data)
+{
+  TR_CFG_JCACHE_ENTRY *entry=(TR_CFG_JCACHE_ENTRY *)data;
+  json_decref(entry->jcfg);
+  g_free(entry);
+}
+
+static int tr_cfg_mgr_destructor(void *object)
+{
+  TR_CFG_MGR *cfg_mgr=talloc_get_type_abort(object, TR_CFG_MGR);
+  if (cfg_mgr->jcfg_cache!=NULL)
+    g_hash_table_destroy(cfg_mgr->jcfg_cache);
+  /* before talloc gets to the replaced configurations it is still holding */
+  tr_reclaim_free(cfg_mgr->reclaim);
+  /* readers may outlive the manager; the last one frees the active configuration */
+  if (cfg_mgr->active!=NULL) {
+    talloc_steal(NULL, cfg_mgr->active);
+    tr_cfg_release(cfg_mgr->active);
+  }
+  return 0;
+}
+
 TR_CFG_MGR *tr_cfg_mgr_new(TALLOC_CTX *mem_ctx)
 {
-  return talloc_zero(mem_ctx, TR_CFG_MGR);
+  TR_CFG_MGR *cfg_mgr=talloc_zero(mem_ctx, TR_CFG_MGR);
+  if (cfg_mgr!=NULL) {
+    cfg_mgr->jcfg_cache=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, tr_cfg_jcache_entry_destroy);
+    if (cfg_mgr->jcfg_cache==NULL) {
+      talloc_free(cfg_mgr);
+      return NULL;
+    }
+    cfg_mgr->reclaim=tr_reclaim_new(cfg_mgr);
+    if (cfg_mgr->reclaim==NULL) {
+      g_hash_table_destroy(cfg_mgr->jcfg_cache);
+      talloc_free(cfg_mgr);
+      return NULL;
+    }
+    cfg_mgr->parse_threads=TR_DEFAULT_PARSE_THREADS;
+    talloc_set_destructor((void *)cfg_mgr, tr_cfg_mgr_destructor);
+  }
+  return cfg_mgr;
 }
 
 void tr_cfg_mgr_free (TR_CFG_MGR *cfg_mgr) {
   talloc_free(cfg_mgr);
 }
 
+/**
+ * Take a reference to the active configuration
+ *
+ * The configuration stays valid until the reference is dropped with
+ * tr_cfg_release(), even if a new configuration is applied in the meantime.
+ * Take one reference at the start of a request and use it throughout, so the
+ * whole request sees a single consistent configuration.
+ *
+ * Does not take a lock. The caller is inside a read section of the manager's
+ * reclaimer from before it loads the active pointer until its reference is
+ * taken, so a configuration replaced in the meantime is not freed under it.
+ *
+ * @param cfg_mgr Configuration manager
+ * @return The active configuration, or null if none has been applied
+ */
+TR_CFG *tr_cfg_mgr_acquire(TR_CFG_MGR *cfg_mgr)
+{
+  TR_CFG *cfg=NULL;
+  unsigned int slot=tr_reclaim_enter(cfg_mgr->reclaim);
+
+  cfg=g_atomic_pointer_get(&(cfg_mgr->active));
+  if (cfg!=NULL)
+    g_atomic_int_inc(&(cfg->refcount));
+  tr_reclaim_exit(cfg_mgr->reclaim, slot);
+  return cfg;
+}
+
+/* Drop the manager's reference to a configuration it replaced. Requests in progress may
+ * still hold it, so detach it from the manager's context and let whoever drops the last
+ * reference free it. */
+static void tr_cfg_mgr_release_replaced(void *obj)
+{
+  TR_CFG *cfg=talloc_get_type_abort(obj, TR_CFG);
+  talloc_steal(NULL, cfg);
+  tr_cfg_release(cfg);
+}
+
+/**
+ * Drop replaced configurations that no reader can still be loading
+ *
+ * Does not wait. Call from the main thread after applying a configuration,
+ * and again later while this returns nonzero.
+ *
+ * @param cfg_mgr Configuration manager
+ * @return Number of replaced configurations still waiting
+ */
+size_t tr_cfg_mgr_reclaim(TR_CFG_MGR *cfg_mgr)
+{
+  return tr_reclaim_poll(cfg_mgr->reclaim);
+}
+
 TR_CFG_RC tr_apply_new_config (TR_CFG_MGR *cfg_mgr)
 {
+  TR_CFG *old=NULL;
+
   /* cfg_mgr->active is allowed to be null, but new cannot be */
   if ((cfg_mgr==NULL) || (cfg_mgr->new==NULL))
     return TR_CFG_BAD_PARAMS;
 
-  if (cfg_mgr->active != NULL)
-    tr_cfg_free(cfg_mgr->active);
-
-  cfg_mgr->active = cfg_mgr->new;
+  old=cfg_mgr->active;
+  cfg_mgr->new->generation=++(cfg_mgr->generation);
+  g_atomic_pointer_set(&(cfg_mgr->active), cfg_mgr->new); /* the manager's reference passes to active */
   cfg_mgr->new=NULL; /* only keep a single handle on the new configuration */
 
+  /* A reader that loaded the old pointer before the swap may not have taken its
+   * reference yet, so the old configuration is released once none can be left. */
+  if (old!=NULL) {
+    tr_reclaim_retire(cfg_mgr->reclaim, old, tr_cfg_mgr_release_replaced);
+    tr_cfg_mgr_reclaim(cfg_mgr);
+  }
+  tr_debug("tr_apply_new_config: applied configuration generation %u.", cfg_mgr->generation);
+
   tr_log_threshold(cfg_mgr->active->internal->log_threshold);
   tr_console_threshold(cfg_mgr->active->internal->console_threshold);
+  if (cfg_mgr->active->internal->log_async) {
+    if (0 != tr_log_async_start(cfg_mgr->active->internal->log_overflow))
+      tr_warning("tr_apply_new_config: unable to start log thread, logging synchronously.");
+  } else
+    tr_log_async_stop();
 
   return TR_CFG_SUCCESS;
 }
@@ -226,29 +352,6 @@ static void tr_cfg_log_json_error(const char *label, json_error_t *rc)
 	   rc->text);
 }
 
-/**
- * Parse a config file and return its JSON structure. Also emits a serial number to the log
- * if one is present.
- *
- * @param file_with_path The file (with path!) to parse
- * @return Pointer to the result of parsing, or null on error
- */
-static json_t *tr_cfg_parse_one_config_file(const char *file_with_path)
-{
-  json_t *jcfg=NULL;
-  json_error_t rc;
-
-  if (NULL==(jcfg=json_load_file(file_with_path, 
-                                 JSON_DISABLE_EOF_CHECK|JSON_REJECT_DUPLICATES, &rc))) {
-    tr_debug("tr_cfg_parse_one_config_file: Error parsing config file %s.", 
-             file_with_path);
-    tr_cfg_log_json_error("tr_cfg_parse_one_config_file", &rc);
-    return NULL;
-  }
-
-  return jcfg;
-}
-
 /* extract serial number */
 static json_int_t get_cfg_serial(json_t *jcfg)
 {
@@ -275,36 +378,197 @@ static void tr_cfg_parse_free_jcfgs(unsigned int n_jcfgs, json_t **jcfgs)
   talloc_free(jcfgs);
 }
 
+/* upper limit on TR_CFG_MGR parse_threads */
+#define TR_CFG_PARSE_MAX_THREADS 16
+
+/* a config file to be parsed by a worker thread */
+typedef struct tr_cfg_parse_job {
+  const char *file_with_path;
+  int stat_ok; /* is file_status valid? */
+  struct stat file_status; /* status before parsing, for the cache */
+  json_t *jcfg; /* result, null on error */
+  json_error_t rc; /* parse error, valid if jcfg is null */
+} TR_CFG_PARSE_JOB;
+
+/* work shared by the parser threads */
+typedef struct tr_cfg_parse_pool {
+  TR_CFG_PARSE_JOB *jobs;
+  unsigned int n_jobs;
+  unsigned int next_job; /* next job to take, accessed atomically */
+} TR_CFG_PARSE_POOL;
+
+/* Is the file described by file_status the one that was parsed to make entry? */
+int tr_cfg_jcache_entry_current(TR_CFG_JCACHE_ENTRY *entry, struct stat *file_status)
+{
+  return (entry->inode==file_status->st_ino)
+         && (entry->size==file_status->st_size)
+         && (entry->mtime.tv_sec==file_status->st_mtim.tv_sec)
+         && (entry->mtime.tv_nsec==file_status->st_mtim.tv_nsec);
+}
+
+/**
+ * Look for an unchanged config file in the cache
+ *
+ * The cached JSON is reused if the file has the same inode, size and modification
+ * time as when it was parsed. Config parsers do not modify the JSON, so it can be
+ * shared between configurations.
+ *
+ * @param cfg_mgr Configuration manager holding the cache
+ * @param file_with_path The file (with path!)
+ * @param file_status Current status of the file
+ * @return New reference to the cached JSON, or null if the file must be parsed
+ */
+static json_t *tr_cfg_jcache_lookup(TR_CFG_MGR *cfg_mgr, const char *file_with_path, struct stat *file_status)
+{
+  TR_CFG_JCACHE_ENTRY *entry=NULL;
+
+  entry=g_hash_table_lookup(cfg_mgr->jcfg_cache, file_with_path);
+  if ((entry!=NULL) && tr_cfg_jcache_entry_current(entry, file_status)) {
+    tr_debug("tr_cfg_jcache_lookup: %s unchanged, not reparsing.", file_with_path);
+    entry->generation=cfg_mgr->jcfg_generation;
+    return json_incref(entry->jcfg);
+  }
+  return NULL;
+}
+
+/* Remember a newly parsed config file */
+void tr_cfg_jcache_store(TR_CFG_MGR *cfg_mgr, const char *file_with_path, struct stat *file_status, json_t *jcfg)
+{
+  TR_CFG_JCACHE_ENTRY *entry=g_malloc(sizeof(TR_CFG_JCACHE_ENTRY));
+
+  entry->jcfg=json_incref(jcfg);
+  entry->mtime=file_status->st_mtim;
+  entry->size=file_status->st_size;
+  entry->inode=file_status->st_ino;
+  entry->generation=cfg_mgr->jcfg_generation;
+  g_hash_table_replace(cfg_mgr->jcfg_cache, g_strdup(file_with_path), entry);
+}
+
+/* Worker thread, parses files until none are left. Does not log; errors are left in the job. */
+static void *tr_cfg_parse_worker(void *arg)
+{
+  TR_CFG_PARSE_POOL *pool=(TR_CFG_PARSE_POOL *)arg;
+  TR_CFG_PARSE_JOB *job=NULL;
+  unsigned int job_ii=0;
+
+  while ((job_ii=__atomic_fetch_add(&(pool->next_job), 1, __ATOMIC_RELAXED)) < pool->n_jobs) {
+    job=&(pool->jobs[job_ii]);
+    job->jcfg=json_load_file(job->file_with_path,
+                             JSON_DISABLE_EOF_CHECK|JSON_REJECT_DUPLICATES,
+                             &(job->rc));
+  }
+  return NULL;
+}
+
+/**
+ * Parse files concurrently. Uses up to max_threads threads, including the calling
+ * thread, and returns once all jobs are done.
+ *
+ * Only JSON parsing happens off the calling thread. Jansson is safe to use from
+ * several threads as long as they do not share JSON objects.
+ */
+static void tr_cfg_parse_jobs_run(TR_CFG_PARSE_JOB *jobs, unsigned int n_jobs, unsigned int max_threads)
+{
+  TR_CFG_PARSE_POOL pool;
+  pthread_t threads[TR_CFG_PARSE_MAX_THREADS-1];
+  unsigned int n_threads=0;
+  unsigned int ii=0;
+
+  pool.jobs=jobs;
+  pool.n_jobs=n_jobs;
+  pool.next_job=0;
+
+#if JANSSON_VERSION_HEX >= 0x020600
+  json_object_seed(0); /* seed the hash function before starting threads */
+#endif
+
+  /* start helpers; if a thread cannot be started, the rest of the work is done here */
+  if (max_threads<1)
+    max_threads=1;
+  if (max_threads>TR_CFG_PARSE_MAX_THREADS)
+    max_threads=TR_CFG_PARSE_MAX_THREADS;
+  for (ii=0; (ii+1<n_jobs) && (ii+1<max_threads); ii++) {
+    if (0!=pthread_create(&threads[n_threads], NULL, tr_cfg_parse_worker, &pool)) {
+      tr_debug("tr_cfg_parse_jobs_run: Unable to start parser thread, continuing with %u.", n_threads+1);
+      break;
+    }
+    n_threads++;
+  }
+  tr_cfg_parse_worker(&pool);
+  for (ii=0; ii<n_threads; ii++)
+    pthread_join(threads[ii], NULL);
+}
+
+static gboolean tr_cfg_jcache_entry_is_stale(gpointer key, gpointer value, gpointer generation)
+{
+  TR_CFG_JCACHE_ENTRY *entry=(TR_CFG_JCACHE_ENTRY *)value;
+  return (entry->generation != *(unsigned int *)generation);
+}
+
 /**
  * Parse a list of configuration files. Returns an array of JSON objects, free this with
  * tr_cfg_parse_free_jcfgs(), a helper function
  *
- * @param config_dir
+ * Files that have not changed since they were last parsed are not read again. The
+ * others are parsed concurrently, then checked in filename order, so errors are
+ * reported as if the files had been read one at a time.
+ *
+ * @param cfg_mgr Configuration manager, for its cache of parsed files
  * @param n_files
  * @param cfg_files
  * @return
  */
-static json_t **tr_cfg_parse_config_files(TALLOC_CTX *mem_ctx, unsigned int n_files, GArray *files)
+static json_t **tr_cfg_parse_config_files(TALLOC_CTX *mem_ctx, TR_CFG_MGR *cfg_mgr, unsigned int n_files, GArray *files)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   unsigned int ii=0;
   json_t **jcfgs=NULL;
   TR_CFG_FILE *this_file = NULL;
+  TR_CFG_PARSE_JOB *jobs=NULL;
+  TR_CFG_PARSE_JOB *job=NULL;
+  unsigned int n_jobs=0;
 
   /* first allocate the jcfgs */
-  jcfgs=talloc_array(NULL, json_t *, n_files);
-  if (jcfgs==NULL) {
+  jcfgs=talloc_zero_array(NULL, json_t *, n_files);
+  jobs=talloc_array(tmp_ctx, TR_CFG_PARSE_JOB, n_files);
+  if ((jcfgs==NULL) || (jobs==NULL)) {
     tr_crit("tr_parse_config_files: cannot allocate JSON structure array");
     goto cleanup;
   }
+
+  /* take unchanged files from the cache, queue the rest for parsing */
+  cfg_mgr->jcfg_generation++;
+  for (ii=0; ii<n_files; ii++) {
+    this_file = &g_array_index(files, TR_CFG_FILE, ii);
+    job=&jobs[n_jobs];
+    job->stat_ok=(0==stat(this_file->name, &(job->file_status)));
+    if (job->stat_ok)
+      jcfgs[ii]=tr_cfg_jcache_lookup(cfg_mgr, this_file->name, &(job->file_status));
+    if (jcfgs[ii]==NULL) {
+      job->file_with_path=this_file->name;
+      job->jcfg=NULL;
+      n_jobs++;
+    }
+  }
+
+  tr_cfg_parse_jobs_run(jobs, n_jobs, cfg_mgr->parse_threads);
+
+  /* collect the results in filename order */
+  job=jobs;
   for (ii=0; ii<n_files; ii++) {
     this_file = &g_array_index(files, TR_CFG_FILE, ii);
-    jcfgs[ii]=tr_cfg_parse_one_config_file(this_file->name);
     if (jcfgs[ii]==NULL) {
-      tr_err("tr_parse_config: Error parsing JSON in %s", this_file->name);
-      tr_cfg_parse_free_jcfgs(ii, jcfgs); /* frees the JSON objects and the jcfgs array */
-      jcfgs=NULL;
-      goto cleanup;
+      jcfgs[ii]=job->jcfg;
+      job->jcfg=NULL;
+      if (jcfgs[ii]==NULL) {
+        tr_debug("tr_cfg_parse_config_files: Error parsing config file %s.", this_file->name);
+        tr_cfg_log_json_error("tr_cfg_parse_config_files", &(job->rc));
+        tr_err("tr_parse_config: Error parsing JSON in %s", this_file->name);
+        goto cleanup;
+      }
+      if (job->stat_ok)
+        tr_cfg_jcache_store(cfg_mgr, this_file->name, &(job->file_status), jcfgs[ii]);
+      job++;
     }
 
     this_file->serial = get_cfg_serial(jcfgs[ii]);
@@ -320,11 +584,20 @@ static json_t **tr_cfg_parse_config_files(TALLOC_CTX *mem_ctx, unsigned int n_fi
     }
   }
 
-cleanup:
-  if (jcfgs)
-    talloc_steal(mem_ctx, jcfgs); /* give this to the caller's context if we succeeded */
+  /* forget files that are no longer part of the configuration */
+  g_hash_table_foreach_remove(cfg_mgr->jcfg_cache, tr_cfg_jcache_entry_is_stale, &(cfg_mgr->jcfg_generation));
+  talloc_steal(mem_ctx, jcfgs); /* give this to the caller's context since we succeeded */
   talloc_free(tmp_ctx);
   return jcfgs;
+
+cleanup:
+  /* failed: release whatever was parsed */
+  for (ii=0; (jobs!=NULL) && (ii<n_jobs); ii++)
+    json_decref(jobs[ii].jcfg);
+  if (jcfgs!=NULL)
+    tr_cfg_parse_free_jcfgs(n_files, jcfgs);
+  talloc_free(tmp_ctx);
+  return NULL;
 }
 
 /* define a type for config parse functions */
@@ -413,7 +686,7 @@ TR_CFG_RC tr_parse_config(TR_CFG_MGR *cfg_mgr, unsigned int n_files, char **file
   add_files(cfg_mgr->new, n_files, files_with_paths);
 
   /* first parse the json */
-  jcfgs=tr_cfg_parse_config_files(tmp_ctx, n_files, cfg_mgr->new->files);
+  jcfgs=tr_cfg_parse_config_files(tmp_ctx, cfg_mgr, n_files, cfg_mgr->new->files);
   if (jcfgs==NULL) {
     cfg_rc=TR_CFG_NOPARSE;
     goto cleanup;
@@ -448,26 +721,28 @@ cleanup:
   return cfg_rc;
 }
 
-static int is_cfg_file(const struct dirent *dent) {
+/* Returns nonzero if a file with this name (without path) should be read as a config file */
+int tr_is_config_file_name(const char *name)
+{
   size_t n;
 
   /* Only accept filenames ending in ".cfg" and starting with a character
    * other than an ASCII '.' */
 
   /* filename must be at least 4 characters long to be acceptable */
-  n=strlen(dent->d_name);
+  n=strlen(name);
   if (n < 4) {
     return 0;
   }
 
   /* filename must not start with '.' */
-  if ('.' == dent->d_name[0]) {
+  if ('.' == name[0]) {
     return 0;
   }
 
   /* If the above passed and the last four characters of the filename are .cfg, accept.
    * (n.b., assumes an earlier test checked that the name is >= 4 chars long.) */
-  if (0 == strcmp(&(dent->d_name[n-4]), ".cfg")) {
+  if (0 == strcmp(&(name[n-4]), ".cfg")) {
     return 1;
   }
 
@@ -475,6 +750,10 @@ static int is_cfg_file(const struct dirent *dent) {
   return 0;
 }
 
+static int is_cfg_file(const struct dirent *dent) {
+  return tr_is_config_file_name(dent->d_name);
+}
+
 /* Find configuration files in a particular directory. Returns the
  * number of entries found, 0 if none are found, or <0 for some
  * errors. If n>=0, the cfg_files parameter will contain a newly
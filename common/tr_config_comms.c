@@ -162,7 +162,7 @@ static void tr_cfg_parse_comm_rps(TR_CFG *trc, json_t *jrps, TR_COMM *comm, TR_C
     }
 
     /* Add the RP to the community, first see if we have the RP in any community */
-    found_rp=tr_rp_realm_lookup(trc->ctable->rp_realms, rp_name);
+    found_rp=tr_comm_table_find_rp_realm(trc->ctable, rp_name);
     if (found_rp!=NULL) {
       tr_debug("tr_cfg_parse_comm_rps: RP realm %s already exists.", s);
       new_rp=found_rp; /* use it rather than creating a new realm record */
@@ -175,8 +175,7 @@ static void tr_cfg_parse_comm_rps(TR_CFG *trc, json_t *jrps, TR_COMM *comm, TR_C
       tr_debug("tr_cfg_parse_comm_rps: setting name to %s", rp_name->buf);
       tr_rp_realm_set_id(new_rp, rp_name);
       rp_name=NULL; /* rp_name no longer belongs to us */
-      tr_rp_realm_add(trc->ctable->rp_realms, new_rp);
-      talloc_steal(trc->ctable, trc->ctable->rp_realms); /* make sure head is in the right context */
+      tr_comm_table_add_rp_realm(trc->ctable, new_rp); /* fixes talloc contexts */
     }
     tr_comm_add_rp_realm(trc->ctable, comm, new_rp, 0, NULL, NULL);
   }
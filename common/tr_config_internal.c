@@ -32,8 +32,10 @@
  *
  */
 
+#include <string.h>
 #include <talloc.h>
 #include <jansson.h>
+#include <openssl/rand.h>
 #include <tr_debug.h>
 #include <tr_config.h>
 #include <tr_cfgwatch.h>
@@ -191,11 +193,20 @@ static void set_defaults(TR_CFG_INTERNAL *cfg)
   cfg->trp_connect_interval = TR_DEFAULT_TRP_CONNECT_INTERVAL;
   cfg->trp_sweep_interval = TR_DEFAULT_TRP_SWEEP_INTERVAL;
   cfg->trp_update_interval = TR_DEFAULT_TRP_UPDATE_INTERVAL;
+  cfg->trp_update_max_records = TR_DEFAULT_TRP_UPDATE_MAX_RECORDS;
+  cfg->trp_update_delta = TR_DEFAULT_TRP_UPDATE_DELTA;
+  cfg->trp_event_transport = TR_DEFAULT_TRP_EVENT_TRANSPORT;
+  cfg->trp_send_coalesce = TR_DEFAULT_TRP_SEND_COALESCE;
   cfg->tid_req_timeout = TR_DEFAULT_TID_REQ_TIMEOUT;
   cfg->tid_resp_numer = TR_DEFAULT_TID_RESP_NUMER;
   cfg->tid_resp_denom = TR_DEFAULT_TID_RESP_DENOM;
   cfg->log_threshold = TR_DEFAULT_LOG_THRESHOLD;
   cfg->console_threshold = TR_DEFAULT_CONSOLE_THRESHOLD;
+  cfg->log_async = 0;
+  cfg->log_overflow = TR_LOG_OVERFLOW_DROP;
+  cfg->debug_sample_one_in = 0;
+  cfg->debug_sample_gss_names = NULL;
+  cfg->debug_sample_realms = NULL;
   cfg->monitoring_credentials = NULL;
 }
 
@@ -221,6 +232,68 @@ static TR_CFG_RC tr_cfg_parse_monitoring(TR_CFG *trc, json_t *jmon)
   return TR_CFG_SUCCESS;
 }
 
+/**
+ * Parse the request sampling part of the logging section
+ *
+ * TID requests matching any of these criteria are logged at debug level
+ * whatever the log thresholds are:
+ *
+ *   "debug_sample": {"one_in": 1000,
+ *                    "gss_names": ["rp@example.com"],
+ *                    "realms": ["example.org", "*.example.net"]}
+ */
+static TR_CFG_RC tr_cfg_parse_debug_sample(TR_CFG *trc, json_t *jsample)
+{
+  TR_CFG_INTERNAL *internal = trc->internal;
+  json_t *jrealms = NULL;
+  json_t *jrealm = NULL;
+  TR_NAME *realm = NULL;
+  size_t ii = 0;
+
+  if (!json_is_object(jsample)) {
+    tr_err("tr_cfg_parse_debug_sample: debug_sample is not an object.");
+    return TR_CFG_NOPARSE;
+  }
+
+  NOPARSE_UNLESS(tr_cfg_parse_unsigned(jsample, "one_in", &(internal->debug_sample_one_in)));
+
+  if (NULL != json_object_get(jsample, "gss_names")) {
+    NOPARSE_UNLESS(tr_cfg_parse_gss_names(internal,
+                                          json_object_get(jsample, "gss_names"),
+                                          &(internal->debug_sample_gss_names)));
+  }
+
+  if (NULL != (jrealms = json_object_get(jsample, "realms"))) {
+    if (!json_is_array(jrealms)) {
+      tr_err("tr_cfg_parse_debug_sample: realms is not an array.");
+      return TR_CFG_NOPARSE;
+    }
+    tr_wildcard_set_free(internal->debug_sample_realms);
+    internal->debug_sample_realms = tr_wildcard_set_new(internal);
+    if (internal->debug_sample_realms == NULL)
+      return TR_CFG_NOMEM;
+    for (ii = 0; ii < json_array_size(jrealms); ii++) {
+      jrealm = json_array_get(jrealms, ii);
+      if (!json_is_string(jrealm)) {
+        tr_err("tr_cfg_parse_debug_sample: realm %zu is not a string.", ii);
+        return TR_CFG_NOPARSE;
+      }
+      /* the set borrows its patterns, so keep them in its context */
+      realm = talloc(internal->debug_sample_realms, TR_NAME);
+      if (realm == NULL)
+        return TR_CFG_NOMEM;
+      realm->buf = talloc_strdup(realm, json_string_value(jrealm));
+      if (realm->buf == NULL)
+        return TR_CFG_NOMEM;
+      realm->len = (int) strlen(realm->buf);
+      if (0 != tr_wildcard_set_add(internal->debug_sample_realms, realm))
+        return TR_CFG_NOMEM;
+    }
+  }
+
+  return TR_CFG_SUCCESS;
+}
+
 /**
  * Parse internal configuration JSON
  *
@@ -255,6 +328,10 @@ TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jint)
   NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "trp_connect_interval",     &(trc->internal->trp_connect_interval)));
   NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "trp_sweep_interval",       &(trc->internal->trp_sweep_interval)));
   NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "trp_update_interval",      &(trc->internal->trp_update_interval)));
+  NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "trp_update_max_records",   &(trc->internal->trp_update_max_records)));
+  NOPARSE_UNLESS(tr_cfg_parse_boolean(jint, "trp_update_delta",          &(trc->internal->trp_update_delta)));
+  NOPARSE_UNLESS(tr_cfg_parse_boolean(jint, "trp_event_transport",       &(trc->internal->trp_event_transport)));
+  NOPARSE_UNLESS(tr_cfg_parse_boolean(jint, "trp_send_coalesce",         &(trc->internal->trp_send_coalesce)));
   NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "tid_request_timeout",      &(trc->internal->tid_req_timeout)));
   NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "tid_response_numerator",   &(trc->internal->tid_resp_numer)));
   NOPARSE_UNLESS(tr_cfg_parse_unsigned(jint, "tid_response_denominator", &(trc->internal->tid_resp_denom)));
@@ -272,6 +349,26 @@ TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jint)
       trc->internal->console_threshold = str2sev(s);
       talloc_free((void *) s);
     }
+
+    NOPARSE_UNLESS(tr_cfg_parse_boolean(jtmp, "async", &(trc->internal->log_async)));
+    NOPARSE_UNLESS(tr_cfg_parse_string(jtmp, "async_overflow", &s));
+    if (s) {
+      if (0 == strcmp(s, "drop"))
+        trc->internal->log_overflow = TR_LOG_OVERFLOW_DROP;
+      else if (0 == strcmp(s, "block"))
+        trc->internal->log_overflow = TR_LOG_OVERFLOW_BLOCK;
+      else if (0 == strcmp(s, "sync"))
+        trc->internal->log_overflow = TR_LOG_OVERFLOW_SYNC;
+      else {
+        tr_err("tr_cfg_parse_internal: invalid async_overflow \"%s\" (expected drop, block or sync).", s);
+        talloc_free((void *) s);
+        return TR_CFG_NOPARSE;
+      }
+      talloc_free((void *) s);
+    }
+
+    if (NULL != json_object_get(jtmp, "debug_sample"))
+      NOPARSE_UNLESS(tr_cfg_parse_debug_sample(trc, json_object_get(jtmp, "debug_sample")));
   }
 
   /* Parse the monitoring section */
@@ -283,6 +380,42 @@ TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jint)
   return TR_CFG_SUCCESS;
 }
 
+/**
+ * Decide whether to log a TID request at debug level
+ *
+ * Requests from a listed GSS name or for a listed realm are always sampled.
+ * Others are sampled at random, one in debug_sample_one_in.
+ *
+ * @param internal internal configuration with the sampling settings
+ * @param gss_name GSS name of the requesting client, may be null
+ * @param realm realm of the request
+ * @return 1 if the request is sampled, 0 if not
+ */
+int tr_cfg_debug_sampled(TR_CFG_INTERNAL *internal, TR_NAME *gss_name, TR_NAME *realm)
+{
+  unsigned int r = 0;
+
+  if (internal == NULL)
+    return 0;
+
+  if ((gss_name != NULL)
+      && (internal->debug_sample_gss_names != NULL)
+      && tr_gss_names_matches(internal->debug_sample_gss_names, gss_name))
+    return 1;
+
+  if ((realm != NULL)
+      && (NULL != tr_wildcard_set_find_name(internal->debug_sample_realms, realm)))
+    return 1;
+
+  /* requests are handled in forked processes, so use a generator that is reseeded after fork */
+  if ((internal->debug_sample_one_in > 0)
+      && (1 == RAND_bytes((unsigned char *) &r, sizeof(r)))
+      && (0 == r % internal->debug_sample_one_in))
+    return 1;
+
+  return 0;
+}
+
 static int invalid_port(int port)
 {
   return ((port <= 0) || (port > 65536));
@@ -340,6 +473,13 @@ TR_CFG_RC tr_cfg_validate_internal(TR_CFG_INTERNAL *int_cfg)
     rc = TR_CFG_ERROR;
   }
 
+  if (TR_MIN_TRP_UPDATE_MAX_RECORDS > int_cfg->trp_update_max_records) {
+    tr_debug(
+        "tr_cfg_validate_internal: Error: trp_update_max_records must be at least %d (currently %d).",
+        TR_MIN_TRP_UPDATE_MAX_RECORDS, int_cfg->trp_update_max_records);
+    rc = TR_CFG_ERROR;
+  }
+
   if (TR_MIN_CFG_POLL_INTERVAL > int_cfg->cfg_poll_interval) {
     tr_debug(
         "tr_cfg_validate_internal: Error: cfg_poll_interval must be at least %d (currently %d).",
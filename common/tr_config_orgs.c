@@ -123,8 +123,7 @@ cleanup:
   /* if we succeeded, link things to the configuration and move out of tmp context */
   if (retval==TR_CFG_SUCCESS) {
     if (new_idp_realms!=NULL) {
-      tr_idp_realm_add(trc->ctable->idp_realms, new_idp_realms); /* fixes talloc contexts except for head*/
-      talloc_steal(trc, trc->ctable->idp_realms); /* make sure the head is in the right context */
+      tr_comm_table_add_idp_realm(trc->ctable, new_idp_realms); /* fixes talloc contexts */
     }
 
     if (new_rp_clients!=NULL) {
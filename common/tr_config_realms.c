@@ -444,6 +444,7 @@ TR_IDP_REALM *tr_cfg_parse_idp_realms(TALLOC_CTX *mem_ctx, json_t *jrealms, TR_C
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TR_IDP_REALM *realms=NULL;
+  TR_IDP_REALM *realms_tail=NULL;
   TR_IDP_REALM *new_realm=NULL;
   json_t *this_jrealm=NULL;
   int ii=0;
@@ -464,7 +465,7 @@ TR_IDP_REALM *tr_cfg_parse_idp_realms(TALLOC_CTX *mem_ctx, json_t *jrealms, TR_C
         *rc=TR_CFG_NOPARSE;
         goto cleanup;
       }
-      tr_idp_realm_add(realms, new_realm);
+      tr_idp_realm_add_tail(realms, realms_tail, new_realm);
     } else if (tr_cfg_is_remote_realm(this_jrealm)) {
       new_realm=tr_cfg_parse_one_remote_realm(tmp_ctx, this_jrealm, rc);
       if ((*rc)!=TR_CFG_SUCCESS) {
@@ -472,7 +473,7 @@ TR_IDP_REALM *tr_cfg_parse_idp_realms(TALLOC_CTX *mem_ctx, json_t *jrealms, TR_C
         *rc=TR_CFG_NOPARSE;
         goto cleanup;
       }
-      tr_idp_realm_add(realms, new_realm);
+      tr_idp_realm_add_tail(realms, realms_tail, new_realm);
     }
   }
 
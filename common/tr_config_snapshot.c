@@ -0,0 +1,1223 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <glib.h>
+#include <talloc.h>
+
+#include <tr_config.h>
+#include <tr_constraint_internal.h>
+#include <tr_debug.h>
+
+/*
+ * Configuration snapshots
+ *
+ * A snapshot holds a validated configuration as binary records, so the next start
+ * can build the same configuration without reading any JSON. The records are decoded
+ * straight into the usual table builders in one pass. A snapshot is only used if
+ * every configuration file still has the contents it had when the snapshot was
+ * written; otherwise the files are parsed as usual.
+ *
+ * Layout, in native byte order (snapshots are not meant to be moved between hosts):
+ *
+ *   header:  magic[8], uint32 version, uint32 n_files, uint64 payload_len,
+ *            SHA-256 of the payload
+ *   payload: files, internal settings, RP clients, peers, default servers,
+ *            community table
+ *
+ * Integers are uint32 unless noted. A string is a uint32 length and its bytes,
+ * with TR_CFG_SNAPSHOT_ABSENT as the length of a missing string. Optional
+ * structures are preceded by a uint32 that is 0 if the structure is missing.
+ * Lists are a uint32 count and their items. Memberships refer to realms and
+ * communities by their position in the community table's lists.
+ */
+#define TR_CFG_SNAPSHOT_MAGIC "TRCFGSNP"
+#define TR_CFG_SNAPSHOT_MAGIC_LEN 8
+#define TR_CFG_SNAPSHOT_VERSION 2 /* version 1 held JSON */
+#define TR_CFG_SNAPSHOT_DIGEST_LEN 32 /* SHA-256 */
+#define TR_CFG_SNAPSHOT_HEADER_LEN (TR_CFG_SNAPSHOT_MAGIC_LEN + 4 + 4 + 8 + TR_CFG_SNAPSHOT_DIGEST_LEN)
+#define TR_CFG_SNAPSHOT_ABSENT 0xFFFFFFFF
+
+/* position in a snapshot payload being decoded */
+typedef struct tr_cfg_snapshot_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  int error; /* set on a truncated record or a bad value; later reads return nothing */
+} TR_CFG_SNAPSHOT_READER;
+
+/**
+ * Compute the SHA-256 of a file's contents
+ *
+ * @param file_with_path File to hash
+ * @param digest Output, TR_CFG_SNAPSHOT_DIGEST_LEN bytes
+ * @param file_status Output, status of the file that was hashed
+ * @return 0 on success, nonzero on error
+ */
+static int tr_cfg_snapshot_hash_file(const char *file_with_path,
+                                     unsigned char *digest,
+                                     struct stat *file_status)
+{
+  unsigned char buf[65536];
+  EVP_MD_CTX *sha=NULL;
+  ssize_t len=0;
+  int fd=-1;
+  int retval=1;
+
+  fd=open(file_with_path, O_RDONLY);
+  if (fd<0)
+    goto cleanup;
+  if (0!=fstat(fd, file_status))
+    goto cleanup;
+
+  sha=EVP_MD_CTX_create();
+  if ((sha==NULL) || (1!=EVP_DigestInit_ex(sha, EVP_sha256(), NULL)))
+    goto cleanup;
+  while (0!=(len=read(fd, buf, sizeof(buf)))) {
+    if (len<0) {
+      if (errno==EINTR)
+        continue;
+      goto cleanup;
+    }
+    EVP_DigestUpdate(sha, buf, len);
+  }
+  if (1==EVP_DigestFinal_ex(sha, digest, NULL))
+    retval=0;
+
+cleanup:
+  if (sha!=NULL)
+    EVP_MD_CTX_destroy(sha);
+  if (fd>=0)
+    close(fd);
+  return retval;
+}
+
+/* Write all of buf, returns 0 on success */
+static int tr_cfg_snapshot_write_all(int fd, const void *buf, size_t len)
+{
+  const char *p=buf;
+  ssize_t written=0;
+
+  while (len>0) {
+    written=write(fd, p, len);
+    if (written<0) {
+      if (errno==EINTR)
+        continue;
+      return 1;
+    }
+    p+=written;
+    len-=written;
+  }
+  return 0;
+}
+
+/*
+ * Encoders
+ */
+
+static void tr_cfg_snapshot_put_u32(GString *buf, uint32_t val)
+{
+  g_string_append_len(buf, (const gchar *)&val, sizeof(val));
+}
+
+static void tr_cfg_snapshot_put_i64(GString *buf, int64_t val)
+{
+  g_string_append_len(buf, (const gchar *)&val, sizeof(val));
+}
+
+static void tr_cfg_snapshot_put_str(GString *buf, const char *s, size_t len)
+{
+  if (s==NULL) {
+    tr_cfg_snapshot_put_u32(buf, TR_CFG_SNAPSHOT_ABSENT);
+    return;
+  }
+  tr_cfg_snapshot_put_u32(buf, len);
+  g_string_append_len(buf, s, len);
+}
+
+static void tr_cfg_snapshot_put_name(GString *buf, TR_NAME *name)
+{
+  if (name==NULL)
+    tr_cfg_snapshot_put_str(buf, NULL, 0);
+  else
+    tr_cfg_snapshot_put_str(buf, name->buf, name->len);
+}
+
+/* list of TR_NAMEs, e.g., GSS names or filter matches */
+static void tr_cfg_snapshot_put_name_list(GString *buf, TR_LIST *list)
+{
+  size_t ii=0;
+
+  tr_cfg_snapshot_put_u32(buf, tr_list_length(list));
+  for (ii=0; ii<tr_list_length(list); ii++)
+    tr_cfg_snapshot_put_name(buf, tr_list_index(list, ii));
+}
+
+static void tr_cfg_snapshot_put_gss_names(GString *buf, TR_GSS_NAMES *gss_names)
+{
+  tr_cfg_snapshot_put_u32(buf, gss_names!=NULL);
+  if (gss_names!=NULL)
+    tr_cfg_snapshot_put_name_list(buf, gss_names->names);
+}
+
+/* collect the patterns stored at node, its siblings and their descendants */
+static void tr_cfg_snapshot_wildcard_patterns(TR_WILDCARD_NODE *node, GPtrArray *patterns)
+{
+  for (; node!=NULL; node=node->sibling) {
+    if (node->suffix!=NULL)
+      g_ptr_array_add(patterns, node->suffix);
+    if (node->exact!=NULL)
+      g_ptr_array_add(patterns, node->exact);
+    tr_cfg_snapshot_wildcard_patterns(node->child, patterns);
+  }
+}
+
+static void tr_cfg_snapshot_put_wildcard_set(GString *buf, TR_WILDCARD_SET *set)
+{
+  GPtrArray *patterns=NULL;
+  guint ii=0;
+
+  tr_cfg_snapshot_put_u32(buf, set!=NULL);
+  if (set==NULL)
+    return;
+
+  patterns=g_ptr_array_new();
+  tr_cfg_snapshot_wildcard_patterns(&(set->root), patterns);
+  tr_cfg_snapshot_put_u32(buf, patterns->len);
+  for (ii=0; ii<patterns->len; ii++)
+    tr_cfg_snapshot_put_name(buf, g_ptr_array_index(patterns, ii));
+  g_ptr_array_free(patterns, TRUE);
+}
+
+static void tr_cfg_snapshot_put_apcs(GString *buf, TR_APC *apcs)
+{
+  TR_APC *apc=NULL;
+  uint32_t n_apcs=0;
+
+  for (apc=apcs; apc!=NULL; apc=apc->next)
+    n_apcs++;
+  tr_cfg_snapshot_put_u32(buf, n_apcs);
+  for (apc=apcs; apc!=NULL; apc=apc->next)
+    tr_cfg_snapshot_put_name(buf, tr_apc_get_id(apc));
+}
+
+static void tr_cfg_snapshot_put_aaa_servers(GString *buf, TR_AAA_SERVER *servers)
+{
+  TR_AAA_SERVER *aaa=NULL;
+  uint32_t n_servers=0;
+
+  for (aaa=servers; aaa!=NULL; aaa=aaa->next)
+    n_servers++;
+  tr_cfg_snapshot_put_u32(buf, n_servers);
+  for (aaa=servers; aaa!=NULL; aaa=aaa->next) {
+    tr_cfg_snapshot_put_name(buf, tr_aaa_server_get_hostname(aaa));
+    tr_cfg_snapshot_put_u32(buf, (uint32_t) tr_aaa_server_get_port(aaa));
+  }
+}
+
+static void tr_cfg_snapshot_put_constraint(GString *buf, TR_CONSTRAINT *cons)
+{
+  tr_cfg_snapshot_put_u32(buf, cons!=NULL);
+  if (cons==NULL)
+    return;
+  tr_cfg_snapshot_put_name(buf, cons->type);
+  tr_cfg_snapshot_put_name_list(buf, cons->matches);
+}
+
+static void tr_cfg_snapshot_put_filter_set(GString *buf, TR_FILTER_SET *set)
+{
+  TR_FILTER_SET *this=NULL;
+  TR_FILTER *filt=NULL;
+  TR_FLINE *fline=NULL;
+  TR_FSPEC *fspec=NULL;
+  uint32_t n_filters=0;
+  size_t ii=0, jj=0;
+
+  tr_cfg_snapshot_put_u32(buf, set!=NULL);
+  if (set==NULL)
+    return;
+
+  for (this=set; this!=NULL; this=this->next) {
+    if (this->this!=NULL)
+      n_filters++;
+  }
+  tr_cfg_snapshot_put_u32(buf, n_filters);
+
+  for (this=set; this!=NULL; this=this->next) {
+    filt=this->this;
+    if (filt==NULL)
+      continue;
+    tr_cfg_snapshot_put_u32(buf, tr_filter_get_type(filt));
+    tr_cfg_snapshot_put_u32(buf, tr_list_length(filt->lines));
+    for (ii=0; ii<tr_list_length(filt->lines); ii++) {
+      fline=tr_list_index(filt->lines, ii);
+      tr_cfg_snapshot_put_u32(buf, fline->action);
+      tr_cfg_snapshot_put_constraint(buf, fline->realm_cons);
+      tr_cfg_snapshot_put_constraint(buf, fline->domain_cons);
+      tr_cfg_snapshot_put_u32(buf, tr_list_length(fline->specs));
+      for (jj=0; jj<tr_list_length(fline->specs); jj++) {
+        fspec=tr_list_index(fline->specs, jj);
+        tr_cfg_snapshot_put_name(buf, fspec->field);
+        tr_cfg_snapshot_put_name_list(buf, fspec->match);
+      }
+    }
+  }
+}
+
+static void tr_cfg_snapshot_put_internal(GString *buf, TR_CFG_INTERNAL *internal)
+{
+  tr_cfg_snapshot_put_u32(buf, internal->max_tree_depth);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->tids_port);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->trps_port);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->mons_port);
+  tr_cfg_snapshot_put_str(buf,
+                          internal->hostname,
+                          (internal->hostname==NULL)?0:strlen(internal->hostname));
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->log_threshold);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->console_threshold);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->log_async);
+  tr_cfg_snapshot_put_u32(buf, internal->log_overflow);
+  tr_cfg_snapshot_put_u32(buf, internal->debug_sample_one_in);
+  tr_cfg_snapshot_put_gss_names(buf, internal->debug_sample_gss_names);
+  tr_cfg_snapshot_put_wildcard_set(buf, internal->debug_sample_realms);
+  tr_cfg_snapshot_put_u32(buf, internal->cfg_poll_interval);
+  tr_cfg_snapshot_put_u32(buf, internal->cfg_settling_time);
+  tr_cfg_snapshot_put_u32(buf, internal->trp_sweep_interval);
+  tr_cfg_snapshot_put_u32(buf, internal->trp_update_interval);
+  tr_cfg_snapshot_put_u32(buf, internal->trp_update_max_records);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->trp_update_delta);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->trp_event_transport);
+  tr_cfg_snapshot_put_u32(buf, (uint32_t) internal->trp_send_coalesce);
+  tr_cfg_snapshot_put_u32(buf, internal->trp_connect_interval);
+  tr_cfg_snapshot_put_u32(buf, internal->tid_req_timeout);
+  tr_cfg_snapshot_put_u32(buf, internal->tid_resp_numer);
+  tr_cfg_snapshot_put_u32(buf, internal->tid_resp_denom);
+  tr_cfg_snapshot_put_gss_names(buf, internal->monitoring_credentials);
+}
+
+static void tr_cfg_snapshot_put_rp_clients(GString *buf, TR_RP_CLIENT *rp_clients)
+{
+  TR_RP_CLIENT *client=NULL;
+  uint32_t n_clients=0;
+
+  for (client=rp_clients; client!=NULL; client=client->next)
+    n_clients++;
+  tr_cfg_snapshot_put_u32(buf, n_clients);
+  for (client=rp_clients; client!=NULL; client=client->next) {
+    tr_cfg_snapshot_put_gss_names(buf, client->gss_names);
+    tr_cfg_snapshot_put_filter_set(buf, client->filters);
+  }
+}
+
+static void tr_cfg_snapshot_put_peers(GString *buf, TRP_PTABLE *ptable)
+{
+  TRP_PEER *peer=NULL;
+  uint32_t n_peers=0;
+
+  for (peer=ptable->head; peer!=NULL; peer=peer->next)
+    n_peers++;
+  tr_cfg_snapshot_put_u32(buf, n_peers);
+  for (peer=ptable->head; peer!=NULL; peer=peer->next) {
+    tr_cfg_snapshot_put_str(buf, peer->server, (peer->server==NULL)?0:strlen(peer->server));
+    tr_cfg_snapshot_put_u32(buf, (uint32_t) trp_peer_get_port(peer));
+    tr_cfg_snapshot_put_u32(buf, trp_peer_get_linkcost(peer));
+    tr_cfg_snapshot_put_gss_names(buf, trp_peer_get_gss_names(peer));
+    tr_cfg_snapshot_put_filter_set(buf, peer->filters);
+  }
+}
+
+/**
+ * Encode a community table built from configuration files
+ *
+ * Memberships learned from peers (with a provenance or expiry) are not part of a
+ * configuration, so a table holding any is not encoded.
+ *
+ * @return 0 on success, nonzero if the table cannot be encoded
+ */
+static int tr_cfg_snapshot_put_ctable(GString *buf, TR_COMM_TABLE *ctab)
+{
+  GHashTable *positions=g_hash_table_new(g_direct_hash, g_direct_equal); /* realm or community -> position+1 */
+  TR_IDP_REALM *idp=NULL;
+  TR_RP_REALM *rp=NULL;
+  TR_COMM *comm=NULL;
+  TR_COMM_MEMB *memb=NULL;
+  uint32_t count=0;
+  int retval=1;
+
+  for (count=0, idp=ctab->idp_realms; idp!=NULL; idp=idp->next)
+    g_hash_table_insert(positions, idp, GUINT_TO_POINTER(++count));
+  tr_cfg_snapshot_put_u32(buf, count);
+  for (idp=ctab->idp_realms; idp!=NULL; idp=idp->next) {
+    tr_cfg_snapshot_put_name(buf, tr_idp_realm_get_id(idp));
+    tr_cfg_snapshot_put_u32(buf, (uint32_t) idp->shared_config);
+    tr_cfg_snapshot_put_u32(buf, idp->origin);
+    tr_cfg_snapshot_put_aaa_servers(buf, idp->aaa_servers);
+    tr_cfg_snapshot_put_apcs(buf, tr_idp_realm_get_apcs(idp));
+  }
+
+  for (count=0, rp=ctab->rp_realms; rp!=NULL; rp=rp->next)
+    g_hash_table_insert(positions, rp, GUINT_TO_POINTER(++count));
+  tr_cfg_snapshot_put_u32(buf, count);
+  for (rp=ctab->rp_realms; rp!=NULL; rp=rp->next)
+    tr_cfg_snapshot_put_name(buf, tr_rp_realm_get_id(rp));
+
+  for (count=0, comm=ctab->comms; comm!=NULL; comm=comm->next)
+    g_hash_table_insert(positions, comm, GUINT_TO_POINTER(++count));
+  tr_cfg_snapshot_put_u32(buf, count);
+  for (comm=ctab->comms; comm!=NULL; comm=comm->next) {
+    tr_cfg_snapshot_put_name(buf, tr_comm_get_id(comm));
+    tr_cfg_snapshot_put_u32(buf, tr_comm_get_type(comm));
+    tr_cfg_snapshot_put_apcs(buf, tr_comm_get_apcs(comm));
+    tr_cfg_snapshot_put_name(buf, tr_comm_get_owner_realm(comm));
+    tr_cfg_snapshot_put_name(buf, tr_comm_get_owner_contact(comm));
+    tr_cfg_snapshot_put_i64(buf, comm->expiration_interval);
+  }
+
+  for (count=0, memb=ctab->memberships; memb!=NULL; memb=memb->next) {
+    if ((memb->provenance!=NULL) || (memb->origin_next!=NULL)
+        || (memb->expiry->tv_sec!=0) || (memb->expiry->tv_nsec!=0)) {
+      tr_debug("tr_cfg_snapshot_put_ctable: Community table has memberships learned from peers.");
+      goto cleanup;
+    }
+    count++;
+  }
+  tr_cfg_snapshot_put_u32(buf, count);
+  for (memb=ctab->memberships; memb!=NULL; memb=memb->next) {
+    tr_cfg_snapshot_put_u32(buf, tr_comm_memb_get_role(memb));
+    if (memb->idp!=NULL)
+      tr_cfg_snapshot_put_u32(buf, GPOINTER_TO_UINT(g_hash_table_lookup(positions, memb->idp))-1);
+    else
+      tr_cfg_snapshot_put_u32(buf, GPOINTER_TO_UINT(g_hash_table_lookup(positions, memb->rp))-1);
+    tr_cfg_snapshot_put_u32(buf, GPOINTER_TO_UINT(g_hash_table_lookup(positions, memb->comm))-1);
+    tr_cfg_snapshot_put_u32(buf, tr_comm_memb_get_interval(memb));
+  }
+  retval=0;
+
+cleanup:
+  g_hash_table_destroy(positions);
+  return retval;
+}
+
+/*
+ * Decoders
+ *
+ * Each returns nothing useful once rd->error is set; callers check it after
+ * each record rather than after each field.
+ */
+
+static const unsigned char *tr_cfg_snapshot_get_bytes(TR_CFG_SNAPSHOT_READER *rd, size_t len)
+{
+  const unsigned char *p=rd->p;
+
+  if (rd->error || ((size_t)(rd->end - rd->p) < len)) {
+    rd->error=1;
+    return NULL;
+  }
+  rd->p+=len;
+  return p;
+}
+
+static uint32_t tr_cfg_snapshot_get_u32(TR_CFG_SNAPSHOT_READER *rd)
+{
+  const unsigned char *p=tr_cfg_snapshot_get_bytes(rd, sizeof(uint32_t));
+  uint32_t val=0;
+
+  if (p!=NULL)
+    memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+static int64_t tr_cfg_snapshot_get_i64(TR_CFG_SNAPSHOT_READER *rd)
+{
+  const unsigned char *p=tr_cfg_snapshot_get_bytes(rd, sizeof(int64_t));
+  int64_t val=0;
+
+  if (p!=NULL)
+    memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+/* Get a list length. Every item takes at least four bytes, so a corrupt count is
+ * caught before anything is allocated for it. */
+static uint32_t tr_cfg_snapshot_get_count(TR_CFG_SNAPSHOT_READER *rd)
+{
+  uint32_t count=tr_cfg_snapshot_get_u32(rd);
+
+  if (rd->error || (count > (size_t)(rd->end - rd->p)/4)) {
+    rd->error=1;
+    return 0;
+  }
+  return count;
+}
+
+/* Returns a pointer into the snapshot, not null terminated, or null if the string is missing */
+static const char *tr_cfg_snapshot_get_str(TR_CFG_SNAPSHOT_READER *rd, size_t *len)
+{
+  uint32_t str_len=tr_cfg_snapshot_get_u32(rd);
+
+  *len=0;
+  if (rd->error || (str_len==TR_CFG_SNAPSHOT_ABSENT))
+    return NULL;
+  *len=str_len;
+  return (const char *)tr_cfg_snapshot_get_bytes(rd, str_len);
+}
+
+/* Returns a new name, or null if it is missing */
+static TR_NAME *tr_cfg_snapshot_get_opt_name(TR_CFG_SNAPSHOT_READER *rd)
+{
+  const char *s=NULL;
+  size_t len=0;
+  TR_NAME *name=NULL;
+
+  s=tr_cfg_snapshot_get_str(rd, &len);
+  if (s==NULL)
+    return NULL;
+
+  name=malloc(sizeof(TR_NAME));
+  if (name!=NULL) {
+    name->buf=malloc(len+1);
+    if (name->buf==NULL) {
+      free(name);
+      name=NULL;
+    } else {
+      memcpy(name->buf, s, len);
+      name->buf[len]='\0';
+      name->len=(int) len;
+    }
+  }
+  if (name==NULL)
+    rd->error=1;
+  return name;
+}
+
+/* Returns a new name. A missing name is an error. */
+static TR_NAME *tr_cfg_snapshot_get_name(TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_NAME *name=tr_cfg_snapshot_get_opt_name(rd);
+
+  if (name==NULL)
+    rd->error=1;
+  return name;
+}
+
+static void tr_cfg_snapshot_get_name_list(TR_CFG_SNAPSHOT_READER *rd, TR_LIST *list)
+{
+  uint32_t count=tr_cfg_snapshot_get_count(rd);
+  TR_NAME *name=NULL;
+  uint32_t ii=0;
+
+  for (ii=0; (ii<count) && (!rd->error); ii++) {
+    name=tr_cfg_snapshot_get_name(rd);
+    if ((name!=NULL) && (NULL==tr_list_add(list, name, 0))) {
+      tr_free_name(name);
+      rd->error=1;
+    }
+  }
+}
+
+static TR_GSS_NAMES *tr_cfg_snapshot_get_gss_names(TALLOC_CTX *mem_ctx, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_GSS_NAMES *gss_names=NULL;
+
+  if (0==tr_cfg_snapshot_get_u32(rd))
+    return NULL;
+
+  gss_names=tr_gss_names_new(mem_ctx);
+  if (gss_names==NULL) {
+    rd->error=1;
+    return NULL;
+  }
+  tr_cfg_snapshot_get_name_list(rd, gss_names->names);
+  return gss_names;
+}
+
+static TR_WILDCARD_SET *tr_cfg_snapshot_get_wildcard_set(TALLOC_CTX *mem_ctx, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_WILDCARD_SET *set=NULL;
+  TR_NAME *pattern=NULL;
+  const char *s=NULL;
+  size_t len=0;
+  uint32_t count=0;
+  uint32_t ii=0;
+
+  if (0==tr_cfg_snapshot_get_u32(rd))
+    return NULL;
+
+  set=tr_wildcard_set_new(mem_ctx);
+  if (set==NULL) {
+    rd->error=1;
+    return NULL;
+  }
+  count=tr_cfg_snapshot_get_count(rd);
+  for (ii=0; (ii<count) && (!rd->error); ii++) {
+    s=tr_cfg_snapshot_get_str(rd, &len);
+    /* the set borrows its patterns, so keep them in its context */
+    pattern=talloc(set, TR_NAME);
+    if ((s==NULL) || (pattern==NULL)
+        || (NULL==(pattern->buf=talloc_strndup(pattern, s, len)))) {
+      rd->error=1;
+      break;
+    }
+    pattern->len=(int) strlen(pattern->buf);
+    if (0!=tr_wildcard_set_add(set, pattern))
+      rd->error=1;
+  }
+  return set;
+}
+
+static TR_APC *tr_cfg_snapshot_get_apcs(TALLOC_CTX *mem_ctx, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_APC *apcs=NULL;
+  TR_APC *tail=NULL;
+  TR_APC *apc=NULL;
+  uint32_t count=tr_cfg_snapshot_get_count(rd);
+  uint32_t ii=0;
+
+  for (ii=0; (ii<count) && (!rd->error); ii++) {
+    /* later entries belong to the head, as tr_apc_add() leaves them */
+    apc=tr_apc_new((apcs==NULL)?mem_ctx:apcs);
+    if (apc==NULL) {
+      rd->error=1;
+      break;
+    }
+    tr_apc_set_id(apc, tr_cfg_snapshot_get_name(rd));
+    if (apcs==NULL)
+      apcs=apc;
+    else
+      tail->next=apc;
+    tail=apc;
+  }
+  return apcs;
+}
+
+static TR_AAA_SERVER *tr_cfg_snapshot_get_aaa_servers(TALLOC_CTX *mem_ctx, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_AAA_SERVER *servers=NULL;
+  TR_AAA_SERVER *tail=NULL;
+  TR_AAA_SERVER *aaa=NULL;
+  uint32_t count=tr_cfg_snapshot_get_count(rd);
+  uint32_t ii=0;
+
+  for (ii=0; (ii<count) && (!rd->error); ii++) {
+    aaa=tr_aaa_server_new(mem_ctx);
+    if (aaa==NULL) {
+      rd->error=1;
+      break;
+    }
+    tr_aaa_server_set_hostname(aaa, tr_cfg_snapshot_get_name(rd));
+    tr_aaa_server_set_port(aaa, (int) tr_cfg_snapshot_get_u32(rd));
+    if (servers==NULL)
+      servers=aaa;
+    else
+      tail->next=aaa;
+    tail=aaa;
+  }
+  return servers;
+}
+
+static TR_CONSTRAINT *tr_cfg_snapshot_get_constraint(TALLOC_CTX *mem_ctx, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_CONSTRAINT *cons=NULL;
+
+  if (0==tr_cfg_snapshot_get_u32(rd))
+    return NULL;
+
+  cons=tr_constraint_new(mem_ctx);
+  if (cons==NULL) {
+    rd->error=1;
+    return NULL;
+  }
+  cons->type=tr_cfg_snapshot_get_name(rd);
+  tr_cfg_snapshot_get_name_list(rd, cons->matches);
+  return cons;
+}
+
+/* Decode a filter set. Filters are validated and compiled as they are added, as when parsed. */
+static TR_FILTER_SET *tr_cfg_snapshot_get_filter_set(TALLOC_CTX *mem_ctx, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_FILTER_SET *set=NULL;
+  TR_FILTER *filt=NULL;
+  TR_FLINE *fline=NULL;
+  TR_FSPEC *fspec=NULL;
+  uint32_t ftype=0;
+  uint32_t n_filters=0, n_lines=0, n_specs=0;
+  uint32_t ii=0, jj=0, kk=0;
+
+  if (0==tr_cfg_snapshot_get_u32(rd))
+    return NULL;
+
+  set=tr_filter_set_new(mem_ctx);
+  if (set==NULL) {
+    rd->error=1;
+    return NULL;
+  }
+
+  n_filters=tr_cfg_snapshot_get_count(rd);
+  for (ii=0; (ii<n_filters) && (!rd->error); ii++) {
+    filt=tr_filter_new(set);
+    ftype=tr_cfg_snapshot_get_u32(rd);
+    if ((filt==NULL) || (ftype>=TR_FILTER_TYPE_UNKNOWN)) {
+      rd->error=1;
+      break;
+    }
+    tr_filter_set_type(filt, (TR_FILTER_TYPE) ftype);
+
+    n_lines=tr_cfg_snapshot_get_count(rd);
+    for (jj=0; (jj<n_lines) && (!rd->error); jj++) {
+      fline=tr_fline_new(filt);
+      if (fline==NULL) {
+        rd->error=1;
+        break;
+      }
+      fline->action=(TR_FILTER_ACTION) tr_cfg_snapshot_get_u32(rd);
+      if ((fline->action!=TR_FILTER_ACTION_ACCEPT) && (fline->action!=TR_FILTER_ACTION_REJECT))
+        rd->error=1;
+      fline->realm_cons=tr_cfg_snapshot_get_constraint(fline, rd);
+      fline->domain_cons=tr_cfg_snapshot_get_constraint(fline, rd);
+
+      n_specs=tr_cfg_snapshot_get_count(rd);
+      for (kk=0; (kk<n_specs) && (!rd->error); kk++) {
+        fspec=tr_fspec_new(fline);
+        if (fspec==NULL) {
+          rd->error=1;
+          break;
+        }
+        fspec->field=tr_cfg_snapshot_get_name(rd);
+        tr_cfg_snapshot_get_name_list(rd, fspec->match);
+        if (rd->error
+            || (!tr_filter_validate_spec_field(filt->type, fspec))
+            || (NULL==tr_fline_add_spec(fline, fspec)))
+          rd->error=1;
+      }
+      if ((!rd->error) && (NULL==tr_filter_add_line(filt, fline)))
+        rd->error=1;
+    }
+
+    if ((!rd->error) && ((!tr_filter_validate(filt)) || (0!=tr_filter_set_add(set, filt))))
+      rd->error=1;
+  }
+  return set;
+}
+
+static void tr_cfg_snapshot_get_internal(TR_CFG *cfg, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_CFG_INTERNAL *internal=NULL;
+  const char *s=NULL;
+  size_t len=0;
+
+  internal=talloc_zero(cfg, TR_CFG_INTERNAL);
+  if (internal==NULL) {
+    rd->error=1;
+    return;
+  }
+  cfg->internal=internal;
+
+  internal->max_tree_depth=tr_cfg_snapshot_get_u32(rd);
+  internal->tids_port=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->trps_port=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->mons_port=(int) tr_cfg_snapshot_get_u32(rd);
+  s=tr_cfg_snapshot_get_str(rd, &len);
+  if (s!=NULL) {
+    internal->hostname=talloc_strndup(internal, s, len);
+    if (internal->hostname==NULL)
+      rd->error=1;
+  }
+  internal->log_threshold=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->console_threshold=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->log_async=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->log_overflow=(TR_LOG_OVERFLOW) tr_cfg_snapshot_get_u32(rd);
+  if ((internal->log_overflow!=TR_LOG_OVERFLOW_DROP)
+      && (internal->log_overflow!=TR_LOG_OVERFLOW_BLOCK)
+      && (internal->log_overflow!=TR_LOG_OVERFLOW_SYNC))
+    rd->error=1;
+  internal->debug_sample_one_in=tr_cfg_snapshot_get_u32(rd);
+  internal->debug_sample_gss_names=tr_cfg_snapshot_get_gss_names(internal, rd);
+  internal->debug_sample_realms=tr_cfg_snapshot_get_wildcard_set(internal, rd);
+  internal->cfg_poll_interval=tr_cfg_snapshot_get_u32(rd);
+  internal->cfg_settling_time=tr_cfg_snapshot_get_u32(rd);
+  internal->trp_sweep_interval=tr_cfg_snapshot_get_u32(rd);
+  internal->trp_update_interval=tr_cfg_snapshot_get_u32(rd);
+  internal->trp_update_max_records=tr_cfg_snapshot_get_u32(rd);
+  internal->trp_update_delta=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->trp_event_transport=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->trp_send_coalesce=(int) tr_cfg_snapshot_get_u32(rd);
+  internal->trp_connect_interval=tr_cfg_snapshot_get_u32(rd);
+  internal->tid_req_timeout=tr_cfg_snapshot_get_u32(rd);
+  internal->tid_resp_numer=tr_cfg_snapshot_get_u32(rd);
+  internal->tid_resp_denom=tr_cfg_snapshot_get_u32(rd);
+  internal->monitoring_credentials=tr_cfg_snapshot_get_gss_names(internal, rd);
+}
+
+static void tr_cfg_snapshot_get_rp_clients(TR_CFG *cfg, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TR_RP_CLIENT *tail=NULL;
+  TR_RP_CLIENT *client=NULL;
+  uint32_t count=tr_cfg_snapshot_get_count(rd);
+  uint32_t ii=0;
+
+  for (ii=0; (ii<count) && (!rd->error); ii++) {
+    /* later clients belong to the head, as tr_rp_client_add() leaves them */
+    client=tr_rp_client_new((cfg->rp_clients==NULL)?(TALLOC_CTX *)cfg:cfg->rp_clients);
+    if (client==NULL) {
+      rd->error=1;
+      break;
+    }
+    client->gss_names=tr_cfg_snapshot_get_gss_names(client, rd);
+    tr_rp_client_set_filters(client, tr_cfg_snapshot_get_filter_set(client, rd));
+    if (cfg->rp_clients==NULL)
+      cfg->rp_clients=client;
+    else
+      tail->next=client;
+    tail=client;
+  }
+}
+
+static void tr_cfg_snapshot_get_peers(TR_CFG *cfg, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TRP_PEER *tail=NULL;
+  TRP_PEER *peer=NULL;
+  char *server=NULL;
+  const char *s=NULL;
+  size_t len=0;
+  uint32_t count=tr_cfg_snapshot_get_count(rd);
+  uint32_t ii=0;
+
+  for (ii=0; (ii<count) && (!rd->error); ii++) {
+    peer=trp_peer_new(cfg->peers);
+    s=tr_cfg_snapshot_get_str(rd, &len);
+    if ((peer==NULL) || (s==NULL) || (NULL==(server=talloc_strndup(peer, s, len)))) {
+      rd->error=1;
+      break;
+    }
+    trp_peer_set_server(peer, server);
+    talloc_free(server);
+    if (trp_peer_get_server(peer)==NULL)
+      rd->error=1;
+    trp_peer_set_port(peer, (int) tr_cfg_snapshot_get_u32(rd));
+    trp_peer_set_linkcost(peer, tr_cfg_snapshot_get_u32(rd));
+    trp_peer_set_gss_names(peer, tr_cfg_snapshot_get_gss_names(peer, rd));
+    trp_peer_set_filters(peer, tr_cfg_snapshot_get_filter_set(peer, rd));
+
+    /* append as trp_ptable_add() does, without walking the list for each peer */
+    if (tail==NULL)
+      cfg->peers->head=peer;
+    else
+      tail->next=peer;
+    tail=peer;
+  }
+}
+
+/* Rebuild the community table, one pass over its realms, communities and memberships */
+static void tr_cfg_snapshot_get_ctable(TR_COMM_TABLE *ctab, TR_CFG_SNAPSHOT_READER *rd)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_IDP_REALM **idp_realms=NULL;
+  TR_RP_REALM **rp_realms=NULL;
+  TR_COMM **comms=NULL;
+  TR_IDP_REALM *idp=NULL;
+  TR_RP_REALM *rp=NULL;
+  TR_COMM *comm=NULL;
+  uint32_t n_idp_realms=0, n_rp_realms=0, n_comms=0, n_membs=0;
+  uint32_t role=0, realm_pos=0, comm_pos=0, interval=0;
+  uint32_t ii=0;
+
+  n_idp_realms=tr_cfg_snapshot_get_count(rd);
+  idp_realms=talloc_array(tmp_ctx, TR_IDP_REALM *, n_idp_realms);
+  if (idp_realms==NULL)
+    rd->error=1;
+  for (ii=0; (ii<n_idp_realms) && (!rd->error); ii++) {
+    idp=tr_idp_realm_new(tmp_ctx);
+    if (idp==NULL) {
+      rd->error=1;
+      break;
+    }
+    tr_idp_realm_set_id(idp, tr_cfg_snapshot_get_name(rd));
+    idp->shared_config=(int) tr_cfg_snapshot_get_u32(rd);
+    idp->origin=(TR_REALM_ORIGIN) tr_cfg_snapshot_get_u32(rd);
+    if (idp->origin>TR_REALM_DISCOVERED)
+      rd->error=1;
+    idp->aaa_servers=tr_cfg_snapshot_get_aaa_servers(idp, rd);
+    idp->apcs=tr_cfg_snapshot_get_apcs(idp, rd);
+    if (rd->error)
+      break;
+    tr_comm_table_add_idp_realm(ctab, idp);
+    idp_realms[ii]=idp;
+  }
+
+  n_rp_realms=tr_cfg_snapshot_get_count(rd);
+  rp_realms=talloc_array(tmp_ctx, TR_RP_REALM *, n_rp_realms);
+  if (rp_realms==NULL)
+    rd->error=1;
+  for (ii=0; (ii<n_rp_realms) && (!rd->error); ii++) {
+    rp=tr_rp_realm_new(tmp_ctx);
+    if (rp==NULL) {
+      rd->error=1;
+      break;
+    }
+    tr_rp_realm_set_id(rp, tr_cfg_snapshot_get_name(rd));
+    if (rd->error)
+      break;
+    tr_comm_table_add_rp_realm(ctab, rp);
+    rp_realms[ii]=rp;
+  }
+
+  n_comms=tr_cfg_snapshot_get_count(rd);
+  comms=talloc_array(tmp_ctx, TR_COMM *, n_comms);
+  if (comms==NULL)
+    rd->error=1;
+  for (ii=0; (ii<n_comms) && (!rd->error); ii++) {
+    comm=tr_comm_new(tmp_ctx);
+    if (comm==NULL) {
+      rd->error=1;
+      break;
+    }
+    tr_comm_set_id(comm, tr_cfg_snapshot_get_name(rd));
+    tr_comm_set_type(comm, (TR_COMM_TYPE) tr_cfg_snapshot_get_u32(rd));
+    if ((tr_comm_get_type(comm)!=TR_COMM_APC) && (tr_comm_get_type(comm)!=TR_COMM_COI))
+      rd->error=1;
+    tr_comm_set_apcs(comm, tr_cfg_snapshot_get_apcs(comm, rd));
+    tr_comm_set_owner_realm(comm, tr_cfg_snapshot_get_opt_name(rd));
+    tr_comm_set_owner_contact(comm, tr_cfg_snapshot_get_opt_name(rd));
+    comm->expiration_interval=(time_t) tr_cfg_snapshot_get_i64(rd);
+    if (rd->error || (0!=tr_comm_table_add_comm(ctab, comm))) {
+      rd->error=1;
+      break;
+    }
+    comms[ii]=comm;
+  }
+
+  n_membs=tr_cfg_snapshot_get_count(rd);
+  for (ii=0; (ii<n_membs) && (!rd->error); ii++) {
+    role=tr_cfg_snapshot_get_u32(rd);
+    realm_pos=tr_cfg_snapshot_get_u32(rd);
+    comm_pos=tr_cfg_snapshot_get_u32(rd);
+    interval=tr_cfg_snapshot_get_u32(rd);
+    if (rd->error || (comm_pos>=n_comms)) {
+      rd->error=1;
+      break;
+    }
+    if ((role==TR_ROLE_IDP) && (realm_pos<n_idp_realms))
+      tr_comm_add_idp_realm(ctab, comms[comm_pos], idp_realms[realm_pos], interval, NULL, NULL);
+    else if ((role==TR_ROLE_RP) && (realm_pos<n_rp_realms))
+      tr_comm_add_rp_realm(ctab, comms[comm_pos], rp_realms[realm_pos], interval, NULL, NULL);
+    else
+      rd->error=1;
+  }
+
+  talloc_free(tmp_ctx);
+}
+
+/**
+ * Write a snapshot of a newly parsed configuration
+ *
+ * Writes cfg_mgr->new, which must have been filled in by tr_parse_config(), so call
+ * this before tr_apply_new_config(). The snapshot is written to a temporary file and
+ * renamed into place, so a reader never sees a partial snapshot. Nothing is written
+ * if any file has changed since it was parsed.
+ *
+ * @param cfg_mgr Configuration manager
+ * @param snapshot_file Snapshot to write
+ * @return TR_CFG_SUCCESS on success, an error code otherwise
+ */
+TR_CFG_RC tr_cfg_write_snapshot(TR_CFG_MGR *cfg_mgr, const char *snapshot_file)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  GString *payload=g_string_new(NULL);
+  TR_CFG *cfg=NULL;
+  TR_CFG_FILE *this_file=NULL;
+  TR_CFG_JCACHE_ENTRY *entry=NULL;
+  unsigned char digest[TR_CFG_SNAPSHOT_DIGEST_LEN];
+  unsigned char header[TR_CFG_SNAPSHOT_HEADER_LEN];
+  struct stat file_status;
+  char *tmp_file=NULL;
+  uint32_t version=TR_CFG_SNAPSHOT_VERSION;
+  uint32_t n_files=0;
+  uint64_t payload_len=0;
+  unsigned int ii=0;
+  int fd=-1;
+  TR_CFG_RC rc=TR_CFG_ERROR;
+
+  if ((cfg_mgr==NULL) || (cfg_mgr->new==NULL) || (cfg_mgr->new->internal==NULL) || (snapshot_file==NULL)) {
+    rc=TR_CFG_BAD_PARAMS;
+    goto cleanup;
+  }
+  cfg=cfg_mgr->new;
+
+  /* the files, with the hashes of the contents that were parsed */
+  n_files=cfg->files->len;
+  for (ii=0; ii<n_files; ii++) {
+    this_file=&g_array_index(cfg->files, TR_CFG_FILE, ii);
+    if (0!=tr_cfg_snapshot_hash_file(this_file->name, digest, &file_status)) {
+      tr_debug("tr_cfg_write_snapshot: Unable to read %s.", this_file->name);
+      goto cleanup;
+    }
+    entry=g_hash_table_lookup(cfg_mgr->jcfg_cache, this_file->name);
+    if ((entry==NULL) || (!tr_cfg_jcache_entry_current(entry, &file_status))) {
+      tr_debug("tr_cfg_write_snapshot: %s changed since it was parsed.", this_file->name);
+      goto cleanup;
+    }
+    tr_cfg_snapshot_put_str(payload, this_file->name, strlen(this_file->name));
+    tr_cfg_snapshot_put_i64(payload, this_file->serial);
+    g_string_append_len(payload, (const gchar *)digest, TR_CFG_SNAPSHOT_DIGEST_LEN);
+  }
+
+  /* the configuration built from them */
+  tr_cfg_snapshot_put_internal(payload, cfg->internal);
+  tr_cfg_snapshot_put_rp_clients(payload, cfg->rp_clients);
+  tr_cfg_snapshot_put_peers(payload, cfg->peers);
+  tr_cfg_snapshot_put_aaa_servers(payload, cfg->default_servers);
+  if (0!=tr_cfg_snapshot_put_ctable(payload, cfg->ctable))
+    goto cleanup;
+
+  payload_len=payload->len;
+  memcpy(header, TR_CFG_SNAPSHOT_MAGIC, TR_CFG_SNAPSHOT_MAGIC_LEN);
+  memcpy(header+TR_CFG_SNAPSHOT_MAGIC_LEN, &version, 4);
+  memcpy(header+TR_CFG_SNAPSHOT_MAGIC_LEN+4, &n_files, 4);
+  memcpy(header+TR_CFG_SNAPSHOT_MAGIC_LEN+8, &payload_len, 8);
+  if (1!=EVP_Digest(payload->str, payload->len, header+TR_CFG_SNAPSHOT_MAGIC_LEN+16, NULL, EVP_sha256(), NULL))
+    goto cleanup;
+
+  tmp_file=talloc_asprintf(tmp_ctx, "%s.tmp", snapshot_file);
+  if (tmp_file==NULL) {
+    rc=TR_CFG_NOMEM;
+    goto cleanup;
+  }
+  fd=open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd<0) {
+    tr_err("tr_cfg_write_snapshot: Unable to create %s (%s).", tmp_file, strerror(errno));
+    goto cleanup;
+  }
+  if ((0!=tr_cfg_snapshot_write_all(fd, header, sizeof(header)))
+      || (0!=tr_cfg_snapshot_write_all(fd, payload->str, payload->len))
+      || (0!=fsync(fd))) {
+    tr_err("tr_cfg_write_snapshot: Error writing %s (%s).", tmp_file, strerror(errno));
+    unlink(tmp_file);
+    goto cleanup;
+  }
+  close(fd);
+  fd=-1;
+  if (0!=rename(tmp_file, snapshot_file)) {
+    tr_err("tr_cfg_write_snapshot: Unable to rename %s to %s (%s).", tmp_file, snapshot_file, strerror(errno));
+    unlink(tmp_file);
+    goto cleanup;
+  }
+
+  tr_debug("tr_cfg_write_snapshot: Wrote configuration from %u files to %s.", n_files, snapshot_file);
+  rc=TR_CFG_SUCCESS;
+
+cleanup:
+  if (fd>=0)
+    close(fd);
+  g_string_free(payload, TRUE);
+  talloc_free(tmp_ctx);
+  return rc;
+}
+
+/**
+ * Load a configuration snapshot
+ *
+ * If the snapshot is intact and was written from exactly these files, unchanged since,
+ * fills in cfg_mgr->new from it as tr_parse_config() would, without reading any JSON.
+ * Otherwise leaves cfg_mgr->new null, and the caller should parse the files.
+ *
+ * @param cfg_mgr Configuration manager
+ * @param snapshot_file Snapshot to load
+ * @param n_files Number of entries in files_with_paths
+ * @param files_with_paths Configuration files, with their paths
+ * @return TR_CFG_SUCCESS if cfg_mgr->new was loaded from the snapshot, an error code otherwise
+ */
+TR_CFG_RC tr_cfg_load_snapshot(TR_CFG_MGR *cfg_mgr,
+                               const char *snapshot_file,
+                               unsigned int n_files,
+                               char **files_with_paths)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  GHashTable *expected=NULL;
+  TR_CFG_SNAPSHOT_READER rd={0};
+  TR_CFG_FILE frec={0};
+  struct stat snapshot_status;
+  struct stat file_status;
+  unsigned char digest[TR_CFG_SNAPSHOT_DIGEST_LEN];
+  const unsigned char *base=MAP_FAILED;
+  const unsigned char *recorded=NULL;
+  const char *s=NULL;
+  size_t len=0;
+  char *name=NULL;
+  uint32_t version=0;
+  uint32_t snapshot_n_files=0;
+  uint64_t payload_len=0;
+  unsigned int ii=0;
+  int fd=-1;
+  TR_CFG_RC rc=TR_CFG_NOPARSE;
+
+  if ((cfg_mgr==NULL) || (snapshot_file==NULL) || (files_with_paths==NULL)) {
+    rc=TR_CFG_BAD_PARAMS;
+    goto cleanup;
+  }
+
+  /* start from nothing, as tr_parse_config() does */
+  if (cfg_mgr->new != NULL) {
+    tr_cfg_free(cfg_mgr->new);
+    cfg_mgr->new=NULL;
+  }
+
+  fd=open(snapshot_file, O_RDONLY);
+  if (fd<0) {
+    tr_info("tr_cfg_load_snapshot: Unable to open %s (%s).", snapshot_file, strerror(errno));
+    rc=TR_CFG_ERROR;
+    goto cleanup;
+  }
+  if ((0!=fstat(fd, &snapshot_status)) || (snapshot_status.st_size<TR_CFG_SNAPSHOT_HEADER_LEN)) {
+    tr_notice("tr_cfg_load_snapshot: %s is not a configuration snapshot.", snapshot_file);
+    goto cleanup;
+  }
+  base=mmap(NULL, snapshot_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base==MAP_FAILED) {
+    tr_err("tr_cfg_load_snapshot: Unable to map %s (%s).", snapshot_file, strerror(errno));
+    rc=TR_CFG_ERROR;
+    goto cleanup;
+  }
+
+  /* check the header and the payload checksum */
+  memcpy(&version, base+TR_CFG_SNAPSHOT_MAGIC_LEN, 4);
+  memcpy(&snapshot_n_files, base+TR_CFG_SNAPSHOT_MAGIC_LEN+4, 4);
+  memcpy(&payload_len, base+TR_CFG_SNAPSHOT_MAGIC_LEN+8, 8);
+  if ((0!=memcmp(base, TR_CFG_SNAPSHOT_MAGIC, TR_CFG_SNAPSHOT_MAGIC_LEN))
+      || (version!=TR_CFG_SNAPSHOT_VERSION)
+      || (payload_len!=snapshot_status.st_size-TR_CFG_SNAPSHOT_HEADER_LEN)) {
+    tr_notice("tr_cfg_load_snapshot: %s is not a version %d configuration snapshot.",
+              snapshot_file, TR_CFG_SNAPSHOT_VERSION);
+    goto cleanup;
+  }
+  rd.p=base+TR_CFG_SNAPSHOT_HEADER_LEN;
+  rd.end=rd.p+payload_len;
+  if ((1!=EVP_Digest(rd.p, payload_len, digest, NULL, EVP_sha256(), NULL))
+      || (0!=memcmp(digest, base+TR_CFG_SNAPSHOT_MAGIC_LEN+16, TR_CFG_SNAPSHOT_DIGEST_LEN))) {
+    tr_notice("tr_cfg_load_snapshot: Checksum mismatch, ignoring %s.", snapshot_file);
+    goto cleanup;
+  }
+
+  if (snapshot_n_files!=n_files) {
+    tr_notice("tr_cfg_load_snapshot: %s was written from %u configuration files, not %u.",
+              snapshot_file, snapshot_n_files, n_files);
+    goto cleanup;
+  }
+
+  cfg_mgr->new=tr_cfg_new(tmp_ctx); /* belongs to the temporary context for now */
+  if (cfg_mgr->new==NULL) {
+    rc=TR_CFG_NOMEM;
+    goto cleanup;
+  }
+
+  /* every file must be one of ours, with the contents it had when the snapshot was written */
+  expected=g_hash_table_new(g_str_hash, g_str_equal);
+  for (ii=0; ii<n_files; ii++)
+    g_hash_table_insert(expected, files_with_paths[ii], files_with_paths[ii]);
+  for (ii=0; ii<n_files; ii++) {
+    s=tr_cfg_snapshot_get_str(&rd, &len);
+    frec.serial=(json_int_t) tr_cfg_snapshot_get_i64(&rd);
+    recorded=tr_cfg_snapshot_get_bytes(&rd, TR_CFG_SNAPSHOT_DIGEST_LEN);
+    if ((s==NULL) || (recorded==NULL)) {
+      tr_notice("tr_cfg_load_snapshot: %s is truncated.", snapshot_file);
+      goto cleanup;
+    }
+    name=talloc_strndup(cfg_mgr->new, s, len);
+    if (name==NULL) {
+      rc=TR_CFG_NOMEM;
+      goto cleanup;
+    }
+    if (!g_hash_table_remove(expected, name)) {
+      tr_notice("tr_cfg_load_snapshot: %s is not among the configuration files, not using %s.",
+                name, snapshot_file);
+      goto cleanup;
+    }
+    if ((0!=tr_cfg_snapshot_hash_file(name, digest, &file_status))
+        || (0!=memcmp(digest, recorded, TR_CFG_SNAPSHOT_DIGEST_LEN))) {
+      tr_notice("tr_cfg_load_snapshot: %s changed since %s was written.", name, snapshot_file);
+      goto cleanup;
+    }
+    frec.name=name;
+    g_array_append_val(cfg_mgr->new->files, frec);
+  }
+
+  /* decode the configuration */
+  cfg_mgr->new->peers=trp_ptable_new(cfg_mgr); /* in the same context as tr_parse_config() uses */
+  if (cfg_mgr->new->peers==NULL) {
+    rc=TR_CFG_NOMEM;
+    goto cleanup;
+  }
+  tr_cfg_snapshot_get_internal(cfg_mgr->new, &rd);
+  tr_cfg_snapshot_get_rp_clients(cfg_mgr->new, &rd);
+  tr_cfg_snapshot_get_peers(cfg_mgr->new, &rd);
+  cfg_mgr->new->default_servers=tr_cfg_snapshot_get_aaa_servers(cfg_mgr->new, &rd);
+  tr_cfg_snapshot_get_ctable(cfg_mgr->new->ctable, &rd);
+  if (rd.error || (rd.p!=rd.end)) {
+    tr_notice("tr_cfg_load_snapshot: %s is corrupt.", snapshot_file);
+    goto cleanup;
+  }
+
+  /* the checks are cheap, so make them again */
+  if (TR_CFG_SUCCESS != tr_cfg_validate(cfg_mgr->new)) {
+    tr_err("tr_cfg_load_snapshot: Configuration in %s is not valid.", snapshot_file);
+    rc=TR_CFG_ERROR;
+    goto cleanup;
+  }
+
+  tr_notice("tr_cfg_load_snapshot: Loaded configuration from %s.", snapshot_file);
+  talloc_steal(cfg_mgr, cfg_mgr->new); /* hand this over to the cfg_mgr context */
+  rc=TR_CFG_SUCCESS;
+
+cleanup:
+  if ((rc!=TR_CFG_SUCCESS) && (cfg_mgr!=NULL) && (cfg_mgr->new!=NULL)) {
+    if (cfg_mgr->new->peers!=NULL)
+      trp_ptable_free(cfg_mgr->new->peers);
+    cfg_mgr->new=NULL; /* freed with tmp_ctx */
+  }
+  if (expected!=NULL)
+    g_hash_table_destroy(expected);
+  if (base!=MAP_FAILED)
+    munmap((void *)base, snapshot_status.st_size);
+  if (fd>=0)
+    close(fd);
+  talloc_free(tmp_ctx);
+  return rc;
+}
@@ -36,9 +36,11 @@
 #include "jansson_iterators.h"
 #endif
 #include <assert.h>
+#include <string.h>
 #include <talloc.h>
 
 #include <tr_filter.h>
+#include <tr_wildcard_set.h>
 #include <tid_internal.h>
 #include <tr_debug.h>
 #include <tr_constraint_internal.h>
@@ -306,88 +308,225 @@ TR_CONSTRAINT_SET *tr_constraint_set_filter(TID_REQ *request,
   return (TR_CONSTRAINT_SET *) new_cs;
 }
 
+/* List of constraint patterns, with a wildcard set indexing them. The
+ * patterns borrow their strings from the JSON constraint set. */
+typedef struct constraint_patterns {
+  TR_NAME *names;
+  size_t len;
+  TR_WILDCARD_SET *set;
+} CONSTRAINT_PATTERNS;
+
+static CONSTRAINT_PATTERNS *constraint_patterns_new(TALLOC_CTX *mem_ctx, size_t max_len)
+{
+  CONSTRAINT_PATTERNS *pats = talloc(mem_ctx, CONSTRAINT_PATTERNS);
+
+  if (pats == NULL)
+    return NULL;
+  pats->len = 0;
+  pats->set = NULL;
+  pats->names = talloc_array(pats, TR_NAME, (max_len > 0) ? max_len : 1);
+  if (pats->names == NULL) {
+    talloc_free(pats);
+    return NULL;
+  }
+  return pats;
+}
+
+/* (Re)build the wildcard set for the current list of patterns */
+static int constraint_patterns_index(CONSTRAINT_PATTERNS *pats)
+{
+  size_t ii;
+
+  tr_wildcard_set_free(pats->set);
+  pats->set = tr_wildcard_set_new(pats);
+  if (pats->set == NULL)
+    return 1;
+  for (ii = 0; ii < pats->len; ii++) {
+    if (0 != tr_wildcard_set_add(pats->set, pats->names + ii))
+      return 1;
+  }
+  return 0;
+}
+
 /**
- * Within a given constraint object merge any overlapping domain or
- * realm constraints.  For example ['*','*.net'] can be simplified to
- * ['*']
+ * Build the pattern list for one constraint, merging any overlapping
+ * patterns. For example ['*','*.net'] is simplified to ['*']. Surviving
+ * patterns keep their order.
+ *
+ * The wildcard set prefers the broadest matching pattern, and keeps the
+ * first of any duplicates, so a pattern survives exactly when looking up
+ * its own text finds it.
  */
-static void merge_constraints(json_t *constraint, const char *key)
+static CONSTRAINT_PATTERNS *constraint_patterns_from_json(TALLOC_CTX *mem_ctx, json_t *matches)
 {
-  json_t *value_1, *value_2, *constraint_array;
-  size_t index_1, index_2;
-  /*
-   * Go through the loop pairwise linear, removing elements where one
-   * element is a subset of the other.  Always shrik the array from
-   * the end so that index_1 never becomes invalid (swapping if
-   * needed).
-   */
-  constraint_array = json_object_get(constraint, key);
-  if (NULL == constraint_array)
-    return;
-  json_array_foreach(constraint_array, index_1, value_1)json_array_foreach(constraint_array, index_2, value_2) {
-      if (index_2 <= index_1)
-        continue;
-      if (tr_prefix_wildcard_match(json_string_value(value_2),
-                                   json_string_value(value_1))) {
-        json_array_remove(constraint_array, index_2);
-        index_2--;
-      } else if (tr_prefix_wildcard_match(json_string_value(value_1),
-                                          json_string_value(value_2))) {
-        json_array_set(constraint_array, index_1, value_2);
-        json_array_remove(constraint_array, index_2);
-        index_2--;
-      }
+  TALLOC_CTX *tmp_ctx = talloc_new(NULL);
+  CONSTRAINT_PATTERNS *all = NULL;
+  CONSTRAINT_PATTERNS *pats = NULL;
+  TR_NAME *found = NULL;
+  json_t *value;
+  size_t index;
+
+  all = constraint_patterns_new(tmp_ctx, json_array_size(matches));
+  if (all == NULL)
+    goto cleanup;
+  json_array_foreach(matches, index, value) {
+    all->names[index].buf = (char *) json_string_value(value);
+    all->names[index].len = (int) strlen(all->names[index].buf);
+  }
+  all->len = json_array_size(matches);
+  if (0 != constraint_patterns_index(all))
+    goto cleanup;
+
+  pats = constraint_patterns_new(tmp_ctx, all->len);
+  if (pats == NULL)
+    goto cleanup;
+  for (index = 0; index < all->len; index++) {
+    found = tr_wildcard_set_find_name(all->set, all->names + index);
+    if ((found == NULL) || (found == all->names + index))
+      pats->names[pats->len++] = all->names[index];
+  }
+  if (0 != constraint_patterns_index(pats)) {
+    pats = NULL;
+    goto cleanup;
+  }
+  talloc_steal(mem_ctx, pats);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return pats;
+}
+
+/**
+ * Intersect two merged pattern lists
+ *
+ * A pattern of #result covered by #cons is kept. Otherwise it is replaced
+ * by the patterns of #cons that it covers, if any. Each pattern is looked
+ * up once in the other list's wildcard set, so this is linear in the total
+ * length of the patterns. Because both lists are merged, each pattern of
+ * #cons is covered by at most one pattern of #result, and the output is
+ * merged as well.
+ */
+static CONSTRAINT_PATTERNS *constraint_patterns_intersect(TALLOC_CTX *mem_ctx,
+                                                          CONSTRAINT_PATTERNS *result,
+                                                          CONSTRAINT_PATTERNS *cons)
+{
+  TALLOC_CTX *tmp_ctx = talloc_new(NULL);
+  CONSTRAINT_PATTERNS *out = NULL;
+  size_t *first = NULL; /* for each result pattern, index into covered[] of its first covered pattern */
+  size_t *covered = NULL; /* indices into cons, grouped by the result pattern covering them */
+  size_t *owner = NULL;
+  TR_NAME *found = NULL;
+  size_t ii, jj;
+
+  first = talloc_zero_array(tmp_ctx, size_t, result->len + 1);
+  covered = talloc_array(tmp_ctx, size_t, cons->len + 1);
+  owner = talloc_array(tmp_ctx, size_t, cons->len + 1);
+  if ((first == NULL) || (covered == NULL) || (owner == NULL))
+    goto cleanup;
+
+  /* group the patterns of cons by the result pattern that covers them */
+  for (jj = 0; jj < cons->len; jj++) {
+    found = tr_wildcard_set_find_name(result->set, cons->names + jj);
+    owner[jj] = (found == NULL) ? result->len : (size_t) (found - result->names);
+    if (owner[jj] < result->len)
+      first[owner[jj] + 1]++;
+  }
+  for (ii = 0; ii < result->len; ii++)
+    first[ii + 1] += first[ii];
+  for (jj = 0; jj < cons->len; jj++) {
+    if (owner[jj] < result->len)
+      covered[first[owner[jj]]++] = jj;
+  }
+  /* the fill advanced each start to the next group's start; shift back */
+  for (ii = result->len; ii > 0; ii--)
+    first[ii] = first[ii - 1];
+  first[0] = 0;
+
+  out = constraint_patterns_new(tmp_ctx, result->len + cons->len);
+  if (out == NULL)
+    goto cleanup;
+  for (ii = 0; ii < result->len; ii++) {
+    if (tr_wildcard_set_find_name(cons->set, result->names + ii) != NULL)
+      out->names[out->len++] = result->names[ii];
+    else {
+      for (jj = first[ii]; jj < first[ii + 1]; jj++)
+        out->names[out->len++] = cons->names[covered[jj]];
+    }
+  }
+  if (0 != constraint_patterns_index(out)) {
+    out = NULL;
+    goto cleanup;
+  }
+  talloc_steal(mem_ctx, out);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return out;
+}
+
+static json_t *constraint_patterns_to_json(CONSTRAINT_PATTERNS *pats)
+{
+  json_t *jarray = json_array();
+  size_t ii;
+
+  if (jarray == NULL)
+    return NULL;
+  for (ii = 0; ii < pats->len; ii++) {
+    if (0 != json_array_append_new(jarray, tr_name_to_json_string(pats->names + ii))) {
+      json_decref(jarray);
+      return NULL;
     }
+  }
+  return jarray;
 }
 
 /**
  * Returns an array of constraint strings that is the intersection of
  * all constraints in the constraint_set of type #type
+ *
+ * The constraint set itself is not modified.
  */
 static json_t *constraint_intersect_internal(TR_CONSTRAINT_SET *constraints,
                                              const char *constraint_type)
 {
-  json_t *constraint, *result = NULL;
+  TALLOC_CTX *tmp_ctx = talloc_new(NULL);
+  CONSTRAINT_PATTERNS *result = NULL;
+  CONSTRAINT_PATTERNS *pats = NULL;
+  json_t *constraint, *matches;
+  json_t *jresult = NULL;
   size_t i;
+
   json_array_foreach((json_t *) constraints, i, constraint) {
-    merge_constraints(constraint, constraint_type);
-    if (NULL == result) {
-      result = json_object_get(constraint, constraint_type);
-      if (NULL != result)
-        result = json_copy(result);
-    } else {
-      json_t *intersect, *value_1, *value_2;
-      size_t index_1, index_2;
-      intersect = json_object_get(constraint, constraint_type);
-      /*If an element of the constraint set doesn't have a particular
-       * constraint type, we ignore that element of the constraint set.
-       * However, if no element of the constraint set has a particular
-       *     constraint type we return empty (no access) rather than universal
-       * access.*/
-      if (!intersect)
-        continue;
-      result_loop:
-      json_array_foreach(result, index_1, value_1) {
-        json_array_foreach(intersect, index_2, value_2) {
-          if (tr_prefix_wildcard_match(json_string_value(value_1),
-                                       json_string_value(value_2)))
-            goto result_acceptable;
-          else if (tr_prefix_wildcard_match(json_string_value(value_2),
-                                            json_string_value(value_1))) {
-            json_array_set(result, index_1, value_2);
-            goto result_acceptable;
-          }
-        }
-        json_array_remove(result, index_1);
-        if (index_1 == 0)
-          goto result_loop;
-        index_1--;
-        result_acceptable:
-        continue;
-      }
+    /*If an element of the constraint set doesn't have a particular
+     * constraint type, we ignore that element of the constraint set.
+     * However, if no element of the constraint set has a particular
+     *     constraint type we return empty (no access) rather than universal
+     * access.*/
+    matches = json_object_get(constraint, constraint_type);
+    if (matches == NULL)
+      continue;
+    pats = constraint_patterns_from_json(tmp_ctx, matches);
+    if (pats == NULL)
+      goto fail;
+    if (result != NULL) {
+      pats = constraint_patterns_intersect(tmp_ctx, result, pats);
+      if (pats == NULL)
+        goto fail;
     }
+    result = pats;
   }
-  return result;
+  if (result != NULL) {
+    jresult = constraint_patterns_to_json(result);
+    if (jresult == NULL)
+      goto fail;
+  }
+  talloc_free(tmp_ctx);
+  return jresult;
+
+fail:
+  tr_err("constraint_intersect_internal: unable to intersect %s constraints.", constraint_type);
+  talloc_free(tmp_ctx);
+  return NULL;
 }
 
 /**
@@ -33,7 +33,11 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
 #include <tr_debug.h>
 #include <tid_internal.h>
 
@@ -52,37 +56,538 @@ static int log_opened = 0;
 /* We'll be noisy until overriden */
 static int log_threshold = LOG_DEBUG;
 static int console_threshold = LOG_DEBUG;
+int tr_log_max_sev = LOG_DEBUG;
+int tr_log_sampling = 0;
 
-static void vfire_log(const int sev, const int facility, const char *fmt, va_list ap) {
+/* Nonzero while this thread handles a request sampled for debug logging */
+static __thread int log_sampled = 0;
 
-   /* if we want to use ap twice, we need to duplicate it before the first use */
-   va_list ap_copy;
-   va_copy(ap_copy, ap);
+/* Each thread formats syslog messages into its own buffer, allocated on first use */
+static pthread_once_t log_buf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_buf_key;
+static int log_buf_key_ok = 0;
 
-  /* write messages to stderr if they are more severe than the threshold and are not audit messages */
-  if ((sev <= console_threshold) && (facility != AUDIT_FACILITY)) {
+static void log_buf_key_init(void)
+{
+  log_buf_key_ok = (0 == pthread_key_create(&log_buf_key, free));
+}
 
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+static char *log_buf_get(void)
+{
+  char *buf = NULL;
+
+  pthread_once(&log_buf_once, log_buf_key_init);
+  if (!log_buf_key_ok)
+    return NULL;
+
+  buf = pthread_getspecific(log_buf_key);
+  if (buf == NULL) {
+    buf = malloc(LOG_MAX_MESSAGE_SIZE);
+    if ((buf != NULL) && (0 != pthread_setspecific(log_buf_key, buf))) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  return buf;
+}
+
+static void update_max_sev(void)
+{
+  tr_log_max_sev = (log_threshold > console_threshold) ? log_threshold : console_threshold;
+}
+
+/* Write a formatted message to the selected outputs */
+static void write_log(const int sev, const int facility, int to_console, int to_syslog, const char *msg)
+{
+  if (to_console)
+    fprintf(stderr, "%s\n", msg);
+
+  /* syslog.h provides a macro for generating priorities, however in versions of glibc < 2.17 it is
+     broken if you use it as documented: https://sourceware.org/bugzilla/show_bug.cgi?id=14347
+     RHEL6 uses glibc 2.12, so do not use LOG_MAKEPRI until around 2020.
+  */
+  if (to_syslog)
+    syslog((facility|sev), "%s", msg);
+}
+
+/*
+ * Asynchronous logging
+ *
+ * Each logging thread owns a single-producer, single-consumer byte ring. The
+ * thread copies formatted records into its ring and publishes them by advancing
+ * head; the log thread writes them out and advances tail. Neither side takes a
+ * lock except when a ring is created or released, or to wake the other: the log
+ * thread sleeps on log_wake_cond once every ring is empty, and producers with the
+ * "block" overflow policy sleep on log_space_cond until their ring has room.
+ */
+
+#define LOG_RING_SIZE 65536 /* bytes per thread, power of 2 */
+#define LOG_REC_ALIGN 16
+#define LOG_REC_PAD (-1) /* sev of a record that skips to the start of the ring */
+
+typedef struct log_rec_hdr {
+  unsigned int len; /* bytes in the record, including this header and padding */
+  int sev;
+  int facility;
+  unsigned char to_console;
+  unsigned char to_syslog;
+} LOG_REC_HDR;
+
+typedef struct log_ring {
+  struct log_ring *next;
+  size_t head; /* bytes ever written, only changed by the owning thread */
+  size_t tail; /* bytes ever consumed, only changed by the log thread */
+  int released; /* owning thread has exited */
+  char buf[LOG_RING_SIZE];
+} LOG_RING;
+
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static int log_ring_key_ok = 0;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LOG_RING *log_rings = NULL; /* all rings, protected by log_rings_mutex */
+
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER; /* log thread waits here when idle */
+static pthread_cond_t log_space_cond = PTHREAD_COND_INITIALIZER; /* blocked producers wait here */
+static int log_thread_idle = 0; /* log thread is waiting, or about to wait, on log_wake_cond */
+static int log_n_blocked = 0; /* producers waiting on log_space_cond */
+static int log_n_putting = 0; /* producers that may still queue records */
+
+static pthread_t log_thread;
+static int log_async = 0; /* records go to the rings while nonzero */
+static int log_async_restart = 0; /* restart the log thread on the next message (set in a forked child) */
+static int log_thread_stop = 0;
+static TR_LOG_OVERFLOW log_overflow = TR_LOG_OVERFLOW_DROP;
+static unsigned long log_dropped = 0; /* not yet reported */
+static unsigned long log_dropped_total = 0;
+
+static size_t log_rec_len(size_t msg_len)
+{
+  size_t len = sizeof(LOG_REC_HDR) + msg_len + 1;
+  return (len + LOG_REC_ALIGN - 1) & ~((size_t) LOG_REC_ALIGN - 1);
+}
+
+static void log_ring_release(void *arg)
+{
+  LOG_RING *ring = (LOG_RING *) arg;
+  __atomic_store_n(&(ring->released), 1, __ATOMIC_RELEASE);
+}
+
+/* The log thread is not copied by fork(). Records queued before the fork are the
+ * parent's to write, so discard them here, and start a new log thread in the child
+ * when it next logs. Only the forking thread survives, so the other rings can go. */
+static void log_async_atfork_child(void)
+{
+  LOG_RING *mine = log_ring_key_ok ? pthread_getspecific(log_ring_key) : NULL;
+  LOG_RING *ring = NULL;
+
+  pthread_mutex_init(&log_rings_mutex, NULL);
+  pthread_mutex_init(&log_wake_mutex, NULL);
+  pthread_cond_init(&log_wake_cond, NULL);
+  pthread_cond_init(&log_space_cond, NULL);
+  log_thread_idle = 0;
+  log_n_blocked = 0;
+  log_n_putting = 0;
+  log_thread_stop = 0;
+
+  for (ring = log_rings; ring != NULL; ring = ring->next) {
+    ring->tail = ring->head;
+    if (ring != mine)
+      ring->released = 1;
+  }
+
+  if (log_async) {
+    log_async = 0;
+    log_async_restart = 1;
+  }
+}
+
+static void log_ring_key_init(void)
+{
+  log_ring_key_ok = (0 == pthread_key_create(&log_ring_key, log_ring_release));
+  pthread_atfork(NULL, NULL, log_async_atfork_child);
+}
+
+static LOG_RING *log_ring_get(void)
+{
+  LOG_RING *ring = NULL;
+
+  pthread_once(&log_ring_once, log_ring_key_init);
+  if (!log_ring_key_ok)
+    return NULL;
+
+  ring = pthread_getspecific(log_ring_key);
+  if (ring == NULL) {
+    ring = malloc(sizeof(LOG_RING));
+    if (ring == NULL)
+      return NULL;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->released = 0;
+    if (0 != pthread_setspecific(log_ring_key, ring)) {
+      free(ring);
+      return NULL;
+    }
+    pthread_mutex_lock(&log_rings_mutex);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_rings_mutex);
+  }
+  return ring;
+}
+
+/* Wake the log thread if it is waiting for records. Call after publishing one. */
+static void log_thread_wake(void)
+{
+  /* Pairs with the fence in log_thread_main(): either it sees our record, or we see it idle */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&log_thread_idle, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&log_wake_mutex);
+    pthread_cond_signal(&log_wake_cond);
+    pthread_mutex_unlock(&log_wake_mutex);
+  }
+}
+
+/* Try to copy a record into the ring. Returns 0 on success, nonzero if it does not fit. */
+static int log_ring_put(LOG_RING *ring, int sev, int facility, int to_console, int to_syslog,
+                        const char *msg, size_t msg_len)
+{
+  size_t rec_len = log_rec_len(msg_len);
+  size_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+  size_t head = ring->head;
+  size_t offset = head & (LOG_RING_SIZE - 1);
+  size_t to_end = LOG_RING_SIZE - offset;
+  size_t needed = rec_len;
+  LOG_REC_HDR *hdr = NULL;
+
+  if (to_end < rec_len)
+    needed += to_end; /* skip the end of the ring and write at the start */
+  if (LOG_RING_SIZE - (head - tail) < needed)
+    return 1;
+
+  if (to_end < rec_len) {
+    hdr = (LOG_REC_HDR *) (ring->buf + offset);
+    hdr->len = (unsigned int) to_end;
+    hdr->sev = LOG_REC_PAD;
+    head += to_end;
+    offset = 0;
+  }
+  hdr = (LOG_REC_HDR *) (ring->buf + offset);
+  hdr->len = (unsigned int) rec_len;
+  hdr->sev = sev;
+  hdr->facility = facility;
+  hdr->to_console = (unsigned char) to_console;
+  hdr->to_syslog = (unsigned char) to_syslog;
+  memcpy(ring->buf + offset + sizeof(LOG_REC_HDR), msg, msg_len);
+  ring->buf[offset + sizeof(LOG_REC_HDR) + msg_len] = '\0';
+  __atomic_store_n(&(ring->head), head + rec_len, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Queue a formatted message for the log thread
+ *
+ * When the thread's ring is full, the overflow policy decides what happens. Audit
+ * messages are never dropped; if they cannot be queued they are written directly.
+ *
+ * @return 1 if the message was queued or dropped, 0 if the caller must write it
+ */
+static int log_async_put(int sev, int facility, int to_console, int to_syslog, const char *msg, size_t msg_len)
+{
+  LOG_RING *ring = log_ring_get();
+  int queued = 0;
+  int rc = 0;
+
+  if ((ring == NULL) || (log_rec_len(msg_len) > LOG_RING_SIZE / 2))
+    return 0;
+
+  /* Register before checking log_async, so tr_log_async_stop() waits for us to finish */
+  __atomic_add_fetch(&log_n_putting, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&log_async, __ATOMIC_SEQ_CST))
+    goto cleanup;
+
+  if (0 == log_ring_put(ring, sev, facility, to_console, to_syslog, msg, msg_len)) {
+    queued = 1;
+    rc = 1;
+    goto cleanup;
   }
 
-  /* write messages to syslog if they are more severe than the threshold or are audit messages */
-  if (sev <= log_threshold || (facility == AUDIT_FACILITY)) {
+  switch (__atomic_load_n(&log_overflow, __ATOMIC_RELAXED)) {
+    case TR_LOG_OVERFLOW_BLOCK:
+      pthread_mutex_lock(&log_wake_mutex);
+      __atomic_add_fetch(&log_n_blocked, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&log_async, __ATOMIC_SEQ_CST)) {
+        if (0 == log_ring_put(ring, sev, facility, to_console, to_syslog, msg, msg_len)) {
+          queued = 1;
+          rc = 1;
+          break;
+        }
+        pthread_cond_signal(&log_wake_cond); /* the ring is full, so there is work */
+        pthread_cond_wait(&log_space_cond, &log_wake_mutex);
+      }
+      __atomic_sub_fetch(&log_n_blocked, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&log_wake_mutex);
+      break; /* if stopped while waiting, the caller writes it */
+
+    case TR_LOG_OVERFLOW_SYNC:
+      break;
+
+    case TR_LOG_OVERFLOW_DROP:
+    default:
+      if (facility == AUDIT_FACILITY)
+        break;
+      __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&log_dropped_total, 1, __ATOMIC_RELAXED);
+      rc = 1;
+      break;
+  }
 
-    /* Make sure that the message will fit, truncate if necessary */
-    char *buf = malloc(LOG_MAX_MESSAGE_SIZE);
-    vsnprintf(buf, LOG_MAX_MESSAGE_SIZE, fmt, ap_copy);
+cleanup:
+  __atomic_sub_fetch(&log_n_putting, 1, __ATOMIC_SEQ_CST);
+  if (queued)
+    log_thread_wake();
+  return rc;
+}
 
-    /* syslog.h provides a macro for generating priorities, however in versions of glibc < 2.17 it is
-       broken if you use it as documented: https://sourceware.org/bugzilla/show_bug.cgi?id=14347
-       RHEL6 uses glibc 2.12, so do not use LOG_MAKEPRI until around 2020.
-    */
-    syslog((facility|sev), "%s", buf);
+/* Write out everything queued in one ring. Returns the number of records written. */
+static int log_ring_drain(LOG_RING *ring)
+{
+  size_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+  size_t tail = ring->tail;
+  LOG_REC_HDR *hdr = NULL;
+  int n = 0;
+
+  while (tail != head) {
+    hdr = (LOG_REC_HDR *) (ring->buf + (tail & (LOG_RING_SIZE - 1)));
+    if (hdr->sev != LOG_REC_PAD) {
+      write_log(hdr->sev, hdr->facility, hdr->to_console, hdr->to_syslog, (char *) (hdr + 1));
+      n++;
+    }
+    tail += hdr->len;
+  }
+  __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+  return n;
+}
 
-    free(buf);
+/* Drain every ring once, freeing rings whose threads have exited. Returns the number of records written. */
+static int log_rings_drain(void)
+{
+  LOG_RING **link = NULL;
+  LOG_RING *ring = NULL;
+  unsigned long dropped = 0;
+  int n = 0;
+
+  pthread_mutex_lock(&log_rings_mutex);
+  link = &log_rings;
+  while (NULL != (ring = *link)) {
+    if (__atomic_load_n(&(ring->released), __ATOMIC_ACQUIRE)) {
+      /* the thread has exited, so nothing more will be written */
+      n += log_ring_drain(ring);
+      *link = ring->next;
+      free(ring);
+    } else {
+      n += log_ring_drain(ring);
+      link = &(ring->next);
+    }
+  }
+  pthread_mutex_unlock(&log_rings_mutex);
+
+  dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    char msg[80];
+    snprintf(msg, sizeof(msg), "tr_log: %lu log messages dropped, queue full.", dropped);
+    write_log(LOG_WARNING, LOG_FACILITY,
+              LOG_WARNING <= console_threshold, LOG_WARNING <= log_threshold, msg);
   }
+  return n;
+}
 
-  va_end(ap_copy);
+/* Nonzero if any ring has records waiting */
+static int log_rings_pending(void)
+{
+  LOG_RING *ring = NULL;
+  int pending = 0;
+
+  pthread_mutex_lock(&log_rings_mutex);
+  for (ring = log_rings; (ring != NULL) && (!pending); ring = ring->next)
+    pending = (__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) != ring->tail);
+  pthread_mutex_unlock(&log_rings_mutex);
+  return pending;
+}
+
+static void *log_thread_main(void *arg)
+{
+  while (!__atomic_load_n(&log_thread_stop, __ATOMIC_ACQUIRE)) {
+    if (0 < log_rings_drain()) {
+      /* Pairs with the increment in log_async_put(): either a blocked producer sees the
+       * space we made, or we see it waiting */
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&log_n_blocked, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&log_wake_mutex);
+        pthread_cond_broadcast(&log_space_cond);
+        pthread_mutex_unlock(&log_wake_mutex);
+      }
+      continue;
+    }
+
+    /* Nothing written, so wait until a producer publishes a record or we are stopped.
+     * Check again after announcing that we are idle in case a record arrived meanwhile. */
+    pthread_mutex_lock(&log_wake_mutex);
+    __atomic_store_n(&log_thread_idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((!__atomic_load_n(&log_thread_stop, __ATOMIC_ACQUIRE)) && (!log_rings_pending()))
+      pthread_cond_wait(&log_wake_cond, &log_wake_mutex);
+    __atomic_store_n(&log_thread_idle, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_wake_mutex);
+  }
+  log_rings_drain(); /* anything queued before we were stopped */
+  return NULL;
+}
+
+static void log_async_atexit(void)
+{
+  tr_log_async_stop();
+}
+
+/**
+ * Start writing log messages from a separate thread
+ *
+ * Calling threads format their messages and queue them; the log thread writes them
+ * to stderr and syslog. If already started, only the overflow policy is changed.
+ * Queued messages are written at exit. A process forked while this is running
+ * starts its own log thread when it first logs.
+ *
+ * @param overflow What to do with a message when the calling thread's queue is full
+ * @return 0 on success, nonzero on error (messages are then written synchronously)
+ */
+int tr_log_async_start(TR_LOG_OVERFLOW overflow)
+{
+  static int atexit_registered = 0;
+
+  __atomic_store_n(&log_overflow, overflow, __ATOMIC_RELAXED);
+  if (log_async)
+    return 0;
+
+  pthread_once(&log_ring_once, log_ring_key_init);
+  if (!log_ring_key_ok)
+    return 1;
+
+  log_thread_stop = 0;
+  if (0 != pthread_create(&log_thread, NULL, log_thread_main, NULL))
+    return 1;
+  if (!atexit_registered)
+    atexit_registered = (0 == atexit(log_async_atexit));
+  __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Stop the log thread after it writes any queued messages
+ *
+ * New messages are written synchronously from here on. Producers already queueing
+ * a message are allowed to finish first, so the log thread's final drain sees
+ * everything that was queued. Call this before a forked child exits without running
+ * atexit handlers.
+ */
+void tr_log_async_stop(void)
+{
+  __atomic_store_n(&log_async_restart, 0, __ATOMIC_RELAXED);
+  if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+    return;
+
+  /* stop new records, release blocked producers, then wait for the rest to finish */
+  __atomic_store_n(&log_async, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&log_wake_mutex);
+  pthread_cond_broadcast(&log_space_cond);
+  pthread_mutex_unlock(&log_wake_mutex);
+  while (__atomic_load_n(&log_n_putting, __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+
+  __atomic_store_n(&log_thread_stop, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&log_wake_mutex);
+  pthread_cond_signal(&log_wake_cond);
+  pthread_mutex_unlock(&log_wake_mutex);
+  pthread_join(log_thread, NULL);
+}
+
+/* Number of messages dropped because a queue was full */
+unsigned long tr_log_async_dropped(void)
+{
+  return __atomic_load_n(&log_dropped_total, __ATOMIC_RELAXED);
+}
+
+/**
+ * Mark the calling thread as handling a request sampled for debug logging
+ *
+ * While set, all of the thread's messages down to debug level go to syslog,
+ * whatever the thresholds are. Clear it when the request is finished.
+ *
+ * @param sampled nonzero to log this thread's messages at debug level
+ */
+void tr_log_set_sampled(int sampled)
+{
+  sampled = (sampled != 0);
+  if (sampled == log_sampled)
+    return;
+
+  log_sampled = sampled;
+  if (sampled)
+    __atomic_add_fetch(&tr_log_sampling, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_sub_fetch(&tr_log_sampling, 1, __ATOMIC_RELAXED);
+}
+
+int tr_log_get_sampled(void)
+{
+  return log_sampled;
+}
+
+static void vfire_log(const int sev, const int facility, const char *fmt, va_list ap) {
+
+  /* write messages to stderr if they are more severe than the threshold and are not audit messages */
+  int to_console = (sev <= console_threshold) && (facility != AUDIT_FACILITY);
+  /* write messages to syslog if they are more severe than the threshold or are audit messages,
+   * or if this thread's request is sampled */
+  int to_syslog = (sev <= log_threshold) || (facility == AUDIT_FACILITY) || log_sampled;
+  /* Make sure that the message will fit, truncate if necessary */
+  char *buf = NULL;
+  int len = 0;
+
+  if ((!to_console) && (!to_syslog))
+    return;
+
+  buf = log_buf_get();
+  if (buf != NULL) {
+    len = vsnprintf(buf, LOG_MAX_MESSAGE_SIZE, fmt, ap);
+    if (len < 0)
+      return;
+    if (len >= LOG_MAX_MESSAGE_SIZE)
+      len = LOG_MAX_MESSAGE_SIZE - 1;
+
+    if (__atomic_load_n(&log_async_restart, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&log_async_restart, 0, __ATOMIC_RELAXED))
+      tr_log_async_start(__atomic_load_n(&log_overflow, __ATOMIC_RELAXED)); /* first message after a fork */
+    if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)
+        && log_async_put(sev, facility, to_console, to_syslog, buf, (size_t) len))
+      return;
+
+    write_log(sev, facility, to_console, to_syslog, buf);
+    return;
+  }
+
+  /* no buffer, so format directly to each output */
+  if (to_syslog) {
+    /* if we want to use ap twice, we need to duplicate it before the first use */
+    va_list ap_copy;
+    va_copy(ap_copy, ap);
+    vsyslog((facility|sev), fmt, ap_copy);
+    va_end(ap_copy);
+  }
+  if (to_console) {
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+  }
 }
 
 static void fire_log(const int sev, const int facility, const char *fmt, ...) {
@@ -219,12 +724,14 @@ int str2sev(const char* sev) {
 void tr_log_threshold(const int sev) {
 
   log_threshold = sev;
+  update_max_sev();
   return;
 }
 
 void tr_console_threshold(const int sev) {
 
   console_threshold = sev;
+  update_max_sev();
   return;
 }
 
@@ -36,22 +36,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <talloc.h>
-#include <assert.h>
 
 #include <tr_filter.h>
 #include <trp_internal.h>
 #include <tid_internal.h>
-#include <tr_inet_util.h>
 #include <tr_debug.h>
 
-/* Function types for handling filter fields generally. All target values
- * are represented as strings in a TR_NAME.
- */
+/* Size of the scratch buffer for field values that must be formatted, which
+ * is enough for a hostname (NI_MAXHOST) followed by ":port". */
+#define TR_FILTER_VALUE_BUFLEN (1025+7)
+
+/* Scratch space for a field value that does not exist as a TR_NAME in the target */
+typedef struct tr_filter_value {
+  TR_NAME name;
+  char buf[TR_FILTER_VALUE_BUFLEN];
+} TR_FILTER_VALUE;
 
-/* CMP functions return values like strcmp: 0 on match, <0 on target<val, >0 on target>val */
-typedef int (*TR_FILTER_FIELD_CMP)(TR_FILTER_TARGET *target, TR_NAME *val);
-/* get functions return TR_NAME format of the field value. Caller must free it. */
-typedef TR_NAME *(*TR_FILTER_FIELD_GET)(TR_FILTER_TARGET *target);
+/* Function type for handling filter fields generally. All target values
+ * are represented as strings in a TR_NAME. The result is borrowed from the target
+ * or from the scratch value, so is valid only as long as both of those are. Returns
+ * NULL if the target has no value for the field. These do not allocate memory. */
+typedef TR_NAME *(*TR_FILTER_FIELD_GET)(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch);
 
 static TR_FILTER_TARGET *tr_filter_target_new(TALLOC_CTX *mem_ctx)
 {
@@ -103,259 +108,140 @@ TR_FILTER_TARGET *tr_filter_target_trp_inforec(TALLOC_CTX *mem_ctx, TRP_UPD *upd
   return target;
 }
 
-/** Handler functions for TID RP_REALM field */
-static int tr_ff_cmp_tid_rp_realm(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_name_cmp(tid_req_get_rp_realm(target->tid_req), val);
-}
-
-static TR_NAME *tr_ff_get_tid_rp_realm(TR_FILTER_TARGET *target)
+/* Point the scratch name at a static string */
+static TR_NAME *tr_ff_static_name(TR_FILTER_VALUE *scratch, const char *s)
 {
-  return tr_dup_name(tid_req_get_rp_realm(target->tid_req));
+  if (s==NULL)
+    return NULL;
+  scratch->name.buf=(char *) s;
+  scratch->name.len=(int) strlen(s);
+  return &(scratch->name);
 }
 
-/** Handler functions for TRP info_type field */
-static int tr_ff_cmp_trp_info_type(TR_FILTER_TARGET *target, TR_NAME *val)
+/** Handler for TID RP_REALM field */
+static TR_NAME *tr_ff_get_tid_rp_realm(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  TRP_INFOREC *inforec=target->trp_inforec;
-  char *valstr=NULL;
-  int val_type=0;
-
-  assert(val);
-  assert(inforec);
-
-  /* nothing matches unknown */
-  if (inforec->type==TRP_INFOREC_TYPE_UNKNOWN)
-    return 0;
-
-  valstr = tr_name_strdup(val); /* get this as an official null-terminated string */
-  val_type = trp_inforec_type_from_string(valstr);
-  free(valstr);
-
-  /* we do not define an ordering of info types */
-  return (val_type==inforec->type);
+  return tid_req_get_rp_realm(target->tid_req);
 }
 
-static TR_NAME *tr_ff_get_trp_info_type(TR_FILTER_TARGET *target)
+/** Handler for TRP info_type field */
+static TR_NAME *tr_ff_get_trp_info_type(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
   TRP_INFOREC *inforec=target->trp_inforec;
-  return tr_new_name(trp_inforec_type_to_string(inforec->type));
-}
-
-/** Handlers for TRP realm field */
-static int tr_ff_cmp_trp_realm(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_name_cmp(trp_upd_get_realm(target->trp_upd), val);
-}
-
-static TR_NAME *tr_ff_get_trp_realm(TR_FILTER_TARGET *target)
-{
-  return tr_dup_name(trp_upd_get_realm(target->trp_upd));
-}
-
-/** Handlers for TID realm field */
-static int tr_ff_cmp_tid_realm(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_name_cmp(tid_req_get_realm(target->tid_req), val);
+  return tr_ff_static_name(scratch, trp_inforec_type_to_string(inforec->type));
 }
 
-static TR_NAME *tr_ff_get_tid_realm(TR_FILTER_TARGET *target)
+/** Handler for TRP realm field */
+static TR_NAME *tr_ff_get_trp_realm(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_dup_name(tid_req_get_realm(target->tid_req));
+  return trp_upd_get_realm(target->trp_upd);
 }
 
-/** Handlers for TRP community field */
-static int tr_ff_cmp_trp_comm(TR_FILTER_TARGET *target, TR_NAME *val)
+/** Handler for TID realm field */
+static TR_NAME *tr_ff_get_tid_realm(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_name_cmp(trp_upd_get_comm(target->trp_upd), val);
+  return tid_req_get_realm(target->tid_req);
 }
 
-static TR_NAME *tr_ff_get_trp_comm(TR_FILTER_TARGET *target)
+/** Handler for TRP community field */
+static TR_NAME *tr_ff_get_trp_comm(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_dup_name(trp_upd_get_comm(target->trp_upd));
+  return trp_upd_get_comm(target->trp_upd);
 }
 
-/** Handlers for TID community field */
-static int tr_ff_cmp_tid_comm(TR_FILTER_TARGET *target, TR_NAME *val)
+/** Handler for TID community field */
+static TR_NAME *tr_ff_get_tid_comm(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_name_cmp(tid_req_get_comm(target->tid_req), val);
+  return tid_req_get_comm(target->tid_req);
 }
 
-static TR_NAME *tr_ff_get_tid_comm(TR_FILTER_TARGET *target)
+/** Handler for TRP community_type field */
+static TR_NAME *tr_ff_get_trp_comm_type(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_dup_name(tid_req_get_comm(target->tid_req));
-}
-
-/** Handlers for TRP community_type field */
-static TR_NAME *tr_ff_get_trp_comm_type(TR_FILTER_TARGET *target)
-{
-  TR_NAME *type=NULL;
-
   switch(trp_inforec_get_comm_type(target->trp_inforec)) {
     case TR_COMM_APC:
-      type=tr_new_name("apc");
-      break;
+      return tr_ff_static_name(scratch, "apc");
     case TR_COMM_COI:
-      type=tr_new_name("coi");
-      break;
+      return tr_ff_static_name(scratch, "coi");
     default:
-      type=NULL;
-      break; /* unknown types always fail */
-  }
-
-  return type;
-}
-
-static int tr_ff_cmp_trp_comm_type(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  TR_NAME *type=tr_ff_get_trp_comm_type(target);
-  int retval=0;
-
-  if (type==NULL)
-    retval=1;
-  else {
-    retval = tr_name_cmp(val, type);
-    tr_free_name(type);
+      return NULL; /* unknown types always fail */
   }
-  return retval;
 }
 
-/** Handlers for TRP realm_role field */
-static TR_NAME *tr_ff_get_trp_realm_role(TR_FILTER_TARGET *target)
+/** Handler for TRP realm_role field */
+static TR_NAME *tr_ff_get_trp_realm_role(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  TR_NAME *type=NULL;
-
   switch(trp_inforec_get_role(target->trp_inforec)) {
     case TR_ROLE_IDP:
-      type=tr_new_name("idp");
-      break;
+      return tr_ff_static_name(scratch, "idp");
     case TR_ROLE_RP:
-      type=tr_new_name("rp");
-      break;
+      return tr_ff_static_name(scratch, "rp");
     default:
-      type=NULL;
-      break; /* unknown types always fail */
-  }
-
-  return type;
-}
-
-static int tr_ff_cmp_trp_realm_role(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  TR_NAME *type=tr_ff_get_trp_realm_role(target);
-  int retval=0;
-
-  if (type==NULL)
-    retval=1;
-  else {
-    retval = tr_name_cmp(val, type);
-    tr_free_name(type);
+      return NULL; /* unknown types always fail */
   }
-  return retval;
 }
 
-/** Handlers for TRP apc field */
+/** Handler for TRP apc field */
 /* TODO: Handle multiple APCs, not just the first */
-static int tr_ff_cmp_trp_apc(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_name_cmp(tr_apc_get_id(trp_inforec_get_apcs(target->trp_inforec)), val);
-}
-
-static TR_NAME *tr_ff_get_trp_apc(TR_FILTER_TARGET *target)
+static TR_NAME *tr_ff_get_trp_apc(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
   TR_APC *apc=trp_inforec_get_apcs(target->trp_inforec);
   if (apc==NULL)
     return NULL;
 
-  return tr_dup_name(tr_apc_get_id(apc));
-}
-
-/** Handlers for TRP owner_realm field */
-static int tr_ff_cmp_trp_owner_realm(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_name_cmp(trp_inforec_get_owner_realm(target->trp_inforec), val);
-}
-
-static TR_NAME *tr_ff_get_trp_owner_realm(TR_FILTER_TARGET *target)
-{
-  return tr_dup_name(trp_inforec_get_owner_realm(target->trp_inforec));
+  return tr_apc_get_id(apc);
 }
 
-/** Generic handlers for host:port fields*/
-static TR_NAME *tr_ff_get_hostname_and_port(TR_NAME *hn, int port)
+/** Handler for TRP owner_realm field */
+static TR_NAME *tr_ff_get_trp_owner_realm(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_hostname_and_port_to_name(hn, port);
+  return trp_inforec_get_owner_realm(target->trp_inforec);
 }
 
-static int tr_ff_cmp_hostname_and_port(TR_NAME *hn, int port, int default_port, TR_NAME *val)
+/** Generic handler for host:port fields. Formats the same string as tr_hostname_and_port_to_name(). */
+static TR_NAME *tr_ff_get_hostname_and_port(TR_NAME *hn, int port, TR_FILTER_VALUE *scratch)
 {
-  int cmp = -1;
-  TR_NAME *n = NULL;
-
-  /* allow a match without :port if the default port is in use */
-  if ((port == default_port) && (tr_name_cmp(hn, val) == 0))
-    return 0;
+  int len=0;
 
-  /* need to match with the :port */
-  n = tr_ff_get_hostname_and_port(hn, port);
+  if (hn==NULL)
+    return NULL;
 
-  if (n) {
-    cmp = tr_name_cmp(n, val);
-    tr_free_name(n);
+  len=snprintf(scratch->buf, sizeof(scratch->buf), "%.*s:%d", hn->len, hn->buf, port);
+  if ((len<0) || (len>=sizeof(scratch->buf))) {
+    tr_debug("tr_ff_get_hostname_and_port: hostname too long to filter.");
+    return NULL;
   }
-  return cmp;
-}
-
-/** Handlers for TRP trust_router field */
-static int tr_ff_cmp_trp_trust_router(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_ff_cmp_hostname_and_port(trp_inforec_get_trust_router(target->trp_inforec),
-                                     trp_inforec_get_trust_router_port(target->trp_inforec),
-                                     TRP_PORT,
-                                     val);
+  scratch->name.buf=scratch->buf;
+  scratch->name.len=len;
+  return &(scratch->name);
 }
 
-static TR_NAME *tr_ff_get_trp_trust_router(TR_FILTER_TARGET *target)
+/** Handler for TRP trust_router field */
+static TR_NAME *tr_ff_get_trp_trust_router(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
   return tr_ff_get_hostname_and_port(trp_inforec_get_trust_router(target->trp_inforec),
-                                     trp_inforec_get_trust_router_port(target->trp_inforec));
-}
-
-/** Handlers for TRP next_hop field */
-static int tr_ff_cmp_trp_next_hop(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_ff_cmp_hostname_and_port(trp_inforec_get_next_hop(target->trp_inforec),
-                                     trp_inforec_get_next_hop_port(target->trp_inforec),
-                                     TID_PORT,
-                                     val);
+                                     trp_inforec_get_trust_router_port(target->trp_inforec),
+                                     scratch);
 }
 
-static TR_NAME *tr_ff_get_trp_next_hop(TR_FILTER_TARGET *target)
+/** Handler for TRP next_hop field */
+static TR_NAME *tr_ff_get_trp_next_hop(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
   return tr_ff_get_hostname_and_port(trp_inforec_get_next_hop(target->trp_inforec),
-                                     trp_inforec_get_next_hop_port(target->trp_inforec));
-}
-
-/** Handlers for TRP owner_contact field */
-static int tr_ff_cmp_trp_owner_contact(TR_FILTER_TARGET *target, TR_NAME *val)
-{
-  return tr_name_cmp(trp_inforec_get_owner_contact(target->trp_inforec), val);
-}
-
-static TR_NAME *tr_ff_get_trp_owner_contact(TR_FILTER_TARGET *target)
-{
-  return tr_dup_name(trp_inforec_get_owner_contact(target->trp_inforec));
+                                     trp_inforec_get_next_hop_port(target->trp_inforec),
+                                     scratch);
 }
 
-/** Handlers for TID req original_coi field */
-static int tr_ff_cmp_tid_orig_coi(TR_FILTER_TARGET *target, TR_NAME *val)
+/** Handler for TRP owner_contact field */
+static TR_NAME *tr_ff_get_trp_owner_contact(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_name_cmp(tid_req_get_orig_coi(target->tid_req), val);
+  return trp_inforec_get_owner_contact(target->trp_inforec);
 }
 
-static TR_NAME *tr_ff_get_tid_orig_coi(TR_FILTER_TARGET *target)
+/** Handler for TID req original_coi field */
+static TR_NAME *tr_ff_get_tid_orig_coi(TR_FILTER_TARGET *target, TR_FILTER_VALUE *scratch)
 {
-  return tr_dup_name(tid_req_get_orig_coi(target->tid_req));
+  return tid_req_get_orig_coi(target->tid_req);
 }
 
 /**
@@ -364,57 +250,56 @@ static TR_NAME *tr_ff_get_tid_orig_coi(TR_FILTER_TARGET *target)
 struct tr_filter_field_entry {
   TR_FILTER_TYPE filter_type;
   const char *name;
-  TR_FILTER_FIELD_CMP cmp;
   TR_FILTER_FIELD_GET get;
 };
 static struct tr_filter_field_entry tr_filter_field_table[] = {
     /* realm */
-    {TR_FILTER_TYPE_TID_INBOUND, "realm", tr_ff_cmp_tid_realm, tr_ff_get_tid_realm},
-    {TR_FILTER_TYPE_TRP_INBOUND, "realm", tr_ff_cmp_trp_realm, tr_ff_get_trp_realm},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "realm", tr_ff_cmp_trp_realm, tr_ff_get_trp_realm},
+    {TR_FILTER_TYPE_TID_INBOUND, "realm", tr_ff_get_tid_realm},
+    {TR_FILTER_TYPE_TRP_INBOUND, "realm", tr_ff_get_trp_realm},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "realm", tr_ff_get_trp_realm},
 
     /* community */
-    {TR_FILTER_TYPE_TID_INBOUND, "comm", tr_ff_cmp_tid_comm, tr_ff_get_tid_comm},
-    {TR_FILTER_TYPE_TRP_INBOUND, "comm", tr_ff_cmp_trp_comm, tr_ff_get_trp_comm},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "comm", tr_ff_cmp_trp_comm, tr_ff_get_trp_comm},
+    {TR_FILTER_TYPE_TID_INBOUND, "comm", tr_ff_get_tid_comm},
+    {TR_FILTER_TYPE_TRP_INBOUND, "comm", tr_ff_get_trp_comm},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "comm", tr_ff_get_trp_comm},
 
     /* community type */
-    {TR_FILTER_TYPE_TRP_INBOUND, "comm_type", tr_ff_cmp_trp_comm_type, tr_ff_get_trp_comm_type},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "comm_type", tr_ff_cmp_trp_comm_type, tr_ff_get_trp_comm_type},
+    {TR_FILTER_TYPE_TRP_INBOUND, "comm_type", tr_ff_get_trp_comm_type},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "comm_type", tr_ff_get_trp_comm_type},
 
     /* realm role */
-    {TR_FILTER_TYPE_TRP_INBOUND, "realm_role", tr_ff_cmp_trp_realm_role, tr_ff_get_trp_realm_role},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "realm_role", tr_ff_cmp_trp_realm_role, tr_ff_get_trp_realm_role},
+    {TR_FILTER_TYPE_TRP_INBOUND, "realm_role", tr_ff_get_trp_realm_role},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "realm_role", tr_ff_get_trp_realm_role},
 
     /* apc */
-    {TR_FILTER_TYPE_TRP_INBOUND, "apc", tr_ff_cmp_trp_apc, tr_ff_get_trp_apc},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "apc", tr_ff_cmp_trp_apc, tr_ff_get_trp_apc},
+    {TR_FILTER_TYPE_TRP_INBOUND, "apc", tr_ff_get_trp_apc},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "apc", tr_ff_get_trp_apc},
 
     /* trust_router */
-    {TR_FILTER_TYPE_TRP_INBOUND, "trust_router", tr_ff_cmp_trp_trust_router, tr_ff_get_trp_trust_router},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "trust_router", tr_ff_cmp_trp_trust_router, tr_ff_get_trp_trust_router},
+    {TR_FILTER_TYPE_TRP_INBOUND, "trust_router", tr_ff_get_trp_trust_router},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "trust_router", tr_ff_get_trp_trust_router},
 
     /* next_hop */
-    {TR_FILTER_TYPE_TRP_INBOUND, "next_hop", tr_ff_cmp_trp_next_hop, tr_ff_get_trp_next_hop},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "next_hop", tr_ff_cmp_trp_next_hop, tr_ff_get_trp_next_hop},
+    {TR_FILTER_TYPE_TRP_INBOUND, "next_hop", tr_ff_get_trp_next_hop},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "next_hop", tr_ff_get_trp_next_hop},
 
     /* owner_realm */
-    {TR_FILTER_TYPE_TRP_INBOUND, "owner_realm", tr_ff_cmp_trp_owner_realm, tr_ff_get_trp_owner_realm},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "owner_realm", tr_ff_cmp_trp_owner_realm, tr_ff_get_trp_owner_realm},
+    {TR_FILTER_TYPE_TRP_INBOUND, "owner_realm", tr_ff_get_trp_owner_realm},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "owner_realm", tr_ff_get_trp_owner_realm},
 
     /* owner_contact */
-    {TR_FILTER_TYPE_TRP_INBOUND, "owner_contact", tr_ff_cmp_trp_owner_contact, tr_ff_get_trp_owner_contact},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "owner_contact", tr_ff_cmp_trp_owner_contact, tr_ff_get_trp_owner_contact},
+    {TR_FILTER_TYPE_TRP_INBOUND, "owner_contact", tr_ff_get_trp_owner_contact},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "owner_contact", tr_ff_get_trp_owner_contact},
 
     /* rp_realm */
-    {TR_FILTER_TYPE_TID_INBOUND, "rp_realm", tr_ff_cmp_tid_rp_realm, tr_ff_get_tid_rp_realm},
+    {TR_FILTER_TYPE_TID_INBOUND, "rp_realm", tr_ff_get_tid_rp_realm},
 
     /* original coi */
-    {TR_FILTER_TYPE_TID_INBOUND, "original_coi", tr_ff_cmp_tid_orig_coi, tr_ff_get_tid_orig_coi},
+    {TR_FILTER_TYPE_TID_INBOUND, "original_coi", tr_ff_get_tid_orig_coi},
 
     /* info_type */
-    {TR_FILTER_TYPE_TRP_INBOUND, "info_type", tr_ff_cmp_trp_info_type, tr_ff_get_trp_info_type},
-    {TR_FILTER_TYPE_TRP_OUTBOUND, "info_type", tr_ff_cmp_trp_info_type, tr_ff_get_trp_info_type},
+    {TR_FILTER_TYPE_TRP_INBOUND, "info_type", tr_ff_get_trp_info_type},
+    {TR_FILTER_TYPE_TRP_OUTBOUND, "info_type", tr_ff_get_trp_info_type},
 
     /* Unknown */
     {TR_FILTER_TYPE_UNKNOWN, NULL } /* This must be the final entry */
@@ -426,15 +311,120 @@ static struct tr_filter_field_entry *tr_filter_field_entry(TR_FILTER_TYPE filter
 {
   unsigned int ii;
 
+  if (field_name==NULL)
+    return NULL;
+
+  /* compare in place rather than with tr_name_cmp_str(), which allocates */
   for (ii=0; tr_filter_field_table[ii].filter_type!=TR_FILTER_TYPE_UNKNOWN; ii++) {
     if ((tr_filter_field_table[ii].filter_type==filter_type)
-        && (tr_name_cmp_str(field_name, tr_filter_field_table[ii].name)==0)) {
+        && (strlen(tr_filter_field_table[ii].name)==field_name->len)
+        && (0==strncmp(tr_filter_field_table[ii].name, field_name->buf, field_name->len))) {
       return tr_filter_field_table+ii;
     }
   }
   return NULL;
 }
 
+/* Compiled filter: the lines and specs of a TR_FILTER in arrays, with the field
+ * handler for each spec looked up for the filter's type. */
+struct tr_filter_cspec {
+  TR_FSPEC *fspec;
+  TR_FILTER_FIELD_GET get; /* NULL if the field is unknown, so the spec never matches */
+};
+
+struct tr_filter_cline {
+  TR_FLINE *fline;
+  size_t n_specs;
+  struct tr_filter_cspec *specs;
+};
+
+struct tr_filter_compiled {
+  size_t n_lines;
+  struct tr_filter_cline *lines;
+};
+
+/**
+ * Compile a filter for evaluation by tr_filter_apply()
+ *
+ * Resolves the field handler for each spec and classifies each spec's match
+ * patterns. This is done when a filter is added to a filter set, so filters
+ * from the configuration are compiled when it is loaded. A filter must not be
+ * changed after it is compiled without compiling it again.
+ *
+ * @param filt Filter to compile
+ * @return 0 on success, nonzero on error
+ */
+int tr_filter_compile(TR_FILTER *filt)
+{
+  struct tr_filter_compiled *comp=NULL;
+  struct tr_filter_cline *cline=NULL;
+  struct tr_filter_field_entry *field=NULL;
+  TR_FSPEC *fspec=NULL;
+  size_t ii=0, jj=0;
+
+  if (filt==NULL)
+    return 1;
+
+  comp=talloc(filt, struct tr_filter_compiled);
+  if (comp==NULL)
+    goto fail;
+  comp->n_lines=tr_list_length(filt->lines);
+  comp->lines=talloc_array(comp, struct tr_filter_cline, comp->n_lines);
+  if (comp->lines==NULL)
+    goto fail;
+
+  for (ii=0; ii<comp->n_lines; ii++) {
+    cline=comp->lines+ii;
+    cline->fline=tr_list_index(filt->lines, ii);
+    cline->n_specs=tr_list_length(cline->fline->specs);
+    cline->specs=talloc_array(comp, struct tr_filter_cspec, cline->n_specs);
+    if (cline->specs==NULL)
+      goto fail;
+
+    for (jj=0; jj<cline->n_specs; jj++) {
+      fspec=tr_list_index(cline->fline->specs, jj);
+      field=tr_filter_field_entry(filt->type, fspec->field);
+      if (field==NULL) {
+        tr_err("tr_filter_compile: No entry to handle field %.*s for %s filter.",
+               (fspec->field==NULL)?0:fspec->field->len,
+               (fspec->field==NULL)?"":fspec->field->buf,
+               tr_filter_type_to_string(filt->type));
+      }
+      if (0!=tr_fspec_compile(fspec))
+        goto fail;
+      cline->specs[jj].fspec=fspec;
+      cline->specs[jj].get=(field==NULL)?NULL:field->get;
+    }
+  }
+
+  if (filt->compiled!=NULL)
+    talloc_free(filt->compiled);
+  filt->compiled=comp;
+  return 0;
+
+fail:
+  tr_err("tr_filter_compile: Unable to compile %s filter.", tr_filter_type_to_string(filt->type));
+  if (comp!=NULL)
+    talloc_free(comp);
+  return 1;
+}
+
+/* returns 1 if the target's value of the compiled spec's field matches */
+static int tr_filter_cspec_matches(struct tr_filter_cspec *cspec, TR_FILTER_TARGET *target)
+{
+  TR_FILTER_VALUE scratch;
+  TR_NAME *value=NULL;
+
+  if (cspec->get==NULL)
+    return 0;
+
+  value=cspec->get(target, &scratch);
+  if (value==NULL)
+    return 0; /* if there's no value, there's no match */
+
+  return (NULL!=tr_wildcard_set_find_name(cspec->fspec->matcher, value));
+}
+
 /**
  * Apply a filter to a target record or TID request.
  *
@@ -446,6 +436,9 @@ static struct tr_filter_field_entry *tr_filter_field_entry(TR_FILTER_TYPE filter
  * If there is no match, returns TR_FILTER_NO_MATCH, out_action is undefined, and constraints
  * will not be changed.
  *
+ * Filters are normally compiled when they are added to a filter set. One that has not been
+ * is compiled on first use.
+ *
  * @param target Record or request to which the filter is applied
  * @param filt Filter to apply
  * @param constraints Pointer to existing set of constraints (NULL if not tracking constraints)
@@ -457,55 +450,42 @@ int tr_filter_apply(TR_FILTER_TARGET *target,
                     TR_CONSTRAINT_SET **constraints,
                     TR_FILTER_ACTION *out_action)
 {
-  TALLOC_CTX *tmp_ctx = talloc_new(NULL);
-  TR_FILTER_ITER *filt_iter = tr_filter_iter_new(tmp_ctx);
-  TR_FLINE *this_fline = NULL;
-  TR_FLINE_ITER *fline_iter = tr_fline_iter_new(tmp_ctx);
-  TR_FSPEC *this_fspec = NULL;
-  int retval=TR_FILTER_NO_MATCH;
+  struct tr_filter_cline *cline=NULL;
+  size_t ii=0, jj=0;
 
   /* Default action is reject */
   *out_action = TR_FILTER_ACTION_REJECT;
 
   /* Validate filter */
-  if ((filt_iter == NULL) || (fline_iter == NULL) || (filt==NULL) || (filt->type==TR_FILTER_TYPE_UNKNOWN)) {
-    talloc_free(tmp_ctx);
+  if ((filt==NULL) || (filt->type==TR_FILTER_TYPE_UNKNOWN))
     return TR_FILTER_NO_MATCH;
-  }
 
-  /* Step through filter lines looking for a match. If a line matches, retval
-   * will be set to TR_FILTER_MATCH, so stop then. */
-  for (this_fline = tr_filter_iter_first(filt_iter, filt);
-       this_fline != NULL;
-       this_fline = tr_filter_iter_next(filt_iter)) {
-    /* Assume we are going to succeed. If any specs fail to match, we'll set
-     * this to TR_FILTER_NO_MATCH. */
-    retval=TR_FILTER_MATCH;
-    for (this_fspec = tr_fline_iter_first(fline_iter, this_fline);
-         this_fspec != NULL;
-         this_fspec = tr_fline_iter_next(fline_iter)) {
-      if (!tr_fspec_matches(this_fspec, filt->type, target)) {
-        retval=TR_FILTER_NO_MATCH; /* set this in case this is the last filter line */
+  if ((filt->compiled==NULL) && (0!=tr_filter_compile(filt)))
+    return TR_FILTER_NO_MATCH;
+
+  /* Step through filter lines looking for a match. A line matches if all of its specs do. */
+  for (ii=0; ii<filt->compiled->n_lines; ii++) {
+    cline=filt->compiled->lines+ii;
+    for (jj=0; jj<cline->n_specs; jj++) {
+      if (!tr_filter_cspec_matches(cline->specs+jj, target))
         break; /* give up on this filter line */
-      }
     }
 
-    if (retval==TR_FILTER_MATCH)
-      break;
-
-  }
-
-  if (retval==TR_FILTER_MATCH) {
-    /* Matched line ii. Grab its action and constraints. */
-    *out_action = this_fline->action;
-    if (constraints!=NULL) {
-      /* if either constraint is missing, these are no-ops */
-      tr_constraint_add_to_set(constraints, this_fline->realm_cons);
-      tr_constraint_add_to_set(constraints, this_fline->domain_cons);
+    if (jj==cline->n_specs) {
+      /* Matched line ii. Grab its action and constraints. */
+      tr_debug_hot("tr_filter_apply: Line %u of %s filter matches.",
+               (unsigned) ii, tr_filter_type_to_string(filt->type));
+      *out_action = cline->fline->action;
+      if (constraints!=NULL) {
+        /* if either constraint is missing, these are no-ops */
+        tr_constraint_add_to_set(constraints, cline->fline->realm_cons);
+        tr_constraint_add_to_set(constraints, cline->fline->domain_cons);
+      }
+      return TR_FILTER_MATCH;
     }
   }
 
-  return retval;
+  return TR_FILTER_NO_MATCH;
 }
 
 void tr_fspec_free(TR_FSPEC *fspec)
@@ -543,6 +523,7 @@ TR_FSPEC *tr_fspec_new(TALLOC_CTX *mem_ctx)
 
   if (fspec != NULL) {
     fspec->field = NULL;
+    fspec->matcher = NULL;
     fspec->match = tr_list_new(fspec);
     if (fspec->match == NULL) {
       talloc_free(fspec);
@@ -553,25 +534,45 @@ TR_FSPEC *tr_fspec_new(TALLOC_CTX *mem_ctx)
   return fspec;
 }
 
-/* Helper function and cookie structure for finding a match. The helper is called
- * for every item in the match list, even after a match is found. If a match is found,
- * match should be pointed to the matching item. If this is not NULL, do not change it
- * because a match has already been found. */
-struct fspec_match_cookie { TR_NAME *name; TR_NAME *match;};
-static void fspec_match_helper(void *item, void *data)
+/**
+ * Build the matcher for a spec's match list
+ *
+ * Patterns beginning with '*' match any value ending in the rest of the pattern.
+ * Others must match the whole value. Empty patterns never match. The matcher
+ * borrows the patterns from the match list.
+ *
+ * @param fspec Spec to compile
+ * @return 0 on success, nonzero on error
+ */
+int tr_fspec_compile(TR_FSPEC *fspec)
 {
-  TR_NAME *this_name = (TR_NAME *) item;
-  struct fspec_match_cookie *cookie = (struct fspec_match_cookie *) data;
-  if (cookie->match == NULL) {
-    if (tr_name_prefix_wildcard_match(cookie->name, this_name))
-      cookie->match = this_name;
+  TR_WILDCARD_SET *matcher=NULL;
+  size_t n_match=tr_list_length(fspec->match);
+  size_t ii=0;
+
+  matcher=tr_wildcard_set_new(fspec);
+  if (matcher==NULL)
+    return 1;
+
+  for (ii=0; ii<n_match; ii++) {
+    if (0!=tr_wildcard_set_add(matcher, tr_list_index(fspec->match, ii))) {
+      tr_wildcard_set_free(matcher);
+      return 1;
+    }
   }
+
+  if (fspec->matcher!=NULL)
+    tr_wildcard_set_free(fspec->matcher);
+  fspec->matcher=matcher;
+  return 0;
 }
+
 /* returns 1 if the spec matches */
 int tr_fspec_matches(TR_FSPEC *fspec, TR_FILTER_TYPE ftype, TR_FILTER_TARGET *target)
 {
   struct tr_filter_field_entry *field=NULL;
-  struct fspec_match_cookie cookie = {0};
+  TR_FILTER_VALUE scratch;
+  TR_NAME *value=NULL;
 
   if (fspec==NULL)
     return 0;
@@ -579,33 +580,20 @@ int tr_fspec_matches(TR_FSPEC *fspec, TR_FILTER_TYPE ftype, TR_FILTER_TARGET *ta
   /* Look up how to handle the requested field */
   field = tr_filter_field_entry(ftype, fspec->field);
   if (field==NULL) {
-    tr_err("tr_fspec_matches: No entry to handle field %.*s for %*s filter.",
+    tr_err("tr_fspec_matches: No entry to handle field %.*s for %s filter.",
            fspec->field->len, fspec->field->buf,
            tr_filter_type_to_string(ftype));
     return 0;
   }
 
-  cookie.name = field->get(target);
-  if (cookie.name==NULL)
+  if ((fspec->matcher==NULL) && (0!=tr_fspec_compile(fspec)))
+    return 0;
+
+  value = field->get(target, &scratch);
+  if (value==NULL)
     return 0; /* if there's no value, there's no match */
 
-  cookie.match = NULL;
-  tr_list_foreach(fspec->match,
-                  fspec_match_helper,
-                  &cookie);
-  if (cookie.match) {
-    tr_debug("tr_fspec_matches: Field %.*s value \"%.*s\" matches \"%.*s\" for %s filter.",
-             fspec->field->len, fspec->field->buf,
-             cookie.name->len, cookie.name->buf,
-             cookie.match->len, cookie.match->buf,
-             tr_filter_type_to_string(ftype));
-  } else {
-        tr_debug("tr_fspec_matches: Field %.*s value \"%.*s\" does not match for %s filter.",
-                 fspec->field->len, fspec->field->buf,
-                 cookie.name->len, cookie.name->buf,
-                 tr_filter_type_to_string(ftype));
-  }
-  return (cookie.match != NULL);
+  return (NULL!=tr_wildcard_set_find_name(fspec->matcher, value));
 }
 
 void tr_fline_free(TR_FLINE *fline)
@@ -636,6 +624,7 @@ TR_FILTER *tr_filter_new(TALLOC_CTX *mem_ctx)
 
   if (f != NULL) {
     f->type = TR_FILTER_TYPE_UNKNOWN;
+    f->compiled = NULL;
     f->lines = tr_list_new(f);
     if (f->lines == NULL) {
       talloc_free(f);
@@ -747,6 +736,7 @@ TR_FILTER_SET *tr_filter_set_new(TALLOC_CTX *mem_ctx)
   if (set!=NULL) {
     set->next=NULL;
     set->this=NULL;
+    set->id=NULL;
   }
   return set;
 }
@@ -775,7 +765,37 @@ static TR_FILTER_SET *tr_filter_set_tail(TR_FILTER_SET *set)
 }
 
 /**
- * Add new filter to filter set.
+ * Recompute the identifier of a filter set from its contents.
+ *
+ * @param set Filter set
+ * @return 0 on success, nonzero on error
+ */
+static int tr_filter_set_update_id(TR_FILTER_SET *set)
+{
+  json_t *jset=NULL;
+  char *set_str=NULL;
+  gchar *digest=NULL;
+
+  jset=tr_filter_set_to_json(set);
+  if (jset==NULL)
+    return 1;
+  set_str=json_dumps(jset, JSON_COMPACT|JSON_SORT_KEYS);
+  json_decref(jset);
+  if (set_str==NULL)
+    return 1;
+  digest=g_compute_checksum_for_string(G_CHECKSUM_SHA256, set_str, -1);
+  free(set_str);
+  if (digest==NULL)
+    return 1;
+
+  talloc_free(set->id);
+  set->id=talloc_strdup(set, digest);
+  g_free(digest);
+  return (set->id==NULL);
+}
+
+/**
+ * Add new filter to filter set. Compiles the filter.
  *
  * @param set Filter set
  * @param new New filter to add
@@ -796,7 +816,26 @@ int tr_filter_set_add(TR_FILTER_SET *set, TR_FILTER *new)
   }
   tail->this=new;
   talloc_steal(tail, new);
-  return 0;
+  if (0!=tr_filter_compile(new))
+    return 1;
+  return tr_filter_set_update_id(set);
+}
+
+/**
+ * Get an identifier for the contents of a filter set
+ *
+ * Sets holding identically configured filters have the same identifier. It is
+ * worked out as filters are added, so it costs nothing to use it, e.g., in a
+ * cache key.
+ *
+ * @param set Filter set, may be null
+ * @return Identifier, or null if the set is null or empty
+ */
+const char *tr_filter_set_get_id(TR_FILTER_SET *set)
+{
+  if (set==NULL)
+    return NULL;
+  return set->id;
 }
 
 /**
@@ -92,6 +92,7 @@ TR_IDP_REALM *tr_idp_realm_new(TALLOC_CTX *mem_ctx)
     idp->apcs=NULL;
     idp->origin=TR_REALM_LOCAL;
     idp->refcount=0;
+    idp->memberships=NULL;
     talloc_set_destructor((void *)idp, tr_idp_realm_destructor);
   }
   return idp;
@@ -180,6 +181,26 @@ TR_IDP_REALM *tr_idp_realm_add_func(TR_IDP_REALM *head, TR_IDP_REALM *new)
   return head;
 }
 
+/* Like tr_idp_realm_add_func(), but looks for the end of the list starting from *tail
+ * (if not null), then points *tail at the new end. Keeping *tail between calls makes
+ * building a long list linear in its length. *tail must be on the list, or null.
+ * Use the tr_idp_realm_add_tail() macro. */
+TR_IDP_REALM *tr_idp_realm_add_tail_func(TR_IDP_REALM *head, TR_IDP_REALM **tail, TR_IDP_REALM *new)
+{
+  if (head==NULL) {
+    head=new;
+    *tail=tr_idp_realm_tail(head);
+  } else {
+    tr_idp_realm_tail((*tail!=NULL)?(*tail):head)->next=new;
+    while (new!=NULL) {
+      talloc_steal(head, new); /* put it in the right context */
+      *tail=new;
+      new=new->next;
+    }
+  }
+  return head;
+}
+
 /* use the macro */
 TR_IDP_REALM *tr_idp_realm_remove_func(TR_IDP_REALM *head, TR_IDP_REALM *remove)
 {
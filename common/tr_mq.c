@@ -32,10 +32,14 @@
  *
  */
 
+#include <glib.h>
 #include <talloc.h>
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <tr_mq.h>
 #include <tr_debug.h>
@@ -49,16 +53,13 @@ static int tr_mq_msg_destructor(void *object)
   return 0;
 }
 
-TR_MQ_MSG *tr_mq_msg_new(TALLOC_CTX *mem_ctx, const char *message)
+TR_MQ_MSG *tr_mq_msg_new(TALLOC_CTX *mem_ctx, TR_MQ_MSG_TYPE type)
 {
   TR_MQ_MSG *msg=talloc(mem_ctx, TR_MQ_MSG);
   if (msg!=NULL) {
     msg->next=NULL;
-    msg->message=talloc_strdup(msg, message);
-    if (msg->message==NULL) {
-      talloc_free(msg);
-      return NULL;
-    }
+    msg->type=type;
+    msg->key=NULL;
     msg->p=NULL;
     talloc_set_destructor((void *)msg, tr_mq_msg_destructor);
   }
@@ -71,9 +72,9 @@ void tr_mq_msg_free(TR_MQ_MSG *msg)
     talloc_free(msg);
 }
 
-const char *tr_mq_msg_get_message(TR_MQ_MSG *msg)
+TR_MQ_MSG_TYPE tr_mq_msg_get_type(TR_MQ_MSG *msg)
 {
-  return msg->message;
+  return msg->type;
 }
 
 void *tr_mq_msg_get_payload(TR_MQ_MSG *msg)
@@ -88,6 +89,24 @@ void tr_mq_msg_set_payload(TR_MQ_MSG *msg, void *p, void (*p_free)(void *))
   msg->p_free=p_free;
 }
 
+const char *tr_mq_msg_get_key(TR_MQ_MSG *msg)
+{
+  return msg->key;
+}
+
+/* Set the key used to supersede queued messages. Returns 0 on success. */
+int tr_mq_msg_set_key(TR_MQ_MSG *msg, const char *key)
+{
+  if (msg->key!=NULL)
+    talloc_free(msg->key);
+  msg->key=NULL;
+  if (key!=NULL) {
+    msg->key=talloc_strdup(msg, key);
+    if (msg->key==NULL)
+      return -1;
+  }
+  return 0;
+}
 
 static TR_MQ_MSG *tr_mq_msg_get_next(TR_MQ_MSG *msg)
 {
@@ -100,6 +119,55 @@ static void tr_mq_msg_set_next(TR_MQ_MSG *msg, TR_MQ_MSG *next)
 }
 
 /* Message Queues */
+
+/*
+ * Unkeyed messages added with tr_mq_add() do not take the queue's mutex. They
+ * are pushed onto the intake stack with an atomic compare-and-exchange, and the
+ * consumer moves the whole stack onto the locked list when it next looks at the
+ * queue. The consumer only ever takes the entire stack, so the push cannot suffer
+ * from a node being removed and reused underneath it. Messages on the intake
+ * stack are outside any talloc context until they reach the locked list.
+ */
+
+/* Take everything on the intake stack. Returns it oldest first. */
+static TR_MQ_MSG *tr_mq_take_intake(TR_MQ *mq)
+{
+  TR_MQ_MSG *stack=NULL;
+  TR_MQ_MSG *oldest_first=NULL;
+  TR_MQ_MSG *next=NULL;
+
+  do {
+    stack=g_atomic_pointer_get(&(mq->intake));
+  } while ((stack!=NULL) && !g_atomic_pointer_compare_and_exchange(&(mq->intake), stack, NULL));
+
+  /* reverse the stack */
+  while (stack!=NULL) {
+    next=stack->next;
+    stack->next=oldest_first;
+    oldest_first=stack;
+    stack=next;
+  }
+  return oldest_first;
+}
+
+static int tr_mq_destructor(void *object)
+{
+  TR_MQ *mq=talloc_get_type_abort(object, TR_MQ);
+  TR_MQ_MSG *msg=tr_mq_take_intake(mq);
+  TR_MQ_MSG *next=NULL;
+
+  while (msg!=NULL) {
+    next=msg->next;
+    tr_mq_msg_free(msg);
+    msg=next;
+  }
+  if (mq->keyed!=NULL)
+    g_hash_table_destroy(mq->keyed);
+  if (mq->wake_fd>=0)
+    close(mq->wake_fd);
+  return 0;
+}
+
 TR_MQ *tr_mq_new(TALLOC_CTX *mem_ctx)
 {
   TR_MQ *mq=talloc(mem_ctx, TR_MQ);
@@ -115,9 +183,26 @@ TR_MQ *tr_mq_new(TALLOC_CTX *mem_ctx)
 
     mq->head=NULL;
     mq->tail=NULL;
+    mq->intake=NULL;
 
     mq->notify_cb=NULL;
     mq->notify_cb_arg=NULL;
+    mq->wake_fd=-1;
+    mq->wake_pending=0;
+
+    mq->length=0;
+    mq->max_length=0;
+    mq->high_water=0;
+    mq->n_superseded=0;
+    mq->n_dropped=0;
+    mq->n_added=0;
+    mq->n_wakeups=0;
+    mq->keyed=g_hash_table_new(g_str_hash, g_str_equal); /* keys belong to the messages */
+    talloc_set_destructor((void *)mq, tr_mq_destructor);
+    if (mq->keyed==NULL) {
+      talloc_free(mq);
+      return NULL;
+    }
   }
   return mq;
 }
@@ -160,26 +245,95 @@ static void tr_mq_set_tail(TR_MQ *mq, TR_MQ_MSG *msg)
   mq->tail=msg;
 }
 
+/**
+ * Set the function called when the queue becomes non-empty
+ *
+ * The callback runs in the adding thread, after the queue's lock is released. It is
+ * called when an addition finds the queue empty, not once per message: a burst of
+ * additions before the consumer catches up produces one call. The consumer must
+ * therefore drain the queue each time, or reschedule itself for whatever it leaves
+ * behind. Messages added without the lock only check their own intake stack, so the
+ * callback may also run while earlier messages are still waiting. That is harmless
+ * for a consumer that drains the queue.
+ *
+ * @param mq Queue to watch
+ * @param cb Callback, or NULL for none
+ * @param arg Argument passed to the callback
+ */
 void tr_mq_set_notify_cb(TR_MQ *mq, TR_MQ_NOTIFY_FN cb, void *arg)
 {
   mq->notify_cb=cb;
   mq->notify_cb_arg=arg;
 }
 
-void tr_mq_clear(TR_MQ *mq)
+/*
+ * Eventfd notification
+ *
+ * Instead of a notify_cb, a queue consumed by an event loop can watch an eventfd.
+ * Producers write to it only when wake_pending goes from 0 to 1, so any number of
+ * messages added before the consumer runs cause a single wakeup. The consumer calls
+ * tr_mq_eventfd_ack() before it pops anything. Clearing wake_pending there, rather
+ * than after popping, means a message added while the consumer is working either
+ * is popped in this pass or signals the eventfd again, so none is left unnoticed.
+ * A consumer that stops before the queue is empty calls tr_mq_wake() to come back
+ * for the rest on its next trip through the event loop.
+ */
+
+/**
+ * Create an eventfd that becomes readable when messages are added
+ *
+ * Call before any other thread can add to the queue. The descriptor is nonblocking
+ * and belongs to the queue, which closes it when freed. Calling this again returns
+ * the same descriptor.
+ *
+ * @param mq Queue to watch
+ * @return The file descriptor, or -1 on error
+ */
+int tr_mq_enable_eventfd(TR_MQ *mq)
 {
-  TR_MQ_MSG *m=NULL;
-  TR_MQ_MSG *n=NULL;
+  if (mq->wake_fd<0) {
+    mq->wake_fd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (mq->wake_fd<0)
+      tr_err("tr_mq_enable_eventfd: unable to create eventfd (%s).", strerror(errno));
+  }
+  return mq->wake_fd;
+}
+
+/* Returns the queue's eventfd, or -1 if it does not have one */
+int tr_mq_get_eventfd(TR_MQ *mq)
+{
+  return mq->wake_fd;
+}
+
+/* Signal the eventfd unless a signal is already outstanding */
+void tr_mq_wake(TR_MQ *mq)
+{
+  if (mq->wake_fd<0)
+    return;
+
+  if (g_atomic_int_get(&(mq->wake_pending)))
+    return; /* consumer has not run since the last signal */
+  if (!g_atomic_int_compare_and_exchange(&(mq->wake_pending), 0, 1))
+    return; /* another producer got there first */
+
+  if ((0!=eventfd_write(mq->wake_fd, 1)) && (errno!=EAGAIN))
+    tr_err("tr_mq_wake: error writing to eventfd (%s).", strerror(errno));
+}
+
+/* Consumer has woken up: reset the eventfd and allow the next signal. Call this
+ * before taking messages from the queue. */
+void tr_mq_eventfd_ack(TR_MQ *mq)
+{
+  eventfd_t count=0;
+
+  if (mq->wake_fd<0)
+    return;
+
+  eventfd_read(mq->wake_fd, &count); /* EAGAIN is fine, nothing to reset */
+  g_atomic_int_set(&(mq->wake_pending), 0);
 
   tr_mq_lock(mq);
-  m=tr_mq_get_head(mq);
-  while (m!=NULL) {
-    n=tr_mq_msg_get_next(m);
-    tr_mq_msg_free(m);
-    m=n;
-  }
-  tr_mq_set_head(mq, NULL);
-  tr_mq_set_tail(mq, NULL);
+  mq->n_wakeups++;
   tr_mq_unlock(mq);
 }
 
@@ -199,6 +353,105 @@ static void tr_mq_append(TR_MQ *mq, TR_MQ_MSG *msg)
     tr_mq_set_tail(mq, msg); /* update tail of list */
   }
   talloc_steal(mq, msg);
+  if (msg->key!=NULL)
+    g_hash_table_insert(mq->keyed, msg->key, msg);
+  mq->length++;
+  mq->n_added++;
+  if (mq->length > mq->high_water)
+    mq->high_water=mq->length;
+}
+
+/* Move messages from the intake stack onto the list. Call with the lock held. */
+static void tr_mq_fold_intake(TR_MQ *mq)
+{
+  TR_MQ_MSG *msg=tr_mq_take_intake(mq);
+  TR_MQ_MSG *next=NULL;
+
+  while (msg!=NULL) {
+    next=tr_mq_msg_get_next(msg);
+    tr_mq_msg_set_next(msg, NULL);
+    tr_mq_append(mq, msg);
+    msg=next;
+  }
+}
+
+void tr_mq_clear(TR_MQ *mq)
+{
+  TR_MQ_MSG *m=NULL;
+  TR_MQ_MSG *n=NULL;
+
+  tr_mq_lock(mq);
+  tr_mq_fold_intake(mq);
+  m=tr_mq_get_head(mq);
+  while (m!=NULL) {
+    n=tr_mq_msg_get_next(m);
+    tr_mq_msg_free(m);
+    m=n;
+  }
+  tr_mq_set_head(mq, NULL);
+  tr_mq_set_tail(mq, NULL);
+  g_hash_table_remove_all(mq->keyed);
+  mq->length=0;
+  tr_mq_unlock(mq);
+}
+
+/* Limit on the length of the queue for tr_mq_add_bounded(). Use 0 for no limit. */
+void tr_mq_set_max_length(TR_MQ *mq, unsigned int max_length)
+{
+  tr_mq_lock(mq);
+  mq->max_length=max_length;
+  tr_mq_unlock(mq);
+}
+
+unsigned int tr_mq_get_length(TR_MQ *mq)
+{
+  unsigned int length=0;
+
+  tr_mq_lock(mq);
+  tr_mq_fold_intake(mq);
+  length=mq->length;
+  tr_mq_unlock(mq);
+  return length;
+}
+
+void tr_mq_get_stats(TR_MQ *mq, TR_MQ_STATS *stats)
+{
+  tr_mq_lock(mq);
+  tr_mq_fold_intake(mq);
+  stats->length=mq->length;
+  stats->max_length=mq->max_length;
+  stats->high_water=mq->high_water;
+  stats->n_superseded=mq->n_superseded;
+  stats->n_dropped=mq->n_dropped;
+  stats->n_added=mq->n_added;
+  stats->n_wakeups=mq->n_wakeups;
+  tr_mq_unlock(mq);
+}
+
+/* If a message with the same key is queued, give it msg's payload. Call with the lock held.
+ * Returns the queued message, whose old payload now belongs to msg, or NULL if there was none. */
+static TR_MQ_MSG *tr_mq_supersede(TR_MQ *mq, TR_MQ_MSG *msg)
+{
+  TR_MQ_MSG *queued=NULL;
+  void *p=NULL;
+  void (*p_free)(void *)=NULL;
+
+  if (msg->key==NULL)
+    return NULL;
+
+  queued=g_hash_table_lookup(mq->keyed, msg->key);
+  if ((queued==NULL) || (queued->type!=msg->type))
+    return NULL;
+
+  /* swap payloads so the old one is released when msg is freed */
+  p=queued->p;
+  p_free=queued->p_free;
+  queued->p=msg->p;
+  queued->p_free=msg->p_free;
+  msg->p=p;
+  msg->p_free=p_free;
+  mq->n_superseded++;
+  return queued;
 }
 
 #define DEBUG_TR_MQ 0
@@ -211,20 +464,38 @@ static void tr_mq_print(TR_MQ *mq)
   tr_debug("tr_mq_print: mq contents:");
   while(m!=NULL) {
     ii++;
-    tr_debug("tr_mq_print: Entry %02d: %-15s",
-             ii, tr_mq_msg_get_message(m));
+    tr_debug("tr_mq_print: Entry %02d: type %d",
+             ii, tr_mq_msg_get_type(m));
     m=tr_mq_msg_get_next(m);
   }
 }
 #endif
-void tr_mq_add(TR_MQ *mq, TR_MQ_MSG *msg)
+
+/* Add a message to the queue. If bounded is nonzero, drop it if the queue is full.
+ * In all cases, msg belongs to the queue afterward and must not be used by the caller. */
+static TR_MQ_RC tr_mq_add_internal(TR_MQ *mq, TR_MQ_MSG *msg, int bounded)
 {
   int was_empty=0;
   TR_MQ_NOTIFY_FN notify_cb=NULL;
   void *notify_cb_arg=NULL;
+  TR_MQ_RC rc=TR_MQ_ADDED;
 
   tr_mq_lock(mq);
-  
+  tr_mq_fold_intake(mq); /* keep messages in the order they were added */
+
+  if (NULL!=tr_mq_supersede(mq, msg)) {
+    tr_mq_unlock(mq);
+    tr_mq_msg_free(msg); /* releases the superseded payload */
+    return TR_MQ_SUPERSEDED;
+  }
+
+  if (bounded && (mq->max_length>0) && (mq->length>=mq->max_length)) {
+    mq->n_dropped++;
+    tr_mq_unlock(mq);
+    tr_mq_msg_free(msg);
+    return TR_MQ_FULL;
+  }
+
   was_empty=tr_mq_empty(mq);
   tr_mq_append(mq, msg);
 
@@ -247,6 +518,65 @@ void tr_mq_add(TR_MQ *mq, TR_MQ_MSG *msg)
   /* see if we need to tell someone we became non-empty */
   if (was_empty && (notify_cb!=NULL))
     notify_cb(mq, notify_cb_arg);
+  tr_mq_wake(mq); /* coalesced, so no need to check was_empty */
+
+  return rc;
+}
+
+/* Push msg onto the intake stack without taking the lock. */
+static void tr_mq_add_lockless(TR_MQ *mq, TR_MQ_MSG *msg)
+{
+  TR_MQ_MSG *old=NULL;
+  TR_MQ_NOTIFY_FN notify_cb=NULL;
+  void *notify_cb_arg=NULL;
+
+  talloc_steal(NULL, msg); /* the caller's context may go away before the consumer sees msg */
+  do {
+    old=g_atomic_pointer_get(&(mq->intake));
+    tr_mq_msg_set_next(msg, old);
+  } while (!g_atomic_pointer_compare_and_exchange(&(mq->intake), old, msg));
+
+  tr_mq_wake(mq);
+  if (old!=NULL)
+    return; /* whoever pushed onto the empty stack has already woken the consumer */
+
+  /* Take the lock to wake a consumer blocked in tr_mq_pop(). It holds the lock from
+   * checking for messages until it is waiting on the condition, so it cannot miss this. */
+  tr_mq_lock(mq);
+  pthread_cond_broadcast(&(mq->have_msg_cond));
+  notify_cb=mq->notify_cb;
+  notify_cb_arg=mq->notify_cb_arg;
+  tr_mq_unlock(mq);
+
+  if (notify_cb!=NULL)
+    notify_cb(mq, notify_cb_arg);
+}
+
+/* Add a message to the queue, regardless of its length. Steals msg. A message with
+ * a key replaces the payload of a queued message with the same key and type. Messages
+ * without a key are added without taking the queue's lock. */
+void tr_mq_add(TR_MQ *mq, TR_MQ_MSG *msg)
+{
+  if (msg->key==NULL)
+    tr_mq_add_lockless(mq, msg);
+  else
+    tr_mq_add_internal(mq, msg, 0);
+}
+
+/**
+ * Add a message to the queue unless the queue is full
+ *
+ * As for tr_mq_add(), a message with a key supersedes a queued message with the same
+ * key and type. That is done even if the queue is full. Otherwise, if the queue already
+ * holds its maximum length (see tr_mq_set_max_length()), the message is dropped.
+ *
+ * @param mq Queue to add to
+ * @param msg Message to add, stolen (or freed) in all cases
+ * @return TR_MQ_ADDED, TR_MQ_SUPERSEDED, or TR_MQ_FULL
+ */
+TR_MQ_RC tr_mq_add_bounded(TR_MQ *mq, TR_MQ_MSG *msg)
+{
+  return tr_mq_add_internal(mq, msg, 1);
 }
 
 /* Compute an absolute time from a desired timeout interval for use with tr_mq_pop().
@@ -260,47 +590,75 @@ int tr_mq_pop_timeout(time_t seconds, struct timespec *ts)
   return 0;
 }
 
-/* Retrieves a message from the queue, waiting until absolute
- * time ts_abort before giving up (using CLOCK_MONOTONIC). If ts_abort
- * has passed, returns an existing message but will not wait if one is
- * not already available. If ts_abort is null, no blocking.  Not
- * guaranteed to wait if an error occurs - immediately returns without
- * a message. Use tr_mq_pop_timeout() to get an absolute time that
+/**
+ * Retrieve up to max_msgs messages from the queue with a single lock
+ *
+ * Waits until absolute time ts_abort (using CLOCK_MONOTONIC) for at least one
+ * message to be available, then takes as many as are available without waiting
+ * further. If ts_abort has passed, returns existing messages but will not wait if
+ * none are already available. If ts_abort is null, no blocking. Not guaranteed to
+ * wait if an error occurs. Use tr_mq_pop_timeout() to get an absolute time that
  * is guaranteed compatible with this function.
  *
- * Caller should free msg via tr_mq_msg_free when done with it. It stays
+ * Caller should free each message via tr_mq_msg_free when done with it. They stay
  * in the TR_MQ's context, though, so use talloc_steal() if you want to do
- * something clever with it. */
-TR_MQ_MSG *tr_mq_pop(TR_MQ *mq, struct timespec *ts_abort)
+ * something clever with them.
+ *
+ * @param mq Queue to pop from
+ * @param msgs Array to fill, oldest message first
+ * @param max_msgs Size of msgs
+ * @param ts_abort Time to stop waiting, or NULL to not wait
+ * @return Number of messages retrieved
+ */
+size_t tr_mq_pop_batch(TR_MQ *mq, TR_MQ_MSG **msgs, size_t max_msgs, struct timespec *ts_abort)
 {
   TR_MQ_MSG *popped=NULL;
+  size_t n_popped=0;
   int wait_err=0;
-  
+
   tr_mq_lock(mq);
+  tr_mq_fold_intake(mq);
   if ((tr_mq_get_head(mq)==NULL) && (ts_abort!=NULL)) {
     /* No msgs yet, and blocking was requested */
-    while ((wait_err==0) && (NULL==tr_mq_get_head(mq)))
+    while ((wait_err==0) && (NULL==tr_mq_get_head(mq))) {
       wait_err=pthread_cond_timedwait(&(mq->have_msg_cond),
                                      &(mq->mutex),
                                      ts_abort);
-    
+      tr_mq_fold_intake(mq);
+    }
+
     if ((wait_err!=0) && (wait_err!=ETIMEDOUT)) {
-      tr_notice("tr_mq_pop: error waiting for message.");
-      return NULL;
+      tr_mq_unlock(mq);
+      tr_notice("tr_mq_pop_batch: error waiting for message.");
+      return 0;
     }
     /* if it timed out, ok to go ahead and check once more for a message, so no special exit */
   }
 
-  if (tr_mq_get_head(mq)!=NULL) {
+  while ((n_popped<max_msgs) && (tr_mq_get_head(mq)!=NULL)) {
     popped=tr_mq_get_head(mq);
     tr_mq_set_head(mq, tr_mq_msg_get_next(popped)); /* popped is the old head */
 
     if (tr_mq_get_head(mq)==NULL)
       tr_mq_set_tail(mq, NULL); /* just popped the last element */
+
+    if ((popped->key!=NULL) && (g_hash_table_lookup(mq->keyed, popped->key)==popped))
+      g_hash_table_remove(mq->keyed, popped->key);
+    mq->length--;
+    tr_mq_msg_set_next(popped, NULL); /* disconnect from list */
+    msgs[n_popped++]=popped;
   }
   tr_mq_unlock(mq);
-  if (popped!=NULL)
-    tr_mq_msg_set_next(popped, NULL); /* disconnect from list */
-  return popped;
+  return n_popped;
 }
 
+/* Retrieves a single message from the queue. See tr_mq_pop_batch() for the meaning
+ * of ts_abort. Returns NULL if there was no message. */
+TR_MQ_MSG *tr_mq_pop(TR_MQ *mq, struct timespec *ts_abort)
+{
+  TR_MQ_MSG *popped=NULL;
+
+  if (0==tr_mq_pop_batch(mq, &popped, 1, ts_abort))
+    return NULL;
+  return popped;
+}
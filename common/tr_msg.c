@@ -34,6 +34,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/dh.h>
 #include <openssl/crypto.h>
@@ -258,6 +260,31 @@ void tr_msg_set_trp_req(TR_MSG *msg, TRP_REQ *req)
   msg->msg_type=TRP_REQUEST;
 }
 
+/**
+ * Get a TRP_REFRESH_MARKER message payload
+ *
+ * @param msg
+ * @return the message payload, or null if it is not a TRP_REFRESH message
+ */
+TRP_REFRESH_MARKER *tr_msg_get_trp_refresh(TR_MSG *msg)
+{
+  if (msg->msg_type == TRP_REFRESH)
+    return (TRP_REFRESH_MARKER *)msg->msg_rep;
+  return NULL;
+}
+
+/**
+ * Set message's payload
+ *
+ * Does not manage talloc contexts, works with any means of allocating
+ * the objects.
+ */
+void tr_msg_set_trp_refresh(TR_MSG *msg, TRP_REFRESH_MARKER *marker)
+{
+  msg->msg_rep=marker;
+  msg->msg_type=TRP_REFRESH;
+}
+
 static json_t *tr_msg_encode_dh(DH *dh)
 {
   json_t *jdh = NULL;
@@ -811,6 +838,7 @@ static TRP_RC tr_msg_encode_inforec_comm(json_t *jrec, TRP_INFOREC *rec)
   json_t *jstr=NULL;
   json_t *jint=NULL;
   json_t *japcs=NULL;
+  json_t *jprov=NULL;
   const char *sconst=NULL;
   TR_COMM_TYPE commtype=TR_COMM_UNKNOWN;
 
@@ -862,7 +890,12 @@ static TRP_RC tr_msg_encode_inforec_comm(json_t *jrec, TRP_INFOREC *rec)
     json_object_set_new(jrec, "owner_contact", jstr);
   }  
 
-  json_object_set(jrec, "provenance", trp_inforec_get_provenance(rec));
+  if (trp_inforec_get_provenance(rec)!=NULL) {
+    jprov=tr_provenance_to_json(trp_inforec_get_provenance(rec));
+    if (jprov==NULL)
+      return TRP_ERROR;
+    json_object_set_new(jrec, "provenance", jprov);
+  }
 
   jint=json_integer(trp_inforec_get_interval(rec));
   if(jint==NULL)
@@ -1002,6 +1035,8 @@ static TRP_RC tr_msg_decode_trp_inforec_comm(json_t *jrecord, TRP_INFOREC *rec)
   char *s=NULL;
   int num=0;
   TR_APC *apcs=NULL;
+  json_t *jprov=NULL;
+  TR_PROVENANCE *prov=NULL;
 
   rc=tr_msg_get_json_string(jrecord, "type", &s, tmp_ctx);
   if (rc != TRP_SUCCESS)
@@ -1033,7 +1068,18 @@ static TRP_RC tr_msg_decode_trp_inforec_comm(json_t *jrecord, TRP_INFOREC *rec)
   if ((rc != TRP_SUCCESS) || (TRP_SUCCESS!=trp_inforec_set_interval(rec,num)))
     goto cleanup;
 
-  trp_inforec_set_provenance(rec, json_object_get(jrecord, "provenance"));
+  /* optional here; trps drops records that have no origin */
+  jprov=json_object_get(jrecord, "provenance");
+  if (jprov!=NULL) {
+    prov=tr_provenance_from_json(jprov);
+    if (prov==NULL) {
+      tr_debug("tr_msg_decode_trp_inforec_comm: invalid provenance.");
+      rc=TRP_ERROR;
+      goto cleanup;
+    }
+    trp_inforec_set_provenance(rec, prov);
+    tr_provenance_unref(prov); /* rec holds its own reference */
+  }
 
   /* optional */
   rc=tr_msg_get_json_string(jrecord, "owner_realm", &s, tmp_ctx);
@@ -1263,6 +1309,257 @@ cleanup:
   return update;
 }
 
+/* Encode a chain of TRP updates. A single update is encoded as a bare object,
+ * exactly as older trust routers expect. Several chained updates are encoded
+ * as an array of update objects. */
+static json_t *tr_msg_encode_trp_upd_chain(TRP_UPD *update)
+{
+  json_t *jupdates=NULL;
+  json_t *jupdate=NULL;
+
+  if (trp_upd_get_next(update)==NULL)
+    return tr_msg_encode_trp_upd(update);
+
+  jupdates=json_array();
+  if (jupdates==NULL)
+    return NULL;
+
+  for ( ; update!=NULL; update=trp_upd_get_next(update)) {
+    jupdate=tr_msg_encode_trp_upd(update);
+    if (jupdate==NULL) {
+      json_decref(jupdates);
+      return NULL;
+    }
+    if (0!=json_array_append_new(jupdates, jupdate)) {
+      json_decref(jupdates);
+      return NULL;
+    }
+  }
+  return jupdates;
+}
+
+/* Decode a TRP update message body, which is either a single update object or
+ * an array of them. Returns the head of a chain of updates, all in mem_ctx.
+ * Updates that cannot be parsed are logged and skipped. Returns NULL only if
+ * no update could be parsed. */
+static TRP_UPD *tr_msg_decode_trp_upd_chain(TALLOC_CTX *mem_ctx, json_t *jbody)
+{
+  TRP_UPD *head=NULL;
+  TRP_UPD *tail=NULL;
+  TRP_UPD *update=NULL;
+  size_t n_skipped=0;
+  size_t ii=0;
+
+  if (!json_is_array(jbody))
+    return tr_msg_decode_trp_upd(mem_ctx, jbody);
+
+  if (json_array_size(jbody)==0) {
+    tr_debug("tr_msg_decode_trp_upd_chain: empty TRP update message.");
+    return NULL;
+  }
+
+  tr_debug("tr_msg_decode_trp_upd_chain: found %zu updates", json_array_size(jbody));
+  for (ii=0; ii<json_array_size(jbody); ii++) {
+    update=tr_msg_decode_trp_upd(mem_ctx, json_array_get(jbody, ii));
+    if (update==NULL) {
+      tr_notice("tr_msg_decode_trp_upd_chain: unable to parse update %zu, skipping it.", ii);
+      n_skipped++;
+      continue;
+    }
+    if (tail==NULL)
+      head=update;
+    else
+      trp_upd_set_next(tail, update);
+    tail=update;
+  }
+
+  if (n_skipped>0)
+    tr_notice("tr_msg_decode_trp_upd_chain: skipped %zu of %zu updates.", n_skipped, json_array_size(jbody));
+  return head;
+}
+
+/* Add realm to the array for comm in jlists, creating the array if needed. Returns 0 on success. */
+static int tr_msg_add_refresh_name(json_t *jlists, TR_NAME *comm, TR_NAME *realm)
+{
+  json_t *jrealms=NULL;
+  json_t *jstr=NULL;
+  char *s=NULL;
+
+  s=tr_name_strdup(comm);
+  if (s==NULL)
+    return -1;
+  jrealms=json_object_get(jlists, s);
+  if (jrealms==NULL) {
+    jrealms=json_array();
+    if ((jrealms==NULL) || (0!=json_object_set_new(jlists, s, jrealms))) {
+      free(s);
+      return -1;
+    }
+  }
+  free(s);
+
+  s=tr_name_strdup(realm);
+  if (s==NULL)
+    return -1;
+  jstr=json_string(s);
+  free(s);
+  if (jstr==NULL)
+    return -1;
+  return json_array_append_new(jrealms, jstr);
+}
+
+/* TRP refresh marker. Entries are grouped by community:
+ *   {"routes": {"comm": ["realm", ...], ...}, "communities": {"comm": ["realm", ...], ...}} */
+static json_t *tr_msg_encode_trp_refresh(TRP_REFRESH_MARKER *marker)
+{
+  json_t *jbody=NULL;
+  json_t *jroutes=NULL;
+  json_t *jcomms=NULL;
+  TRP_REFRESH_ITEM *item=NULL;
+  int err=0;
+
+  if (marker==NULL)
+    return NULL;
+
+  jbody=json_object();
+  jroutes=json_object();
+  jcomms=json_object();
+  if ((jbody==NULL) || (jroutes==NULL) || (jcomms==NULL))
+    goto error;
+
+  for (item=trp_refresh_marker_get_items(marker); item!=NULL; item=trp_refresh_item_get_next(item)) {
+    switch (trp_refresh_item_get_type(item)) {
+    case TRP_INFOREC_TYPE_ROUTE:
+      err=tr_msg_add_refresh_name(jroutes, trp_refresh_item_get_comm(item), trp_refresh_item_get_realm(item));
+      break;
+    case TRP_INFOREC_TYPE_COMMUNITY:
+      err=tr_msg_add_refresh_name(jcomms, trp_refresh_item_get_comm(item), trp_refresh_item_get_realm(item));
+      break;
+    default:
+      err=-1;
+      break;
+    }
+    if (err)
+      goto error;
+  }
+
+  json_object_set_new(jbody, "routes", jroutes);
+  json_object_set_new(jbody, "communities", jcomms);
+  return jbody;
+
+error:
+  if (jbody!=NULL)
+    json_decref(jbody);
+  if (jroutes!=NULL)
+    json_decref(jroutes);
+  if (jcomms!=NULL)
+    json_decref(jcomms);
+  return NULL;
+}
+
+/* decode one of the lists in a refresh marker, returns TRP_SUCCESS on success */
+static TRP_RC tr_msg_decode_refresh_list(TRP_REFRESH_MARKER *marker, TRP_INFOREC_TYPE type, json_t *jlists)
+{
+  const char *comm=NULL;
+  json_t *jrealms=NULL;
+  json_t *jrealm=NULL;
+  size_t ii=0;
+  TRP_RC rc=TRP_SUCCESS;
+
+  if (jlists==NULL)
+    return TRP_SUCCESS; /* nothing of this type */
+  if (!json_is_object(jlists))
+    return TRP_NOPARSE;
+
+  json_object_foreach(jlists, comm, jrealms) {
+    if (!json_is_array(jrealms))
+      return TRP_NOPARSE;
+    json_array_foreach(jrealms, ii, jrealm) {
+      if (!json_is_string(jrealm))
+        return TRP_NOPARSE;
+      rc=trp_refresh_marker_add(marker, type, tr_new_name(comm), tr_new_name(json_string_value(jrealm)));
+      if (rc!=TRP_SUCCESS)
+        return rc;
+    }
+  }
+  return TRP_SUCCESS;
+}
+
+static TRP_REFRESH_MARKER *tr_msg_decode_trp_refresh(TALLOC_CTX *mem_ctx, json_t *jbody)
+{
+  TRP_REFRESH_MARKER *marker=trp_refresh_marker_new(NULL);
+
+  if (marker==NULL)
+    return NULL;
+
+  if ((TRP_SUCCESS!=tr_msg_decode_refresh_list(marker,
+                                               TRP_INFOREC_TYPE_ROUTE,
+                                               json_object_get(jbody, "routes")))
+      || (TRP_SUCCESS!=tr_msg_decode_refresh_list(marker,
+                                                  TRP_INFOREC_TYPE_COMMUNITY,
+                                                  json_object_get(jbody, "communities")))) {
+    tr_debug("tr_msg_decode_trp_refresh: error decoding refresh marker.");
+    trp_refresh_marker_free(marker);
+    return NULL;
+  }
+
+  talloc_steal(mem_ctx, marker);
+  return marker;
+}
+
+/* encode a digest as an array of hex strings, one per bucket */
+static json_t *tr_msg_encode_trp_digest(TRP_DIGEST *digest)
+{
+  json_t *jdigest=json_array();
+  json_t *jstr=NULL;
+  char buf[17]; /* 16 hex digits and a null */
+  size_t ii=0;
+
+  if (jdigest==NULL)
+    return NULL;
+
+  for (ii=0; ii<trp_digest_get_n_buckets(digest); ii++) {
+    snprintf(buf, sizeof(buf), "%016" PRIx64, trp_digest_get_bucket(digest, ii));
+    jstr=json_string(buf);
+    if ((jstr==NULL) || (0!=json_array_append_new(jdigest, jstr))) {
+      json_decref(jstr);
+      json_decref(jdigest);
+      return NULL;
+    }
+  }
+  return jdigest;
+}
+
+/* returns NULL if the digest is malformed */
+static TRP_DIGEST *tr_msg_decode_trp_digest(TALLOC_CTX *mem_ctx, json_t *jdigest)
+{
+  TRP_DIGEST *digest=NULL;
+  const char *s=NULL;
+  char *end=NULL;
+  size_t ii=0;
+
+  if (!json_is_array(jdigest))
+    return NULL;
+
+  digest=trp_digest_new(mem_ctx, json_array_size(jdigest));
+  if (digest==NULL)
+    return NULL;
+
+  for (ii=0; ii<json_array_size(jdigest); ii++) {
+    s=json_string_value(json_array_get(jdigest, ii));
+    if ((s==NULL) || (strlen(s)!=16))
+      goto error;
+    trp_digest_set_bucket(digest, ii, (uint64_t) strtoull(s, &end, 16));
+    if (*end!='\0')
+      goto error;
+  }
+  return digest;
+
+error:
+  trp_digest_free(digest);
+  return NULL;
+}
+
 static json_t *tr_msg_encode_trp_req(TRP_REQ *req)
 {
   json_t *jbody=NULL;
@@ -1308,6 +1605,16 @@ static json_t *tr_msg_encode_trp_req(TRP_REQ *req)
   }
   json_object_set_new(jbody, "realm", jstr);
 
+  /* optional summary of what the requester already has */
+  if (NULL!=trp_req_get_digest(req)) {
+    jstr=tr_msg_encode_trp_digest(trp_req_get_digest(req));
+    if (jstr==NULL) {
+      json_decref(jbody);
+      return NULL;
+    }
+    json_object_set_new(jbody, "digest", jstr);
+  }
+
   return jbody;
 }
 
@@ -1315,6 +1622,7 @@ static TRP_REQ *tr_msg_decode_trp_req(TALLOC_CTX *mem_ctx, json_t *jreq)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TRP_REQ *req=NULL;
+  json_t *jdigest=NULL;
   char *s=NULL;
   TRP_RC rc=TRP_ERROR;
 
@@ -1337,6 +1645,14 @@ static TRP_REQ *tr_msg_decode_trp_req(TALLOC_CTX *mem_ctx, json_t *jreq)
   trp_req_set_realm(req, tr_new_name(s));
   talloc_free(s); s=NULL;
 
+  /* A malformed digest is not fatal, the request is then answered in full */
+  jdigest=json_object_get(jreq, "digest");
+  if (jdigest!=NULL) {
+    trp_req_set_digest(req, tr_msg_decode_trp_digest(req, jdigest));
+    if (trp_req_get_digest(req)==NULL)
+      tr_debug("tr_msg_decode_trp_req: ignoring malformed digest.");
+  }
+
   rc=TRP_SUCCESS;
   talloc_steal(mem_ctx, req);
 
@@ -1382,7 +1698,13 @@ char *tr_msg_encode(TALLOC_CTX *mem_ctx, TR_MSG *msg)
       jmsg_type = json_string("trp_update");
       json_object_set_new(jmsg, "msg_type", jmsg_type);
       trpupd=tr_msg_get_trp_upd(msg);
-      json_object_set_new(jmsg, "msg_body", tr_msg_encode_trp_upd(trpupd));
+      json_object_set_new(jmsg, "msg_body", tr_msg_encode_trp_upd_chain(trpupd));
+      break;
+
+    case TRP_REFRESH:
+      jmsg_type = json_string("trp_refresh");
+      json_object_set_new(jmsg, "msg_type", jmsg_type);
+      json_object_set_new(jmsg, "msg_body", tr_msg_encode_trp_refresh(tr_msg_get_trp_refresh(msg)));
       break;
 
     case TRP_REQUEST:
@@ -1462,7 +1784,11 @@ TR_MSG *tr_msg_decode(TALLOC_CTX *mem_ctx, const char *jbuf, size_t buflen)
   }
   else if (0 == strcmp(mtype, "trp_update")) {
     msg->msg_type = TRP_UPDATE;
-    tr_msg_set_trp_upd(msg, tr_msg_decode_trp_upd(msg, jbody));
+    tr_msg_set_trp_upd(msg, tr_msg_decode_trp_upd_chain(msg, jbody));
+  }
+  else if (0 == strcmp(mtype, "trp_refresh")) {
+    msg->msg_type = TRP_REFRESH;
+    tr_msg_set_trp_refresh(msg, tr_msg_decode_trp_refresh(msg, jbody));
   }
   else if (0 == strcmp(mtype, "trp_request")) {
     msg->msg_type = TRP_UPDATE;
@@ -104,6 +104,33 @@ int tr_name_cmp(const TR_NAME *one, const TR_NAME *two)
   return cmp;
 }
 
+/**
+ * Hash a TR_NAME for use as a hash table key
+ *
+ * Consistent with tr_name_cmp(), so names that compare equal hash equal. Suitable
+ * as a GHashFunc, with tr_name_equal() as the matching GEqualFunc.
+ *
+ * @param name TR_NAME to hash
+ * @return Hash value
+ */
+unsigned int tr_name_hash(const void *name)
+{
+  const TR_NAME *n=(const TR_NAME *)name;
+  unsigned int hash=5381;
+  int ii=0;
+
+  /* stop at a null, as tr_name_cmp() does */
+  for (ii=0; (ii<n->len) && (n->buf[ii]!='\0'); ii++)
+    hash=(hash<<5) + hash + (unsigned char) n->buf[ii];
+  return hash;
+}
+
+/* Returns nonzero if the names are equal. Companion to tr_name_hash(). */
+int tr_name_equal(const void *one, const void *two)
+{
+  return 0==tr_name_cmp((const TR_NAME *)one, (const TR_NAME *)two);
+}
+
 /**
  * Compare a TR_NAME with a null-terminated string.
  *
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+#include <tr_provenance.h>
+#include <tr_debug.h>
+
+#define TR_PROVENANCE_INITIAL_HOPS 4
+
+/* Two filter bits per hop, taken from different parts of the hash. */
+static uint64_t tr_provenance_filter_bits(unsigned int hash)
+{
+  return (((uint64_t) 1) << (hash & 0x3F)) | (((uint64_t) 1) << ((hash >> 6) & 0x3F));
+}
+
+TR_PROVENANCE *tr_provenance_new(void)
+{
+  TR_PROVENANCE *prov=malloc(sizeof(TR_PROVENANCE));
+  if (prov!=NULL) {
+    prov->refcount=1;
+    prov->n_hops=0;
+    prov->max_hops=0;
+    prov->filter=0;
+    prov->hops=NULL;
+  }
+  return prov;
+}
+
+/* Takes another reference to prov and returns it. Safe to call with NULL. */
+TR_PROVENANCE *tr_provenance_ref(TR_PROVENANCE *prov)
+{
+  if (prov!=NULL)
+    prov->refcount++;
+  return prov;
+}
+
+/* Drops a reference to prov, freeing it when none remain. Safe to call with NULL. */
+void tr_provenance_unref(TR_PROVENANCE *prov)
+{
+  size_t ii=0;
+
+  if (prov==NULL)
+    return;
+  if (--(prov->refcount)>0)
+    return;
+
+  for (ii=0; ii<prov->n_hops; ii++)
+    tr_free_name(prov->hops[ii].name);
+  free(prov->hops);
+  free(prov);
+}
+
+static int tr_provenance_reserve(TR_PROVENANCE *prov, size_t n_hops)
+{
+  TR_PROVENANCE_HOP *new_hops=NULL;
+  size_t new_max=(prov->max_hops>0)?(prov->max_hops):TR_PROVENANCE_INITIAL_HOPS;
+
+  if (n_hops<=prov->max_hops)
+    return 0;
+
+  while (new_max<n_hops)
+    new_max*=2;
+  new_hops=realloc(prov->hops, new_max*sizeof(TR_PROVENANCE_HOP));
+  if (new_hops==NULL)
+    return -1;
+  prov->hops=new_hops;
+  prov->max_hops=new_max;
+  return 0;
+}
+
+/* Add a hop that the list takes ownership of. */
+static int tr_provenance_append_hop(TR_PROVENANCE *prov, TR_NAME *name)
+{
+  unsigned int hash=tr_name_hash(name);
+
+  if (0!=tr_provenance_reserve(prov, prov->n_hops+1))
+    return -1;
+  prov->hops[prov->n_hops].name=name;
+  prov->hops[prov->n_hops].hash=hash;
+  prov->n_hops++;
+  prov->filter|=tr_provenance_filter_bits(hash);
+  return 0;
+}
+
+/* Copy of prov with a single reference, with room for one more hop. */
+static TR_PROVENANCE *tr_provenance_dup(TR_PROVENANCE *prov)
+{
+  TR_PROVENANCE *new_prov=tr_provenance_new();
+  TR_NAME *name=NULL;
+  size_t ii=0;
+
+  if (new_prov==NULL)
+    return NULL;
+  if (0!=tr_provenance_reserve(new_prov, prov->n_hops+1))
+    goto fail;
+  for (ii=0; ii<prov->n_hops; ii++) {
+    name=tr_dup_name(prov->hops[ii].name);
+    if (name==NULL)
+      goto fail;
+    new_prov->hops[ii].name=name;
+    new_prov->hops[ii].hash=prov->hops[ii].hash;
+    new_prov->n_hops++;
+  }
+  new_prov->filter=prov->filter;
+  return new_prov;
+
+fail:
+  tr_provenance_unref(new_prov);
+  return NULL;
+}
+
+/**
+ * Append a copy of hop to a provenance list
+ *
+ * If *prov is NULL, a new list is created. If *prov is shared with other
+ * holders, it is replaced by a private copy first, dropping the caller's
+ * reference to the shared list. On failure, *prov is left as it was.
+ *
+ * @param prov Pointer to the caller's reference to the list
+ * @param hop Name to append; not consumed
+ * @return 0 on success, nonzero on error
+ */
+int tr_provenance_append(TR_PROVENANCE **prov, TR_NAME *hop)
+{
+  TR_PROVENANCE *target=*prov;
+  TR_NAME *name=tr_dup_name(hop);
+
+  if (name==NULL)
+    return -1;
+
+  if (target==NULL)
+    target=tr_provenance_new();
+  else if (target->refcount>1)
+    target=tr_provenance_dup(target);
+
+  if (target==NULL) {
+    tr_free_name(name);
+    return -1;
+  }
+
+  if (0!=tr_provenance_append_hop(target, name)) {
+    tr_free_name(name);
+    if (target!=*prov)
+      tr_provenance_unref(target);
+    return -1;
+  }
+
+  if (target!=*prov) {
+    tr_provenance_unref(*prov);
+    *prov=target;
+  }
+  return 0;
+}
+
+size_t tr_provenance_len(TR_PROVENANCE *prov)
+{
+  if (prov==NULL)
+    return 0;
+  return prov->n_hops;
+}
+
+/* Returns the ii-th hop, or NULL if there is none. Do not free the result. */
+TR_NAME *tr_provenance_get_hop(TR_PROVENANCE *prov, size_t ii)
+{
+  if ((prov==NULL) || (ii>=prov->n_hops))
+    return NULL;
+  return prov->hops[ii].name;
+}
+
+TR_NAME *tr_provenance_get_origin(TR_PROVENANCE *prov)
+{
+  return tr_provenance_get_hop(prov, 0);
+}
+
+TR_NAME *tr_provenance_get_last_hop(TR_PROVENANCE *prov)
+{
+  if ((prov==NULL) || (prov->n_hops==0))
+    return NULL;
+  return prov->hops[prov->n_hops-1].name;
+}
+
+/* Returns nonzero if name is one of the hops in prov */
+int tr_provenance_contains(TR_PROVENANCE *prov, TR_NAME *name)
+{
+  unsigned int hash=0;
+  uint64_t bits=0;
+  size_t ii=0;
+
+  if ((prov==NULL) || (name==NULL))
+    return 0;
+
+  hash=tr_name_hash(name);
+  bits=tr_provenance_filter_bits(hash);
+  if ((prov->filter & bits)!=bits)
+    return 0;
+
+  for (ii=0; ii<prov->n_hops; ii++) {
+    if ((prov->hops[ii].hash==hash) && (0==tr_name_cmp(prov->hops[ii].name, name)))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Compare two provenance lists
+ *
+ * Lists of different lengths always differ. Otherwise only the last nhops hops
+ * are compared; nhops==0 compares all of them, nhops==1 only the last hop.
+ *
+ * @return 0 if equivalent, nonzero if they differ
+ */
+int tr_provenance_cmp(TR_PROVENANCE *p1, TR_PROVENANCE *p2, size_t nhops)
+{
+  size_t ii=0;
+
+  if ((p1==NULL) || (p2==NULL))
+    return p1!=p2; /* 0 if both null, 1 if only one null */
+
+  if (p1->n_hops!=p2->n_hops)
+    return 1;
+
+  if ((nhops==0) || (nhops>p1->n_hops))
+    nhops=p1->n_hops;
+
+  for (ii=p1->n_hops-nhops; ii<p1->n_hops; ii++) {
+    if ((p1->hops[ii].hash!=p2->hops[ii].hash)
+        || (0!=tr_name_cmp(p1->hops[ii].name, p2->hops[ii].name)))
+      return 1;
+  }
+  return 0;
+}
+
+/* Encode as a JSON array of strings. A NULL list encodes as an empty array. */
+json_t *tr_provenance_to_json(TR_PROVENANCE *prov)
+{
+  json_t *jprov=json_array();
+  json_t *jhop=NULL;
+  size_t ii=0;
+
+  if (jprov==NULL)
+    return NULL;
+
+  for (ii=0; ii<tr_provenance_len(prov); ii++) {
+    jhop=tr_name_to_json_string(prov->hops[ii].name);
+    if ((jhop==NULL) || (0!=json_array_append_new(jprov, jhop))) {
+      json_decref(jprov);
+      return NULL;
+    }
+  }
+  return jprov;
+}
+
+/* Decode a JSON array of strings. Returns NULL if jprov is not an array of strings. */
+TR_PROVENANCE *tr_provenance_from_json(json_t *jprov)
+{
+  TR_PROVENANCE *prov=NULL;
+  TR_NAME *name=NULL;
+  const char *s=NULL;
+  size_t ii=0;
+
+  if (!json_is_array(jprov)) {
+    tr_debug("tr_provenance_from_json: provenance is not an array.");
+    return NULL;
+  }
+
+  prov=tr_provenance_new();
+  if ((prov==NULL) || (0!=tr_provenance_reserve(prov, json_array_size(jprov))))
+    goto fail;
+
+  for (ii=0; ii<json_array_size(jprov); ii++) {
+    s=json_string_value(json_array_get(jprov, ii));
+    if (s==NULL) {
+      tr_debug("tr_provenance_from_json: non-string entry in provenance list.");
+      goto fail;
+    }
+    name=tr_new_name(s);
+    if ((name==NULL) || (0!=tr_provenance_append_hop(prov, name))) {
+      if (name!=NULL)
+        tr_free_name(name);
+      goto fail;
+    }
+  }
+  return prov;
+
+fail:
+  tr_provenance_unref(prov);
+  return NULL;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <talloc.h>
+#include <glib.h>
+
+#include <tr_reclaim.h>
+
+/* How it works: the epoch only advances from e to e+1 once no reader is left that
+ * entered in epoch e-1 (the slot e+1 is about to reuse). A reader that entered but
+ * finds the epoch moved on before it was counted tries again. So after a step to e,
+ * every reader still inside entered in e-1 or e. An object retired in epoch t can
+ * only have been loaded by a reader that entered in t or earlier, and once the epoch
+ * reaches t+2 none of those is left inside. */
+
+static void tr_reclaim_item_free(TR_RECLAIM_ITEM *item)
+{
+  item->free_fn(item->obj);
+  g_free(item);
+}
+
+static int tr_reclaim_destructor(void *object)
+{
+  TR_RECLAIM *rcl=talloc_get_type_abort(object, TR_RECLAIM);
+
+  /* no reader may be inside by now */
+  if (rcl->retired!=NULL)
+    g_queue_free_full(rcl->retired, (GDestroyNotify) tr_reclaim_item_free);
+  return 0;
+}
+
+TR_RECLAIM *tr_reclaim_new(TALLOC_CTX *mem_ctx)
+{
+  TR_RECLAIM *rcl=talloc(mem_ctx, TR_RECLAIM);
+
+  if (rcl!=NULL) {
+    rcl->epoch=0;
+    rcl->n_active[0]=0;
+    rcl->n_active[1]=0;
+    rcl->retired=g_queue_new();
+    talloc_set_destructor((void *)rcl, tr_reclaim_destructor);
+  }
+  return rcl;
+}
+
+/* Frees any objects still retired. */
+void tr_reclaim_free(TR_RECLAIM *rcl)
+{
+  talloc_free(rcl);
+}
+
+/**
+ * Start a read
+ *
+ * Call before loading the shared pointer, and call tr_reclaim_exit() once a
+ * reference to the object has been taken. Safe in any thread.
+ *
+ * @param rcl Reclaimer guarding the pointer
+ * @return Slot to pass to tr_reclaim_exit()
+ */
+unsigned int tr_reclaim_enter(TR_RECLAIM *rcl)
+{
+  guint epoch=0;
+
+  /* retries only if the owner advances the epoch in between */
+  while (1) {
+    epoch=(guint)g_atomic_int_get(&(rcl->epoch));
+    g_atomic_int_inc(&(rcl->n_active[epoch&1]));
+    if ((guint)g_atomic_int_get(&(rcl->epoch))==epoch)
+      return epoch&1;
+    g_atomic_int_add(&(rcl->n_active[epoch&1]), -1);
+  }
+}
+
+void tr_reclaim_exit(TR_RECLAIM *rcl, unsigned int slot)
+{
+  g_atomic_int_add(&(rcl->n_active[slot]), -1);
+}
+
+/**
+ * Hand over an object that readers can no longer find
+ *
+ * The shared pointer must already point elsewhere. The object is freed with
+ * free_fn by a later tr_reclaim_poll(), in the owner thread.
+ *
+ * @param rcl Reclaimer guarding the pointer
+ * @param obj The replaced object
+ * @param free_fn Function to free it with
+ */
+void tr_reclaim_retire(TR_RECLAIM *rcl, void *obj, TR_RECLAIM_FREE_FN free_fn)
+{
+  TR_RECLAIM_ITEM *item=g_new(TR_RECLAIM_ITEM, 1);
+
+  item->obj=obj;
+  item->free_fn=free_fn;
+  item->epoch=(guint)g_atomic_int_get(&(rcl->epoch));
+  g_queue_push_tail(rcl->retired, item);
+}
+
+/* Free the retired objects no reader can still be loading. */
+static void tr_reclaim_flush(TR_RECLAIM *rcl, guint epoch)
+{
+  TR_RECLAIM_ITEM *item=NULL;
+
+  while (NULL!=(item=g_queue_peek_head(rcl->retired))) {
+    if (epoch - item->epoch < 2)
+      break;
+    g_queue_pop_head(rcl->retired);
+    tr_reclaim_item_free(item);
+  }
+}
+
+/**
+ * Free whatever retired objects can be freed, without waiting
+ *
+ * Call from the owner thread after retiring objects, and again later while
+ * any remain. With no reader inside, everything retired so far is freed.
+ *
+ * @param rcl Reclaimer
+ * @return Number of objects still retired
+ */
+size_t tr_reclaim_poll(TR_RECLAIM *rcl)
+{
+  guint epoch=(guint)g_atomic_int_get(&(rcl->epoch));
+  int ii=0;
+
+  tr_reclaim_flush(rcl, epoch);
+
+  /* two steps are enough for everything retired so far */
+  for (ii=0; (ii<2) && !g_queue_is_empty(rcl->retired); ii++) {
+    if (g_atomic_int_get(&(rcl->n_active[(epoch+1)&1]))>0)
+      break; /* readers from the previous epoch are still inside */
+    epoch++;
+    g_atomic_int_set(&(rcl->epoch), (gint)epoch);
+    tr_reclaim_flush(rcl, epoch);
+  }
+  return g_queue_get_length(rcl->retired);
+}
@@ -72,6 +72,7 @@ TR_RP_REALM *tr_rp_realm_new(TALLOC_CTX *mem_ctx)
     rp->next=NULL;
     rp->realm_id=NULL;
     rp->refcount=0;
+    rp->memberships=NULL;
     talloc_set_destructor((void *)rp, tr_rp_realm_destructor);
   }
   return rp;
@@ -113,6 +114,26 @@ TR_RP_REALM *tr_rp_realm_add_func(TR_RP_REALM *head, TR_RP_REALM *new)
   return head;
 }
 
+/* Like tr_rp_realm_add_func(), but looks for the end of the list starting from *tail
+ * (if not null), then points *tail at the new end. Keeping *tail between calls makes
+ * building a long list linear in its length. *tail must be on the list, or null.
+ * Use the tr_rp_realm_add_tail() macro. */
+TR_RP_REALM *tr_rp_realm_add_tail_func(TR_RP_REALM *head, TR_RP_REALM **tail, TR_RP_REALM *new)
+{
+  if (head==NULL) {
+    head=new;
+    *tail=tr_rp_realm_tail(head);
+  } else {
+    tr_rp_realm_tail((*tail!=NULL)?(*tail):head)->next=new;
+    while (new!=NULL) {
+      talloc_steal(head, new); /* put it in the right context */
+      *tail=new;
+      new=new->next;
+    }
+  }
+  return head;
+}
+
 /* use the macro */
 TR_RP_REALM *tr_rp_realm_remove_func(TR_RP_REALM *head, TR_RP_REALM *remove)
 {
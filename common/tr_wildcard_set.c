@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <talloc.h>
+
+#include <tr_name_internal.h>
+#include <tr_wildcard_set.h>
+
+TR_WILDCARD_SET *tr_wildcard_set_new(TALLOC_CTX *mem_ctx)
+{
+  TR_WILDCARD_SET *set=talloc(mem_ctx, TR_WILDCARD_SET);
+  if (set!=NULL) {
+    set->root=(TR_WILDCARD_NODE){'\0', NULL, NULL, NULL, NULL};
+    set->n_patterns=0;
+  }
+  return set;
+}
+
+void tr_wildcard_set_free(TR_WILDCARD_SET *set)
+{
+  talloc_free(set);
+}
+
+static TR_WILDCARD_NODE *tr_wildcard_node_child(TR_WILDCARD_NODE *node, char c)
+{
+  for (node=node->child; node!=NULL; node=node->sibling) {
+    if (node->c==c)
+      return node;
+  }
+  return NULL;
+}
+
+/**
+ * Add a pattern to the set
+ *
+ * The set keeps a pointer to the pattern, which must outlive the set. Empty patterns
+ * never match anything, so they are ignored. If an equal pattern is already in the
+ * set, that one is kept.
+ *
+ * @param set Set to add to
+ * @param pattern Pattern to add
+ * @return 0 on success, nonzero on error
+ */
+int tr_wildcard_set_add(TR_WILDCARD_SET *set, TR_NAME *pattern)
+{
+  TR_WILDCARD_NODE *node=&(set->root);
+  TR_WILDCARD_NODE *child=NULL;
+  size_t start=0;
+  size_t ii=0;
+
+  if ((pattern==NULL) || (pattern->len<=0))
+    return 0;
+
+  if (pattern->buf[0]=='*')
+    start=1;
+
+  /* walk or extend the trie from the last character back to the first fixed one */
+  for (ii=(size_t) pattern->len; ii>start; ii--) {
+    child=tr_wildcard_node_child(node, pattern->buf[ii-1]);
+    if (child==NULL) {
+      child=talloc(set, TR_WILDCARD_NODE);
+      if (child==NULL)
+        return 1;
+      *child=(TR_WILDCARD_NODE){pattern->buf[ii-1], NULL, node->child, NULL, NULL};
+      node->child=child;
+    }
+    node=child;
+  }
+
+  if (start==1) {
+    if (node->suffix==NULL) {
+      node->suffix=pattern;
+      set->n_patterns++;
+    }
+  } else {
+    if (node->exact==NULL) {
+      node->exact=pattern;
+      set->n_patterns++;
+    }
+  }
+  return 0;
+}
+
+/* number of distinct patterns in the set */
+size_t tr_wildcard_set_size(TR_WILDCARD_SET *set)
+{
+  if (set==NULL)
+    return 0;
+  return set->n_patterns;
+}
+
+/**
+ * Find a pattern in the set that matches a string
+ *
+ * If more than one pattern matches, wildcard patterns with shorter fixed parts are
+ * preferred, and an exact match is returned only if no wildcard pattern matches.
+ *
+ * @param set Set to search
+ * @param s String to match, need not be null terminated
+ * @param len Length of s
+ * @return Borrowed pointer to the matching pattern, or NULL if none matches
+ */
+TR_NAME *tr_wildcard_set_find(TR_WILDCARD_SET *set, const char *s, size_t len)
+{
+  TR_WILDCARD_NODE *node=NULL;
+  size_t ii=0;
+
+  if (set==NULL)
+    return NULL;
+
+  node=&(set->root);
+  for (ii=len; ; ii--) {
+    if (node->suffix!=NULL)
+      return node->suffix;
+    if (ii==0)
+      break;
+    node=tr_wildcard_node_child(node, s[ii-1]);
+    if (node==NULL)
+      return NULL;
+  }
+  return node->exact; /* consumed all of s */
+}
+
+TR_NAME *tr_wildcard_set_find_name(TR_WILDCARD_SET *set, const TR_NAME *name)
+{
+  if (name==NULL)
+    return NULL;
+  return tr_wildcard_set_find(set, name->buf, (size_t) name->len);
+}
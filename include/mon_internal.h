@@ -101,6 +101,7 @@ enum mon_opt_type {
   OPT_TYPE_SHOW_TID_REQS_FAILED,
   OPT_TYPE_SHOW_TID_ERROR_COUNT,
   OPT_TYPE_SHOW_TID_REQS_PENDING,
+  OPT_TYPE_SHOW_TRP_QUEUE,
 
   // Dynamic trust router state
   OPT_TYPE_SHOW_ROUTES,
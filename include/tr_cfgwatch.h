@@ -44,7 +44,8 @@
 /* interval in seconds */
 #define TR_CFGWATCH_DEFAULT_POLL 1
 #define TR_CFGWATCH_DEFAULT_SETTLE 5
-/* note: settling time is minimum - only checked on poll intervals */
+/* note: when polling, settling time is minimum - only checked on poll intervals.
+ * When watching with inotify, the update happens one settling time after the last change. */
 
 struct tr_fstat {
   char *name;
@@ -55,6 +56,7 @@ typedef struct tr_cfgwatch_data {
   struct timeval poll_interval; /* how often should we check for updates? */
   struct timeval settling_time; /* how long should we wait for changes to settle before updating? */
   char *config_dir; /* what directory are we watching? */
+  char *snapshot_file; /* configuration snapshot to start from and keep up to date, or NULL */
   struct tr_fstat *fstat_list; /* file names and mtimes */
   int n_files; /* number of files in fstat_list */
   int change_detected; /* have we detected a change? */
@@ -62,6 +64,11 @@ typedef struct tr_cfgwatch_data {
   TR_CFG_MGR *cfg_mgr; /* what trust router config are we updating? */
   void (*update_cb)(TR_CFG *new_cfg, void *cookie); /* callback after config updated */
   void *update_cookie; /* data for the update_cb() */
+  int inotify_fd; /* -1 if not watching with inotify */
+  struct event *inotify_ev; /* fires when inotify_fd is readable */
+  struct event *settle_ev; /* one-shot timer, applies the config once changes settle */
+  struct event *poll_ev; /* poll timer, used if inotify is not available */
+  struct event *reclaim_ev; /* one-shot timer, frees replaced configurations readers were still loading */
 } TR_CFGWATCH;
 
 
@@ -38,10 +38,12 @@
 #include <stdio.h>
 #include <talloc.h>
 #include <time.h>
+#include <glib.h>
 
 #include <tr_idp.h>
 #include <tr_rp.h>
 #include <tr_apc.h>
+#include <tr_provenance.h>
 
 typedef struct tr_comm_table TR_COMM_TABLE;
 
@@ -60,21 +62,33 @@ typedef struct tr_comm {
   TR_NAME *owner_contact; /* contact email */
   time_t expiration_interval; /*Minutes to key expiration; only valid for an APC*/
   unsigned int refcount; /* how many TR_COMM_MEMBs refer to this community? */
+  struct tr_comm_memb *members; /* memberships in this community, linked by comm_link */
 } TR_COMM;
 
+/* Links for the per-community and per-realm membership lists. These hold only the
+ * records on the table's main list, one per realm/comm/role. The head's prev points
+ * to the tail. */
+typedef struct tr_comm_memb_link {
+  struct tr_comm_memb *next;
+  struct tr_comm_memb *prev;
+} TR_COMM_MEMB_LINK;
+
 /* community membership - link realms to their communities */
 typedef struct tr_comm_memb {
   struct tr_comm_memb *next;
+  struct tr_comm_memb *prev; /* previous record on the table's main list, null for the head or if not on it */
   struct tr_comm_memb *origin_next; /* for multiple copies from different origins */
+  TR_COMM_MEMB_LINK comm_link; /* list headed by comm->members */
+  TR_COMM_MEMB_LINK realm_link; /* list headed by the realm's memberships */
   TR_IDP_REALM *idp; /* only set one of idp and rp, other null */
   TR_RP_REALM *rp; /* only set one of idp and rp, other null */
   TR_COMM *comm;
-  TR_NAME *origin;
-  json_t *provenance; /* array of names of systems traversed */
+  TR_PROVENANCE *provenance; /* systems traversed, first is the origin */
   unsigned int interval;
   struct timespec *expiry;
   unsigned int times_expired; /* how many times has this expired? */
   int triggered; /* do we need to send this with triggered updates? */
+  int provisional; /* restored from saved state, not yet confirmed by the peer */
 } TR_COMM_MEMB;
 
 /* table of communities/memberships */
@@ -82,8 +96,19 @@ struct tr_comm_table {
   TR_COMM *comms; /* all communities */
   TR_IDP_REALM *idp_realms; /* all idp realms */
   TR_RP_REALM *rp_realms; /* all rp realms */
+  /* where to start looking for the ends of the lists above (null: start at the head) */
+  TR_COMM *comms_tail;
+  TR_IDP_REALM *idp_realms_tail;
+  TR_RP_REALM *rp_realms_tail;
   TR_COMM_MEMB *memberships; /* head of the linked list of membership records */
-}; 
+  TR_COMM_MEMB *memberships_tail; /* last record on the main membership list */
+  /* indexes, maintained by the tr_comm_table_add/remove/sweep functions */
+  GHashTable *comm_index; /* community ID -> first TR_COMM with that ID */
+  GHashTable *idp_realm_index; /* realm ID -> first TR_IDP_REALM with that ID */
+  GHashTable *rp_realm_index; /* realm ID -> first TR_RP_REALM with that ID */
+  GHashTable *idp_memb_index; /* (realm ID, comm ID) -> IdP membership on the main list */
+  GHashTable *rp_memb_index; /* (realm ID, comm ID) -> RP membership on the main list */
+};
 
 typedef enum tr_realm_role {
   TR_ROLE_UNKNOWN=0,
@@ -102,6 +127,7 @@ typedef struct tr_comm_iter {
   TR_COMM *cur_comm;
   TR_COMM_MEMB *cur_memb;
   TR_COMM_MEMB *cur_orig_head; /* for iterating along orig_next list */
+  TR_COMM_MEMB *next_list; /* membership list to continue with when cur_memb's ends */
   TR_NAME *match; /* realm or comm to match */
   TR_REALM *realm; /* handle so caller does not have to manage memory, private */
 } TR_COMM_ITER;
@@ -147,8 +173,8 @@ void tr_comm_memb_set_comm(TR_COMM_MEMB *memb, TR_COMM *comm);
 TR_COMM *tr_comm_memb_get_comm(TR_COMM_MEMB *memb);
 TR_NAME *tr_comm_memb_get_origin(TR_COMM_MEMB *memb);
 TR_NAME *tr_comm_memb_dup_origin(TR_COMM_MEMB *memb);
-json_t *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb);
-void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, json_t *prov);
+TR_PROVENANCE *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb);
+void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, TR_PROVENANCE *prov);
 void tr_comm_memb_add_to_provenance(TR_COMM_MEMB *memb, TR_NAME *hop);
 size_t tr_comm_memb_provenance_len(TR_COMM_MEMB *memb);
 void tr_comm_memb_set_interval(TR_COMM_MEMB *memb, unsigned int interval);
@@ -159,6 +185,8 @@ struct timespec *tr_comm_memb_get_expiry_realtime(TR_COMM_MEMB *memb, struct tim
 int tr_comm_memb_is_expired(TR_COMM_MEMB *memb, struct timespec *curtime);
 void tr_comm_memb_set_triggered(TR_COMM_MEMB *memb, int trig);
 int tr_comm_memb_is_triggered(TR_COMM_MEMB *memb);
+void tr_comm_memb_set_provisional(TR_COMM_MEMB *memb, int provisional);
+int tr_comm_memb_is_provisional(TR_COMM_MEMB *memb);
 void tr_comm_memb_reset_times_expired(TR_COMM_MEMB *memb);
 void tr_comm_memb_expire(TR_COMM_MEMB *memb);
 unsigned int tr_comm_memb_get_times_expired(TR_COMM_MEMB *memb);
@@ -178,8 +206,8 @@ TR_NAME *tr_comm_dup_owner_realm(TR_COMM *comm);
 void tr_comm_set_owner_contact(TR_COMM *comm, TR_NAME *contact);
 TR_NAME *tr_comm_get_owner_contact(TR_COMM *comm);
 TR_NAME *tr_comm_dup_owner_contact(TR_COMM *comm);
-void tr_comm_add_idp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_IDP_REALM *realm, unsigned int interval, json_t *provenance, struct timespec *expiry);
-void tr_comm_add_rp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_RP_REALM *realm, unsigned int interval, json_t *provenance, struct timespec *expiry);
+void tr_comm_add_idp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_IDP_REALM *realm, unsigned int interval, TR_PROVENANCE *provenance, struct timespec *expiry);
+void tr_comm_add_rp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_RP_REALM *realm, unsigned int interval, TR_PROVENANCE *provenance, struct timespec *expiry);
 TR_RP_REALM *tr_comm_find_rp(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *rp_realm);
 TR_IDP_REALM *tr_comm_find_idp(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *idp_realm);
 const char *tr_comm_type_to_str(TR_COMM_TYPE type);
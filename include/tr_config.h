@@ -37,16 +37,21 @@
 
 #include <stdio.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <jansson.h>
 #include <syslog.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <talloc.h>
 #include <glib.h>
 
+#include <tr_debug.h>
+#include <tr_wildcard_set.h>
 #include <tr_comm.h>
 #include <tr_rp.h>
 #include <tr_rp_client.h>
 #include <tr_idp.h>
+#include <tr_reclaim.h>
 #include <trp_ptable.h>
 #include <trp_internal.h>
 
@@ -60,14 +65,20 @@
 #define TR_DEFAULT_TRP_CONNECT_INTERVAL 10
 #define TR_DEFAULT_TRP_UPDATE_INTERVAL 30
 #define TR_DEFAULT_TRP_SWEEP_INTERVAL 30
+#define TR_DEFAULT_TRP_UPDATE_MAX_RECORDS 1 /* one update per message, understood by all peers */
+#define TR_DEFAULT_TRP_UPDATE_DELTA 0 /* full scheduled updates, understood by all peers */
+#define TR_DEFAULT_TRP_EVENT_TRANSPORT 0 /* one thread per peer connection */
+#define TR_DEFAULT_TRP_SEND_COALESCE 0 /* one write per outgoing message */
 #define TR_DEFAULT_TID_REQ_TIMEOUT 5
 #define TR_DEFAULT_TID_RESP_NUMER 2
 #define TR_DEFAULT_TID_RESP_DENOM 3
+#define TR_DEFAULT_PARSE_THREADS 4 /* threads used to parse config files */
 
 /* limits on values for validations */
 #define TR_MIN_TRP_CONNECT_INTERVAL 5
 #define TR_MIN_TRP_SWEEP_INTERVAL 5
 #define TR_MIN_TRP_UPDATE_INTERVAL 5
+#define TR_MIN_TRP_UPDATE_MAX_RECORDS 1
 #define TR_MIN_CFG_POLL_INTERVAL 1
 #define TR_MIN_CFG_SETTLING_TIME 0
 #define TR_MIN_TID_REQ_TIMEOUT 1
@@ -90,10 +101,19 @@ typedef struct tr_cfg_internal {
   const char *hostname;
   int log_threshold;
   int console_threshold;
+  int log_async; /* write log messages from a separate thread if nonzero */
+  TR_LOG_OVERFLOW log_overflow; /* what to do when the log queue is full */
+  unsigned int debug_sample_one_in; /* debug-log one in this many TID requests, 0 for none */
+  TR_GSS_NAMES *debug_sample_gss_names; /* debug-log all TID requests from these clients */
+  TR_WILDCARD_SET *debug_sample_realms; /* debug-log all TID requests for these realms */
   unsigned int cfg_poll_interval;
   unsigned int cfg_settling_time;
   unsigned int trp_sweep_interval;
   unsigned int trp_update_interval;
+  unsigned int trp_update_max_records; /* max inforecs packed into one TRP update message */
+  int trp_update_delta; /* send only changed entries in scheduled updates if nonzero */
+  int trp_event_transport; /* service established peer connections from the event loop if nonzero */
+  int trp_send_coalesce; /* combine queued outgoing messages into one write if nonzero */
   unsigned int trp_connect_interval;
   unsigned int tid_req_timeout;
   unsigned int tid_resp_numer; /* numerator of fraction of AAA servers to wait for in unshared mode */
@@ -115,13 +135,31 @@ typedef struct tr_cfg {
   TR_AAA_SERVER *default_servers;	/* default server list */
 
   GArray *files; /* files loaded to make this configuration */
+
+  unsigned int generation; /* set when the configuration is applied */
+  gint refcount; /* held by the manager while active and by each reader, accessed atomically */
 } TR_CFG;
 
+/* parsed config file, kept while its status on disk is unchanged */
+typedef struct tr_cfg_jcache_entry {
+  json_t *jcfg;
+  struct timespec mtime;
+  off_t size;
+  ino_t inode;
+  unsigned int generation; /* parse in which the file was last seen */
+} TR_CFG_JCACHE_ENTRY;
+
 typedef struct tr_cfg_mgr {
-  TR_CFG *active;
+  TR_CFG *active; /* use tr_cfg_mgr_acquire() to read this outside the main thread; published atomically */
   TR_CFG *new;
+  unsigned int generation; /* generation of the most recently applied configuration */
+  TR_RECLAIM *reclaim; /* frees replaced configurations once no reader can still be loading them */
+  GHashTable *jcfg_cache; /* parsed JSON of each config file, reused while the file is unchanged */
+  unsigned int jcfg_generation; /* incremented on each parse; stale cache entries are dropped */
+  unsigned int parse_threads; /* most threads to parse config files with, including the caller */
 } TR_CFG_MGR;
 
+int tr_is_config_file_name(const char *name);
 int tr_find_config_files(const char *config_dir, struct dirent ***cfg_files);
 void tr_free_config_file_list(int n, struct dirent ***cfg_files);
 TR_CFG_RC tr_parse_config(TR_CFG_MGR *cfg_mgr, unsigned int n_files, char **files_with_paths);
@@ -131,6 +169,12 @@ TR_CFG *tr_cfg_new(TALLOC_CTX *mem_ctx);
 TR_CFG_MGR *tr_cfg_mgr_new(TALLOC_CTX *mem_ctx);
 void tr_cfg_free(TR_CFG *cfg);
 void tr_cfg_mgr_free(TR_CFG_MGR *cfg);
+TR_CFG *tr_cfg_mgr_acquire(TR_CFG_MGR *cfg_mgr);
+void tr_cfg_release(TR_CFG *cfg);
+size_t tr_cfg_mgr_reclaim(TR_CFG_MGR *cfg_mgr);
+unsigned int tr_cfg_get_generation(TR_CFG *cfg);
+int tr_cfg_jcache_entry_current(TR_CFG_JCACHE_ENTRY *entry, struct stat *file_status);
+void tr_cfg_jcache_store(TR_CFG_MGR *cfg_mgr, const char *file_with_path, struct stat *file_status, json_t *jcfg);
 
 void tr_print_config(TR_CFG *cfg);
 void tr_print_comms(TR_COMM_TABLE *ctab);
@@ -140,6 +184,7 @@ void tr_print_comm_rps(TR_COMM_TABLE *ctab, TR_COMM *comm);
 /* tr_config_internal.c */
 TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jint);
 TR_CFG_RC tr_cfg_validate_internal(TR_CFG_INTERNAL *int_cfg);
+int tr_cfg_debug_sampled(TR_CFG_INTERNAL *internal, TR_NAME *gss_name, TR_NAME *realm);
 
 /* tr_config_comms.c */
 TR_IDP_REALM *tr_cfg_find_idp (TR_CFG *tr_cfg, TR_NAME *idp_id, TR_CFG_RC *rc);
@@ -166,4 +211,11 @@ TR_CFG_RC tr_cfg_parse_gss_names(TALLOC_CTX *mem_ctx, json_t *jgss_names, TR_GSS
 /* tr_config_encoders.c */
 json_t *tr_cfg_files_to_json_array(TR_CFG *cfg);
 
+/* tr_config_snapshot.c */
+TR_CFG_RC tr_cfg_write_snapshot(TR_CFG_MGR *cfg_mgr, const char *snapshot_file);
+TR_CFG_RC tr_cfg_load_snapshot(TR_CFG_MGR *cfg_mgr,
+                               const char *snapshot_file,
+                               unsigned int n_files,
+                               char **files_with_paths);
+
 #endif
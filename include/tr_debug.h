@@ -39,16 +39,49 @@
 #include <trust_router/tr_versioning.h>
 #include <tid_internal.h>
 
+/* Most verbose severity that any log output accepts. Kept up to date by
+ * tr_log_threshold() and tr_console_threshold(). */
+TR_EXPORT extern int tr_log_max_sev;
+
+/* Number of threads handling a request sampled for debug logging */
+TR_EXPORT extern int tr_log_sampling;
+
+#define tr_log_enabled(sev) \
+  (((sev) <= tr_log_max_sev) || (tr_log_sampling && ((sev) <= LOG_DEBUG) && tr_log_get_sampled()))
+
+/* Only evaluate the arguments if the message will be written somewhere */
+#define tr_log_if_enabled(sev, ...)             \
+  do {                                          \
+    if (tr_log_enabled(sev))                    \
+      tr_log((sev), __VA_ARGS__);               \
+  } while (0)
+
 /* Log macros according to severity levels */
 
-#define tr_emerg(...)   tr_log(LOG_EMERG, __VA_ARGS__)
-#define tr_alert(...)   tr_log(LOG_ALERT, __VA_ARGS__)
-#define tr_crit(...)    tr_log(LOG_CRIT, __VA_ARGS__)
-#define tr_err(...)     tr_log(LOG_ERR, __VA_ARGS__)
-#define tr_warning(...) tr_log(LOG_WARNING, __VA_ARGS__)
-#define tr_notice(...)  tr_log(LOG_NOTICE, __VA_ARGS__)
-#define tr_info(...)    tr_log(LOG_INFO, __VA_ARGS__)
-#define tr_debug(...)   tr_log(LOG_DEBUG, __VA_ARGS__)
+#define tr_emerg(...)   tr_log_if_enabled(LOG_EMERG, __VA_ARGS__)
+#define tr_alert(...)   tr_log_if_enabled(LOG_ALERT, __VA_ARGS__)
+#define tr_crit(...)    tr_log_if_enabled(LOG_CRIT, __VA_ARGS__)
+#define tr_err(...)     tr_log_if_enabled(LOG_ERR, __VA_ARGS__)
+#define tr_warning(...) tr_log_if_enabled(LOG_WARNING, __VA_ARGS__)
+#define tr_notice(...)  tr_log_if_enabled(LOG_NOTICE, __VA_ARGS__)
+#define tr_info(...)    tr_log_if_enabled(LOG_INFO, __VA_ARGS__)
+#define tr_debug(...)   tr_log_if_enabled(LOG_DEBUG, __VA_ARGS__)
+
+/* Debug messages on per-message or per-lookup paths. Configuring with
+ * --disable-hot-debug-log defines TR_LOG_STRIP_HOT_DEBUG, which compiles
+ * these out entirely (the arguments are still type checked). */
+#ifdef TR_LOG_STRIP_HOT_DEBUG
+#define tr_debug_hot(...) do { if (0) tr_log(LOG_DEBUG, __VA_ARGS__); } while (0)
+#else
+#define tr_debug_hot(...) tr_debug(__VA_ARGS__)
+#endif
+
+/* What to do with a message when the logging thread's queue is full */
+typedef enum tr_log_overflow {
+  TR_LOG_OVERFLOW_DROP = 0, /* drop and count it (audit messages are written directly) */
+  TR_LOG_OVERFLOW_BLOCK, /* wait for the log thread to make room */
+  TR_LOG_OVERFLOW_SYNC, /* write it directly from the logging thread */
+} TR_LOG_OVERFLOW;
 
 TR_EXPORT const char *sev2str(int sev);
 TR_EXPORT int str2sev(const char *sev);
@@ -57,6 +90,11 @@ TR_EXPORT void tr_console_threshold(const int sev);
 TR_EXPORT void tr_log_open(void);
 TR_EXPORT void tr_log_close(void);
 TR_EXPORT void tr_log(const int sev, const char *fmt, ...);
+TR_EXPORT int tr_log_async_start(TR_LOG_OVERFLOW overflow);
+TR_EXPORT void tr_log_async_stop(void);
+TR_EXPORT unsigned long tr_log_async_dropped(void);
+TR_EXPORT void tr_log_set_sampled(int sampled);
+TR_EXPORT int tr_log_get_sampled(void);
 TR_EXPORT void tr_audit_resp(TID_RESP *resp);
 TR_EXPORT void tr_audit_req(TID_REQ *req);
 
@@ -41,6 +41,7 @@
 
 #include <tr_list.h>
 #include <tr_name_internal.h>
+#include <tr_wildcard_set.h>
 #include <trust_router/tr_constraint.h>
 #include <trust_router/tid.h>
 #include <trust_router/trp.h>
@@ -67,6 +68,7 @@ typedef enum {
 typedef struct tr_fspec {
   TR_NAME *field;
   TR_LIST *match;
+  TR_WILDCARD_SET *matcher; /* match list, NULL until compiled */
 } TR_FSPEC;
 
 typedef struct tr_fline {
@@ -79,12 +81,14 @@ typedef struct tr_fline {
 typedef struct tr_filter {
   TR_FILTER_TYPE type;
   TR_LIST *lines;
+  struct tr_filter_compiled *compiled; /* NULL until compiled */
 } TR_FILTER;
 
 typedef struct tr_filter_set TR_FILTER_SET;
 struct tr_filter_set {
   TR_FILTER *this;
   TR_FILTER_SET *next;
+  char *id; /* digest of the set's contents, kept on the first element by tr_filter_set_add() */
 };
 
 /**
@@ -103,6 +107,7 @@ TR_FILTER_SET *tr_filter_set_new(TALLOC_CTX *mem_ctx);
 void tr_filter_set_free(TR_FILTER_SET *fs);
 int tr_filter_set_add(TR_FILTER_SET *set, TR_FILTER *new);
 TR_FILTER *tr_filter_set_get(TR_FILTER_SET *set, TR_FILTER_TYPE type);
+const char *tr_filter_set_get_id(TR_FILTER_SET *set);
 
 TR_FILTER *tr_filter_new(TALLOC_CTX *mem_ctx);
 void tr_filter_free(TR_FILTER *filt);
@@ -119,6 +124,7 @@ TR_FSPEC *tr_fspec_new(TALLOC_CTX *mem_ctx);
 void tr_fspec_free(TR_FSPEC *fspec);
 TR_NAME *tr_fspec_add_match(TR_FSPEC *fspec, TR_NAME *match);
 
+int tr_fspec_compile(TR_FSPEC *fspec);
 int tr_fspec_matches(TR_FSPEC *fspec, TR_FILTER_TYPE ftype, TR_FILTER_TARGET *target);
 
 /* Iterator for TR_FILTER lines */
@@ -148,6 +154,7 @@ typedef TR_LIST_ITER TR_FLINE_ITER;
 /*In tr_constraint.c and exported, but not really a public symbol; needed by tr_filter.c and by tr_constraint.c*/
 int TR_EXPORT tr_prefix_wildcard_match(const char *str, const char *wc_str);
 
+int tr_filter_compile(TR_FILTER *filt);
 int tr_filter_apply(TR_FILTER_TARGET *target, TR_FILTER *filt, TR_CONSTRAINT_SET **constraints, TR_FILTER_ACTION *out_action);
 void tr_filter_target_free(TR_FILTER_TARGET *target);
 TR_FILTER_TARGET *tr_filter_target_tid_req(TALLOC_CTX *mem_ctx, TID_REQ *req);
@@ -59,6 +59,7 @@ typedef struct tr_idp_realm {
   TR_APC *apcs;
   TR_REALM_ORIGIN origin; /* how did we learn about this realm? */
   unsigned int refcount; /* how many TR_COMM_MEMBs refer to this realm */
+  struct tr_comm_memb *memberships; /* this realm's memberships in its community table, see tr_comm.h */
 } TR_IDP_REALM;
   
 TR_IDP_REALM *tr_idp_realm_new(TALLOC_CTX *mem_ctx);
@@ -71,6 +72,8 @@ TR_APC *tr_idp_realm_get_apcs(TR_IDP_REALM *idp);
 TR_IDP_REALM *tr_idp_realm_lookup(TR_IDP_REALM *idp_realms, TR_NAME *idp_name);
 TR_IDP_REALM *tr_idp_realm_add_func(TR_IDP_REALM *head, TR_IDP_REALM *new);
 #define tr_idp_realm_add(head,new) ((head)=tr_idp_realm_add_func((head),(new)))
+TR_IDP_REALM *tr_idp_realm_add_tail_func(TR_IDP_REALM *head, TR_IDP_REALM **tail, TR_IDP_REALM *new);
+#define tr_idp_realm_add_tail(head,tail,new) ((head)=tr_idp_realm_add_tail_func((head),&(tail),(new)))
 TR_IDP_REALM *tr_idp_realm_remove_func(TR_IDP_REALM *head, TR_IDP_REALM *remove);
 #define tr_idp_realm_remove(head,remove) ((head)=tr_idp_realm_remove_func((head),(remove)))
 TR_IDP_REALM *tr_idp_realm_sweep_func(TR_IDP_REALM *head);
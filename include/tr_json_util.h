@@ -48,8 +48,9 @@
  */
 #define OBJECT_SET_OR_FAIL(jobj, key, val)     \
 do {                                           \
-  if (val)                                     \
-    json_object_set_new((jobj),(key),(val));   \
+  json_t *jval_=(val); /* evaluate once */     \
+  if (jval_)                                   \
+    json_object_set_new((jobj),(key),jval_);   \
   else                                         \
     goto cleanup;                              \
 } while (0)
@@ -64,8 +65,9 @@ do {                                           \
  */
 #define OBJECT_SET_OR_SKIP(jobj, key, val)     \
 do {                                           \
-  if (val)                                     \
-    json_object_set_new((jobj),(key),(val));   \
+  json_t *jval_=(val); /* evaluate once */     \
+  if (jval_)                                   \
+    json_object_set_new((jobj),(key),jval_);   \
 } while (0)
 
 
@@ -79,8 +81,9 @@ do {                                           \
  */
 #define ARRAY_APPEND_OR_FAIL(jary, val)        \
 do {                                           \
-  if (val)                                     \
-    json_array_append_new((jary),(val));       \
+  json_t *jval_=(val); /* evaluate once */     \
+  if (jval_)                                   \
+    json_array_append_new((jary),jval_);       \
   else                                         \
     goto cleanup;                              \
 } while (0)
@@ -35,15 +35,33 @@
 #ifndef _TR_MQ_H_
 #define _TR_MQ_H_
 
+#include <glib.h>
 #include <talloc.h>
 #include <pthread.h>
 #include <time.h>
 
+/* types of inter-thread messages */
+typedef enum tr_mq_msg_type {
+  TR_MQMSG_NONE=0,
+  TR_MQMSG_TRPC_SEND, /* message for a trpc to send to its peer */
+  TR_MQMSG_ABORT, /* tells a thread to shut down */
+  TR_MQMSG_MSG_RECEIVED, /* TRP message received by a trps connection thread */
+  TR_MQMSG_TRPC_CONNECTED,
+  TR_MQMSG_TRPC_DISCONNECTED,
+  TR_MQMSG_TRPS_CONNECTED,
+  TR_MQMSG_TRPS_DISCONNECTED,
+  TR_MQMSG_TRPS_EVENT_READY, /* incoming connection handed to event loop */
+  TR_MQMSG_TRPC_EVENT_READY, /* outgoing connection handed to event loop */
+  TR_MQMSG_TID_SUCCESS, /* response from an AAA server */
+  TR_MQMSG_TID_FAILURE
+} TR_MQ_MSG_TYPE;
+
 /* msg for inter-thread messaging */
 typedef struct tr_mq_msg TR_MQ_MSG;
 struct tr_mq_msg {
   TR_MQ_MSG *next;
-  char *message;
+  TR_MQ_MSG_TYPE type;
+  char *key; /* a queued message is superseded by a newer one with the same key, may be null */
   void *p; /* payload */
   void (*p_free)(void *); /* function to free payload */
 };
@@ -57,28 +75,67 @@ struct tr_mq {
   pthread_cond_t have_msg_cond;
   TR_MQ_MSG *head;
   TR_MQ_MSG *tail;
-  TR_MQ_NOTIFY_FN notify_cb; /* callback when queue becomes non-empty */
+  TR_MQ_MSG *intake; /* unkeyed messages added without the lock, newest first; atomic access only */
+  TR_MQ_NOTIFY_FN notify_cb; /* callback when queue becomes non-empty, not per message (see tr_mq_set_notify_cb()) */
   void *notify_cb_arg;
+  int wake_fd; /* eventfd signalled when messages arrive, or -1 (see tr_mq_enable_eventfd()) */
+  gint wake_pending; /* nonzero while wake_fd has an unacknowledged signal; atomic access only */
+  GHashTable *keyed; /* key -> queued message with that key */
+  unsigned int length;
+  unsigned int max_length; /* limit for tr_mq_add_bounded(), 0 for no limit */
+  unsigned int high_water; /* longest the queue has been */
+  unsigned long n_superseded;
+  unsigned long n_dropped;
+  unsigned long n_added; /* messages appended to the queue */
+  unsigned long n_wakeups; /* consumer wakeups acknowledged with tr_mq_eventfd_ack() */
 };
 
-/* message string for sending trpc messages */
-#define TR_MQMSG_TRPC_SEND "trpc send msg"
+/* result of adding to a queue */
+typedef enum tr_mq_rc {
+  TR_MQ_ADDED=0, /* appended to the queue */
+  TR_MQ_SUPERSEDED, /* replaced the payload of a queued message with the same key */
+  TR_MQ_FULL, /* queue was full, message dropped */
+  TR_MQ_ERROR
+} TR_MQ_RC;
+
+/* snapshot of queue statistics */
+typedef struct tr_mq_stats {
+  unsigned int length;
+  unsigned int max_length;
+  unsigned int high_water;
+  unsigned long n_superseded;
+  unsigned long n_dropped;
+  unsigned long n_added;
+  unsigned long n_wakeups;
+} TR_MQ_STATS;
 
-TR_MQ_MSG *tr_mq_msg_new(TALLOC_CTX *mem_ctx, const char *msg);
+TR_MQ_MSG *tr_mq_msg_new(TALLOC_CTX *mem_ctx, TR_MQ_MSG_TYPE type);
 void tr_mq_msg_free(TR_MQ_MSG *msg);
-const char *tr_mq_msg_get_message(TR_MQ_MSG *msg);
+TR_MQ_MSG_TYPE tr_mq_msg_get_type(TR_MQ_MSG *msg);
 void *tr_mq_msg_get_payload(TR_MQ_MSG *msg);
 void tr_mq_msg_set_payload(TR_MQ_MSG *msg, void *p, void (*p_free)(void *));
+const char *tr_mq_msg_get_key(TR_MQ_MSG *msg);
+int tr_mq_msg_set_key(TR_MQ_MSG *msg, const char *key);
 
 
 TR_MQ *tr_mq_new(TALLOC_CTX *mem_ctx);
 void tr_mq_free(TR_MQ *mq);
 int tr_mq_lock(TR_MQ *mq);
 int tr_mq_unlock(TR_MQ *mq);
+/* called when the queue becomes non-empty, not per message; the consumer must drain it */
 void tr_mq_set_notify_cb(TR_MQ *mq, TR_MQ_NOTIFY_FN cb, void *arg);
+int tr_mq_enable_eventfd(TR_MQ *mq);
+int tr_mq_get_eventfd(TR_MQ *mq);
+void tr_mq_eventfd_ack(TR_MQ *mq);
+void tr_mq_wake(TR_MQ *mq);
 void tr_mq_add(TR_MQ *mq, TR_MQ_MSG *msg);
+TR_MQ_RC tr_mq_add_bounded(TR_MQ *mq, TR_MQ_MSG *msg);
+void tr_mq_set_max_length(TR_MQ *mq, unsigned int max_length);
+unsigned int tr_mq_get_length(TR_MQ *mq);
+void tr_mq_get_stats(TR_MQ *mq, TR_MQ_STATS *stats);
 int tr_mq_pop_timeout(time_t seconds, struct timespec *ts);
 TR_MQ_MSG *tr_mq_pop(TR_MQ *mq, struct timespec *ts_abort);
+size_t tr_mq_pop_batch(TR_MQ *mq, TR_MQ_MSG **msgs, size_t max_msgs, struct timespec *ts_abort);
 void tr_mq_clear(TR_MQ *mq);
  
 #endif /*_TR_MQ_H_ */
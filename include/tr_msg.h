@@ -49,7 +49,8 @@ enum msg_type {
   TRP_UPDATE,
   TRP_REQUEST,
   MON_REQUEST,
-  MON_RESPONSE
+  MON_RESPONSE,
+  TRP_REFRESH
 };
 
 /* Union of TR message types to hold message of any type. */
@@ -69,6 +70,8 @@ TRP_UPD *tr_msg_get_trp_upd(TR_MSG *msg);
 void tr_msg_set_trp_upd(TR_MSG *msg, TRP_UPD *req);
 TRP_REQ *tr_msg_get_trp_req(TR_MSG *msg);
 void tr_msg_set_trp_req(TR_MSG *msg, TRP_REQ *req);
+TRP_REFRESH_MARKER *tr_msg_get_trp_refresh(TR_MSG *msg);
+void tr_msg_set_trp_refresh(TR_MSG *msg, TRP_REFRESH_MARKER *marker);
 MON_REQ *tr_msg_get_mon_req(TR_MSG *msg);
 void tr_msg_set_mon_req(TR_MSG *msg, MON_REQ *req);
 MON_RESP *tr_msg_get_mon_resp(TR_MSG *msg);
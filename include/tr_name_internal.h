@@ -48,6 +48,8 @@
 /** Prototypes */
 json_t *tr_name_to_json_string(const TR_NAME *src);
 int tr_name_cmp_str(const TR_NAME *one, const char *two_str);
+unsigned int tr_name_hash(const void *name);
+int tr_name_equal(const void *one, const void *two);
 int tr_name_prefix_wildcard_match(const TR_NAME *str, const TR_NAME *wc_str);
 
 #endif //TRUST_ROUTER_TR_NAME_INTERNAL_H
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TR_PROVENANCE_H
+#define TR_PROVENANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+
+/* One hop in a provenance list. The hash is computed once, when the hop is added. */
+typedef struct tr_provenance_hop {
+  TR_NAME *name;
+  unsigned int hash;
+} TR_PROVENANCE_HOP;
+
+/* List of the systems a community membership has traversed, oldest first, so
+ * the first hop is the origin. Provenance lists are shared between the community
+ * table and the inforecs advertising its memberships, so they are reference
+ * counted rather than allocated in a talloc context. Use tr_provenance_append()
+ * to extend one; it copies a shared list before modifying it.
+ *
+ * The filter has two bits set per hop, derived from the hop hash. A name whose
+ * bits are not all set is certainly not in the list, so the usual negative
+ * loop check does not touch the hops at all. */
+typedef struct tr_provenance {
+  unsigned int refcount;
+  size_t n_hops;
+  size_t max_hops; /* allocated length of hops */
+  uint64_t filter;
+  TR_PROVENANCE_HOP *hops;
+} TR_PROVENANCE;
+
+TR_PROVENANCE *tr_provenance_new(void);
+TR_PROVENANCE *tr_provenance_ref(TR_PROVENANCE *prov);
+void tr_provenance_unref(TR_PROVENANCE *prov);
+int tr_provenance_append(TR_PROVENANCE **prov, TR_NAME *hop);
+size_t tr_provenance_len(TR_PROVENANCE *prov);
+TR_NAME *tr_provenance_get_hop(TR_PROVENANCE *prov, size_t ii);
+TR_NAME *tr_provenance_get_origin(TR_PROVENANCE *prov);
+TR_NAME *tr_provenance_get_last_hop(TR_PROVENANCE *prov);
+int tr_provenance_contains(TR_PROVENANCE *prov, TR_NAME *name);
+int tr_provenance_cmp(TR_PROVENANCE *p1, TR_PROVENANCE *p2, size_t nhops);
+json_t *tr_provenance_to_json(TR_PROVENANCE *prov);
+TR_PROVENANCE *tr_provenance_from_json(json_t *jprov);
+
+#endif /* TR_PROVENANCE_H */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef TR_RECLAIM_H
+#define TR_RECLAIM_H
+
+#include <talloc.h>
+#include <glib.h>
+
+/* Deferred freeing of shared objects that readers in other threads find through
+ * a pointer the owner thread replaces. A reader brackets loading the pointer and
+ * taking its own reference with tr_reclaim_enter()/tr_reclaim_exit(). The owner
+ * hands each replaced object to tr_reclaim_retire() and calls tr_reclaim_poll()
+ * from time to time; an object is freed by the poll that finds no reader still
+ * able to have loaded it. Neither side ever waits for the other. */
+
+typedef void (*TR_RECLAIM_FREE_FN)(void *);
+
+typedef struct tr_reclaim_item {
+  void *obj;
+  TR_RECLAIM_FREE_FN free_fn;
+  guint epoch; /* epoch in which the object was retired */
+} TR_RECLAIM_ITEM;
+
+typedef struct tr_reclaim {
+  gint epoch; /* only advanced by the owner thread, accessed atomically */
+  gint n_active[2]; /* readers between enter and exit, by parity of the epoch they entered in; accessed atomically */
+  GQueue *retired; /* TR_RECLAIM_ITEMs, oldest first; owner thread only */
+} TR_RECLAIM;
+
+TR_RECLAIM *tr_reclaim_new(TALLOC_CTX *mem_ctx);
+void tr_reclaim_free(TR_RECLAIM *rcl);
+unsigned int tr_reclaim_enter(TR_RECLAIM *rcl);
+void tr_reclaim_exit(TR_RECLAIM *rcl, unsigned int slot);
+void tr_reclaim_retire(TR_RECLAIM *rcl, void *obj, TR_RECLAIM_FREE_FN free_fn);
+size_t tr_reclaim_poll(TR_RECLAIM *rcl);
+
+#endif /* TR_RECLAIM_H */
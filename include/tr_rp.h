@@ -43,6 +43,7 @@ typedef struct tr_rp_realm {
   struct tr_rp_realm *next;
   TR_NAME *realm_id;
   unsigned int refcount; /* how many TR_COMM_MEMBs refer to this realm */
+  struct tr_comm_memb *memberships; /* this realm's memberships in its community table, see tr_comm.h */
 } TR_RP_REALM;
 
 /* prototypes */
@@ -54,6 +55,8 @@ void tr_rp_realm_set_id(TR_RP_REALM *rp, TR_NAME *id);
 TR_RP_REALM *tr_rp_realm_lookup(TR_RP_REALM *rp_realms, TR_NAME *rp_name);
 TR_RP_REALM *tr_rp_realm_add_func(TR_RP_REALM *head, TR_RP_REALM *new);
 #define tr_rp_realm_add(head,new) ((head)=tr_rp_realm_add_func((head),(new)))
+TR_RP_REALM *tr_rp_realm_add_tail_func(TR_RP_REALM *head, TR_RP_REALM **tail, TR_RP_REALM *new);
+#define tr_rp_realm_add_tail(head,tail,new) ((head)=tr_rp_realm_add_tail_func((head),&(tail),(new)))
 TR_RP_REALM *tr_rp_realm_remove_func(TR_RP_REALM *head, TR_RP_REALM *remove);
 #define tr_rp_realm_remove(head,remove) ((head)=tr_rp_realm_remove_func((head),(remove)))
 TR_RP_REALM *tr_rp_realm_sweep_func(TR_RP_REALM *head);
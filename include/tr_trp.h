@@ -53,6 +53,9 @@ typedef struct tr_trps_events {
   struct event *connect_ev;
   struct event *update_ev;
   struct event *sweep_ev;
+  struct event *rview_ev; /* publishes the route view once per pass when it is out of date */
+  struct event *sigterm_ev;
+  struct event *sigint_ev;
 } TR_TRPS_EVENTS;
 
 /* typedef'ed as TR_INSTANCE in tr.h */
@@ -65,17 +68,11 @@ struct tr_instance {
   TR_TRPS_EVENTS *events;
 };
 
-/* messages between threads */
-#define TR_MQMSG_MSG_RECEIVED "msg received"
-#define TR_MQMSG_TRPC_DISCONNECTED "trpc disconnected"
-#define TR_MQMSG_TRPC_CONNECTED "trpc connected"
-#define TR_MQMSG_TRPS_DISCONNECTED "trps disconnected"
-#define TR_MQMSG_TRPS_CONNECTED "trps connected"
-#define TR_MQMSG_ABORT "abort"
-
 /* prototypes */
 TRP_RC tr_trps_event_init(struct event_base *base, struct tr_instance *tr);
+void tr_trps_stop_connections(TRPS_INSTANCE *trps);
 TRP_RC tr_add_local_routes(TRPS_INSTANCE *trps, TR_CFG *cfg);
+TRP_RC tr_update_local_routes(TRPS_INSTANCE *trps, TR_CFG *cfg);
 TRP_RC tr_trpc_initiate(TRPS_INSTANCE *trps, TRP_PEER *peer, struct event *ev);
 void tr_config_changed(TR_CFG *new_cfg, void *cookie);
 TRP_RC tr_connect_to_peers(TRPS_INSTANCE *trps, struct event *ev);
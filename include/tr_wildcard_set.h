@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TR_WILDCARD_SET_H
+#define TR_WILDCARD_SET_H
+
+#include <talloc.h>
+
+#include <tr_name_internal.h>
+
+/* Node of a trie keyed by pattern characters, last character first */
+typedef struct tr_wildcard_node {
+  char c;
+  struct tr_wildcard_node *child; /* first child */
+  struct tr_wildcard_node *sibling; /* next child of the same parent */
+  TR_NAME *suffix; /* leading-'*' pattern whose fixed part ends at this node */
+  TR_NAME *exact; /* pattern without a wildcard that ends at this node */
+} TR_WILDCARD_NODE;
+
+/* Set of patterns with the same meaning as in tr_name_prefix_wildcard_match():
+ * a leading '*' matches any prefix, otherwise the pattern must match exactly.
+ * Finding the patterns matching a string takes time proportional to its length,
+ * however many patterns are in the set. Patterns are borrowed, not copied. */
+typedef struct tr_wildcard_set {
+  TR_WILDCARD_NODE root;
+  size_t n_patterns;
+} TR_WILDCARD_SET;
+
+TR_WILDCARD_SET *tr_wildcard_set_new(TALLOC_CTX *mem_ctx);
+void tr_wildcard_set_free(TR_WILDCARD_SET *set);
+int tr_wildcard_set_add(TR_WILDCARD_SET *set, TR_NAME *pattern);
+size_t tr_wildcard_set_size(TR_WILDCARD_SET *set);
+TR_NAME *tr_wildcard_set_find(TR_WILDCARD_SET *set, const char *s, size_t len);
+TR_NAME *tr_wildcard_set_find_name(TR_WILDCARD_SET *set, const TR_NAME *name);
+
+#endif /* TR_WILDCARD_SET_H */
@@ -35,18 +35,22 @@
 #ifndef TRP_INTERNAL_H
 #define TRP_INTERNAL_H
 
+#include <glib.h>
 #include <jansson.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <talloc.h>
 #include <time.h>
 
 #include <gsscon.h>
 #include <tr_mq.h>
 #include <tr_msg.h>
+#include <tr_reclaim.h>
 #include <trp_peer.h>
 #include <trp_ptable.h>
 #include <trp_route.h>
 #include <trp_rtable.h>
+#include <trp_rview.h>
 #include <tr_apc.h>
 #include <tr_comm.h>
 #include <trust_router/trp.h>
@@ -54,6 +58,34 @@
 /* what clock do we use with clock_gettime() ? */
 #define TRP_CLOCK CLOCK_MONOTONIC
 
+/* Limits on messages queued to a single peer. Updates for the same route or community
+ * membership supersede one another in the queue, so these are only reached by a peer
+ * that falls well behind. Past the backlog limit, we hold off on routine updates. */
+#define TRPC_SEND_QUEUE_MAX 4096
+#define TRPC_SEND_QUEUE_BACKLOG 1024
+
+/* Limits for nonblocking connections. Incoming tokens larger than the maximum are
+ * treated as a protocol error. Outgoing messages stay in the peer's send queue
+ * rather than the stream once this much is waiting to be written. */
+#define TRP_STREAM_MAX_TOKEN (16*1024*1024)
+#define TRP_STREAM_TX_LIMIT (256*1024)
+
+/* Least time between periodic saves of the routing state, in seconds. It is
+ * also saved when we are asked to stop. */
+#define TRPS_STATE_SAVE_INTERVAL 300
+
+/* Limits on coalescing queued messages into one write on a threaded outgoing
+ * connection. A batch is sent once it reaches either size, or once the first
+ * message in it has waited this long for company. */
+#define TRPC_CORK_MAX_MSGS 256
+#define TRPC_CORK_MAX_BYTES (64*1024)
+#define TRPC_CORK_USEC 2000
+#define TRPC_SEND_TIMEOUT_MSEC (60*1000) /* give up on a peer that will not take data */
+
+/* Largest message we build by packing several updates together. A chain whose encoding
+ * is larger is split; an update larger than this on its own is still sent by itself. */
+#define TRPS_UPDATE_MAX_MSG_BYTES (64*1024)
+
 /* info records */
 /* TRP update record types */
 typedef struct trp_inforec_route {
@@ -72,7 +104,7 @@ typedef struct trp_inforec_comm {
   TR_NAME *owner_realm;
   TR_NAME *owner_contact;
   time_t expiration_interval; /* Minutes to key expiration; only valid for an APC */
-  json_t *provenance;
+  TR_PROVENANCE *provenance;
   unsigned int interval;
 } TRP_INFOREC_COMM;
 
@@ -92,12 +124,37 @@ struct trp_update {
   TR_NAME *comm;
   TRP_INFOREC *records;
   TR_NAME *peer; /* who did this update come from? */
+  TRP_UPD *next; /* further updates carried in the same message */
 };
 
 struct trp_req {
   TR_NAME *comm;
   TR_NAME *realm;
   TR_NAME *peer; /* who did this req come from? */
+  TRP_DIGEST *digest; /* what the requester already has from us, may be null */
+};
+
+typedef struct trp_refresh_item TRP_REFRESH_ITEM;
+struct trp_refresh_item {
+  TRP_REFRESH_ITEM *next;
+  TRP_INFOREC_TYPE type; /* route or community membership */
+  TR_NAME *comm;
+  TR_NAME *realm;
+};
+
+struct trp_refresh_marker {
+  TR_NAME *peer; /* who did this marker come from? */
+  TRP_REFRESH_ITEM *items;
+  TRP_REFRESH_ITEM *tail;
+  size_t n_items;
+};
+
+#define TRP_DIGEST_N_BUCKETS 64
+#define TRP_DIGEST_MAX_BUCKETS 1024
+
+struct trp_digest {
+  size_t n_buckets;
+  uint64_t *buckets;
 };
 
 
@@ -125,7 +182,24 @@ struct trp_connection {
   void *status_change_cookie;
 };
 
+/* nonblocking framing for an established connection */
+typedef struct trp_stream TRP_STREAM;
+struct trp_stream {
+  int fd;
+  gss_ctx_id_t *gssctx;
+  unsigned char rx_hdr[4]; /* length of the token being received */
+  size_t rx_hdr_len; /* header bytes received so far */
+  char *rx_token; /* malloc'ed once the header is complete */
+  size_t rx_token_len;
+  size_t rx_len; /* token bytes received so far */
+  char *tx_buf; /* framed tokens waiting to be written */
+  size_t tx_start;
+  size_t tx_end;
+  size_t tx_alloc;
+};
+
 typedef TRP_RC (*TRPS_MSG_FUNC)(TRPS_INSTANCE *, TRP_CONNECTION *, TR_MSG *);
+typedef void (*TRPS_RVIEW_NOTIFY_FN)(TRPS_INSTANCE *, void *);
 typedef void (*TRP_RESP_FUNC)();
 /*typedef int (*TRP_AUTH_FUNC)(gss_name_t client_name, TR_NAME *display_name, void *cookie);*/
 typedef client_cb_fn TRP_AUTH_FUNC;
@@ -162,6 +236,18 @@ struct trps_instance {
   struct timeval connect_interval; /* interval between connection refreshes */
   struct timeval update_interval; /* interval between scheduled updates */
   struct timeval sweep_interval; /* interval between route table sweeps */
+  unsigned int update_max_records; /* max inforecs to pack into a single update message */
+  int update_delta; /* send only changed entries plus refresh markers in scheduled updates */
+  gint event_transport; /* service established connections from the event loop, accessed atomically */
+  gint send_coalesce; /* combine queued messages into one write on threaded outgoing connections, accessed atomically */
+  char *state_file; /* routing state saved for warm restarts, NULL if disabled */
+  struct timespec state_saved; /* when the routing state was last saved, by TRP_CLOCK */
+  TRP_RVIEW *rview; /* selected routes for lock-free readers, published atomically */
+  TR_RECLAIM *rview_reclaim; /* frees replaced views once no reader can still be loading them */
+  unsigned int rview_generation; /* generation of the most recently published view */
+  int rview_dirty; /* selected routes changed since rview was published */
+  TRPS_RVIEW_NOTIFY_FN rview_notify_cb; /* called when rview_dirty becomes set */
+  void *rview_notify_cb_arg;
 };
 
 typedef enum trp_update_type {
@@ -192,6 +278,14 @@ int trp_connection_auth(TRP_CONNECTION *conn, TRP_AUTH_FUNC auth_callback, void
 TRP_CONNECTION *trp_connection_accept(TALLOC_CTX *mem_ctx, int listen, TR_NAME *gss_servicename);
 TRP_RC trp_connection_initiate(TRP_CONNECTION *conn, char *server, int port);
 
+TRP_STREAM *trp_stream_new(TALLOC_CTX *mem_ctx, int fd, gss_ctx_id_t *gssctx);
+void trp_stream_free(TRP_STREAM *stream);
+TRP_RC trp_stream_read(TRP_STREAM *stream, char **buf, size_t *buflen);
+TRP_RC trp_stream_wrap(gss_ctx_id_t *gssctx, const char *msg, size_t msglen, gss_buffer_t token);
+TRP_RC trp_stream_queue(TRP_STREAM *stream, const char *msg, size_t msglen);
+TRP_RC trp_stream_flush(TRP_STREAM *stream);
+size_t trp_stream_pending(TRP_STREAM *stream);
+
 TRPC_INSTANCE *trpc_new (TALLOC_CTX *mem_ctx);
 void trpc_free (TRPC_INSTANCE *trpc);
 TRP_CONNECTION *trpc_get_conn(TRPC_INSTANCE *trpc);
@@ -210,12 +304,16 @@ TRP_CONNECTION_STATUS trpc_get_status(TRPC_INSTANCE *trpc);
 TR_MQ *trpc_get_mq(TRPC_INSTANCE *trpc);
 void trpc_set_mq(TRPC_INSTANCE *trpc, TR_MQ *mq);
 void trpc_mq_add(TRPC_INSTANCE *trpc, TR_MQ_MSG *msg);
+TR_MQ_RC trpc_mq_add_bounded(TRPC_INSTANCE *trpc, TR_MQ_MSG *msg);
+unsigned int trpc_mq_get_length(TRPC_INSTANCE *trpc);
+void trpc_mq_get_stats(TRPC_INSTANCE *trpc, TR_MQ_STATS *stats);
 TR_MQ_MSG *trpc_mq_pop(TRPC_INSTANCE *trpc, struct timespec *ts_abort);
 void trpc_mq_clear(TRPC_INSTANCE *trpc);
 void trpc_master_mq_add(TRPC_INSTANCE *trpc, TR_MQ_MSG *msg);
 TR_MQ_MSG *trpc_master_mq_pop(TRPC_INSTANCE *trpc);
 TRP_RC trpc_connect(TRPC_INSTANCE *trpc);
 TRP_RC trpc_send_msg(TRPC_INSTANCE *trpc, const char *msg_content);
+TRP_RC trpc_send_msgs(TRPC_INSTANCE *trpc, const char **msgs, size_t n_msgs);
 
 TRPS_INSTANCE *trps_new (TALLOC_CTX *mem_ctx);
 void trps_free (TRPS_INSTANCE *trps);
@@ -225,14 +323,28 @@ void trps_set_peer_status_callback(TRPS_INSTANCE *trps, void (*cb)(TRP_PEER *, v
 TR_NAME *trps_dup_label(TRPS_INSTANCE *trps);
 TRP_RC trps_init_rtable(TRPS_INSTANCE *trps);
 void trps_clear_rtable(TRPS_INSTANCE *trps);
+TRP_RC trps_update_local_routes(TRPS_INSTANCE *trps, TRP_ROUTE **routes, size_t n_routes);
+void trps_flush_retracted_routes(TRPS_INSTANCE *trps);
 void trps_set_connect_interval(TRPS_INSTANCE *trps, unsigned int interval);
 unsigned int trps_get_connect_interval(TRPS_INSTANCE *trps);
 void trps_set_update_interval(TRPS_INSTANCE *trps, unsigned int interval);
 unsigned int trps_get_update_interval(TRPS_INSTANCE *trps);
 void trps_set_sweep_interval(TRPS_INSTANCE *trps, unsigned int interval);
 unsigned int trps_get_sweep_interval(TRPS_INSTANCE *trps);
+void trps_set_update_max_records(TRPS_INSTANCE *trps, unsigned int max_records);
+unsigned int trps_get_update_max_records(TRPS_INSTANCE *trps);
+void trps_set_update_delta(TRPS_INSTANCE *trps, int update_delta);
+int trps_get_update_delta(TRPS_INSTANCE *trps);
+void trps_set_event_transport(TRPS_INSTANCE *trps, int event_transport);
+int trps_get_event_transport(TRPS_INSTANCE *trps);
+void trps_set_send_coalesce(TRPS_INSTANCE *trps, int send_coalesce);
+int trps_get_send_coalesce(TRPS_INSTANCE *trps);
+void trps_set_state_file(TRPS_INSTANCE *trps, const char *state_file);
+const char *trps_get_state_file(TRPS_INSTANCE *trps);
 TRPC_INSTANCE *trps_find_trpc(TRPS_INSTANCE *trps, TRP_PEER *peer);
 TRP_RC trps_send_msg (TRPS_INSTANCE *trps, TRP_PEER *peer, const char *msg);
+TRP_RC trps_send_bytes(TRPS_INSTANCE *trps, TRP_PEER *peer, GBytes *bytes, const char *key);
+int trps_peer_backlogged(TRPS_INSTANCE *trps, TRP_PEER *peer);
 void trps_add_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *new);
 void trps_remove_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *remove);
 void trps_add_trpc(TRPS_INSTANCE *trps, TRPC_INSTANCE *trpc);
@@ -246,14 +358,20 @@ int trps_get_listener(TRPS_INSTANCE *trps,
                       int *fd_out,
                       size_t max_fd);
 TR_MQ_MSG *trps_mq_pop(TRPS_INSTANCE *trps);
+size_t trps_mq_pop_batch(TRPS_INSTANCE *trps, TR_MQ_MSG **msgs, size_t max_msgs);
 void trps_mq_add(TRPS_INSTANCE *trps, TR_MQ_MSG *msg);
 TRP_RC trps_authorize_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *conn);
 void trps_handle_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *conn);
+TRP_RC trps_deliver_message(TRPS_INSTANCE *trps, TRP_CONNECTION *conn, const char *buf, size_t buflen);
 TRP_RC trps_update_active_routes(TRPS_INSTANCE *trps);
 TRP_RC trps_handle_tr_msg(TRPS_INSTANCE *trps, TR_MSG *tr_msg);
 TRP_ROUTE *trps_get_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm, TR_NAME *peer);
 TRP_ROUTE *trps_get_selected_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm);
 TR_NAME *trps_get_next_hop(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm);
+TRP_RC trps_publish_rview(TRPS_INSTANCE *trps);
+size_t trps_reclaim_rviews(TRPS_INSTANCE *trps);
+TRP_RVIEW *trps_acquire_rview(TRPS_INSTANCE *trps);
+void trps_set_rview_notify_cb(TRPS_INSTANCE *trps, TRPS_RVIEW_NOTIFY_FN cb, void *arg);
 TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps);
 TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps);
 TRP_RC trps_add_route(TRPS_INSTANCE *trps, TRP_ROUTE *route);
@@ -261,8 +379,16 @@ TRP_RC trps_add_peer(TRPS_INSTANCE *trps, TRP_PEER *peer);
 TRP_PEER *trps_get_peer_by_gssname(TRPS_INSTANCE *trps, TR_NAME *gssname);
 TRP_PEER *trps_get_peer_by_servicename(TRPS_INSTANCE *trps, TR_NAME *servicename);
 TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE type);
+TRP_RC trps_update_deferred(TRPS_INSTANCE *trps);
 int trps_peer_connected(TRPS_INSTANCE *trps, TRP_PEER *peer);
 TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_gssname);
+TRP_INFOREC *trps_memb_to_inforec(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_COMM_MEMB *memb);
+TRP_RC trps_restore_update(TRPS_INSTANCE *trps, TRP_UPD *upd, struct timespec *expiry);
+
+/* trps_state.c */
+TRP_RC trps_save_state(TRPS_INSTANCE *trps);
+int trps_state_save_due(TRPS_INSTANCE *trps);
+TRP_RC trps_load_state(TRPS_INSTANCE *trps);
 
 TRP_INFOREC *trp_inforec_new(TALLOC_CTX *mem_ctx, TRP_INFOREC_TYPE type);
 void trp_inforec_free(TRP_INFOREC *rec);
@@ -292,8 +418,8 @@ TR_NAME *trp_inforec_get_owner_realm(TRP_INFOREC *rec);
 TRP_RC trp_inforec_set_owner_realm(TRP_INFOREC *rec, TR_NAME *name);
 TR_NAME *trp_inforec_get_owner_contact(TRP_INFOREC *rec);
 TRP_RC trp_inforec_set_owner_contact(TRP_INFOREC *rec, TR_NAME *name);
-json_t *trp_inforec_get_provenance(TRP_INFOREC *rec);
-TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, json_t *prov);
+TR_PROVENANCE *trp_inforec_get_provenance(TRP_INFOREC *rec);
+TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, TR_PROVENANCE *prov);
 TRP_INFOREC_TYPE trp_inforec_type_from_string(const char *s);
 const char *trp_inforec_type_to_string(TRP_INFOREC_TYPE msgtype);
 time_t trp_inforec_get_exp_interval(TRP_INFOREC *rec);
@@ -306,4 +432,27 @@ TR_APC *trp_inforec_get_apcs(TRP_INFOREC *rec);
 TRP_RC trp_inforec_set_apcs(TRP_INFOREC *rec, TR_APC *apcs);
 TR_NAME *trp_inforec_dup_origin(TRP_INFOREC *rec);
 
+TRP_REFRESH_MARKER *trp_refresh_marker_new(TALLOC_CTX *mem_ctx);
+void trp_refresh_marker_free(TRP_REFRESH_MARKER *marker);
+TR_NAME *trp_refresh_marker_get_peer(TRP_REFRESH_MARKER *marker);
+void trp_refresh_marker_set_peer(TRP_REFRESH_MARKER *marker, TR_NAME *peer);
+TRP_RC trp_refresh_marker_add(TRP_REFRESH_MARKER *marker, TRP_INFOREC_TYPE type, TR_NAME *comm, TR_NAME *realm);
+size_t trp_refresh_marker_num_items(TRP_REFRESH_MARKER *marker);
+TRP_REFRESH_ITEM *trp_refresh_marker_get_items(TRP_REFRESH_MARKER *marker);
+TRP_REFRESH_ITEM *trp_refresh_item_get_next(TRP_REFRESH_ITEM *item);
+TRP_INFOREC_TYPE trp_refresh_item_get_type(TRP_REFRESH_ITEM *item);
+TR_NAME *trp_refresh_item_get_comm(TRP_REFRESH_ITEM *item);
+TR_NAME *trp_refresh_item_get_realm(TRP_REFRESH_ITEM *item);
+
+TRP_DIGEST *trp_digest_new(TALLOC_CTX *mem_ctx, size_t n_buckets);
+void trp_digest_free(TRP_DIGEST *digest);
+size_t trp_digest_get_n_buckets(TRP_DIGEST *digest);
+uint64_t trp_digest_get_bucket(TRP_DIGEST *digest, size_t index);
+void trp_digest_set_bucket(TRP_DIGEST *digest, size_t index, uint64_t value);
+size_t trp_digest_bucket_index(TRP_DIGEST *digest, TR_NAME *comm, TR_NAME *realm);
+void trp_digest_add(TRP_DIGEST *digest, TR_NAME *comm, TR_NAME *realm, const char *key, const char *summary);
+uint64_t trp_digest_root(TRP_DIGEST *digest);
+int trp_digest_equal(TRP_DIGEST *d1, TRP_DIGEST *d2);
+int trp_digest_bucket_matches(TRP_DIGEST *d1, TRP_DIGEST *d2, size_t index);
+
 #endif /* TRP_INTERNAL_H */
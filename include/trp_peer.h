@@ -35,8 +35,11 @@
 #ifndef TRUST_ROUTER_TRP_PEER_H
 #define TRUST_ROUTER_TRP_PEER_H
 
+#include <glib.h>
+
 #include <tr_gss_names.h>
 #include <tr_filter.h>
+#include <trust_router/trp.h>
 
 typedef enum trp_peer_conn_status {
   PEER_DISCONNECTED=0,
@@ -58,6 +61,10 @@ struct trp_peer {
   void (*conn_status_cb)(TRP_PEER *, void *); /* callback for connected status change */
   void *conn_status_cookie;
   TR_FILTER_SET *filters;
+  GHashTable *sent; /* what we last advertised to this peer, see trp_peer_sent_matches() */
+  unsigned int sent_generation;
+  GHashTable *received; /* what this peer last advertised to us, see trp_peer_received_set() */
+  int update_deferred; /* a routine update was skipped because the send queue was backed up */
 };
 
 
@@ -85,8 +92,29 @@ void trp_peer_set_incoming_status(TRP_PEER *peer, TRP_PEER_CONN_STATUS status);
 int trp_peer_is_connected(TRP_PEER *peer);
 void trp_peer_set_linkcost(TRP_PEER *peer, unsigned int linkcost);
 void trp_peer_set_conn_status_cb(TRP_PEER *peer, void (*cb)(TRP_PEER *, void *), void *cookie);
+int trp_peer_same(TRP_PEER *peer, TRP_PEER *old);
+void trp_peer_take_state(TRP_PEER *peer, TRP_PEER *old);
 void trp_peer_set_filters(TRP_PEER *peer, TR_FILTER_SET *filts);
 TR_FILTER *trp_peer_get_filter(TRP_PEER *peer, TR_FILTER_TYPE ftype);
+void trp_peer_set_update_deferred(TRP_PEER *peer, int deferred);
+int trp_peer_get_update_deferred(TRP_PEER *peer);
+int trp_peer_sent_matches(TRP_PEER *peer, const char *key, const char *summary);
+void trp_peer_sent_record(TRP_PEER *peer, const char *key, const char *summary);
+void trp_peer_sent_sweep(TRP_PEER *peer);
+void trp_peer_sent_clear(TRP_PEER *peer);
+guint trp_peer_sent_size(TRP_PEER *peer);
+void trp_peer_received_set(TRP_PEER *peer,
+                           const char *key,
+                           TR_NAME *comm,
+                           TR_NAME *realm,
+                           const char *summary,
+                           unsigned int interval,
+                           struct timespec *expiry);
+unsigned int trp_peer_received_get_interval(TRP_PEER *peer, const char *key);
+void trp_peer_received_set_expiry(TRP_PEER *peer, const char *key, struct timespec *expiry);
+void trp_peer_received_sweep(TRP_PEER *peer, struct timespec *now);
+guint trp_peer_received_size(TRP_PEER *peer);
+TRP_DIGEST *trp_peer_received_digest(TALLOC_CTX *mem_ctx, TRP_PEER *peer, struct timespec *now);
 
 /* trp_peer_encoders.c */
 char *trp_peer_to_str(TALLOC_CTX *memctx, TRP_PEER *peer, const char *sep);
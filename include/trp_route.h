@@ -50,6 +50,7 @@ typedef struct trp_route {
   struct timespec *expiry;
   int local; /* is this a local route? */
   int triggered;
+  int provisional; /* restored from saved state, not yet confirmed by the peer */
 } TRP_ROUTE;
 
 /* trp_route.c */
@@ -87,6 +88,8 @@ void trp_route_set_local(TRP_ROUTE *entry, int local);
 int trp_route_is_local(TRP_ROUTE *entry);
 void trp_route_set_triggered(TRP_ROUTE *entry, int trig);
 int trp_route_is_triggered(TRP_ROUTE *entry);
+void trp_route_set_provisional(TRP_ROUTE *entry, int provisional);
+int trp_route_is_provisional(TRP_ROUTE *entry);
 
 /* trp_route_encoders.c */
 char *trp_route_to_str(TALLOC_CTX *mem_ctx, TRP_ROUTE *entry, const char *sep);
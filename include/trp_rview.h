@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _TRP_RVIEW_H_
+#define _TRP_RVIEW_H_
+
+#include <talloc.h>
+#include <glib.h>
+
+#include <tr_name_internal.h>
+#include <trp_route.h>
+
+/*
+ * Read-only view of the selected routes
+ *
+ * A view is built from the route table after each batch of changes and is never
+ * modified afterward, so any number of threads can look routes up in it without
+ * locking. The TRP server publishes each new view with an atomic pointer store.
+ * Readers take a reference with trps_acquire_rview() and drop it with
+ * trp_rview_release(); a replaced view is freed when its last reference goes.
+ */
+
+typedef struct trp_rview_entry {
+  TR_NAME *comm;
+  TR_NAME *realm;
+  TR_NAME *next_hop;
+  int next_hop_port;
+  unsigned int metric;
+  int local;
+} TRP_RVIEW_ENTRY;
+
+typedef struct trp_rview TRP_RVIEW;
+struct trp_rview {
+  unsigned int generation;
+  size_t n_entries;
+  TRP_RVIEW_ENTRY *entries; /* sorted by community, then realm */
+  gint refcount; /* held by the TRP server while current and by each reader, accessed atomically */
+};
+
+/* trp_rview.c */
+TRP_RVIEW *trp_rview_new(TALLOC_CTX *mem_ctx, TRP_ROUTE **routes, size_t n_routes, unsigned int generation);
+void trp_rview_free(TRP_RVIEW *view);
+void trp_rview_release(TRP_RVIEW *view);
+unsigned int trp_rview_get_generation(TRP_RVIEW *view);
+size_t trp_rview_size(TRP_RVIEW *view);
+TRP_RVIEW_ENTRY *trp_rview_lookup(TRP_RVIEW *view, TR_NAME *comm, TR_NAME *realm);
+TR_NAME *trp_rview_entry_get_comm(TRP_RVIEW_ENTRY *entry);
+TR_NAME *trp_rview_entry_get_realm(TRP_RVIEW_ENTRY *entry);
+TR_NAME *trp_rview_entry_get_next_hop(TRP_RVIEW_ENTRY *entry);
+TR_NAME *trp_rview_entry_dup_next_hop(TRP_RVIEW_ENTRY *entry);
+int trp_rview_entry_get_next_hop_port(TRP_RVIEW_ENTRY *entry);
+unsigned int trp_rview_entry_get_metric(TRP_RVIEW_ENTRY *entry);
+int trp_rview_entry_is_local(TRP_RVIEW_ENTRY *entry);
+
+#endif /* _TRP_RVIEW_H_ */
@@ -73,6 +73,8 @@ typedef struct trp_inforec TRP_INFOREC;
 
 typedef struct trp_update TRP_UPD;
 typedef struct trp_req TRP_REQ;
+typedef struct trp_refresh_marker TRP_REFRESH_MARKER;
+typedef struct trp_digest TRP_DIGEST;
 
 /* Functions for TRP_UPD structures */
 TR_EXPORT TRP_UPD *trp_upd_new(TALLOC_CTX *mem_ctx);
@@ -93,6 +95,8 @@ TR_NAME *trp_upd_dup_peer(TRP_UPD *upd);
 void trp_upd_set_peer(TRP_UPD *upd, TR_NAME *peer);
 void trp_upd_set_next_hop(TRP_UPD *upd, const char *hostname, int port);
 void trp_upd_add_to_provenance(TRP_UPD *upd, TR_NAME *name);
+TRP_UPD *trp_upd_get_next(TRP_UPD *upd);
+void trp_upd_set_next(TRP_UPD *upd, TRP_UPD *next);
 
 /* Functions for TRP_REQ structures */
 TR_EXPORT TRP_REQ *trp_req_new(TALLOC_CTX *mem_ctx);
@@ -105,5 +109,7 @@ TR_EXPORT TR_NAME *trp_req_get_peer(TRP_REQ *req);
 void trp_req_set_peer(TRP_REQ *req, TR_NAME *peer);
 int trp_req_is_wildcard(TRP_REQ *req);
 TRP_RC trp_req_make_wildcard(TRP_REQ *req);
+TRP_DIGEST *trp_req_get_digest(TRP_REQ *req);
+void trp_req_set_digest(TRP_REQ *req, TRP_DIGEST *digest);
 
 #endif /* TRP_H */
@@ -67,6 +67,7 @@ struct  mon_opt_entry mon_opt_table[] = {
     { OPT_TYPE_SHOW_TID_REQS_FAILED,    MON_CMD_SHOW,  "tid_reqs_failed"    },
     { OPT_TYPE_SHOW_TID_REQS_PENDING,   MON_CMD_SHOW,  "tid_reqs_pending"   },
     { OPT_TYPE_SHOW_TID_ERROR_COUNT,    MON_CMD_SHOW,  "tid_error_count"    },
+    { OPT_TYPE_SHOW_TRP_QUEUE,          MON_CMD_SHOW,  "trp_queue"          },
     { OPT_TYPE_SHOW_ROUTES,             MON_CMD_SHOW,  "routes"             },
     { OPT_TYPE_SHOW_PEERS,              MON_CMD_SHOW,  "peers"              },
     { OPT_TYPE_SHOW_COMMUNITIES,        MON_CMD_SHOW,  "communities"        },
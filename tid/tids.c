@@ -456,6 +456,8 @@ static void tids_handle_proc(TIDS_INSTANCE *tids, int conn_fd, int result_fd)
   close(result_fd);
   close(conn_fd);
 
+  tr_log_async_stop(); /* abort() skips the atexit handler that writes queued messages */
+
   /* This ought to be an exit(0), but log4shib does not play well with fork() due to
    * threading issues. To ensure we do not get stuck in the exit handler, we will
    * abort. First disable core dump for this subprocess (the main process will still
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <talloc.h>
+#include <assert.h>
+
+#include <tr_config.h>
+#include <tr_debug.h>
+#include <tr_event.h>
+#include <tr_cfgwatch.h>
+
+/* Tests for reloading the configuration when its files change */
+
+#define SETTLE_MSEC 200
+#define POLL_MSEC 50
+
+static const char *cfg_fmt=
+  "{\"serial_number\": %d,\n"
+  " \"tr_internal\": {\"hostname\": \"server.example.com\", \"monitoring\": {\"port\": 12311,\n"
+  "                 \"authorized_credentials\": [\"mon@example.com\"]}},\n"
+  " \"communities\": [{\"community_id\": \"apc.example.com\", \"type\": \"apc\", \"apcs\": [],\n"
+  "                   \"idp_realms\": [\"A.example.com\"], \"rp_realms\": [\"A.example.com\"]}],\n"
+  " \"local_organizations\": [{\"organization_name\": \"test org\", \"realms\": [\n"
+  "   {\"realm\": \"A.example.com\",\n"
+  "    \"identity_provider\": {\"aaa_servers\": [\"rad.A.example.com\"], \"apcs\": [\"apc.example.com\"],\n"
+  "                           \"shared_config\": \"no\"},\n"
+  "    \"gss_names\": [\"gss@example.com\"]}]}]}\n";
+
+/* what the update callback has seen */
+struct updates {
+  int count;
+  struct timeval last;
+};
+
+static void count_update(TR_CFG *new_cfg, void *cookie)
+{
+  struct updates *updates=(struct updates *)cookie;
+
+  assert(new_cfg!=NULL);
+  updates->count++;
+  assert(0==gettimeofday(&(updates->last), NULL));
+}
+
+static void write_cfg(const char *dir, const char *name, int serial)
+{
+  char *path=talloc_asprintf(NULL, "%s/%s", dir, name);
+  FILE *f=NULL;
+
+  assert(path!=NULL);
+  f=fopen(path, "w");
+  assert(f!=NULL);
+  assert(0<fprintf(f, cfg_fmt, serial));
+  assert(0==fclose(f));
+  talloc_free(path);
+}
+
+static void run_loop(struct event_base *base, int msec)
+{
+  struct timeval tv={msec/1000, (msec%1000)*1000};
+
+  assert(0==event_base_loopexit(base, &tv));
+  assert(0<=event_base_dispatch(base));
+}
+
+static long usec_since(struct timeval *then, struct timeval *now)
+{
+  struct timeval diff;
+
+  timersub(now, then, &diff);
+  return diff.tv_sec*1000000+diff.tv_usec;
+}
+
+struct watch {
+  TALLOC_CTX *mem_ctx;
+  struct event_base *base;
+  TR_CFG_MGR *cfg_mgr;
+  TR_CFGWATCH *cfgwatch;
+  struct updates updates;
+};
+
+/* load the configuration in dir and start watching it */
+static void watch_start(struct watch *w, char *dir)
+{
+  struct event *ev=NULL;
+
+  w->mem_ctx=talloc_new(NULL);
+  w->base=event_base_new();
+  w->cfg_mgr=tr_cfg_mgr_new(w->mem_ctx);
+  w->cfgwatch=tr_cfgwatch_create(w->mem_ctx);
+  assert((w->base!=NULL) && (w->cfg_mgr!=NULL) && (w->cfgwatch!=NULL));
+  w->updates.count=0;
+  w->cfgwatch->config_dir=dir;
+  w->cfgwatch->cfg_mgr=w->cfg_mgr;
+  w->cfgwatch->update_cb=count_update;
+  w->cfgwatch->update_cookie=&(w->updates);
+  w->cfgwatch->settling_time.tv_sec=0;
+  w->cfgwatch->settling_time.tv_usec=SETTLE_MSEC*1000;
+  w->cfgwatch->poll_interval.tv_sec=0;
+  w->cfgwatch->poll_interval.tv_usec=POLL_MSEC*1000;
+  assert(0==tr_read_and_apply_config(w->cfgwatch));
+  assert(w->updates.count==1);
+  assert(0==tr_cfgwatch_event_init(w->base, w->cfgwatch, &ev));
+  assert(ev!=NULL);
+}
+
+static void watch_stop(struct watch *w)
+{
+  talloc_free(w->mem_ctx);
+  event_base_free(w->base);
+}
+
+static char *make_dir(TALLOC_CTX *mem_ctx)
+{
+  char *dir=talloc_strdup(mem_ctx, "/tmp/cfgwatch_test.XXXXXX");
+
+  assert((dir!=NULL) && (NULL!=mkdtemp(dir)));
+  return dir;
+}
+
+static void remove_dir(const char *dir)
+{
+  char *cmd=talloc_asprintf(NULL, "rm -rf '%s'", dir);
+
+  assert(0==system(cmd));
+  talloc_free(cmd);
+}
+
+/* the configuration is read once, a settling time after the last of a burst of changes */
+static void test_settle(void)
+{
+  char *dir=make_dir(NULL);
+  struct watch w;
+  struct timeval last_write;
+  int ii=0;
+
+  write_cfg(dir, "main.cfg", 1);
+  watch_start(&w, dir);
+
+  for (ii=0; ii<3; ii++) {
+    assert(0==gettimeofday(&last_write, NULL));
+    write_cfg(dir, "main.cfg", 2+ii);
+    run_loop(w.base, SETTLE_MSEC/2);
+    assert(w.updates.count==1);
+  }
+  run_loop(w.base, SETTLE_MSEC+100);
+  assert(w.updates.count==2);
+  /* libevent's clock is coarse, so allow the timer to fire a little early */
+  assert(usec_since(&last_write, &(w.updates.last))>=(SETTLE_MSEC-10)*1000);
+
+  /* nothing else happens */
+  run_loop(w.base, SETTLE_MSEC+100);
+  assert(w.updates.count==2);
+
+  /* a touched config file has a new mtime, so it is read again */
+  assert(0==utimensat(AT_FDCWD, talloc_asprintf(dir, "%s/main.cfg", dir), NULL, 0));
+  run_loop(w.base, SETTLE_MSEC+100);
+  assert(w.updates.count==3);
+
+  /* a file that is not part of the configuration does not cause a reload */
+  write_cfg(dir, "notes.txt", 0);
+  run_loop(w.base, SETTLE_MSEC+100);
+  assert(w.updates.count==3);
+
+  watch_stop(&w);
+  remove_dir(dir);
+  talloc_free(dir);
+}
+
+/* replacing a directory of config files by swapping a symlink to it is noticed */
+static void test_symlink_swap(void)
+{
+  char *dir=make_dir(NULL);
+  char *path=NULL;
+  struct watch w;
+
+  /* laid out as a Kubernetes ConfigMap volume */
+  path=talloc_asprintf(dir, "%s/..v1", dir);
+  assert(0==mkdir(path, 0700));
+  write_cfg(path, "main.cfg", 1);
+  assert(0==symlink("..v1", talloc_asprintf(dir, "%s/..data", dir)));
+  assert(0==symlink("..data/main.cfg", talloc_asprintf(dir, "%s/main.cfg", dir)));
+  watch_start(&w, dir);
+
+  path=talloc_asprintf(dir, "%s/..v2", dir);
+  assert(0==mkdir(path, 0700));
+  write_cfg(path, "main.cfg", 2);
+  assert(0==symlink("..v2", talloc_asprintf(dir, "%s/..data_tmp", dir)));
+  assert(0==rename(talloc_asprintf(dir, "%s/..data_tmp", dir), talloc_asprintf(dir, "%s/..data", dir)));
+  run_loop(w.base, SETTLE_MSEC+100);
+  assert(w.updates.count==2);
+
+  watch_stop(&w);
+  remove_dir(dir);
+  talloc_free(dir);
+}
+
+/* if the watched directory goes away, changes are picked up by polling */
+static void test_poll_fallback(void)
+{
+  char *dir=make_dir(NULL);
+  char *moved=talloc_asprintf(dir, "%s.moved", dir);
+  struct watch w;
+
+  write_cfg(dir, "main.cfg", 1);
+  watch_start(&w, dir);
+  assert(w.cfgwatch->inotify_fd>=0);
+  assert(w.cfgwatch->poll_ev==NULL);
+
+  assert(0==rename(dir, moved));
+  run_loop(w.base, SETTLE_MSEC+100);
+  assert(w.cfgwatch->inotify_fd<0);
+  assert(w.cfgwatch->inotify_ev==NULL);
+  assert(w.cfgwatch->poll_ev!=NULL);
+  assert(w.updates.count==1); /* no files, nothing to load */
+
+  assert(0==rename(moved, dir));
+  write_cfg(dir, "main.cfg", 2);
+  run_loop(w.base, SETTLE_MSEC+3*POLL_MSEC);
+  assert(w.updates.count==2);
+
+  /* still polling */
+  write_cfg(dir, "main.cfg", 3);
+  run_loop(w.base, SETTLE_MSEC+3*POLL_MSEC);
+  assert(w.updates.count==3);
+
+  watch_stop(&w);
+  remove_dir(dir);
+  talloc_free(dir);
+}
+
+int main(void)
+{
+  tr_log_open();
+  test_settle();
+  test_symlink_swap();
+  test_poll_fallback();
+  printf("Success.\n");
+  return 0;
+}
@@ -33,13 +33,38 @@
  */
 
 #include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <talloc.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <tr_config.h>
 #include <tr_debug.h>
 #include <tr_event.h>
 #include <tr_cfgwatch.h>
 
+/* how long to wait before trying again to free a replaced configuration */
+static struct timeval tr_cfgwatch_reclaim_interval={1,0};
+
+static int tr_cfgwatch_destructor(void *object)
+{
+  TR_CFGWATCH *cfgwatch=talloc_get_type_abort(object, TR_CFGWATCH);
+  if (cfgwatch->inotify_ev!=NULL)
+    event_free(cfgwatch->inotify_ev);
+  if (cfgwatch->settle_ev!=NULL)
+    event_free(cfgwatch->settle_ev);
+  if (cfgwatch->poll_ev!=NULL)
+    event_free(cfgwatch->poll_ev);
+  if (cfgwatch->reclaim_ev!=NULL)
+    event_free(cfgwatch->reclaim_ev);
+  if (cfgwatch->inotify_fd>=0)
+    close(cfgwatch->inotify_fd);
+  return 0;
+}
+
 /* Initialize a new tr_cfgwatch_data struct. Free this with talloc. */
 TR_CFGWATCH *tr_cfgwatch_create(TALLOC_CTX *mem_ctx)
 {
@@ -49,7 +74,10 @@ TR_CFGWATCH *tr_cfgwatch_create(TALLOC_CTX *mem_ctx)
   new_cfg=talloc_zero(tmp_ctx, TR_CFGWATCH);
   if (new_cfg == NULL) {
     tr_debug("tr_cfgwatch_create: Allocation failed.");
-  } 
+  } else {
+    new_cfg->inotify_fd=-1;
+    talloc_set_destructor((void *)new_cfg, tr_cfgwatch_destructor);
+  }
   talloc_steal(mem_ctx, new_cfg);
   talloc_free(tmp_ctx);
   return new_cfg;
@@ -243,6 +271,8 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
   TR_CFG_RC rc = TR_CFG_SUCCESS;	/* presume success */
   struct tr_fstat *new_fstat_list=NULL;
   char **files_with_paths=NULL;
+  TR_CFG *old_cfg=NULL;
+  int from_snapshot=0;
   int retval=0;
 
   /* find the configuration files -- n.b., tr_find_config_files()
@@ -271,12 +301,30 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
     retval=1; goto cleanup;
   }
 
+  /* On the first load, start from the snapshot if the files have not changed since it was written. */
+  if ((cfgwatch->snapshot_file!=NULL) && (cfgwatch->fstat_list==NULL))
+    from_snapshot=(TR_CFG_SUCCESS == tr_cfg_load_snapshot(cfgwatch->cfg_mgr,
+                                                          cfgwatch->snapshot_file,
+                                                          n_files,
+                                                          files_with_paths));
+
   /* now fill it in (tr_parse_config allocates space for new config) */
-  if (TR_CFG_SUCCESS != (rc = tr_parse_config(cfgwatch->cfg_mgr, n_files, files_with_paths))) {
+  if ((!from_snapshot)
+      && (TR_CFG_SUCCESS != (rc = tr_parse_config(cfgwatch->cfg_mgr, n_files, files_with_paths)))) {
     tr_debug("tr_read_and_apply_config: Error parsing configuration information, rc=%d.", rc);
     retval=1; goto cleanup;
   }
 
+  /* Save what we parsed for the next start. This must happen before the configuration
+   * is applied, because the update callback adds state learned from peers to it. */
+  if ((cfgwatch->snapshot_file!=NULL) && (!from_snapshot)
+      && (TR_CFG_SUCCESS != tr_cfg_write_snapshot(cfgwatch->cfg_mgr, cfgwatch->snapshot_file)))
+    tr_warning("tr_read_and_apply_config: Unable to write configuration snapshot %s.", cfgwatch->snapshot_file);
+
+  /* Keep the old configuration until the callback has moved any state off it
+   * (e.g., memberships learned from peers are held in its community table). */
+  old_cfg=tr_cfg_mgr_acquire(cfgwatch->cfg_mgr);
+
   /* apply new configuration (nulls new, manages context ownership) */
   if (TR_CFG_SUCCESS != (rc = tr_apply_new_config(cfgwatch->cfg_mgr))) {
     tr_debug("tr_read_and_apply_config: Error applying configuration, rc = %d.", rc);
@@ -288,6 +336,10 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
   if (cfgwatch->update_cb!=NULL)
     cfgwatch->update_cb(cfgwatch->cfg_mgr->active, cfgwatch->update_cookie);
 
+  /* if a reader was still loading the old configuration, free it on a later pass */
+  if ((tr_cfg_mgr_reclaim(cfgwatch->cfg_mgr)>0) && (cfgwatch->reclaim_ev!=NULL))
+    event_add(cfgwatch->reclaim_ev, &tr_cfgwatch_reclaim_interval);
+
   /* give ownership of the new_fstat_list to caller's context */
   if (cfgwatch->fstat_list != NULL) {
     /* free the old one */
@@ -299,6 +351,7 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
   new_fstat_list=NULL;
 
  cleanup:
+  tr_cfg_release(old_cfg);
   tr_free_config_file_list(n_files, &cfg_files);
   talloc_free(tmp_ctx);
   cfgwatch->cfg_mgr->new=NULL; /* this has been freed, either explicitly or with tmp_ctx */
@@ -306,6 +359,26 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
 }
 
 
+/* Read the new configuration now that changes have settled. */
+static void tr_cfgwatch_apply_settled(TR_CFGWATCH *cfg_status)
+{
+  tr_notice("Configuration file change settled, attempting to update configuration.");
+  if (0 != tr_read_and_apply_config(cfg_status))
+    tr_warning("Configuration file update failed. Using previous configuration.");
+  else
+    tr_notice("Configuration updated successfully.");
+  cfg_status->change_detected=0;
+}
+
+/* Frees replaced configurations, retrying until none are left. */
+static void tr_cfgwatch_reclaim_cb(int listener, short event, void *arg)
+{
+  TR_CFGWATCH *cfg_status=talloc_get_type_abort(arg, TR_CFGWATCH);
+
+  if (tr_cfg_mgr_reclaim(cfg_status->cfg_mgr)>0)
+    event_add(cfg_status->reclaim_ev, &tr_cfgwatch_reclaim_interval);
+}
+
 static void tr_cfgwatch_event_cb(int listener, short event, void *arg)
 {
   TR_CFGWATCH *cfg_status=(TR_CFGWATCH *) arg;
@@ -325,20 +398,175 @@ static void tr_cfgwatch_event_cb(int listener, short event, void *arg)
       tr_err("tr_cfgwatch_event_cb: gettimeofday() failed (2).");
     }
     timersub(&now, &cfg_status->last_change_detected, &diff);
-    if (!timercmp(&diff, &cfg_status->settling_time, <)) {
-      tr_notice("Configuration file change settled, attempting to update configuration.");
-      if (0 != tr_read_and_apply_config(cfg_status))
-        tr_warning("Configuration file update failed. Using previous configuration.");
-      else
-        tr_notice("Configuration updated successfully.");
-      cfg_status->change_detected=0;
+    if (!timercmp(&diff, &cfg_status->settling_time, <))
+      tr_cfgwatch_apply_settled(cfg_status);
+  }
+}
+
+
+/* Start polling the configuration directory. Returns 0 on success. */
+static int tr_cfgwatch_poll_init(struct event_base *base, TR_CFGWATCH *cfg_status)
+{
+  cfg_status->poll_ev=event_new(base, -1, EV_TIMEOUT|EV_PERSIST, tr_cfgwatch_event_cb, (void *)cfg_status);
+  if (cfg_status->poll_ev == NULL) {
+    tr_err("tr_cfgwatch_poll_init: Unable to create poll event.");
+    return 1;
+  }
+  event_add(cfg_status->poll_ev, &(cfg_status->poll_interval));
+
+  tr_info("tr_cfgwatch_poll_init: Added configuration file watcher with %0d.%06d second poll interval.",
+           cfg_status->poll_interval.tv_sec,
+           cfg_status->poll_interval.tv_usec);
+  return 0;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* inotify events that may mean the configuration changed */
+#define TR_CFGWATCH_INOTIFY_MASK (IN_CLOSE_WRITE|IN_MODIFY|IN_ATTRIB|IN_CREATE|IN_DELETE \
+                                  |IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF)
+
+/* Fires once the configuration files have been left alone for the settling time. */
+static void tr_cfgwatch_settle_cb(int listener, short event, void *arg)
+{
+  TR_CFGWATCH *cfg_status=talloc_get_type_abort(arg, TR_CFGWATCH);
+
+  /* Compare against the recorded file list, which also picks up changes that were missed,
+   * e.g., while the directory was being replaced. A touched config file counts as changed
+   * because its mtime differs. If no config file changed (e.g., only another file in the
+   * directory did), there is nothing to do. */
+  if (tr_cfgwatch_update_needed(cfg_status))
+    tr_cfgwatch_apply_settled(cfg_status);
+  else {
+    tr_debug("tr_cfgwatch_settle_cb: No configuration files changed.");
+    cfg_status->change_detected=0;
+  }
+}
+
+/* Could an event on this name mean the config files changed without an event of their own?
+ * Tools that replace a directory of config files atomically (e.g., a Kubernetes ConfigMap
+ * volume) keep the real files in a "..<timestamp>" directory and swap a "..data" symlink
+ * to it. The config files are symlinks through "..data", so only the swap is reported. */
+static int tr_cfgwatch_is_swap_name(const char *name)
+{
+  return (0==strncmp(name, "..", 2));
+}
+
+/* Stop using inotify and poll instead. Used if the directory we are watching goes away. */
+static void tr_cfgwatch_inotify_stop(TR_CFGWATCH *cfg_status)
+{
+  struct event_base *base=event_get_base(cfg_status->inotify_ev);
+
+  tr_warning("tr_cfgwatch_inotify_stop: Lost watch on %s, falling back to polling.", cfg_status->config_dir);
+  event_free(cfg_status->inotify_ev);
+  cfg_status->inotify_ev=NULL;
+  close(cfg_status->inotify_fd);
+  cfg_status->inotify_fd=-1;
+  if (0 != tr_cfgwatch_poll_init(base, cfg_status))
+    tr_crit("tr_cfgwatch_inotify_stop: Configuration file changes will not be detected.");
+}
+
+/* Handle inotify events on the configuration directory. Each relevant change restarts the
+ * settling timer, so the configuration is read once the files have been quiet for the
+ * settling time. */
+static void tr_cfgwatch_inotify_cb(int listener, short event, void *arg)
+{
+  TR_CFGWATCH *cfg_status=talloc_get_type_abort(arg, TR_CFGWATCH);
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *iev=NULL;
+  ssize_t len=0;
+  char *p=NULL;
+  int relevant=0;
+  int lost_watch=0;
+
+  for (;;) {
+    len=read(cfg_status->inotify_fd, buf, sizeof(buf));
+    if (len<0) {
+      if (errno==EINTR)
+        continue;
+      if (errno!=EAGAIN)
+        tr_err("tr_cfgwatch_inotify_cb: Error reading inotify events (%s).", strerror(errno));
+      break;
+    }
+    if (len==0)
+      break;
+
+    for (p=buf; p<buf+len; p+=sizeof(struct inotify_event)+iev->len) {
+      iev=(const struct inotify_event *)p;
+      if (iev->mask & (IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT)) {
+        lost_watch=1;
+        relevant=1;
+      } else if (iev->mask & IN_Q_OVERFLOW) {
+        relevant=1; /* lost events, have to assume something changed */
+      } else if ((iev->len>0)
+                 && ((iev->mask & IN_ISDIR)
+                     || tr_cfgwatch_is_swap_name(iev->name)
+                     || tr_is_config_file_name(iev->name))) {
+        relevant=1; /* the settle timer checks whether any config file really changed */
+      }
     }
   }
+
+  if (relevant) {
+    if (!cfg_status->change_detected)
+      tr_notice("Configuration file change detected, waiting for changes to settle.");
+    cfg_status->change_detected=1;
+    if (0 != gettimeofday(&cfg_status->last_change_detected, NULL)) {
+      tr_err("tr_cfgwatch_inotify_cb: gettimeofday() failed.");
+    }
+    /* (re)start the settling timer */
+    event_add(cfg_status->settle_ev, &(cfg_status->settling_time));
+  }
+
+  if (lost_watch)
+    tr_cfgwatch_inotify_stop(cfg_status);
 }
 
+/* Watch the configuration directory with inotify. Returns 0 on success. */
+static int tr_cfgwatch_inotify_init(struct event_base *base, TR_CFGWATCH *cfg_status)
+{
+  cfg_status->inotify_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (cfg_status->inotify_fd<0) {
+    tr_info("tr_cfgwatch_inotify_init: inotify unavailable (%s).", strerror(errno));
+    goto fail;
+  }
+
+  if (0 > inotify_add_watch(cfg_status->inotify_fd, cfg_status->config_dir, TR_CFGWATCH_INOTIFY_MASK)) {
+    tr_info("tr_cfgwatch_inotify_init: Unable to watch %s (%s).", cfg_status->config_dir, strerror(errno));
+    goto fail;
+  }
+
+  cfg_status->settle_ev=event_new(base, -1, EV_TIMEOUT, tr_cfgwatch_settle_cb, (void *)cfg_status);
+  cfg_status->inotify_ev=event_new(base, cfg_status->inotify_fd, EV_READ|EV_PERSIST,
+                                   tr_cfgwatch_inotify_cb, (void *)cfg_status);
+  if ((cfg_status->settle_ev==NULL) || (cfg_status->inotify_ev==NULL)) {
+    tr_err("tr_cfgwatch_inotify_init: Unable to create events.");
+    goto fail;
+  }
+  event_add(cfg_status->inotify_ev, NULL);
+
+  tr_info("tr_cfgwatch_inotify_init: Watching %s for configuration changes with inotify.", cfg_status->config_dir);
+  return 0;
+
+fail:
+  if (cfg_status->inotify_ev!=NULL) {
+    event_free(cfg_status->inotify_ev);
+    cfg_status->inotify_ev=NULL;
+  }
+  if (cfg_status->settle_ev!=NULL) {
+    event_free(cfg_status->settle_ev);
+    cfg_status->settle_ev=NULL;
+  }
+  if (cfg_status->inotify_fd>=0) {
+    close(cfg_status->inotify_fd);
+    cfg_status->inotify_fd=-1;
+  }
+  return 1;
+}
+#endif /* HAVE_SYS_INOTIFY_H */
 
 /* Configure the cfgwatch instance and set up its event handler.
- * Returns 0 on success, nonzero on failure. Points
+ * Watches the configuration directory with inotify if possible, otherwise
+ * polls it. Returns 0 on success, nonzero on failure. Points
  * *cfgwatch_ev to the event struct. */
 int tr_cfgwatch_event_init(struct event_base *base,
                            TR_CFGWATCH *cfg_status,
@@ -354,13 +582,22 @@ int tr_cfgwatch_event_init(struct event_base *base,
   cfg_status->last_change_detected.tv_sec=0;
   cfg_status->last_change_detected.tv_usec=0;
 
-  /* create the event and enable it */
-  *cfgwatch_ev=event_new(base, -1, EV_TIMEOUT|EV_PERSIST, tr_cfgwatch_event_cb, (void *)cfg_status);
-  event_add(*cfgwatch_ev, &(cfg_status->poll_interval));
+  cfg_status->reclaim_ev=event_new(base, -1, EV_TIMEOUT, tr_cfgwatch_reclaim_cb, (void *)cfg_status);
+  if (cfg_status->reclaim_ev == NULL) {
+    tr_err("tr_cfgwatch_event_init: Unable to create reclaim event.");
+    return 1;
+  }
 
-  tr_info("tr_cfgwatch_event_init: Added configuration file watcher with %0d.%06d second poll interval.",
-           cfg_status->poll_interval.tv_sec,
-           cfg_status->poll_interval.tv_usec);
+#ifdef HAVE_SYS_INOTIFY_H
+  if (0 == tr_cfgwatch_inotify_init(base, cfg_status)) {
+    *cfgwatch_ev=cfg_status->inotify_ev;
+    return 0;
+  }
+  tr_notice("tr_cfgwatch_event_init: Falling back to polling for configuration changes.");
+#endif
+
+  if (0 != tr_cfgwatch_poll_init(base, cfg_status))
+    return 1;
+  *cfgwatch_ev=cfg_status->poll_ev;
   return 0;
 }
-
@@ -82,6 +82,8 @@ static const char arg_doc[]=""; /* string describing arguments, if any */
 static const struct argp_option cmdline_options[] = {
     { "config-dir", 'c', "DIR", 0, "Specify configuration file location (default is current directory)"},
     { "config-validate", 'C', NULL, 0, "Validate configuration files and exit"},
+    { "trp-state", 't', "FILE", 0, "Save routes and communities learned from peers to FILE, and restore them from it on start"},
+    { "config-snapshot", 's', "FILE", 0, "Start from the configuration snapshot in FILE if the configuration files are unchanged, and keep it up to date"},
     { "version", 1, NULL, 0, "Print version information and exit"},
     { NULL }
 };
@@ -91,6 +93,8 @@ struct cmdline_args {
     int version_requested;
     int validate_config_and_exit;
     char *config_dir;
+    char *trp_state_file;
+    char *snapshot_file;
 };
 
 /* parser for individual options - fills in a struct cmdline_args */
@@ -108,6 +112,22 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
       arguments->config_dir=arg;
       break;
 
+    case 't':
+      if (arg == NULL) {
+        /* somehow we got called without an argument */
+        return ARGP_ERR_UNKNOWN;
+      }
+      arguments->trp_state_file=arg;
+      break;
+
+    case 's':
+      if (arg == NULL) {
+        /* somehow we got called without an argument */
+        return ARGP_ERR_UNKNOWN;
+      }
+      arguments->snapshot_file=arg;
+      break;
+
     case 1:
       arguments->version_requested=1;
       break;
@@ -168,16 +188,20 @@ static MON_RC tr_handle_uptime(void *cookie, json_t **result_ptr)
 static MON_RC tr_handle_show_rp_clients(void *cookie, json_t **response_ptr)
 {
   TR_CFG_MGR *cfg_mgr = talloc_get_type_abort(cookie, TR_CFG_MGR);
+  TR_CFG *cfg = tr_cfg_mgr_acquire(cfg_mgr);
 
-  *response_ptr = tr_rp_clients_to_json(cfg_mgr->active->rp_clients);
+  *response_ptr = tr_rp_clients_to_json(cfg->rp_clients);
+  tr_cfg_release(cfg);
   return (*response_ptr == NULL) ? MON_NOMEM : MON_SUCCESS;
 }
 
 static MON_RC tr_handle_show_cfg_serial(void *cookie, json_t **response_ptr)
 {
   TR_CFG_MGR *cfg_mgr = talloc_get_type_abort(cookie, TR_CFG_MGR);
+  TR_CFG *cfg = tr_cfg_mgr_acquire(cfg_mgr);
 
-  *response_ptr = tr_cfg_files_to_json_array(cfg_mgr->active);
+  *response_ptr = tr_cfg_files_to_json_array(cfg);
+  tr_cfg_release(cfg);
   return (*response_ptr == NULL) ? MON_NOMEM : MON_SUCCESS;
 }
 
@@ -215,6 +239,8 @@ int main(int argc, char *argv[])
   opts.version_requested=0;
   opts.validate_config_and_exit=0;
   opts.config_dir=".";
+  opts.trp_state_file=NULL;
+  opts.snapshot_file=NULL;
 
   /* parse the command line*/
   argp_parse(&argp, argc, argv, 0, 0, &opts);
@@ -270,6 +296,7 @@ int main(int argc, char *argv[])
     return 1;
   }
   tr->cfgwatch->config_dir=opts.config_dir;
+  tr->cfgwatch->snapshot_file=opts.snapshot_file;
   tr->cfgwatch->cfg_mgr=tr->cfg_mgr;
   tr->cfgwatch->update_cb=tr_config_changed; /* handle configuration changes */
   tr->cfgwatch->update_cookie=(void *)tr;
@@ -313,6 +340,9 @@ int main(int argc, char *argv[])
   /* tell the trps which port the tid server listens on */
   tr->trps->tids_port = tr->tids->tids_port;
 
+  /* routing state saved across restarts, restored when the TRP events are set up */
+  trps_set_state_file(tr->trps, opts.trp_state_file);
+
   /* install TRP handler events */
   tr_debug("Initializing Dynamic Trust Router Protocol events.");
   if (TRP_SUCCESS != tr_trps_event_init(ev_base, tr)) {
@@ -323,6 +353,7 @@ int main(int argc, char *argv[])
   tr_debug("Starting event loop.");
   tr_event_loop_run(ev_base); /* does not return until we are done */
 
+  tr_trps_stop_connections(tr->trps); /* join the connection threads before freeing what they use */
   tr_destroy(tr); /* thanks to talloc, should destroy everything */
 
   talloc_free(main_ctx);
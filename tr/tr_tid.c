@@ -45,6 +45,7 @@
 #include <tr_debug.h>
 #include <gsscon.h>
 #include <trp_route.h>
+#include <trp_rview.h>
 #include <trp_internal.h>
 #include <tr_config.h>
 #include <tr_mq.h>
@@ -90,6 +91,7 @@ struct tr_tids_fwd_cookie {
   TR_AAA_SERVER *aaa; /* AAA server to contact */
   DH *dh_params;
   TID_REQ *fwd_req; /* the req to duplicate */
+  int debug_sampled; /* request is sampled for debug logging */
 };
 
 static int tr_tids_fwd_cookie_destructor(void *obj)
@@ -122,10 +124,6 @@ static int tr_tids_fwd_release_mutex(struct tr_tids_fwd_cookie *cookie)
   return (pthread_mutex_unlock(&(cookie->mutex)));
 }
 
-/* values for messages */
-#define TR_TID_MQMSG_SUCCESS "tid success"
-#define TR_TID_MQMSG_FAILURE "tid failure"
-
 /* Thread main for sending and receiving a request to a single AAA server */
 static void *tr_tids_req_fwd_thread(void *arg)
 {
@@ -140,6 +138,7 @@ static void *tr_tids_req_fwd_thread(void *arg)
   int success=0;
 
   talloc_steal(tmp_ctx, args); /* take responsibility for the cookie */
+  tr_log_set_sampled(args->debug_sampled);
 
   if (tidc!=NULL)
     talloc_steal(tmp_ctx, tidc);
@@ -208,9 +207,9 @@ cleanup:
     /* mq is still valid, so we can queue our response */
     tr_debug("tr_tids_req_fwd_thread: thread %d using valid msg queue.", cookie->thread_id);
     if (success)
-      msg= tr_mq_msg_new(tmp_ctx, TR_TID_MQMSG_SUCCESS);
+      msg= tr_mq_msg_new(tmp_ctx, TR_MQMSG_TID_SUCCESS);
     else
-      msg= tr_mq_msg_new(tmp_ctx, TR_TID_MQMSG_FAILURE);
+      msg= tr_mq_msg_new(tmp_ctx, TR_MQMSG_TID_FAILURE);
 
     if (msg==NULL)
       tr_notice("tr_tids_req_fwd_thread: thread %d unable to allocate response msg.", cookie->thread_id);
@@ -229,6 +228,7 @@ cleanup:
     free(aaa_hostname);
 
   talloc_free(tmp_ctx);
+  tr_log_set_sampled(0);
   return NULL;
 }
 
@@ -338,19 +338,21 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   TR_FILTER_ACTION oaction = TR_FILTER_ACTION_REJECT;
   time_t expiration_interval=0;
   struct tr_tids_event_cookie *cookie=talloc_get_type_abort(cookie_in, struct tr_tids_event_cookie);
-  TR_CFG_MGR *cfg_mgr=cookie->cfg_mgr;
+  TR_CFG *cfg=tr_cfg_mgr_acquire(cookie->cfg_mgr); /* use one configuration for the whole request */
   TRPS_INSTANCE *trps=cookie->trps;
-  TRP_ROUTE *route=NULL;
+  TRP_RVIEW *rview=NULL;
+  TRP_RVIEW_ENTRY *route=NULL;
   TR_MQ *mq=NULL;
   TR_MQ_MSG *msg=NULL;
   unsigned int n_responses=0;
   unsigned int n_failed=0;
   struct timespec ts_abort={0};
-  unsigned int resp_frac_numer=cfg_mgr->active->internal->tid_resp_numer;
-  unsigned int resp_frac_denom=cfg_mgr->active->internal->tid_resp_denom;
+  unsigned int resp_frac_numer=cfg->internal->tid_resp_numer;
+  unsigned int resp_frac_denom=cfg->internal->tid_resp_denom;
   TR_RESP_COOKIE *payload=NULL;
   TR_FILTER_TARGET *target=NULL;
   int ii=0;
+  int debug_sampled=0;
   int retval=-1;
 
   if ((!tids) || (!orig_req) || (!resp)) {
@@ -359,6 +361,10 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     goto cleanup;
   }
 
+  /* Decide once whether to debug-log this request. Forwarding threads inherit the decision. */
+  debug_sampled = tr_cfg_debug_sampled(cfg->internal, tids->gss_name, orig_req->realm);
+  tr_log_set_sampled(debug_sampled);
+
   tr_debug("tr_tids_req_handler: Request received (conn = %d)! Realm = %s, Comm = %s", orig_req->conn, 
            orig_req->realm->buf, orig_req->comm->buf);
   if (orig_req->request_id)
@@ -377,7 +383,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   talloc_steal(tmp_ctx, fwd_req);
 
   /* cfg_comm is now the community (APC or CoI) of the incoming request */
-  if (NULL == (cfg_comm=tr_comm_table_find_comm(cfg_mgr->active->ctable, orig_req->comm))) {
+  if (NULL == (cfg_comm=tr_comm_table_find_comm(cfg->ctable, orig_req->comm))) {
     tr_notice("tr_tids_req_hander: Request for unknown comm: %s.", orig_req->comm->buf);
     tid_resp_set_err_msg(resp, tr_new_name("Unknown community"));
     retval=-1;
@@ -415,7 +421,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     retval=-1;
     goto cleanup;
   }
-  for (rp_client=tr_rp_client_iter_first(rpc_iter, cfg_mgr->active->rp_clients);
+  for (rp_client=tr_rp_client_iter_first(rpc_iter, cfg->rp_clients);
        rp_client != NULL;
        rp_client=tr_rp_client_iter_next(rpc_iter)) {
 
@@ -441,7 +447,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   }
 
   /* Check that the rp_realm is a member of the community in the request */
-  if (NULL == tr_comm_find_rp(cfg_mgr->active->ctable, cfg_comm, orig_req->rp_realm)) {
+  if (NULL == tr_comm_find_rp(cfg->ctable, cfg_comm, orig_req->rp_realm)) {
     tr_notice("tr_tids_req_handler: RP Realm (%s) not member of community (%s).",
               orig_req->rp_realm->buf, orig_req->comm->buf);
     tid_resp_set_err_msg(resp, tr_new_name("RP community membership error"));
@@ -449,13 +455,13 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     goto cleanup;
   }
 
-  switch(map_coi(cfg_mgr->active->ctable, fwd_req)) {
+  switch(map_coi(cfg->ctable, fwd_req)) {
     case MAP_COI_MAP_NOT_REQUIRED:
       cfg_apc = cfg_comm;
       break;
 
     case MAP_COI_SUCCESS:
-      cfg_apc = tr_comm_table_find_comm(cfg_mgr->active->ctable, tid_req_get_comm(fwd_req));
+      cfg_apc = tr_comm_table_find_comm(cfg->ctable, tid_req_get_comm(fwd_req));
       tr_debug("tr_tids_req_handler: Community %.*s is a COI, mapping to APC %.*s.",
                tid_req_get_orig_coi(fwd_req)->len, tid_req_get_orig_coi(fwd_req)->buf,
                tr_comm_get_id(cfg_apc)->len, tr_comm_get_id(cfg_apc)->buf);
@@ -490,7 +496,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   /* cfg_comm is now the original community, and cfg_apc is the APC it belongs to. These
    * may both be the same. If not, check that rp_realm is a  member of the mapped APC */
   if ((cfg_apc != cfg_comm)
-      && (NULL == tr_comm_find_rp(cfg_mgr->active->ctable,
+      && (NULL == tr_comm_find_rp(cfg->ctable,
                                   cfg_apc,
                                   tid_req_get_rp_realm(fwd_req)))) {
     tr_notice("tr_tids_req_hander: RP Realm (%.*s) not member of mapped APC (%.*s).",
@@ -503,11 +509,12 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
 
   /* Look up the route for forwarding request's community/realm. */
   tr_debug("tr_tids_req_handler: looking up route.");
-  route=trps_get_selected_route(trps, fwd_req->comm, fwd_req->realm);
+  rview=trps_acquire_rview(trps); /* released at cleanup, route points into it */
+  route=trp_rview_lookup(rview, fwd_req->comm, fwd_req->realm);
   if (route==NULL) {
     /* No route. Use default AAA servers if we have them. */
     tr_debug("tr_tids_req_handler: No route for realm %s, defaulting.", fwd_req->realm->buf);
-    if (NULL == (aaa_servers = tr_default_server_lookup(cfg_mgr->active->default_servers,
+    if (NULL == (aaa_servers = tr_default_server_lookup(cfg->default_servers,
                                                         fwd_req->comm))) {
       tr_notice("tr_tids_req_handler: No default AAA servers, discarded.");
       tid_resp_set_err_msg(resp, tr_new_name("No path to AAA Server(s) for realm"));
@@ -518,9 +525,10 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   } else {
     /* Found a route. Determine the AAA servers or next hop address for the request we are forwarding. */
     tr_debug("tr_tids_req_handler: found route.");
-    if (trp_route_is_local(route)) {
+    if (trp_rview_entry_is_local(route)) {
       tr_debug("tr_tids_req_handler: route is local.");
-      aaa_servers = tr_idp_aaa_server_lookup(cfg_mgr->active->ctable->idp_realms,
+      /* look the realm up by its index, then get its servers */
+      aaa_servers = tr_idp_aaa_server_lookup(tr_comm_table_find_idp_realm(cfg->ctable, fwd_req->realm),
                                              fwd_req->realm,
                                              fwd_req->comm,
                                              &idp_shared);
@@ -532,24 +540,24 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
         retval=-1;
         goto cleanup;
       }
-      tr_aaa_server_set_hostname(aaa_servers, trp_route_dup_next_hop(route));
+      tr_aaa_server_set_hostname(aaa_servers, trp_rview_entry_dup_next_hop(route));
       if (tr_aaa_server_get_hostname(aaa_servers) == NULL) {
         tr_err("tr_tids_req_handler: error allocating next hop");
         retval=-1;
         goto cleanup;
       }
-      tr_aaa_server_set_port(aaa_servers, trp_route_get_next_hop_port(route));
+      tr_aaa_server_set_port(aaa_servers, trp_rview_entry_get_next_hop_port(route));
       idp_shared = 0;
     }
 
     /* Since we aren't defaulting, check idp coi and apc membership of the original request */
-    if (NULL == (tr_comm_find_idp(cfg_mgr->active->ctable, cfg_comm, orig_req->realm))) {
+    if (NULL == (tr_comm_find_idp(cfg->ctable, cfg_comm, orig_req->realm))) {
       tr_notice("tr_tids_req_handler: IDP Realm (%s) not member of community (%s).", orig_req->realm->buf, cfg_comm->id->buf);
       tid_resp_set_err_msg(resp, tr_new_name("IDP community membership error"));
       retval=-1;
       goto cleanup;
     }
-    if ( cfg_apc && (NULL == (tr_comm_find_idp(cfg_mgr->active->ctable, cfg_apc, orig_req->realm)))) {
+    if ( cfg_apc && (NULL == (tr_comm_find_idp(cfg->ctable, cfg_apc, orig_req->realm)))) {
       tr_notice("tr_tids_req_handler: IDP Realm (%s) not member of APC (%s).", orig_req->realm->buf, cfg_apc->id->buf);
       tid_resp_set_err_msg(resp, tr_new_name("IDP APC membership error"));
       retval=-1;
@@ -616,6 +624,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     aaa_cookie[n_aaa]->aaa=this_aaa;
     aaa_cookie[n_aaa]->dh_params=tr_dh_dup(orig_req->tidc_dh);
     aaa_cookie[n_aaa]->fwd_req=tid_dup_req(fwd_req);
+    aaa_cookie[n_aaa]->debug_sampled=debug_sampled;
     talloc_steal(aaa_cookie[n_aaa], aaa_cookie[n_aaa]->fwd_req);
     tr_debug("tr_tids_req_handler: cookie %d initialized.", n_aaa);
 
@@ -634,7 +643,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   }
 
   /* determine expiration time */
-  if (0!=tr_mq_pop_timeout(cfg_mgr->active->internal->tid_req_timeout, &ts_abort)) {
+  if (0!=tr_mq_pop_timeout(cfg->internal->tid_req_timeout, &ts_abort)) {
     tr_notice("tr_tids_req_handler: unable to read clock for timeout.");
     retval=-1;
     goto cleanup;
@@ -647,7 +656,8 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   while (((n_responses+n_failed)<n_aaa) &&
          (NULL!=(msg=tr_mq_pop(mq, &ts_abort)))) {
     /* process message */
-    if (0==strcmp(tr_mq_msg_get_message(msg), TR_TID_MQMSG_SUCCESS)) {
+    switch (tr_mq_msg_get_type(msg)) {
+    case TR_MQMSG_TID_SUCCESS:
       payload=talloc_get_type_abort(tr_mq_msg_get_payload(msg), TR_RESP_COOKIE);
       talloc_steal(tmp_ctx, payload); /* put this back in our context */
       aaa_resp[payload->thread_id]=payload->resp; /* save pointers to these */
@@ -662,7 +672,9 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
                   payload->resp->err_msg->len,
                   payload->resp->err_msg->buf);
       }
-    } else if (0==strcmp(tr_mq_msg_get_message(msg), TR_TID_MQMSG_FAILURE)) {
+      break;
+
+    case TR_MQMSG_TID_FAILURE:
       /* failure */
       n_failed++;
       payload=talloc_get_type(tr_mq_msg_get_payload(msg), TR_RESP_COOKIE);
@@ -676,7 +688,9 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
       }
       tr_notice("tr_tids_req_handler: TID request for AAA server %d failed.",
                 payload->thread_id);
-    } else {
+      break;
+
+    default:
       /* unexpected message */
       tr_err("tr_tids_req_handler: Unexpected message received. Aborting!");
       retval=-1;
@@ -746,7 +760,10 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   retval=0;
     
 cleanup:
+  tr_log_set_sampled(0);
   talloc_free(tmp_ctx);
+  trp_rview_release(rview);
+  tr_cfg_release(cfg);
   return retval;
 }
 
@@ -756,6 +773,8 @@ static int tr_tids_gss_handler(gss_name_t client_name, TR_NAME *gss_name,
   struct tr_tids_event_cookie *cookie=talloc_get_type_abort(data, struct tr_tids_event_cookie);
   TIDS_INSTANCE *tids = cookie->tids;
   TR_CFG_MGR *cfg_mgr = cookie->cfg_mgr;
+  TR_CFG *cfg=NULL;
+  TR_RP_CLIENT *rp_client=NULL;
 
   if ((!client_name) || (!gss_name) || (!tids) || (!cfg_mgr)) {
     tr_debug("tr_tidc_gss_handler: Bad parameters.");
@@ -763,7 +782,10 @@ static int tr_tids_gss_handler(gss_name_t client_name, TR_NAME *gss_name,
   }
 
   /* Ensure at least one client exists using this GSS name */
-  if (NULL == tr_rp_client_lookup(cfg_mgr->active->rp_clients, gss_name)) {
+  cfg=tr_cfg_mgr_acquire(cfg_mgr);
+  rp_client=tr_rp_client_lookup(cfg->rp_clients, gss_name);
+  tr_cfg_release(cfg);
+  if (NULL == rp_client) {
     tr_debug("tr_tids_gss_handler: Unknown GSS name %.*s", gss_name->len, gss_name->buf);
     return -1;
   }
@@ -40,6 +40,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -65,7 +67,8 @@ struct tr_trps_event_cookie {
   struct event *ev;
 };
 
-/* callback to schedule event to process messages */
+/* callback to schedule event to process messages; tr_trps_process_mq() reschedules
+ * itself if it leaves any behind, since this only runs when the queue was empty */
 static void tr_trps_mq_cb(TR_MQ *mq, void *arg)
 {
   struct event *mq_ev=(struct event *)arg;
@@ -156,6 +159,22 @@ static void *tr_trps_thread(void *arg)
   trps_mq_add(trps, msg); /* steals msg context */
   msg=NULL;
 
+  if (trps_get_event_transport(trps)) {
+    /* The main thread takes over the connection from here. Do not touch conn after
+     * queueing this, and do not report a disconnection. */
+    msg= tr_mq_msg_new(tmp_ctx, TR_MQMSG_TRPS_EVENT_READY);
+    if (msg==NULL) {
+      tr_err("tr_trps_thread: error allocating TR_MQ_MSG");
+      trp_connection_close(conn);
+      goto cleanup;
+    }
+    tr_mq_msg_set_payload(msg, (void *)conn, NULL); /* do not pass a free routine */
+    trps_mq_add(trps, msg);
+    tr_debug("tr_trps_thread: exit, connection handed to event loop");
+    talloc_free(tmp_ctx);
+    return NULL;
+  }
+
   trps_handle_connection(trps, conn);
 
 cleanup:
@@ -229,6 +248,269 @@ static void tr_trps_cleanup_trpc(TRPS_INSTANCE *trps, TRPC_INSTANCE *trpc)
   tr_debug("tr_trps_cleanup_trpc: deleted connection");
 }
 
+/* an incoming connection has gone down */
+static void tr_trps_conn_lost(TRPS_INSTANCE *trps, TRP_CONNECTION *conn)
+{
+  TR_NAME *peer_gssname=trp_connection_get_peer(conn);
+  TRP_PEER *peer=NULL;
+  char *tmp=NULL;
+
+  if (NULL == peer_gssname) {
+    /* If the GSS auth failed, then we don't know the peer's GSS name. */
+    tr_info("tr_trps_conn_lost: incoming connection failed to auth.");
+  } else {
+    /* We do know the peer's GSS name, see if we recognize it. */
+    peer = trps_get_peer_by_gssname(trps, peer_gssname); /* get the peer record */
+    tmp = tr_name_strdup(peer_gssname); /* get the name as a null-terminated string */
+    if (peer == NULL) {
+      tr_err("tr_trps_conn_lost: incoming connection from unknown peer (%s) lost.", tmp);
+    } else {
+      trp_peer_set_incoming_status(peer, PEER_DISCONNECTED);
+      tr_trps_cleanup_conn(trps, conn);
+      tr_info("tr_trps_conn_lost: incoming connection from %s lost.", tmp);
+    }
+    free(tmp);
+  }
+}
+
+/* an outgoing connection has gone down */
+static void tr_trps_trpc_lost(TRPS_INSTANCE *trps, TRPC_INSTANCE *trpc)
+{
+  TR_NAME *svcname=trpc_get_gssname(trpc);
+  TRP_PEER *peer=NULL;
+  char *tmp=NULL;
+
+  if (NULL == svcname) {
+    tr_info("tr_trps_trpc_lost: outgoing connection to unknown GSS service name lost.");
+  } else {
+    peer = trps_get_peer_by_servicename(trps, svcname);
+    tmp = tr_name_strdup(svcname);
+    if (peer == NULL)
+      tr_err("tr_trps_trpc_lost: outgoing connection to unknown peer (%s) lost.", tmp);
+    else {
+      trp_peer_set_outgoing_status(peer, PEER_DISCONNECTED);
+      tr_info("tr_trps_trpc_lost: outgoing connection to %s lost.", tmp);
+      tr_trps_cleanup_trpc(trps, trpc);
+    }
+    free(tmp);
+  }
+}
+
+/*
+ * Established connections serviced by the event loop
+ *
+ * When the event transport is enabled, connection threads only perform the GSS
+ * handshake, which is blocking and infrequent. They then hand the connection to
+ * the main thread, which reads incoming messages and writes outgoing ones as the
+ * sockets become ready. Incoming messages are handled as soon as they are read
+ * rather than passing through the trps message queue. Outgoing messages are still
+ * queued on the trpc's message queue, so the limits on that queue apply as before.
+ *
+ * Everything here runs on the main thread, including the additions to the trpc
+ * queues that trigger the write events.
+ */
+
+/* most messages to handle from one connection before returning to the event loop */
+#define TR_TRP_EVENT_READ_BATCH 32
+
+struct tr_trp_conn_events {
+  TRPS_INSTANCE *trps;
+  TRP_CONNECTION *conn;
+  TRPC_INSTANCE *trpc; /* null for incoming connections */
+  TRP_STREAM *stream;
+  struct event *read_ev;
+  struct event *write_ev; /* outgoing connections only */
+};
+
+static int tr_trp_conn_events_destructor(void *obj)
+{
+  struct tr_trp_conn_events *cev=talloc_get_type_abort(obj, struct tr_trp_conn_events);
+  if (cev->trpc!=NULL)
+    tr_mq_set_notify_cb(trpc_get_mq(cev->trpc), NULL, NULL);
+  if (cev->read_ev!=NULL)
+    event_free(cev->read_ev);
+  if (cev->write_ev!=NULL)
+    event_free(cev->write_ev);
+  return 0;
+}
+
+/* Stop servicing a connection and clean it up. Frees cev. */
+static void tr_trp_conn_events_lost(struct tr_trp_conn_events *cev)
+{
+  TRPS_INSTANCE *trps=cev->trps;
+  TRP_CONNECTION *conn=cev->conn;
+  TRPC_INSTANCE *trpc=cev->trpc;
+
+  talloc_free(cev); /* stop watching the socket before it is closed */
+  trp_connection_close(conn);
+  if (trpc==NULL)
+    tr_trps_conn_lost(trps, conn);
+  else
+    tr_trps_trpc_lost(trps, trpc);
+}
+
+/* read and handle messages from an incoming connection */
+static void tr_trps_conn_read_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct tr_trp_conn_events *cev=talloc_get_type_abort(arg, struct tr_trp_conn_events);
+  char *buf=NULL;
+  size_t buflen=0;
+  TRP_RC rc=TRP_ERROR;
+  int ii=0;
+
+  for (ii=0; ii<TR_TRP_EVENT_READ_BATCH; ii++) {
+    if (trp_stream_read(cev->stream, &buf, &buflen)!=TRP_SUCCESS) {
+      tr_trp_conn_events_lost(cev);
+      return;
+    }
+    if (buf==NULL)
+      break; /* wait for more data */
+
+    rc=trps_deliver_message(cev->trps, cev->conn, buf, buflen);
+    free(buf);
+    if (rc==TRP_ERROR) {
+      tr_trp_conn_events_lost(cev);
+      return;
+    } else if (rc!=TRP_SUCCESS)
+      tr_debug("tr_trps_conn_read_cb: unable to use message (%d)", rc);
+  }
+}
+
+/* Peers do not send anything on our outgoing connections, so this only
+ * notices when they close. */
+static void tr_trpc_conn_read_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct tr_trp_conn_events *cev=talloc_get_type_abort(arg, struct tr_trp_conn_events);
+  char scratch[256];
+  ssize_t n=0;
+
+  n=read(fd, scratch, sizeof(scratch));
+  if ((n==0) || ((n<0) && (errno!=EAGAIN) && (errno!=EWOULDBLOCK) && (errno!=EINTR)))
+    tr_trp_conn_events_lost(cev);
+}
+
+/* send messages from the trpc queue to the peer */
+static void tr_trpc_conn_write_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct tr_trp_conn_events *cev=talloc_get_type_abort(arg, struct tr_trp_conn_events);
+  TR_MQ_MSG *msg=NULL;
+  GBytes *payload=NULL;
+  const char *encoded_msg=NULL;
+
+  /* Leave messages in the queue once plenty is waiting to go out. They can still
+   * be superseded there, and the queue limits apply to them. */
+  while (trp_stream_pending(cev->stream)<TRP_STREAM_TX_LIMIT) {
+    msg=trpc_mq_pop(cev->trpc, NULL);
+    if (msg==NULL)
+      break;
+
+    switch (tr_mq_msg_get_type(msg)) {
+    case TR_MQMSG_ABORT:
+      tr_debug("tr_trpc_conn_write_cb: received abort message.");
+      tr_mq_msg_free(msg);
+      tr_trp_conn_events_lost(cev);
+      return;
+
+    case TR_MQMSG_TRPC_SEND:
+      /* payload is a null-terminated GBytes, possibly shared with other peers' queues */
+      payload=tr_mq_msg_get_payload(msg);
+      encoded_msg=(payload==NULL) ? NULL : g_bytes_get_data(payload, NULL);
+      if (encoded_msg==NULL)
+        tr_notice("tr_trpc_conn_write_cb: null outgoing TRP message.");
+      else if (trp_stream_queue(cev->stream, encoded_msg, strlen(encoded_msg))!=TRP_SUCCESS) {
+        tr_notice("tr_trpc_conn_write_cb: unable to wrap outgoing TRP message.");
+        tr_mq_msg_free(msg);
+        tr_trp_conn_events_lost(cev);
+        return;
+      }
+      break;
+
+    default:
+      tr_notice("tr_trpc_conn_write_cb: unknown message type %d received.", tr_mq_msg_get_type(msg));
+    }
+
+    tr_mq_msg_free(msg);
+  }
+
+  if (trp_stream_flush(cev->stream)!=TRP_SUCCESS) {
+    tr_notice("tr_trpc_conn_write_cb: error sending to peer.");
+    tr_trp_conn_events_lost(cev);
+    return;
+  }
+
+  if (trp_stream_pending(cev->stream)>0)
+    event_add(cev->write_ev, NULL); /* wait until the socket will take more */
+  else if (trpc_mq_get_length(cev->trpc)>0)
+    event_active(cev->write_ev, EV_WRITE, 0); /* stopped early, come back for the rest */
+}
+
+/* callback when a trpc queue serviced by the event loop becomes non-empty; the write
+ * callback keeps itself scheduled until it has emptied the queue */
+static void tr_trpc_mq_cb(TR_MQ *mq, void *arg)
+{
+  struct event *write_ev=(struct event *)arg;
+  event_active(write_ev, EV_WRITE, 0);
+}
+
+/**
+ * Start servicing an established connection from the event loop
+ *
+ * The state for this is allocated in conn's context, so it goes away
+ * when the connection is cleaned up.
+ *
+ * @param base event base for the connection's events
+ * @param trps TRPS instance
+ * @param conn connection to service
+ * @param trpc TRPC instance for an outgoing connection, or NULL for an incoming one
+ * @return TRP_SUCCESS or an error code
+ */
+static TRP_RC tr_trp_conn_events_start(struct event_base *base,
+                                       TRPS_INSTANCE *trps,
+                                       TRP_CONNECTION *conn,
+                                       TRPC_INSTANCE *trpc)
+{
+  struct tr_trp_conn_events *cev=NULL;
+  int fd=trp_connection_get_fd(conn);
+
+  cev=talloc(conn, struct tr_trp_conn_events);
+  if (cev==NULL)
+    return TRP_NOMEM;
+  cev->trps=trps;
+  cev->conn=conn;
+  cev->trpc=trpc;
+  cev->read_ev=NULL;
+  cev->write_ev=NULL;
+  talloc_set_destructor((void *)cev, tr_trp_conn_events_destructor);
+
+  cev->stream=trp_stream_new(cev, fd, trp_connection_get_gssctx(conn));
+  if (cev->stream==NULL)
+    goto error;
+
+  if (trpc==NULL)
+    cev->read_ev=event_new(base, fd, EV_READ|EV_PERSIST, tr_trps_conn_read_cb, (void *)cev);
+  else {
+    cev->read_ev=event_new(base, fd, EV_READ|EV_PERSIST, tr_trpc_conn_read_cb, (void *)cev);
+    cev->write_ev=event_new(base, fd, EV_WRITE, tr_trpc_conn_write_cb, (void *)cev);
+    if (cev->write_ev==NULL)
+      goto error;
+  }
+  if ((cev->read_ev==NULL) || (0!=event_add(cev->read_ev, NULL)))
+    goto error;
+
+  if (trpc!=NULL) {
+    tr_mq_set_notify_cb(trpc_get_mq(trpc), tr_trpc_mq_cb, (void *)(cev->write_ev));
+    event_active(cev->write_ev, EV_WRITE, 0); /* send anything queued during the handshake */
+  }
+  tr_debug("tr_trp_conn_events_start: servicing %s connection from the event loop.",
+           (trpc==NULL)?"incoming":"outgoing");
+  return TRP_SUCCESS;
+
+error:
+  tr_err("tr_trp_conn_events_start: unable to set up connection events.");
+  talloc_free(cev);
+  return TRP_ERROR;
+}
+
 /**
  * Get a dynamically allocated string with a description of the route table.
  * Caller must free the string using talloc_free().
@@ -255,111 +537,134 @@ static char *tr_trps_comm_table_to_str(TALLOC_CTX *memctx, TRPS_INSTANCE *trps)
   return tr_comm_table_to_str(memctx, trps->ctable);
 }
 
-/**
- * Event handler to process TRP messages from connection threads. These
- * are added to the message queue (mq) in tr_trps_msg_handler(), which
- * runs in the other threads.
- *
- * @param socket Ignored
- * @param event Ignored
- * @param arg Pointer to the TRPS_INSTANCE
- */
-static void tr_trps_process_mq(int socket, short event, void *arg)
+/* handle one message from a connection thread */
+static void tr_trps_handle_mq_msg(TRPS_INSTANCE *trps, struct event_base *base, TR_MQ_MSG *msg)
 {
-  TRPS_INSTANCE *trps=talloc_get_type_abort(arg, TRPS_INSTANCE);
-  TR_MQ_MSG *msg=NULL;
-  const char *s=NULL;
   TRP_PEER *peer = NULL;
   char *tmp = NULL;
 
-  msg=trps_mq_pop(trps);
-  while (msg!=NULL) {
-    s=tr_mq_msg_get_message(msg);
-    if (0==strcmp(s, TR_MQMSG_TRPS_CONNECTED)) {
-      TR_NAME *peer_gssname=(TR_NAME *)tr_mq_msg_get_payload(msg);
-      if (NULL == peer_gssname) {
-        /* This should not happen, we should not be able to establish a connection if we do not
-         * know their GSS name */
-        tr_err("tr_trps_process_mq: incoming connection from unknown GSS name reported.");
-      } else {
-        peer = trps_get_peer_by_gssname(trps, peer_gssname); /* get the peer record */
-        tmp = tr_name_strdup(peer_gssname); /* get the name as a null-terminated string */
-        if (peer == NULL)
-          tr_err("tr_trps_process_mq: incoming connection from unknown peer (%s) reported.", tmp);
-        else {
-          trp_peer_set_incoming_status(peer, PEER_CONNECTED);
-          tr_info("tr_trps_process_mq: incoming connection from %s established.", tmp);
-        }
-        free(tmp);
+  switch (tr_mq_msg_get_type(msg)) {
+  case TR_MQMSG_TRPS_CONNECTED: {
+    TR_NAME *peer_gssname=(TR_NAME *)tr_mq_msg_get_payload(msg);
+    if (NULL == peer_gssname) {
+      /* This should not happen, we should not be able to establish a connection if we do not
+       * know their GSS name */
+      tr_err("tr_trps_handle_mq_msg: incoming connection from unknown GSS name reported.");
+    } else {
+      peer = trps_get_peer_by_gssname(trps, peer_gssname); /* get the peer record */
+      tmp = tr_name_strdup(peer_gssname); /* get the name as a null-terminated string */
+      if (peer == NULL)
+        tr_err("tr_trps_handle_mq_msg: incoming connection from unknown peer (%s) reported.", tmp);
+      else {
+        trp_peer_set_incoming_status(peer, PEER_CONNECTED);
+        tr_info("tr_trps_handle_mq_msg: incoming connection from %s established.", tmp);
       }
+      free(tmp);
     }
-    else if (0==strcmp(s, TR_MQMSG_TRPS_DISCONNECTED)) {
-      TRP_CONNECTION *conn=talloc_get_type_abort(tr_mq_msg_get_payload(msg), TRP_CONNECTION);
-      TR_NAME *peer_gssname=trp_connection_get_peer(conn);
+    break;
+  }
 
-      if (NULL == peer_gssname) {
-        /* If the GSS auth failed, then we don't know the peer's GSS name. */
-        tr_info("tr_trps_process_mq: incoming connection failed to auth.");
-      } else {
-        /* We do know the peer's GSS name, see if we recognize it. */
-        peer = trps_get_peer_by_gssname(trps, peer_gssname); /* get the peer record */
-        tmp = tr_name_strdup(peer_gssname); /* get the name as a null-terminated string */
-        if (peer == NULL) {
-          tr_err("tr_trps_process_mq: incoming connection from unknown peer (%.*s) lost.", tmp);
-        } else {
-          trp_peer_set_incoming_status(peer, PEER_DISCONNECTED);
-          tr_trps_cleanup_conn(trps, conn);
-          tr_info("tr_trps_process_mq: incoming connection from %s lost.", tmp);
-        }
-        free(tmp);
+  case TR_MQMSG_TRPS_DISCONNECTED:
+    tr_trps_conn_lost(trps, talloc_get_type_abort(tr_mq_msg_get_payload(msg), TRP_CONNECTION));
+    break;
+
+  case TR_MQMSG_TRPC_CONNECTED: {
+    TR_NAME *svcname=(TR_NAME *)tr_mq_msg_get_payload(msg);
+    if (NULL == svcname) {
+      /* This should not happen because we shouldn't be reporting a connection unless we were
+       * able to auth the service name. */
+      tr_err("tr_trps_handle_mq_msg: outgoing connection established to unknown GSS service name.");
+    } else {
+      peer = trps_get_peer_by_servicename(trps, svcname);
+      tmp = tr_name_strdup(svcname);
+      if (peer == NULL)
+        tr_err("tr_trps_handle_mq_msg: outgoing connection to unknown peer (%s) reported.", tmp);
+      else {
+        trp_peer_set_outgoing_status(peer, PEER_CONNECTED);
+        tr_info("tr_trps_handle_mq_msg: outgoing connection to %s established.", tmp);
       }
+      free(tmp);
     }
-    else if (0==strcmp(s, TR_MQMSG_TRPC_CONNECTED)) {
-      TR_NAME *svcname=(TR_NAME *)tr_mq_msg_get_payload(msg);
-      if (NULL == svcname) {
-        /* This should not happen because we shouldn't be reporting a connection unless we were
-         * able to auth the service name. */
-        tr_err("tr_trps_process_mq: outgoing connection established to unknown GSS service name.");
-      } else {
-        peer = trps_get_peer_by_servicename(trps, svcname);
-        tmp = tr_name_strdup(svcname);
-        if (peer == NULL)
-          tr_err("tr_trps_process_mq: outgoing connection to unknown peer (%s) reported.", tmp);
-        else {
-          trp_peer_set_outgoing_status(peer, PEER_CONNECTED);
-          tr_info("tr_trps_process_mq: outgoing connection to %s established.", tmp);
-        }
-        free(tmp);
-      }
+    break;
+  }
+
+  case TR_MQMSG_TRPC_DISCONNECTED:
+    tr_trps_trpc_lost(trps, talloc_get_type_abort(tr_mq_msg_get_payload(msg), TRPC_INSTANCE));
+    break;
+
+  case TR_MQMSG_TRPS_EVENT_READY: {
+    TRP_CONNECTION *conn=talloc_get_type_abort(tr_mq_msg_get_payload(msg), TRP_CONNECTION);
+    if (tr_trp_conn_events_start(base, trps, conn, NULL)!=TRP_SUCCESS) {
+      tr_err("tr_trps_handle_mq_msg: unable to service incoming connection from the event loop.");
+      trp_connection_close(conn);
+      tr_trps_conn_lost(trps, conn);
     }
-    else if (0==strcmp(s, TR_MQMSG_TRPC_DISCONNECTED)) {
-      TRPC_INSTANCE *trpc=talloc_get_type_abort(tr_mq_msg_get_payload(msg), TRPC_INSTANCE);
-      TR_NAME *svcname=trpc_get_gssname(trpc);
-      if (NULL == svcname) {
-        tr_info("tr_trps_process_mq: outgoing connection to unknown GSS service name lost.");
-      } else {
-        peer = trps_get_peer_by_servicename(trps, svcname);
-        tmp = tr_name_strdup(svcname);
-        if (peer == NULL)
-          tr_err("tr_trps_process_mq: outgoing connection to unknown peer (%s) lost.", tmp);
-        else {
-          trp_peer_set_outgoing_status(peer, PEER_DISCONNECTED);
-          tr_info("tr_trps_process_mq: outgoing connection to %s lost.", tmp);
-          tr_trps_cleanup_trpc(trps, trpc);
-        }
-        free(tmp);
-      }
+    break;
+  }
+
+  case TR_MQMSG_TRPC_EVENT_READY: {
+    TRPC_INSTANCE *trpc=talloc_get_type_abort(tr_mq_msg_get_payload(msg), TRPC_INSTANCE);
+    if (tr_trp_conn_events_start(base, trps, trpc_get_conn(trpc), trpc)!=TRP_SUCCESS) {
+      tr_err("tr_trps_handle_mq_msg: unable to service outgoing connection from the event loop.");
+      trp_connection_close(trpc_get_conn(trpc));
+      tr_trps_trpc_lost(trps, trpc);
     }
+    break;
+  }
+
+  case TR_MQMSG_MSG_RECEIVED:
+    if (trps_handle_tr_msg(trps, tr_mq_msg_get_payload(msg))!=TRP_SUCCESS)
+      tr_err("tr_trps_handle_mq_msg: error handling message.");
+    break;
+
+  default:
+    tr_notice("tr_trps_handle_mq_msg: unknown message type %d received.", tr_mq_msg_get_type(msg));
+  }
+}
+
+/* most messages to take from the trps queue at once */
+#define TR_TRPS_MQ_BATCH 64
+/* most messages to handle per wakeup before letting other events run */
+#define TR_TRPS_MQ_WAKEUP_MAX (4*TR_TRPS_MQ_BATCH)
+
+/**
+ * Event handler to process TRP messages from connection threads. These
+ * are added to the message queue (mq) in tr_trps_msg_handler(), which
+ * runs in the other threads.
+ *
+ * Handles at most TR_TRPS_MQ_WAKEUP_MAX messages, then reschedules itself
+ * if any are left so connection events are not starved by a busy queue.
+ *
+ * @param socket The queue's eventfd, or ignored if it does not have one
+ * @param event Ignored
+ * @param arg Pointer to the event cookie
+ */
+static void tr_trps_process_mq(int socket, short event, void *arg)
+{
+  struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
+  TRPS_INSTANCE *trps=cookie->trps;
+  struct event_base *base=event_get_base(cookie->ev);
+  TR_MQ_MSG *msgs[TR_TRPS_MQ_BATCH];
+  size_t n_msgs=0;
+  size_t n_handled=0;
+  size_t ii=0;
 
-    else if (0==strcmp(s, TR_MQMSG_MSG_RECEIVED)) {
-      if (trps_handle_tr_msg(trps, tr_mq_msg_get_payload(msg))!=TRP_SUCCESS)
-        tr_err("tr_trps_process_mq: error handling message.");
+  tr_mq_eventfd_ack(trps->mq); /* before popping, so later additions signal again */
+  while ((n_handled<TR_TRPS_MQ_WAKEUP_MAX)
+         && (0<(n_msgs=trps_mq_pop_batch(trps, msgs, TR_TRPS_MQ_BATCH)))) {
+    for (ii=0; ii<n_msgs; ii++) {
+      tr_trps_handle_mq_msg(trps, base, msgs[ii]);
+      tr_mq_msg_free(msgs[ii]);
     }
-    else
-      tr_notice("tr_trps_process_mq: unknown message '%s' received.", tr_mq_msg_get_message(msg));
+    n_handled+=n_msgs;
+  }
 
-    tr_mq_msg_free(msg);
-    msg=trps_mq_pop(trps);
+  if ((n_handled>=TR_TRPS_MQ_WAKEUP_MAX) && (tr_mq_get_length(trps->mq)>0)) {
+    /* come back for the rest after other pending events have run */
+    if (tr_mq_get_eventfd(trps->mq)>=0)
+      tr_mq_wake(trps->mq);
+    else
+      event_active(cookie->ev, 0, 0);
   }
 }
 
@@ -386,6 +691,8 @@ static void tr_trps_sweep(int listener, short event, void *arg)
   trps_sweep_routes(trps);
   tr_debug("tr_trps_sweep: sweeping communities.");
   trps_sweep_ctable(trps);
+  /* catch up peers whose updates were held back while their send queues were full */
+  trps_update_deferred(trps);
   table_str=tr_trps_route_table_to_str(NULL, trps);
   if (table_str!=NULL) {
     tr_debug(table_str);
@@ -397,10 +704,51 @@ static void tr_trps_sweep(int listener, short event, void *arg)
     tr_debug(table_str);
     talloc_free(table_str);
   }
+
+  /* keep the saved routing state reasonably current, in case we do not get to save it on exit */
+  if (trps_state_save_due(trps) && (TRP_SUCCESS!=trps_save_state(trps)))
+    tr_warning("tr_trps_sweep: unable to save routing state.");
+
   /* schedule the event to run again */
   event_add(ev, &(trps->sweep_interval));
 }
 
+/* Publish the route view if the selected routes have changed. Scheduled by
+ * tr_trps_rview_notify() and run at the start of the next loop pass. Also frees
+ * replaced views, coming back later for any a reader was still loading. */
+static void tr_trps_publish_rview(evutil_socket_t fd, short event, void *arg)
+{
+  struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
+  struct timeval retry_time={1,0};
+
+  if (TRP_SUCCESS!=trps_publish_rview(cookie->trps)) {
+    tr_warning("tr_trps_publish_rview: unable to publish route view, trying again shortly.");
+    event_add(cookie->ev, &retry_time);
+  } else if (trps_reclaim_rviews(cookie->trps)>0)
+    event_add(cookie->ev, &retry_time);
+}
+
+/* Called when a change makes the route view out of date. Every change made during
+ * this pass of the event loop goes into the one view published on the next. */
+static void tr_trps_rview_notify(TRPS_INSTANCE *trps, void *arg)
+{
+  struct event *ev=(struct event *)arg;
+  struct timeval zero_time={0,0};
+
+  event_add(ev, &zero_time);
+}
+
+/* leave the event loop when asked to stop, saving the routing state if configured */
+static void tr_trps_stop(evutil_socket_t signum, short event, void *arg)
+{
+  struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
+
+  tr_notice("tr_trps_stop: received signal %d, exiting.", (int) signum);
+  if (TRP_SUCCESS!=trps_save_state(cookie->trps)) /* does nothing without a state file */
+    tr_warning("tr_trps_stop: unable to save routing state.");
+  event_base_loopexit(event_get_base(cookie->ev), NULL);
+}
+
 static void tr_connection_update(int listener, short event, void *arg)
 {
   struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
@@ -424,6 +772,12 @@ static int tr_trps_events_destructor(void *obj)
     event_free(ev->update_ev);
   if (ev->sweep_ev!=NULL)
     event_free(ev->sweep_ev);
+  if (ev->rview_ev!=NULL)
+    event_free(ev->rview_ev);
+  if (ev->sigterm_ev!=NULL)
+    event_free(ev->sigterm_ev);
+  if (ev->sigint_ev!=NULL)
+    event_free(ev->sigint_ev);
   return 0;
 }
 static TR_TRPS_EVENTS *tr_trps_events_new(TALLOC_CTX *mem_ctx)
@@ -435,6 +789,9 @@ static TR_TRPS_EVENTS *tr_trps_events_new(TALLOC_CTX *mem_ctx)
     ev->connect_ev=NULL;
     ev->update_ev=NULL;
     ev->sweep_ev=NULL;
+    ev->rview_ev=NULL;
+    ev->sigterm_ev=NULL;
+    ev->sigint_ev=NULL;
     if (ev->listen_ev==NULL) {
       talloc_free(ev);
       ev=NULL;
@@ -457,13 +814,18 @@ TRP_RC tr_trps_event_init(struct event_base *base, TR_INSTANCE *tr)
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   struct tr_socket_event *listen_ev=NULL;
   struct tr_trps_event_cookie *trps_cookie=NULL;
+  struct tr_trps_event_cookie *mq_cookie=NULL;
   struct tr_trps_event_cookie *connection_cookie=NULL;
   struct tr_trps_event_cookie *update_cookie=NULL;
   struct tr_trps_event_cookie *sweep_cookie=NULL;
+  struct tr_trps_event_cookie *rview_cookie=NULL;
+  struct tr_trps_event_cookie *stop_cookie=NULL;
   struct timeval zero_time={0,0};
   TRP_RC retval=TRP_ERROR;
+  int mq_fd=-1;
   size_t ii=0;
 
+  trps_set_rview_notify_cb(tr->trps, NULL, NULL); /* until the new event exists */
   if (tr->events != NULL) {
     tr_notice("tr_trps_event_init: tr->events was not null. Freeing before reallocating..");
     tr_trps_events_free(tr->events);
@@ -519,14 +881,36 @@ TRP_RC tr_trps_event_init(struct event_base *base, TR_INSTANCE *tr)
     event_add(listen_ev->ev[ii], NULL);
   }
   
-  /* now set up message queue processing event, only triggered by
-   * tr_trps_mq_cb() */
-  tr->events->mq_ev=event_new(base,
-                              0,
-                              EV_PERSIST,
-                              tr_trps_process_mq,
-                              (void *)(tr->trps));
-  tr_mq_set_notify_cb(tr->trps->mq, tr_trps_mq_cb, tr->events->mq_ev);
+  /* now set up message queue processing event, triggered by the queue's
+   * eventfd, or by tr_trps_mq_cb() if that could not be created */
+  mq_cookie=talloc(tr->events, struct tr_trps_event_cookie);
+  if (mq_cookie == NULL) {
+    tr_debug("tr_trps_event_init: Unable to allocate mq_cookie.");
+    retval=TRP_NOMEM;
+    tr_trps_events_free(tr->events);
+    tr->events=NULL;
+    goto cleanup;
+  }
+  mq_cookie->trps=tr->trps;
+  mq_cookie->cfg_mgr=tr->cfg_mgr;
+  mq_fd=tr_mq_enable_eventfd(tr->trps->mq);
+  if (mq_fd>=0) {
+    tr->events->mq_ev=event_new(base,
+                                mq_fd,
+                                EV_READ|EV_PERSIST,
+                                tr_trps_process_mq,
+                                (void *)mq_cookie);
+    event_add(tr->events->mq_ev, NULL);
+  } else {
+    tr_notice("tr_trps_event_init: falling back to callback notification for message queue.");
+    tr->events->mq_ev=event_new(base,
+                                0,
+                                EV_PERSIST,
+                                tr_trps_process_mq,
+                                (void *)mq_cookie);
+    tr_mq_set_notify_cb(tr->trps->mq, tr_trps_mq_cb, tr->events->mq_ev);
+  }
+  mq_cookie->ev=tr->events->mq_ev; /* event loop used for connections handed over by their threads */
 
   /* now set up the peer connection timer event */
   connection_cookie=talloc(tr->events, struct tr_trps_event_cookie);
@@ -574,6 +958,46 @@ TRP_RC tr_trps_event_init(struct event_base *base, TR_INSTANCE *tr)
   sweep_cookie->ev=tr->events->sweep_ev; /* in case it needs to frob the event */
   event_add(tr->events->sweep_ev, &(tr->trps->sweep_interval));
 
+  /* now set up the route view publication event, scheduled when routes change */
+  rview_cookie=talloc(tr->events, struct tr_trps_event_cookie);
+  if (rview_cookie == NULL) {
+    tr_debug("tr_trps_event_init: Unable to allocate rview_cookie.");
+    retval=TRP_NOMEM;
+    tr_trps_events_free(tr->events);
+    tr->events=NULL;
+    goto cleanup;
+  }
+  rview_cookie->trps=tr->trps;
+  rview_cookie->cfg_mgr=tr->cfg_mgr;
+  tr->events->rview_ev=event_new(base, -1, EV_TIMEOUT, tr_trps_publish_rview, (void *)rview_cookie);
+  rview_cookie->ev=tr->events->rview_ev; /* to retry after a failure */
+
+  /* Leave the event loop cleanly when asked to stop, so the connection threads can be
+   * stopped and the routing state saved. */
+  stop_cookie=talloc(tr->events, struct tr_trps_event_cookie);
+  if (stop_cookie == NULL) {
+    tr_debug("tr_trps_event_init: Unable to allocate stop_cookie.");
+    retval=TRP_NOMEM;
+    tr_trps_events_free(tr->events);
+    tr->events=NULL;
+    goto cleanup;
+  }
+  stop_cookie->trps=tr->trps;
+  stop_cookie->cfg_mgr=tr->cfg_mgr;
+  tr->events->sigterm_ev=evsignal_new(base, SIGTERM, tr_trps_stop, (void *)stop_cookie);
+  tr->events->sigint_ev=evsignal_new(base, SIGINT, tr_trps_stop, (void *)stop_cookie);
+  stop_cookie->ev=tr->events->sigterm_ev; /* used to find the event base */
+  event_add(tr->events->sigterm_ev, NULL);
+  event_add(tr->events->sigint_ev, NULL);
+
+  /* When keeping routing state across restarts, restore what was saved. */
+  if ((trps_get_state_file(tr->trps)!=NULL) && (TRP_SUCCESS!=trps_load_state(tr->trps)))
+    tr_warning("tr_trps_event_init: unable to restore saved routing state, starting without it.");
+
+  /* publish whatever changed before now, then follow later changes */
+  trps_set_rview_notify_cb(tr->trps, tr_trps_rview_notify, (void *)(tr->events->rview_ev));
+  event_add(tr->events->rview_ev, &zero_time);
+
   talloc_steal(tr, tr->events);
   retval=TRP_SUCCESS;
 
@@ -582,12 +1006,132 @@ cleanup:
   return retval;
 }
 
+/**
+ * Stop the connection threads and free their connections
+ *
+ * Call after the event loop has exited, before the TRPS instance is freed. Outgoing
+ * connection threads are sent an abort message, and every connection socket is shut
+ * down so threads blocked reading from their peers return. Each thread is then joined,
+ * so none is left running against a freed instance. Connections serviced from the
+ * event loop have no running thread, but are joined and freed the same way.
+ *
+ * @param trps TRPS instance whose connections should be stopped
+ */
+void tr_trps_stop_connections(TRPS_INSTANCE *trps)
+{
+  TRPC_INSTANCE *trpc=NULL;
+  TRP_CONNECTION *conn=NULL;
+  TR_MQ_MSG *msg=NULL;
+  int fd=-1;
+
+  for (trpc=trps->trpc; trpc!=NULL; trpc=trpc_get_next(trpc)) {
+    msg=tr_mq_msg_new(NULL, TR_MQMSG_ABORT);
+    if (msg==NULL)
+      tr_err("tr_trps_stop_connections: error allocating TR_MQ_MSG");
+    else
+      trpc_mq_add(trpc, msg); /* steals msg context */
+    fd=trp_connection_get_fd(trpc_get_conn(trpc));
+    if (fd>=0)
+      shutdown(fd, SHUT_RDWR);
+  }
+  for (conn=trps->conn; conn!=NULL; conn=trp_connection_get_next(conn)) {
+    fd=trp_connection_get_fd(conn);
+    if (fd>=0)
+      shutdown(fd, SHUT_RDWR);
+  }
+
+  while (trps->trpc!=NULL)
+    tr_trps_cleanup_trpc(trps, trps->trpc);
+  while (trps->conn!=NULL)
+    tr_trps_cleanup_conn(trps, trps->conn);
+  tr_debug("tr_trps_stop_connections: all connections stopped.");
+}
+
 /* data passed to thread */
 struct trpc_thread_data {
   TRPC_INSTANCE *trpc;
   TRPS_INSTANCE *trps;
 };
 
+/**
+ * Send queued messages to the peer in a single write
+ *
+ * Starts a batch with first, then adds further messages from the queue until
+ * the batch holds TRPC_CORK_MAX_MSGS messages or TRPC_CORK_MAX_BYTES bytes, or
+ * until TRPC_CORK_USEC microseconds have passed. An abort message ends the
+ * batch, but what was collected before it is still sent.
+ *
+ * @param trpc TRPC instance with an established connection
+ * @param first message already popped from the queue, freed by this function
+ * @return nonzero if the thread should stop, 0 otherwise
+ */
+static int tr_trpc_send_batch(TRPC_INSTANCE *trpc, TR_MQ_MSG *first)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_MQ_MSG **batch=NULL;
+  const char **encoded=NULL;
+  TR_MQ_MSG *msg=first;
+  GBytes *payload=NULL;
+  const char *encoded_msg=NULL;
+  struct timespec cork_until={0,0};
+  size_t n_msgs=0, n_encoded=0, n_bytes=0, ii=0;
+  int exit_loop=0;
+
+  batch=talloc_array(tmp_ctx, TR_MQ_MSG *, TRPC_CORK_MAX_MSGS);
+  encoded=talloc_array(tmp_ctx, const char *, TRPC_CORK_MAX_MSGS);
+  if ((batch==NULL) || (encoded==NULL)
+      || (0!=clock_gettime(CLOCK_MONOTONIC, &cork_until))) { /* same clock as tr_mq_pop() */
+    tr_err("tr_trpc_send_batch: unable to start a batch.");
+    tr_mq_msg_free(first);
+    talloc_free(tmp_ctx);
+    return 1;
+  }
+  cork_until.tv_nsec+=TRPC_CORK_USEC*1000L;
+  if (cork_until.tv_nsec>=1000000000L) {
+    cork_until.tv_sec++;
+    cork_until.tv_nsec-=1000000000L;
+  }
+
+  while (msg!=NULL) {
+    batch[n_msgs++]=msg;
+    if (tr_mq_msg_get_type(msg)==TR_MQMSG_ABORT) {
+      tr_debug("tr_trpc_send_batch: received abort message from main thread.");
+      exit_loop=1;
+      break;
+    } else if (tr_mq_msg_get_type(msg)==TR_MQMSG_TRPC_SEND) {
+      /* payload is a null-terminated GBytes, possibly shared with other peers' queues */
+      payload=tr_mq_msg_get_payload(msg);
+      encoded_msg=(payload==NULL) ? NULL : g_bytes_get_data(payload, NULL);
+      if (encoded_msg==NULL)
+        tr_notice("tr_trpc_send_batch: null outgoing TRP message.");
+      else {
+        encoded[n_encoded++]=encoded_msg;
+        n_bytes+=strlen(encoded_msg);
+      }
+    } else
+      tr_notice("tr_trpc_send_batch: unknown message type %d received.", tr_mq_msg_get_type(msg));
+
+    if ((n_msgs>=TRPC_CORK_MAX_MSGS) || (n_bytes>=TRPC_CORK_MAX_BYTES))
+      break;
+    msg=trpc_mq_pop(trpc, &cork_until); /* waits until the cork expires at most */
+  }
+
+  if (n_encoded>0) {
+    if (trpc_send_msgs(trpc, encoded, n_encoded)==TRP_SUCCESS)
+      tr_debug("tr_trpc_send_batch: sent %u messages, %u bytes.", (unsigned) n_encoded, (unsigned) n_bytes);
+    else {
+      tr_notice("tr_trpc_send_batch: trpc_send_msgs failed.");
+      /* Assume this means we lost the connection. */
+      exit_loop=1;
+    }
+  }
+
+  for (ii=0; ii<n_msgs; ii++)
+    tr_mq_msg_free(batch[ii]);
+  talloc_free(tmp_ctx);
+  return exit_loop;
+}
+
 /**
  * Thread for handling TRPC (outgoing) connections
  *
@@ -599,6 +1143,13 @@ struct trpc_thread_data {
  * TR_MQMSG_TRPC_DISCONNECTED message to the trps thread, then cleans up and
  * terminates.
  *
+ * If write coalescing is enabled, messages that are queued close together are
+ * sent with a single write (see tr_trpc_send_batch()).
+ *
+ * If the event transport is enabled, the thread instead hands the connection
+ * to the main thread with a TR_MQMSG_TRPC_EVENT_READY message and terminates
+ * as soon as it has connected.
+ *
  * The trps may continue queueing messages for this client even when the
  * connection is down. To prevent the queue from growing endlessly, this thread
  * should clear its queue after failed connection attempts.
@@ -611,8 +1162,8 @@ static void *tr_trpc_thread(void *arg)
   TRPS_INSTANCE *trps=thread_data->trps;
   TRP_RC rc=TRP_ERROR;
   TR_MQ_MSG *msg=NULL;
-  const char *msg_type=NULL;
-  char *encoded_msg=NULL;
+  GBytes *payload=NULL;
+  const char *encoded_msg=NULL;
   TR_NAME *peer_gssname=NULL;
   struct timespec wait_until = {0};
   int exit_loop=0;
@@ -647,6 +1198,21 @@ static void *tr_trpc_thread(void *arg)
     trps_mq_add(trps, msg); /* steals msg context */
     msg=NULL;
 
+    if (trps_get_event_transport(trps)) {
+      /* The main thread sends our queued messages from here on. Do not touch trpc
+       * after queueing this, and do not report a disconnection. */
+      msg= tr_mq_msg_new(tmp_ctx, TR_MQMSG_TRPC_EVENT_READY);
+      if (msg!=NULL) {
+        tr_mq_msg_set_payload(msg, (void *)trpc, NULL); /* do not pass a free routine */
+        trps_mq_add(trps, msg);
+        talloc_free(tmp_ctx);
+        tr_debug("tr_trpc_thread: connection handed to event loop, thread terminating.");
+        return NULL;
+      }
+      tr_err("tr_trpc_thread: error allocating TR_MQ_MSG");
+      exit_loop=1; /* report the connection as lost */
+    }
+
     /* Loop until we get an abort message or until the connection is lost. */
     while(!exit_loop) {
       /* Wait up to 10 minutes for a message to be queued to send to the peer.
@@ -658,13 +1224,19 @@ static void *tr_trpc_thread(void *arg)
 
       /* Pop a message from the queue. */
       msg = trpc_mq_pop(trpc, &wait_until);
-      if (msg) {
-        msg_type = tr_mq_msg_get_message(msg);
-        if (0 == strcmp(msg_type, TR_MQMSG_ABORT)) {
+      if ((msg != NULL) && trps_get_send_coalesce(trps)) {
+        exit_loop = tr_trpc_send_batch(trpc, msg); /* takes care of msg */
+      } else if (msg) {
+        switch (tr_mq_msg_get_type(msg)) {
+        case TR_MQMSG_ABORT:
           tr_debug("tr_trpc_thread: received abort message from main thread.");
           exit_loop = 1;
-        } else if (0 == strcmp(msg_type, TR_MQMSG_TRPC_SEND)) {
-          encoded_msg = tr_mq_msg_get_payload(msg);
+          break;
+
+        case TR_MQMSG_TRPC_SEND:
+          /* payload is a null-terminated GBytes, possibly shared with other peers' queues */
+          payload = tr_mq_msg_get_payload(msg);
+          encoded_msg = (payload == NULL) ? NULL : g_bytes_get_data(payload, NULL);
           if (encoded_msg == NULL)
             tr_notice("tr_trpc_thread: null outgoing TRP message.");
           else {
@@ -677,8 +1249,11 @@ static void *tr_trpc_thread(void *arg)
               exit_loop = 1;
             }
           }
-        } else
-          tr_notice("tr_trpc_thread: unknown message '%s' received.", msg_type);
+          break;
+
+        default:
+          tr_notice("tr_trpc_thread: unknown message type %d received.", tr_mq_msg_get_type(msg));
+        }
 
         tr_mq_msg_free(msg);
       } else {
@@ -843,6 +1418,43 @@ TRP_RC tr_add_local_routes(TRPS_INSTANCE *trps, TR_CFG *cfg)
   return TRP_SUCCESS;
 }
 
+/**
+ * Apply the local routes of a new configuration to the route table
+ *
+ * Only routes that were added, changed or removed are touched, see trps_update_local_routes().
+ */
+TRP_RC tr_update_local_routes(TRPS_INSTANCE *trps, TR_CFG *cfg)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_IDP_REALM *cur=NULL;
+  TRP_ROUTE **local_routes=NULL;
+  GPtrArray *all_routes=g_ptr_array_new();
+  size_t n_routes=0;
+  size_t ii=0;
+  TRP_RC rc=TRP_ERROR;
+
+  if (all_routes==NULL) {
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  for (cur=cfg->ctable->idp_realms; cur!=NULL; cur=cur->next) {
+    local_routes= tr_make_local_routes(tmp_ctx, cur, cfg->internal->hostname, cfg->internal->trps_port, &n_routes);
+    for (ii=0; ii<n_routes; ii++)
+      g_ptr_array_add(all_routes, local_routes[ii]);
+    n_routes=0;
+  }
+
+  /* routes still belong to tmp_ctx; the route table takes the ones it keeps */
+  rc=trps_update_local_routes(trps, (TRP_ROUTE **)all_routes->pdata, all_routes->len);
+
+cleanup:
+  if (all_routes!=NULL)
+    g_ptr_array_free(all_routes, TRUE);
+  talloc_free(tmp_ctx);
+  return rc;
+}
+
 /* decide how often to attempt to connect to a peer */
 static int tr_conn_attempt_due(TRPS_INSTANCE *trps, TRP_PEER *peer, struct timespec *when)
 {
@@ -927,13 +1539,22 @@ void tr_config_changed(TR_CFG *new_cfg, void *cookie)
   trps_set_connect_interval(trps, new_cfg->internal->trp_connect_interval);
   trps_set_update_interval(trps, new_cfg->internal->trp_update_interval);
   trps_set_sweep_interval(trps, new_cfg->internal->trp_sweep_interval);
+  trps_set_update_max_records(trps, new_cfg->internal->trp_update_max_records);
+  trps_set_update_delta(trps, new_cfg->internal->trp_update_delta);
+  trps_set_event_transport(trps, new_cfg->internal->trp_event_transport);
+  trps_set_send_coalesce(trps, new_cfg->internal->trp_send_coalesce);
   trps_set_ctable(trps, new_cfg->ctable);
   trps_set_ptable(trps, new_cfg->peers);
   trps_set_peer_status_callback(trps, tr_peer_status_change, (void *)trps);
-  trps_clear_rtable(trps); /* should we do this every time??? */
-  tr_add_local_routes(trps, new_cfg); /* should we do this every time??? */
+  /* apply only the changes to our local routes; learned routes are kept */
+  if (TRP_SUCCESS!=tr_update_local_routes(trps, new_cfg)) {
+    tr_err("tr_config_changed: error updating local routes, rebuilding route table.");
+    trps_clear_rtable(trps);
+    tr_add_local_routes(trps, new_cfg);
+  }
   trps_update_active_routes(trps); /* find new routes */
   trps_update(trps, TRP_UPDATE_TRIGGERED); /* send any triggered routes */
+  trps_flush_retracted_routes(trps); /* withdrawals have been sent */
   tr_print_config(new_cfg);
   table_str=tr_trps_route_table_to_str(NULL, trps);
   if (table_str!=NULL) {
@@ -52,11 +52,67 @@ static MON_RC handle_show_routes(void *cookie, json_t **response_ptr)
   return (*response_ptr == NULL) ? MON_NOMEM : MON_SUCCESS;
 }
 
+/* describe the queue of messages waiting to be sent to a peer */
+static json_t *send_queue_to_json(TRPS_INSTANCE *trps, TRP_PEER *peer)
+{
+  TRPC_INSTANCE *trpc = trps_find_trpc(trps, peer);
+  TR_MQ_STATS stats;
+
+  if (trpc == NULL)
+    return NULL;
+
+  trpc_mq_get_stats(trpc, &stats);
+  return json_pack("{sIsIsIsIsI}",
+                   "depth", (json_int_t) stats.length,
+                   "max_depth", (json_int_t) stats.max_length,
+                   "high_water", (json_int_t) stats.high_water,
+                   "superseded", (json_int_t) stats.n_superseded,
+                   "dropped", (json_int_t) stats.n_dropped);
+}
+
 static MON_RC handle_show_peers(void *cookie, json_t **response_ptr)
 {
   TRPS_INSTANCE *trps = talloc_get_type_abort(cookie, TRPS_INSTANCE);
+  TRP_PTABLE_ITER *iter = NULL;
+  TRP_PEER *peer = NULL;
+  json_t *jqueue = NULL;
+  size_t ii = 0;
 
   *response_ptr = trp_ptable_to_json(trps->ptable);
+  if (*response_ptr == NULL)
+    return MON_NOMEM;
+
+  /* the peer table does not know about our connections, so add send queues here */
+  iter = trp_ptable_iter_new(NULL);
+  if (iter == NULL) {
+    json_decref(*response_ptr);
+    *response_ptr = NULL;
+    return MON_NOMEM;
+  }
+  for (peer = trp_ptable_iter_first(iter, trps->ptable), ii = 0;
+       peer != NULL;
+       peer = trp_ptable_iter_next(iter), ii++) {
+    jqueue = send_queue_to_json(trps, peer);
+    if (jqueue != NULL)
+      json_object_set_new(json_array_get(*response_ptr, ii), "send_queue", jqueue);
+  }
+  trp_ptable_iter_free(iter);
+  return MON_SUCCESS;
+}
+
+/* describe the queue of messages from the TRP connection threads to the main thread */
+static MON_RC handle_show_trp_queue(void *cookie, json_t **response_ptr)
+{
+  TRPS_INSTANCE *trps = talloc_get_type_abort(cookie, TRPS_INSTANCE);
+  TR_MQ_STATS stats;
+
+  tr_mq_get_stats(trps->mq, &stats);
+  *response_ptr = json_pack("{sIsIsIsIsb}",
+                            "depth", (json_int_t) stats.length,
+                            "high_water", (json_int_t) stats.high_water,
+                            "messages", (json_int_t) stats.n_added,
+                            "wakeups", (json_int_t) stats.n_wakeups,
+                            "eventfd", (tr_mq_get_eventfd(trps->mq) >= 0));
   return (*response_ptr == NULL) ? MON_NOMEM : MON_SUCCESS;
 }
 
@@ -84,6 +140,9 @@ void tr_trp_register_mons_handlers(TRPS_INSTANCE *trps, MONS_INSTANCE *mons)
   mons_register_handler(mons,
                         MON_CMD_SHOW, OPT_TYPE_SHOW_PEERS,
                         handle_show_peers, trps);
+  mons_register_handler(mons,
+                        MON_CMD_SHOW, OPT_TYPE_SHOW_TRP_QUEUE,
+                        handle_show_trp_queue, trps);
   mons_register_handler(mons,
                         MON_CMD_SHOW, OPT_TYPE_SHOW_COMMUNITIES,
                         handle_show_communities, trps);
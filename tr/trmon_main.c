@@ -70,6 +70,7 @@ static const char doc[] =
     "       tid_reqs_failed    - number of TID requests completed with errors\n"
     "       tid_reqs_pending   - number of TID requests currently being processed\n"
     "       tid_error_count    - number of unprocessable TID connections\n"
+    "       trp_queue          - TRP message queue depth, messages and wakeups\n"
     "       routes             - current TID routing table\n"
     "       peers              - dynamic Trust Router peer table\n"
     "       communities        - community table\n"
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <talloc.h>
+#include <gssapi.h>
+
+#include <trp_internal.h>
+
+/* Tests for sending several TRP messages with one vectored write */
+
+/*
+ * Stand-ins for the GSS mechanism. "Wrapping" just copies the message, so the
+ * framing can be checked without credentials. These take the place of the
+ * library's versions when linked into this program.
+ */
+OM_uint32 gss_wrap(OM_uint32 *minor, gss_ctx_id_t ctx, int conf_req, gss_qop_t qop,
+                   gss_buffer_t input, int *conf_state, gss_buffer_t output)
+{
+  output->value=malloc(input->length);
+  assert(output->value!=NULL);
+  memcpy(output->value, input->value, input->length);
+  output->length=input->length;
+  *conf_state=1;
+  return GSS_S_COMPLETE;
+}
+
+OM_uint32 gss_release_buffer(OM_uint32 *minor, gss_buffer_t buffer)
+{
+  free(buffer->value);
+  buffer->value=NULL;
+  buffer->length=0;
+  return GSS_S_COMPLETE;
+}
+
+/* message ii of a test, len characters plus a null terminator */
+static char *make_msg(size_t ii, size_t len)
+{
+  char *msg=malloc(len+1);
+  size_t jj=0;
+
+  assert((msg!=NULL) && (len>=8));
+  snprintf(msg, len+1, "%08zu", ii);
+  for (jj=8; jj<len; jj++)
+    msg[jj]='a'+(ii+jj)%26;
+  msg[len]='\0';
+  return msg;
+}
+
+struct reader {
+  int fd;
+  size_t n_msgs;
+  size_t msg_len;
+  int slow; /* pause between reads so the writer fills the socket */
+  size_t n_read;
+};
+
+static void read_all(int fd, void *buf, size_t len)
+{
+  ssize_t n=0;
+
+  while (len>0) {
+    n=read(fd, buf, len);
+    assert(n>0);
+    buf=(char *)buf+n;
+    len-=n;
+  }
+}
+
+/* read framed messages and check that they arrive intact and in order */
+static void *reader_thread(void *arg)
+{
+  struct reader *reader=(struct reader *)arg;
+  uint32_t hdr=0;
+  char *buf=NULL;
+  char *expected=NULL;
+
+  for (reader->n_read=0; reader->n_read<reader->n_msgs; reader->n_read++) {
+    if (reader->slow)
+      usleep(1000);
+    read_all(reader->fd, &hdr, sizeof(hdr));
+    assert(ntohl(hdr)==reader->msg_len);
+    buf=malloc(reader->msg_len);
+    assert(buf!=NULL);
+    read_all(reader->fd, buf, reader->msg_len);
+    expected=make_msg(reader->n_read, reader->msg_len);
+    assert(0==memcmp(buf, expected, reader->msg_len));
+    free(expected);
+    free(buf);
+  }
+  return NULL;
+}
+
+static void send_and_check(size_t n_msgs, size_t msg_len, int nonblocking)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPC_INSTANCE *trpc=trpc_new(tmp_ctx);
+  TRP_CONNECTION *conn=NULL;
+  const char **msgs=NULL;
+  struct reader reader;
+  pthread_t thread;
+  int sndbuf=4096;
+  int fds[2];
+  size_t ii=0;
+
+  assert(trpc!=NULL);
+  assert(0==socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  if (nonblocking) {
+    assert(0==setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)));
+    assert(0==fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL)|O_NONBLOCK));
+  }
+  conn=trp_connection_new(trpc);
+  assert(conn!=NULL);
+  trp_connection_set_fd(conn, fds[0]);
+  trpc_set_conn(trpc, conn);
+
+  msgs=talloc_array(tmp_ctx, const char *, n_msgs);
+  assert(msgs!=NULL);
+  for (ii=0; ii<n_msgs; ii++)
+    msgs[ii]=make_msg(ii, msg_len);
+
+  reader.fd=fds[1];
+  reader.n_msgs=n_msgs;
+  reader.msg_len=msg_len;
+  reader.slow=nonblocking;
+  reader.n_read=0;
+  assert(0==pthread_create(&thread, NULL, reader_thread, &reader));
+
+  assert(trpc_send_msgs(trpc, msgs, n_msgs)==TRP_SUCCESS);
+
+  assert(0==pthread_join(thread, NULL));
+  assert(reader.n_read==n_msgs);
+
+  for (ii=0; ii<n_msgs; ii++)
+    free((char *)msgs[ii]);
+  close(fds[0]);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  /* a handful of messages in one write */
+  send_and_check(3, 32, 0);
+
+  /* more iovecs than one writev() takes, so the write is split */
+  send_and_check(IOV_MAX, 32, 0);
+  send_and_check(IOV_MAX/2+1, 32, 0);
+
+  /* a nonblocking socket that fills up, so writes stop partway through an iovec */
+  send_and_check(64, 10000, 1);
+  send_and_check(IOV_MAX, 1000, 1);
+
+  printf("Success.\n");
+  return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <jansson.h>
+#include <glib.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_config.h>
+#include <tr_msg.h>
+#include <tr_mq.h>
+#include <trp_route.h>
+#include <trp_rtable.h>
+#include <trp_internal.h>
+#include <trp_peer.h>
+#include <trp_ptable.h>
+
+/* Tests for delta updates, refresh markers, and the shared update encoding cache */
+
+#define N_REALMS 3
+
+static const char *accept_all="{\"trp_outbound\": [{\"action\": \"accept\", "
+                              "\"specs\": [{\"field\": \"realm\", \"match\": \"*\"}]}]}";
+
+/* add a connected peer and return the client instance that holds its send queue */
+static TRPC_INSTANCE *add_peer(TRPS_INSTANCE *trps, const char *server, TRP_PEER **peer_out)
+{
+  TRP_PEER *peer=trp_peer_new(NULL);
+  TRPC_INSTANCE *trpc=trpc_new(NULL);
+  TRP_CONNECTION *conn=NULL;
+  json_t *jfilts=json_loads(accept_all, 0, NULL);
+  TR_CFG_RC rc=TR_CFG_ERROR;
+  char *gss_name=NULL;
+
+  assert((peer!=NULL) && (trpc!=NULL) && (jfilts!=NULL));
+  trp_peer_set_server(peer, server);
+  assert(0<asprintf(&gss_name, "trustrouter@%s", server));
+  trp_peer_add_gss_name(peer, tr_new_name(gss_name));
+  free(gss_name);
+  trp_peer_set_port(peer, 12309);
+  trp_peer_set_linkcost(peer, 1);
+  trp_peer_set_filters(peer, tr_cfg_parse_filters(peer, jfilts, &rc));
+  assert(rc==TR_CFG_SUCCESS);
+  json_decref(jfilts);
+
+  conn=trp_connection_new(trpc);
+  assert(conn!=NULL);
+  conn->status=TRP_CONNECTION_UP;
+  trpc_set_conn(trpc, conn);
+  trpc_set_gssname(trpc, trp_peer_dup_servicename(peer));
+  trps_add_trpc(trps, trpc);
+
+  *peer_out=peer;
+  assert(trps_add_peer(trps, peer)==TRP_SUCCESS);
+  return trpc;
+}
+
+static TR_NAME *realm_name(int ii)
+{
+  char s[]="realm0";
+  s[5]+=ii;
+  return tr_new_name(s);
+}
+
+static void add_local_routes(TRPS_INSTANCE *trps)
+{
+  TRP_ROUTE *route=NULL;
+  int ii=0;
+
+  for (ii=0; ii<N_REALMS; ii++) {
+    route=trp_route_new(NULL);
+    assert(route!=NULL);
+    trp_route_set_comm(route, tr_new_name("apc0"));
+    trp_route_set_realm(route, realm_name(ii));
+    trp_route_set_peer(route, tr_new_name(""));
+    trp_route_set_metric(route, 0);
+    trp_route_set_trust_router(route, tr_new_name("tr.example.com"));
+    trp_route_set_next_hop(route, tr_new_name(""));
+    trp_route_set_local(route, 1);
+    trp_route_set_selected(route, 1);
+    trp_route_set_interval(route, 60);
+    trp_rtable_add(trps->rtable, route);
+  }
+}
+
+static TRP_ROUTE *get_route(TRPS_INSTANCE *trps, int ii)
+{
+  TR_NAME *comm=tr_new_name("apc0");
+  TR_NAME *realm=realm_name(ii);
+  TR_NAME *peer=tr_new_name("");
+  TRP_ROUTE *route=trp_rtable_get_entry(trps->rtable, comm, realm, peer);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  tr_free_name(peer);
+  assert(route!=NULL);
+  return route;
+}
+
+/* what one peer received in one update cycle */
+struct drained {
+  GPtrArray *payloads; /* one GBytes per message, in order */
+  unsigned int upd_realms; /* bit ii set if realm ii was in an update */
+  unsigned int refresh_realms; /* bit ii set if realm ii was in a refresh marker */
+};
+
+static unsigned int realm_bit(TR_NAME *realm)
+{
+  assert((realm!=NULL) && (realm->len==6));
+  return 1u<<(realm->buf[5]-'0');
+}
+
+static void drain(TRPC_INSTANCE *trpc, struct drained *out)
+{
+  TR_MQ_MSG *mq_msg=NULL;
+  GBytes *bytes=NULL;
+  TR_MSG *msg=NULL;
+  TRP_UPD *upd=NULL;
+  TRP_REFRESH_ITEM *item=NULL;
+
+  out->payloads=g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+  out->upd_realms=0;
+  out->refresh_realms=0;
+
+  while (NULL!=(mq_msg=trpc_mq_pop(trpc, NULL))) {
+    bytes=tr_mq_msg_get_payload(mq_msg);
+    g_ptr_array_add(out->payloads, g_bytes_ref(bytes));
+    msg=tr_msg_decode(NULL, g_bytes_get_data(bytes, NULL), strlen(g_bytes_get_data(bytes, NULL)));
+    assert(msg!=NULL);
+    switch (tr_msg_get_msg_type(msg)) {
+    case TRP_UPDATE:
+      for (upd=tr_msg_get_trp_upd(msg); upd!=NULL; upd=trp_upd_get_next(upd)) {
+        assert((out->upd_realms & realm_bit(trp_upd_get_realm(upd)))==0); /* each at most once */
+        out->upd_realms|=realm_bit(trp_upd_get_realm(upd));
+      }
+      break;
+    case TRP_REFRESH:
+      for (item=trp_refresh_marker_get_items(tr_msg_get_trp_refresh(msg));
+           item!=NULL;
+           item=trp_refresh_item_get_next(item))
+        out->refresh_realms|=realm_bit(trp_refresh_item_get_realm(item));
+      break;
+    default:
+      assert(0);
+    }
+    tr_msg_free_decoded(msg);
+    tr_mq_msg_free(mq_msg);
+  }
+}
+
+static void drained_free(struct drained *d)
+{
+  g_ptr_array_free(d->payloads, TRUE);
+}
+
+/* check what each peer received without running another update cycle */
+static void check_cycle_no_update(TRPC_INSTANCE **trpc,
+                                  size_t n_trpc,
+                                  unsigned int upd_realms,
+                                  unsigned int refresh_realms)
+{
+  struct drained d;
+  size_t ii=0;
+
+  for (ii=0; ii<n_trpc; ii++) {
+    drain(trpc[ii], &d);
+    assert(d.upd_realms==upd_realms);
+    assert(d.refresh_realms==refresh_realms);
+    drained_free(&d);
+  }
+}
+
+/* run an update cycle and check what each peer received */
+static void check_cycle(TRPS_INSTANCE *trps,
+                        TRP_UPDATE_TYPE update_type,
+                        TRPC_INSTANCE **trpc,
+                        size_t n_trpc,
+                        unsigned int upd_realms,
+                        unsigned int refresh_realms)
+{
+  assert(trps_update(trps, update_type)==TRP_SUCCESS);
+  check_cycle_no_update(trpc, n_trpc, upd_realms, refresh_realms);
+}
+
+/* fill a send queue with placeholders until the peer counts as backlogged */
+static void back_up_queue(TRPC_INSTANCE *trpc)
+{
+  TR_MQ_MSG *filler=NULL;
+  int ii=0;
+
+  for (ii=0; ii<TRPC_SEND_QUEUE_BACKLOG; ii++) {
+    filler=tr_mq_msg_new(NULL, TR_MQMSG_TRPC_SEND);
+    assert(filler!=NULL);
+    trpc_mq_add(trpc, filler);
+  }
+}
+
+/* the sent state is only updated through trp_peer_sent_record() */
+static void test_sent_state(void)
+{
+  TRP_PEER *peer=trp_peer_new(NULL);
+
+  assert(peer!=NULL);
+  assert(!trp_peer_sent_matches(peer, "key", "a"));
+  assert(trp_peer_sent_size(peer)==0);
+
+  trp_peer_sent_record(peer, "key", "a");
+  assert(trp_peer_sent_matches(peer, "key", "a"));
+  assert(!trp_peer_sent_matches(peer, "key", "b"));
+  assert(trp_peer_sent_matches(peer, "key", "a")); /* checking b did not replace a */
+
+  /* recorded since the last sweep, so it survives */
+  trp_peer_sent_sweep(peer);
+  assert(trp_peer_sent_size(peer)==1);
+  /* not recorded again, so it is forgotten */
+  trp_peer_sent_sweep(peer);
+  assert(trp_peer_sent_size(peer)==0);
+
+  trp_peer_sent_record(peer, "key", "a");
+  trp_peer_sent_clear(peer);
+  assert(!trp_peer_sent_matches(peer, "key", "a"));
+  trp_peer_free(peer);
+}
+
+static void test_updates(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=trps_new(tmp_ctx);
+  TRP_PEER *peer[2]={NULL, NULL};
+  TRPC_INSTANCE *trpc[2]={NULL, NULL};
+  struct drained d[2];
+  TRP_ROUTE *route=NULL;
+  int ii=0;
+
+  assert(trps!=NULL);
+  trps->hostname=talloc_strdup(trps, "tr.example.com");
+  trps->tids_port=12310;
+  trps->ctable=tr_comm_table_new(trps);
+  trps_set_update_delta(trps, 1);
+  trps_set_update_max_records(trps, 10);
+  trpc[0]=add_peer(trps, "peer0", peer+0);
+  trpc[1]=add_peer(trps, "peer1", peer+1);
+  add_local_routes(trps);
+
+  /* The first scheduled update sends everything. Both peers get the same routes,
+   * so the second reuses the messages encoded for the first. */
+  assert(trps_update(trps, TRP_UPDATE_SCHEDULED)==TRP_SUCCESS);
+  drain(trpc[0], d+0);
+  drain(trpc[1], d+1);
+  for (ii=0; ii<2; ii++) {
+    assert(d[ii].upd_realms==0x7);
+    assert(d[ii].refresh_realms==0);
+    assert(trp_peer_sent_size(peer[ii])==N_REALMS);
+  }
+  assert(d[0].payloads->len==d[1].payloads->len);
+  for (ii=0; ii<d[0].payloads->len; ii++)
+    assert(g_ptr_array_index(d[0].payloads, ii)==g_ptr_array_index(d[1].payloads, ii));
+  drained_free(d+0);
+  drained_free(d+1);
+
+  /* nothing changed, so only a refresh marker is sent */
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc, 2, 0, 0x7);
+
+  /* a changed route is sent, the others are refreshed */
+  trp_route_set_metric(get_route(trps, 1), 5);
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc, 2, 0x2, 0x5);
+
+  /* a triggered update is sent even if the peer already has that content */
+  trp_route_set_triggered(get_route(trps, 1), 1);
+  check_cycle(trps, TRP_UPDATE_TRIGGERED, trpc, 2, 0x2, 0);
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc, 2, 0, 0x7);
+
+  /* A peer whose queue is backed up is skipped. Nothing is recorded as sent to it,
+   * so it gets the change once it catches up. */
+  back_up_queue(trpc[1]);
+  trp_route_set_metric(get_route(trps, 0), 7);
+  assert(trps_update(trps, TRP_UPDATE_SCHEDULED)==TRP_SUCCESS);
+  drain(trpc[0], d+0);
+  assert(d[0].upd_realms==0x1);
+  assert(d[0].refresh_realms==0x6);
+  drained_free(d+0);
+  trpc_mq_clear(trpc[1]);
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc+1, 1, 0x1, 0x6);
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc, 2, 0, 0x7);
+
+  /* A deferred triggered update is not lost when the triggered flags are cleared.
+   * The peer gets a scheduled update once its queue drains. */
+  back_up_queue(trpc[1]);
+  trp_route_set_metric(get_route(trps, 1), 9);
+  trp_route_set_triggered(get_route(trps, 1), 1);
+  check_cycle(trps, TRP_UPDATE_TRIGGERED, trpc, 1, 0x2, 0);
+  trpc_mq_clear(trpc[1]);
+  assert(trps_update_deferred(trps)==TRP_SUCCESS);
+  drain(trpc[0], d+0);
+  assert(d[0].payloads->len==0); /* peer0 was not deferred */
+  drained_free(d+0);
+  check_cycle_no_update(trpc+1, 1, 0x2, 0x5);
+  assert(trps_update_deferred(trps)==TRP_SUCCESS); /* nothing more to catch up */
+  check_cycle_no_update(trpc+1, 1, 0, 0);
+
+  /* Likewise if the next thing to come along is another triggered update */
+  back_up_queue(trpc[1]);
+  trp_route_set_metric(get_route(trps, 0), 3);
+  trp_route_set_triggered(get_route(trps, 0), 1);
+  check_cycle(trps, TRP_UPDATE_TRIGGERED, trpc, 1, 0x1, 0);
+  trpc_mq_clear(trpc[1]);
+  trp_route_set_triggered(get_route(trps, 1), 1);
+  check_cycle(trps, TRP_UPDATE_TRIGGERED, trpc, 1, 0x2, 0);
+  check_cycle_no_update(trpc+1, 1, 0x1, 0x6);
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc, 2, 0, 0x7);
+
+  /* a route we no longer have is neither refreshed nor remembered */
+  route=get_route(trps, 2);
+  trp_rtable_remove(trps->rtable, route);
+  check_cycle(trps, TRP_UPDATE_SCHEDULED, trpc, 2, 0, 0x3);
+  assert(trp_peer_sent_size(peer[0])==2);
+  assert(trp_peer_sent_size(peer[1])==2);
+
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  test_sent_state();
+  test_updates();
+  printf("Success.\n");
+  return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <talloc.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_config.h>
+#include <tr_msg.h>
+#include <trp_internal.h>
+#include <trp_peer.h>
+#include <trp_ptable.h>
+
+/* Tests for what we remember about updates received from a peer */
+
+static const char *accept_realm0="{\"trp_inbound\": [{\"action\": \"accept\", "
+                                 "\"specs\": [{\"field\": \"realm\", \"match\": \"realm0\"}]}]}";
+
+/* entries are kept until they expire, and only unexpired entries are summarized */
+static void test_received_expiry(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_PEER *peer=trp_peer_new(tmp_ctx);
+  TR_NAME *comm=tr_new_name("apc0");
+  TR_NAME *realm=tr_new_name("realm0");
+  struct timespec now={1000, 0};
+  struct timespec early={1010, 0};
+  struct timespec late={1020, 0};
+  struct timespec later={1030, 0};
+
+  assert(peer!=NULL);
+  trp_peer_received_set(peer, "early", comm, realm, "a", 5, &early);
+  trp_peer_received_set(peer, "late", comm, realm, "b", 10, &late);
+  assert(trp_peer_received_size(peer)==2);
+  assert(trp_peer_received_get_interval(peer, "early")==5);
+  assert(trp_peer_received_get_interval(peer, "late")==10);
+  assert(trp_peer_received_get_interval(peer, "unknown")==0);
+
+  /* nothing has expired yet */
+  trp_peer_received_sweep(peer, &now);
+  assert(trp_peer_received_size(peer)==2);
+  assert(trp_peer_received_digest(tmp_ctx, peer, &now)!=NULL);
+
+  /* an entry expires at its expiry time */
+  trp_peer_received_sweep(peer, &early);
+  assert(trp_peer_received_size(peer)==1);
+  assert(trp_peer_received_get_interval(peer, "early")==0);
+
+  /* extending the expiry keeps the entry */
+  trp_peer_received_set_expiry(peer, "late", &later);
+  trp_peer_received_sweep(peer, &late);
+  assert(trp_peer_received_size(peer)==1);
+
+  /* the digest forgets expired entries too */
+  assert(trp_peer_received_digest(tmp_ctx, peer, &later)==NULL);
+  assert(trp_peer_received_size(peer)==0);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  talloc_free(tmp_ctx);
+}
+
+static TRP_UPD *make_upd(TALLOC_CTX *mem_ctx, const char *realm)
+{
+  TRP_UPD *upd=trp_upd_new(mem_ctx);
+  TRP_INFOREC *rec=NULL;
+
+  assert(upd!=NULL);
+  trp_upd_set_comm(upd, tr_new_name("apc0"));
+  trp_upd_set_realm(upd, tr_new_name(realm));
+  trp_upd_set_peer(upd, tr_new_name("trustrouter@peer0"));
+  rec=trp_inforec_new(upd, TRP_INFOREC_TYPE_ROUTE);
+  assert(rec!=NULL);
+  assert(TRP_SUCCESS==trp_inforec_set_trust_router(rec, tr_new_name("tr.peer0"), 12309));
+  assert(TRP_SUCCESS==trp_inforec_set_next_hop(rec, tr_new_name("tr.peer0"), 12310));
+  assert(TRP_SUCCESS==trp_inforec_set_metric(rec, 1));
+  assert(TRP_SUCCESS==trp_inforec_set_interval(rec, 30));
+  trp_upd_add_inforec(upd, rec);
+  return upd;
+}
+
+/* only updates that get past our inbound filters are remembered */
+static void test_received_filtered(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=trps_new(tmp_ctx);
+  TRP_PEER *peer=trp_peer_new(NULL);
+  json_t *jfilts=json_loads(accept_realm0, 0, NULL);
+  TR_CFG_RC cfg_rc=TR_CFG_ERROR;
+  TRP_UPD *upd=NULL;
+  TR_MSG msg; /* not a pointer! */
+
+  assert((trps!=NULL) && (peer!=NULL) && (jfilts!=NULL));
+  trps->hostname=talloc_strdup(trps, "tr.example.com");
+  trps->tids_port=12310;
+  trps->ctable=tr_comm_table_new(trps);
+
+  trp_peer_set_server(peer, "peer0");
+  trp_peer_add_gss_name(peer, tr_new_name("trustrouter@peer0"));
+  trp_peer_set_port(peer, 12309);
+  trp_peer_set_linkcost(peer, 1);
+  trp_peer_set_filters(peer, tr_cfg_parse_filters(peer, jfilts, &cfg_rc));
+  assert(cfg_rc==TR_CFG_SUCCESS);
+  json_decref(jfilts);
+  assert(trps_add_peer(trps, peer)==TRP_SUCCESS);
+
+  upd=make_upd(tmp_ctx, "realm0");
+  trp_upd_set_next(upd, make_upd(tmp_ctx, "realm1"));
+  tr_msg_set_trp_upd(&msg, upd);
+  assert(trps_handle_tr_msg(trps, &msg)==TRP_SUCCESS);
+
+  /* realm1 was rejected, so the peer will send it again after a reconnect */
+  assert(trp_peer_received_size(peer)==1);
+
+  /* still well within its lifetime, so a sweep keeps it */
+  assert(trps_sweep_routes(trps)==TRP_SUCCESS);
+  assert(trp_peer_received_size(peer)==1);
+
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  test_received_expiry();
+  test_received_filtered();
+  printf("Success.\n");
+  return 0;
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <jansson.h>
+#include <glib.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_idp.h>
+#include <tr_rp.h>
+#include <tr_config.h>
+#include <tr_msg.h>
+#include <tr_mq.h>
+#include <trp_route.h>
+#include <trp_rtable.h>
+#include <trp_internal.h>
+#include <trp_peer.h>
+#include <trp_ptable.h>
+
+/* Tests for carrying routing state across a configuration reload */
+
+static const char *accept_all="{\"trp_outbound\": [{\"action\": \"accept\", "
+                              "\"specs\": [{\"field\": \"realm\", \"match\": \"*\"}]}]}";
+
+static TRP_PEER *new_peer(const char *server)
+{
+  TRP_PEER *peer=trp_peer_new(NULL);
+  json_t *jfilts=json_loads(accept_all, 0, NULL);
+  TR_CFG_RC rc=TR_CFG_ERROR;
+  char *gss_name=NULL;
+
+  assert((peer!=NULL) && (jfilts!=NULL));
+  trp_peer_set_server(peer, server);
+  assert(0<asprintf(&gss_name, "trustrouter@%s", server));
+  trp_peer_add_gss_name(peer, tr_new_name(gss_name));
+  free(gss_name);
+  trp_peer_set_port(peer, 12309);
+  trp_peer_set_linkcost(peer, 1);
+  trp_peer_set_filters(peer, tr_cfg_parse_filters(peer, jfilts, &rc));
+  assert(rc==TR_CFG_SUCCESS);
+  json_decref(jfilts);
+  return peer;
+}
+
+/* add a connected peer and return the client instance that holds its send queue */
+static TRPC_INSTANCE *add_peer(TRPS_INSTANCE *trps, const char *server)
+{
+  TRP_PEER *peer=new_peer(server);
+  TRPC_INSTANCE *trpc=trpc_new(NULL);
+  TRP_CONNECTION *conn=NULL;
+
+  assert(trpc!=NULL);
+  conn=trp_connection_new(trpc);
+  assert(conn!=NULL);
+  conn->status=TRP_CONNECTION_UP;
+  trpc_set_conn(trpc, conn);
+  trpc_set_gssname(trpc, trp_peer_dup_servicename(peer));
+  trps_add_trpc(trps, trpc);
+  assert(trps_add_peer(trps, peer)==TRP_SUCCESS);
+  return trpc;
+}
+
+static TRPS_INSTANCE *new_trps(TALLOC_CTX *mem_ctx)
+{
+  TRPS_INSTANCE *trps=trps_new(mem_ctx);
+
+  assert(trps!=NULL);
+  trps->hostname=talloc_strdup(trps, "tr.example.com");
+  trps->tids_port=12310;
+  trps->ctable=tr_comm_table_new(trps);
+  return trps;
+}
+
+static TR_NAME *realm_name(int ii)
+{
+  char s[]="realm0";
+  s[5]+=ii;
+  return tr_new_name(s);
+}
+
+static TRP_ROUTE *new_local_route(int ii, unsigned int metric)
+{
+  TRP_ROUTE *route=trp_route_new(NULL);
+
+  assert(route!=NULL);
+  trp_route_set_comm(route, tr_new_name("apc0"));
+  trp_route_set_realm(route, realm_name(ii));
+  trp_route_set_peer(route, tr_new_name(""));
+  trp_route_set_metric(route, metric);
+  trp_route_set_trust_router(route, tr_new_name("tr.example.com"));
+  trp_route_set_trust_router_port(route, 12310);
+  trp_route_set_next_hop(route, tr_new_name(""));
+  trp_route_set_local(route, 1);
+  trp_route_set_interval(route, 60);
+  return route;
+}
+
+static TRP_ROUTE *find_route(TRPS_INSTANCE *trps, int ii, const char *peer_name)
+{
+  TR_NAME *comm=tr_new_name("apc0");
+  TR_NAME *realm=realm_name(ii);
+  TR_NAME *peer=tr_new_name(peer_name);
+  TRP_ROUTE *route=trp_rtable_get_entry(trps->rtable, comm, realm, peer);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  tr_free_name(peer);
+  return route;
+}
+
+static unsigned int realm_bit(TR_NAME *realm)
+{
+  assert((realm!=NULL) && (realm->len==6));
+  return 1u<<(realm->buf[5]-'0');
+}
+
+/* Empty a send queue. Returns a bit per realm updated; realms withdrawn are also set in *withdrawn. */
+static unsigned int drain(TRPC_INSTANCE *trpc, unsigned int *withdrawn)
+{
+  TR_MQ_MSG *mq_msg=NULL;
+  GBytes *bytes=NULL;
+  TR_MSG *msg=NULL;
+  TRP_UPD *upd=NULL;
+  unsigned int realms=0;
+
+  *withdrawn=0;
+  while (NULL!=(mq_msg=trpc_mq_pop(trpc, NULL))) {
+    bytes=tr_mq_msg_get_payload(mq_msg);
+    msg=tr_msg_decode(NULL, g_bytes_get_data(bytes, NULL), strlen(g_bytes_get_data(bytes, NULL)));
+    assert(msg!=NULL);
+    if (tr_msg_get_msg_type(msg)==TRP_UPDATE) {
+      for (upd=tr_msg_get_trp_upd(msg); upd!=NULL; upd=trp_upd_get_next(upd)) {
+        realms|=realm_bit(trp_upd_get_realm(upd));
+        if (trp_metric_is_infinite(trp_inforec_get_metric(trp_upd_get_inforec(upd))))
+          *withdrawn|=realm_bit(trp_upd_get_realm(upd));
+      }
+    }
+    tr_msg_free_decoded(msg);
+    tr_mq_msg_free(mq_msg);
+  }
+  return realms;
+}
+
+/* what a reload does with the routing table, less the parts that need a config */
+static void reload_routes(TRPS_INSTANCE *trps, TRP_ROUTE **routes, size_t n_routes)
+{
+  assert(trps_update_local_routes(trps, routes, n_routes)==TRP_SUCCESS);
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_update(trps, TRP_UPDATE_TRIGGERED)==TRP_SUCCESS);
+  trps_flush_retracted_routes(trps);
+}
+
+/* unchanged local routes are kept, others are announced and removed ones withdrawn */
+static void test_local_routes(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  TRPC_INSTANCE *trpc=add_peer(trps, "peer0");
+  TRP_ROUTE *routes[3]={NULL, NULL, NULL};
+  TRP_ROUTE *kept=NULL;
+  unsigned int withdrawn=0;
+  int ii=0;
+
+  for (ii=0; ii<3; ii++)
+    routes[ii]=new_local_route(ii, 0);
+  reload_routes(trps, routes, 3);
+  assert(drain(trpc, &withdrawn)==0x7);
+  assert(withdrawn==0);
+  for (ii=0; ii<3; ii++) {
+    assert(routes[ii]==NULL); /* taken by the route table */
+    assert(find_route(trps, ii, "")!=NULL);
+    assert(trp_route_is_selected(find_route(trps, ii, "")));
+    assert(!trp_route_is_triggered(find_route(trps, ii, "")));
+  }
+
+  /* realm0 unchanged, realm1 changed, realm2 removed, realm3 new */
+  kept=find_route(trps, 0, "");
+  routes[0]=new_local_route(0, 0);
+  routes[1]=new_local_route(1, 2);
+  routes[2]=new_local_route(3, 0);
+  assert(trps_update_local_routes(trps, routes, 3)==TRP_SUCCESS);
+  assert(find_route(trps, 0, "")==kept); /* the duplicate was freed */
+  assert(!trp_route_is_triggered(kept));
+  assert(trp_route_is_triggered(find_route(trps, 1, "")));
+  assert(trp_route_get_metric(find_route(trps, 1, ""))==2);
+  assert(trp_route_is_triggered(find_route(trps, 3, "")));
+  assert(trp_route_is_triggered(find_route(trps, 2, "")));
+  assert(trp_metric_is_infinite(trp_route_get_metric(find_route(trps, 2, ""))));
+
+  /* the retraction stays selected until it has been announced */
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trp_route_is_selected(find_route(trps, 2, "")));
+  assert(trps_update(trps, TRP_UPDATE_TRIGGERED)==TRP_SUCCESS);
+  assert(drain(trpc, &withdrawn)==0xe);
+  assert(withdrawn==0x4);
+
+  /* then it is gone */
+  trps_flush_retracted_routes(trps);
+  assert(find_route(trps, 2, "")==NULL);
+  for (ii=0; ii<4; ii++) {
+    if (ii!=2)
+      assert(find_route(trps, ii, "")!=NULL);
+  }
+  assert(trps_update(trps, TRP_UPDATE_SCHEDULED)==TRP_SUCCESS);
+  assert(drain(trpc, &withdrawn)==0xb);
+  assert(withdrawn==0);
+
+  /* the same configuration again changes nothing */
+  routes[0]=new_local_route(0, 0);
+  routes[1]=new_local_route(1, 2);
+  routes[2]=new_local_route(3, 0);
+  reload_routes(trps, routes, 3);
+  assert(drain(trpc, &withdrawn)==0);
+  talloc_free(tmp_ctx);
+}
+
+/* routes from a peer that is dropped from the configuration are withdrawn, then removed */
+static void test_orphan_routes(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  TRPC_INSTANCE *trpc=add_peer(trps, "peer0");
+  TRP_PTABLE *ptable=NULL;
+  TRP_ROUTE *route=trp_route_new(NULL);
+  unsigned int withdrawn=0;
+
+  add_peer(trps, "peer1");
+  assert(route!=NULL);
+  trp_route_set_comm(route, tr_new_name("apc0"));
+  trp_route_set_realm(route, realm_name(0));
+  trp_route_set_peer(route, tr_new_name("trustrouter@peer1"));
+  trp_route_set_metric(route, 2);
+  trp_route_set_trust_router(route, tr_new_name("tr.peer1"));
+  trp_route_set_trust_router_port(route, 12310);
+  trp_route_set_next_hop(route, tr_new_name("peer1"));
+  trp_route_set_next_hop_port(route, 12309);
+  trp_route_set_interval(route, 60);
+  trps_add_route(trps, route);
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trp_route_is_selected(route));
+  assert(trps_update(trps, TRP_UPDATE_SCHEDULED)==TRP_SUCCESS);
+  assert(drain(trpc, &withdrawn)==0x1);
+  assert(withdrawn==0);
+
+  /* reload without peer1 */
+  ptable=trp_ptable_new(NULL);
+  assert(ptable!=NULL);
+  assert(trp_ptable_add(ptable, new_peer("peer0"))==TRP_SUCCESS);
+  trps_set_ptable(trps, ptable);
+  route=find_route(trps, 0, "trustrouter@peer1");
+  assert(route!=NULL);
+  assert(trp_metric_is_infinite(trp_route_get_metric(route)));
+  assert(trp_route_is_triggered(route));
+
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trp_route_is_selected(route));
+  assert(trps_update(trps, TRP_UPDATE_TRIGGERED)==TRP_SUCCESS);
+  assert(drain(trpc, &withdrawn)==0x1);
+  assert(withdrawn==0x1);
+
+  trps_flush_retracted_routes(trps);
+  assert(find_route(trps, 0, "trustrouter@peer1")==NULL);
+  assert(trps_update(trps, TRP_UPDATE_SCHEDULED)==TRP_SUCCESS);
+  assert(drain(trpc, &withdrawn)==0);
+  talloc_free(tmp_ctx);
+}
+
+static TR_COMM *add_comm(TR_COMM_TABLE *ctab, const char *id)
+{
+  TR_COMM *comm=tr_comm_new(NULL);
+
+  assert(comm!=NULL);
+  tr_comm_set_id(comm, tr_new_name(id));
+  tr_comm_set_type(comm, TR_COMM_APC);
+  assert(tr_comm_table_add_comm(ctab, comm)==0);
+  return comm;
+}
+
+/* add an IDP membership; learned from origin if that is not null */
+static void add_idp_memb(TR_COMM_TABLE *ctab, TR_COMM *comm, const char *realm_id, const char *origin,
+                         struct timespec *expiry)
+{
+  TR_IDP_REALM *idp=tr_idp_realm_new(NULL);
+  TR_PROVENANCE *prov=NULL;
+  TR_NAME *name=NULL;
+
+  assert(idp!=NULL);
+  tr_idp_realm_set_id(idp, tr_new_name(realm_id));
+  if (origin!=NULL) {
+    idp->origin=TR_REALM_DISCOVERED;
+    prov=tr_provenance_new();
+    name=tr_new_name(origin);
+    assert((prov!=NULL) && (name!=NULL));
+    assert(0==tr_provenance_append(&prov, name));
+    tr_free_name(name);
+  }
+  tr_comm_table_add_idp_realm(ctab, idp);
+  tr_comm_add_idp_realm(ctab, comm, idp, 60, prov, expiry);
+  if (prov!=NULL)
+    tr_provenance_unref(prov);
+}
+
+static void add_rp_memb(TR_COMM_TABLE *ctab, TR_COMM *comm, const char *realm_id, const char *origin,
+                        struct timespec *expiry)
+{
+  TR_RP_REALM *rp=tr_rp_realm_new(NULL);
+  TR_PROVENANCE *prov=tr_provenance_new();
+  TR_NAME *name=tr_new_name(origin);
+
+  assert((rp!=NULL) && (prov!=NULL));
+  tr_rp_realm_set_id(rp, tr_new_name(realm_id));
+  assert(0==tr_provenance_append(&prov, name));
+  tr_free_name(name);
+  tr_comm_table_add_rp_realm(ctab, rp);
+  tr_comm_add_rp_realm(ctab, comm, rp, 60, prov, expiry);
+  tr_provenance_unref(prov);
+}
+
+static TR_COMM_MEMB *find_idp_memb(TR_COMM_TABLE *ctab, const char *comm_id, const char *realm_id,
+                                   const char *origin)
+{
+  TR_NAME *comm=tr_new_name(comm_id);
+  TR_NAME *realm=tr_new_name(realm_id);
+  TR_NAME *orig=(origin==NULL)?NULL:tr_new_name(origin);
+  TR_COMM_MEMB *memb=tr_comm_table_find_idp_memb_origin(ctab, realm, comm, orig);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  if (orig!=NULL)
+    tr_free_name(orig);
+  return memb;
+}
+
+/* learned memberships survive replacing the community table, configured ones do not */
+static void test_ctable(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  TR_COMM_TABLE *old_ctab=trps->ctable;
+  TR_COMM_TABLE *new_ctab=tr_comm_table_new(tmp_ctx);
+  TR_COMM *comm=NULL;
+  TR_COMM_MEMB *memb=NULL;
+  TR_NAME *name=NULL;
+  struct timespec expiry={1000, 0};
+
+  comm=add_comm(old_ctab, "apc0");
+  add_idp_memb(old_ctab, comm, "configured.example", NULL, NULL);
+  add_idp_memb(old_ctab, comm, "learned.example", "peer1", &expiry);
+  tr_comm_memb_set_triggered(find_idp_memb(old_ctab, "apc0", "learned.example", "peer1"), 1);
+  comm=add_comm(old_ctab, "coi0");
+  add_rp_memb(old_ctab, comm, "rp.example", "peer1", &expiry);
+
+  comm=add_comm(new_ctab, "apc0");
+  add_idp_memb(new_ctab, comm, "configured2.example", NULL, NULL);
+
+  trps_set_ctable(trps, new_ctab);
+  assert(trps->ctable==new_ctab);
+
+  /* configured memberships come from the new table only */
+  assert(find_idp_memb(new_ctab, "apc0", "configured.example", NULL)==NULL);
+  assert(find_idp_memb(new_ctab, "apc0", "configured2.example", NULL)!=NULL);
+
+  /* learned ones are copied with their state */
+  memb=find_idp_memb(new_ctab, "apc0", "learned.example", "peer1");
+  assert(memb!=NULL);
+  assert(tr_comm_memb_get_interval(memb)==60);
+  assert(tr_comm_memb_get_expiry(memb)->tv_sec==1000);
+  assert(tr_comm_memb_is_triggered(memb));
+  assert(tr_comm_memb_get_idp_realm(memb)!=tr_comm_table_find_idp_realm(old_ctab, tr_comm_memb_get_realm_id(memb)));
+
+  /* including the communities and realms they belong to */
+  name=tr_new_name("coi0");
+  comm=tr_comm_table_find_comm(new_ctab, name);
+  tr_free_name(name);
+  assert(comm!=NULL);
+  name=tr_new_name("rp.example");
+  assert(tr_comm_table_find_rp_realm(new_ctab, name)!=NULL);
+  memb=tr_comm_table_find_rp_memb_origin(new_ctab, name, tr_comm_get_id(comm),
+                                         tr_comm_memb_get_origin(memb));
+  tr_free_name(name);
+  assert(memb!=NULL);
+
+  /* the copy does not depend on the old table */
+  tr_comm_table_free(old_ctab);
+  memb=find_idp_memb(new_ctab, "apc0", "learned.example", "peer1");
+  assert(memb!=NULL);
+  assert(tr_comm_memb_get_origin(memb)!=NULL);
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  test_local_routes();
+  test_orphan_routes();
+  test_ctable();
+  printf("Success.\n");
+  return 0;
+}
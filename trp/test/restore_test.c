@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <talloc.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_config.h>
+#include <tr_msg.h>
+#include <tr_provenance.h>
+#include <trp_internal.h>
+#include <trp_peer.h>
+#include <trp_ptable.h>
+#include <trp_route.h>
+#include <trp_rtable.h>
+
+/* Tests for replaying routing state saved before a restart */
+
+static const char *accept_realm0="{\"trp_inbound\": [{\"action\": \"accept\", "
+                                 "\"specs\": [{\"field\": \"realm\", \"match\": \"realm0\"}]}]}";
+
+static TRPS_INSTANCE *new_trps(TALLOC_CTX *mem_ctx)
+{
+  TRPS_INSTANCE *trps=trps_new(mem_ctx);
+  TRP_PEER *peer=trp_peer_new(NULL);
+  TR_COMM *comm=tr_comm_new(NULL);
+  json_t *jfilts=json_loads(accept_realm0, 0, NULL);
+  TR_CFG_RC cfg_rc=TR_CFG_ERROR;
+
+  assert((trps!=NULL) && (peer!=NULL) && (comm!=NULL) && (jfilts!=NULL));
+  trps->hostname=talloc_strdup(trps, "tr.example.com");
+  trps->tids_port=12310;
+  trps->ctable=tr_comm_table_new(trps);
+
+  tr_comm_set_id(comm, tr_new_name("apc0"));
+  tr_comm_set_type(comm, TR_COMM_APC);
+  assert(tr_comm_table_add_comm(trps->ctable, comm)==0);
+
+  trp_peer_set_server(peer, "peer0");
+  trp_peer_add_gss_name(peer, tr_new_name("trustrouter@peer0"));
+  trp_peer_set_port(peer, 12309);
+  trp_peer_set_linkcost(peer, 1);
+  trp_peer_set_filters(peer, tr_cfg_parse_filters(peer, jfilts, &cfg_rc));
+  assert(cfg_rc==TR_CFG_SUCCESS);
+  json_decref(jfilts);
+  assert(trps_add_peer(trps, peer)==TRP_SUCCESS);
+  return trps;
+}
+
+static TRP_UPD *make_route_upd(TALLOC_CTX *mem_ctx, const char *realm, const char *peer)
+{
+  TRP_UPD *upd=trp_upd_new(mem_ctx);
+  TRP_INFOREC *rec=NULL;
+
+  assert(upd!=NULL);
+  trp_upd_set_comm(upd, tr_new_name("apc0"));
+  trp_upd_set_realm(upd, tr_new_name(realm));
+  trp_upd_set_peer(upd, tr_new_name(peer));
+  rec=trp_inforec_new(upd, TRP_INFOREC_TYPE_ROUTE);
+  assert(rec!=NULL);
+  assert(TRP_SUCCESS==trp_inforec_set_trust_router(rec, tr_new_name("tr.peer0"), 12309));
+  assert(TRP_SUCCESS==trp_inforec_set_next_hop(rec, tr_new_name("tr.peer0"), 12310));
+  assert(TRP_SUCCESS==trp_inforec_set_metric(rec, 1));
+  assert(TRP_SUCCESS==trp_inforec_set_interval(rec, 30));
+  trp_upd_add_inforec(upd, rec);
+  return upd;
+}
+
+static TRP_UPD *make_memb_upd(TALLOC_CTX *mem_ctx, const char *realm)
+{
+  TRP_UPD *upd=trp_upd_new(mem_ctx);
+  TRP_INFOREC *rec=NULL;
+  TR_PROVENANCE *prov=tr_provenance_new();
+  TR_NAME *hop=tr_new_name("peer0:12309");
+
+  assert((upd!=NULL) && (prov!=NULL) && (hop!=NULL));
+  trp_upd_set_comm(upd, tr_new_name("apc0"));
+  trp_upd_set_realm(upd, tr_new_name(realm));
+  trp_upd_set_peer(upd, tr_new_name("trustrouter@peer0"));
+  rec=trp_inforec_new(upd, TRP_INFOREC_TYPE_COMMUNITY);
+  assert(rec!=NULL);
+  assert(TRP_SUCCESS==trp_inforec_set_comm_type(rec, TR_COMM_APC));
+  assert(TRP_SUCCESS==trp_inforec_set_role(rec, TR_ROLE_IDP));
+  assert(TRP_SUCCESS==trp_inforec_set_interval(rec, 30));
+  assert(0==tr_provenance_append(&prov, hop));
+  assert(TRP_SUCCESS==trp_inforec_set_provenance(rec, prov));
+  tr_provenance_unref(prov);
+  tr_free_name(hop);
+  trp_upd_add_inforec(upd, rec);
+  return upd;
+}
+
+static TRP_PEER *find_peer(TRPS_INSTANCE *trps)
+{
+  TR_NAME *gssname=tr_new_name("trustrouter@peer0");
+  TRP_PEER *peer=trps_get_peer_by_gssname(trps, gssname);
+
+  tr_free_name(gssname);
+  assert(peer!=NULL);
+  return peer;
+}
+
+static TRP_ROUTE *find_route(TRPS_INSTANCE *trps, const char *realm_id)
+{
+  TR_NAME *comm=tr_new_name("apc0");
+  TR_NAME *realm=tr_new_name(realm_id);
+  TR_NAME *peer=tr_new_name("trustrouter@peer0");
+  TRP_ROUTE *route=trps_get_route(trps, comm, realm, peer);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  tr_free_name(peer);
+  return route;
+}
+
+static TR_COMM_MEMB *find_memb(TRPS_INSTANCE *trps, const char *realm_id)
+{
+  TR_NAME *comm=tr_new_name("apc0");
+  TR_NAME *realm=tr_new_name(realm_id);
+  TR_NAME *origin=tr_new_name("peer0:12309");
+  TR_COMM_MEMB *memb=tr_comm_table_find_idp_memb_origin(trps->ctable, realm, comm, origin);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  tr_free_name(origin);
+  return memb;
+}
+
+/* a time in seconds from now by TRP_CLOCK */
+static struct timespec *from_now(struct timespec *ts, time_t secs)
+{
+  assert(0==clock_gettime(TRP_CLOCK, ts));
+  ts->tv_sec+=secs;
+  return ts;
+}
+
+/* restored entries are provisional, keep their saved expiry, and are not recorded as received */
+static void test_restore_provisional(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  TRP_PEER *peer=find_peer(trps);
+  TRP_ROUTE *route=NULL;
+  TR_COMM_MEMB *memb=NULL;
+  struct timespec expiry={0,0};
+
+  from_now(&expiry, 100);
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer0"), &expiry)==TRP_SUCCESS);
+  route=find_route(trps, "realm0");
+  assert(route!=NULL);
+  assert(trp_route_is_provisional(route));
+  assert(trp_route_get_expiry(route)->tv_sec==expiry.tv_sec);
+  assert(trp_route_get_metric(route)==1);
+
+  assert(trps_restore_update(trps, make_memb_upd(tmp_ctx, "realm0"), &expiry)==TRP_SUCCESS);
+  memb=find_memb(trps, "realm0");
+  assert(memb!=NULL);
+  assert(tr_comm_memb_is_provisional(memb));
+  assert(tr_comm_memb_get_expiry(memb)->tv_sec==expiry.tv_sec);
+
+  /* the peer has not sent these, so they are not in our digest of its updates */
+  assert(trp_peer_received_size(peer)==0);
+
+  /* provisional routes are still used for forwarding */
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trp_route_is_selected(route));
+
+  talloc_free(tmp_ctx);
+}
+
+/* updates the inbound filters reject, or from peers we do not know, are not restored */
+static void test_restore_filtered(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  struct timespec expiry={0,0};
+
+  from_now(&expiry, 100);
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm1", "trustrouter@peer0"), &expiry)==TRP_SUCCESS);
+  assert(find_route(trps, "realm1")==NULL);
+  assert(trps_restore_update(trps, make_memb_upd(tmp_ctx, "realm1"), &expiry)==TRP_SUCCESS);
+  assert(find_memb(trps, "realm1")==NULL);
+
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer9"), &expiry)==TRP_SUCCESS);
+  assert(trp_rtable_size(trps->rtable)==0);
+
+  talloc_free(tmp_ctx);
+}
+
+/* a restored entry that is never confirmed lapses at its saved expiry */
+static void test_restore_expiry(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  TRP_ROUTE *route=NULL;
+  struct timespec expiry={0,0};
+
+  from_now(&expiry, -1);
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer0"), &expiry)==TRP_SUCCESS);
+  assert(trps_restore_update(trps, make_memb_upd(tmp_ctx, "realm0"), &expiry)==TRP_SUCCESS);
+  route=find_route(trps, "realm0");
+  assert(route!=NULL);
+  assert(find_memb(trps, "realm0")!=NULL);
+
+  /* the first sweep retracts the route, the next one after that removes it */
+  assert(trps_sweep_routes(trps)==TRP_SUCCESS);
+  assert(trp_metric_is_infinite(trp_route_get_metric(route)));
+  trp_route_set_expiry(route, from_now(&expiry, -1));
+  assert(trps_sweep_routes(trps)==TRP_SUCCESS);
+  assert(find_route(trps, "realm0")==NULL);
+
+  /* memberships likewise */
+  assert(trps_sweep_ctable(trps)==TRP_SUCCESS);
+  assert(find_memb(trps, "realm0")!=NULL);
+  assert(tr_comm_memb_get_times_expired(find_memb(trps, "realm0"))==1);
+  *tr_comm_memb_get_expiry(find_memb(trps, "realm0"))=*from_now(&expiry, -1);
+  assert(trps_sweep_ctable(trps)==TRP_SUCCESS);
+  assert(find_memb(trps, "realm0")==NULL);
+
+  talloc_free(tmp_ctx);
+}
+
+/* an update or refresh marker from the peer confirms a restored entry */
+static void test_restore_confirmed(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=new_trps(tmp_ctx);
+  TRP_REFRESH_MARKER *marker=NULL;
+  TRP_ROUTE *route=NULL;
+  struct timespec expiry={0,0};
+  TR_MSG msg; /* not a pointer! */
+
+  from_now(&expiry, 5);
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer0"), &expiry)==TRP_SUCCESS);
+  assert(trps_restore_update(trps, make_memb_upd(tmp_ctx, "realm0"), &expiry)==TRP_SUCCESS);
+  assert(trp_route_is_provisional(find_route(trps, "realm0")));
+  assert(tr_comm_memb_is_provisional(find_memb(trps, "realm0")));
+
+  /* a refresh marker covering both clears the flags and extends the expiry */
+  marker=trp_refresh_marker_new(tmp_ctx);
+  assert(marker!=NULL);
+  trp_refresh_marker_set_peer(marker, tr_new_name("trustrouter@peer0"));
+  assert(TRP_SUCCESS==trp_refresh_marker_add(marker, TRP_INFOREC_TYPE_ROUTE, tr_new_name("apc0"), tr_new_name("realm0")));
+  assert(TRP_SUCCESS==trp_refresh_marker_add(marker, TRP_INFOREC_TYPE_COMMUNITY, tr_new_name("apc0"), tr_new_name("realm0")));
+  tr_msg_set_trp_refresh(&msg, marker);
+  assert(trps_handle_tr_msg(trps, &msg)==TRP_SUCCESS);
+  route=find_route(trps, "realm0");
+  assert(!trp_route_is_provisional(route));
+  assert(trp_route_get_expiry(route)->tv_sec>expiry.tv_sec);
+  assert(!tr_comm_memb_is_provisional(find_memb(trps, "realm0")));
+  assert(tr_comm_memb_get_expiry(find_memb(trps, "realm0"))->tv_sec>expiry.tv_sec);
+
+  /* a restored entry does not replace one the peer has already sent */
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer0"), &expiry)==TRP_SUCCESS);
+  assert(find_route(trps, "realm0")==route);
+  assert(!trp_route_is_provisional(route));
+
+  talloc_free(tmp_ctx);
+
+  /* so does a full update */
+  tmp_ctx=talloc_new(NULL);
+  trps=new_trps(tmp_ctx);
+  assert(trps_restore_update(trps, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer0"), &expiry)==TRP_SUCCESS);
+  assert(trp_route_is_provisional(find_route(trps, "realm0")));
+  tr_msg_set_trp_upd(&msg, make_route_upd(tmp_ctx, "realm0", "trustrouter@peer0"));
+  assert(trps_handle_tr_msg(trps, &msg)==TRP_SUCCESS);
+  assert(!trp_route_is_provisional(find_route(trps, "realm0")));
+  assert(trp_peer_received_size(find_peer(trps))==1);
+
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  test_restore_provisional();
+  test_restore_filtered();
+  test_restore_expiry();
+  test_restore_confirmed();
+  printf("Success.\n");
+  return 0;
+}
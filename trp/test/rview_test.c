@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <talloc.h>
+#include <glib.h>
+
+#include <tr_name_internal.h>
+#include <tr_comm.h>
+#include <tr_config.h>
+#include <trp_internal.h>
+#include <trp_route.h>
+#include <trp_rtable.h>
+#include <trp_rview.h>
+
+/* Tests for the read-only view of the selected routes */
+
+#define N_READERS 4
+#define N_PUBLISHES 2000
+
+static TRP_ROUTE *new_route(const char *comm, const char *realm, const char *next_hop,
+                            unsigned int metric, int selected)
+{
+  TRP_ROUTE *route=trp_route_new(NULL);
+  struct timespec expiry={0,0};
+
+  assert(route!=NULL);
+  assert(0==clock_gettime(TRP_CLOCK, &expiry));
+  expiry.tv_sec+=3600;
+  trp_route_set_comm(route, tr_new_name(comm));
+  trp_route_set_realm(route, tr_new_name(realm));
+  trp_route_set_peer(route, tr_new_name(""));
+  trp_route_set_trust_router(route, tr_new_name("tr.example.com"));
+  trp_route_set_next_hop(route, tr_new_name(next_hop));
+  trp_route_set_next_hop_port(route, 12309);
+  trp_route_set_metric(route, metric);
+  trp_route_set_interval(route, 60);
+  trp_route_set_expiry(route, &expiry);
+  trp_route_set_local(route, (metric==0));
+  trp_route_set_selected(route, selected);
+  return route;
+}
+
+static TRP_RVIEW_ENTRY *lookup(TRP_RVIEW *view, const char *comm_id, const char *realm_id)
+{
+  TR_NAME *comm=tr_new_name(comm_id);
+  TR_NAME *realm=tr_new_name(realm_id);
+  TRP_RVIEW_ENTRY *entry=trp_rview_lookup(view, comm, realm);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
+  return entry;
+}
+
+/* only usable selected routes are in a view, and each can be found */
+static void test_lookup(void)
+{
+  TRP_ROUTE *routes[6];
+  TRP_RVIEW *view=NULL;
+  TRP_RVIEW_ENTRY *entry=NULL;
+  size_t ii=0;
+
+  /* deliberately out of order */
+  routes[0]=new_route("apc1", "realm0", "hop0", 2, 1);
+  routes[1]=new_route("apc0", "realm1", "hop1", 0, 1);
+  routes[2]=new_route("apc0", "realm0", "hop2", 3, 1);
+  routes[3]=new_route("apc0", "realm2", "hop3", 1, 0); /* not selected */
+  routes[4]=new_route("apc0", "realm3", "hop4", TRP_METRIC_INFINITY, 1); /* retracted */
+  routes[5]=new_route("apc1", "realm1", "hop5", 5, 1);
+
+  view=trp_rview_new(NULL, routes, 6, 7);
+  assert(view!=NULL);
+  assert(trp_rview_get_generation(view)==7);
+  assert(trp_rview_size(view)==4);
+
+  entry=lookup(view, "apc0", "realm0");
+  assert(entry!=NULL);
+  assert(0==tr_name_cmp(trp_rview_entry_get_comm(entry), routes[2]->comm));
+  assert(0==tr_name_cmp(trp_rview_entry_get_realm(entry), routes[2]->realm));
+  assert(0==tr_name_cmp(trp_rview_entry_get_next_hop(entry), routes[2]->next_hop));
+  assert(trp_rview_entry_get_next_hop_port(entry)==12309);
+  assert(trp_rview_entry_get_metric(entry)==3);
+  assert(!trp_rview_entry_is_local(entry));
+
+  entry=lookup(view, "apc0", "realm1");
+  assert((entry!=NULL) && trp_rview_entry_is_local(entry));
+  entry=lookup(view, "apc1", "realm0");
+  assert((entry!=NULL) && (trp_rview_entry_get_metric(entry)==2));
+  entry=lookup(view, "apc1", "realm1");
+  assert((entry!=NULL) && (trp_rview_entry_get_metric(entry)==5));
+
+  assert(lookup(view, "apc0", "realm2")==NULL);
+  assert(lookup(view, "apc0", "realm3")==NULL);
+  assert(lookup(view, "apc2", "realm0")==NULL);
+  assert(lookup(view, "apc1", "realm2")==NULL);
+  assert(lookup(NULL, "apc0", "realm0")==NULL);
+
+  /* the view has its own copies */
+  for (ii=0; ii<6; ii++)
+    trp_route_free(routes[ii]);
+  entry=lookup(view, "apc1", "realm1");
+  assert(entry!=NULL);
+  assert(0==strncmp(trp_rview_entry_get_next_hop(entry)->buf, "hop5", 4));
+  trp_rview_release(view);
+
+  /* an empty view is fine too */
+  view=trp_rview_new(NULL, NULL, 0, 1);
+  assert(view!=NULL);
+  assert(trp_rview_size(view)==0);
+  assert(lookup(view, "apc0", "realm0")==NULL);
+  trp_rview_release(view);
+}
+
+static int n_notified=0;
+
+static void count_notify(TRPS_INSTANCE *trps, void *arg)
+{
+  n_notified++;
+}
+
+static int n_freed=0;
+
+static int count_free(int *ptr)
+{
+  n_freed++;
+  return 0;
+}
+
+/* a view is only published when the selected routes change */
+static void test_publish(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=trps_new(tmp_ctx);
+  TRP_RVIEW *view=NULL;
+  TRP_RVIEW_ENTRY *entry=NULL;
+  TRP_ROUTE *route=NULL;
+  struct timespec expired={0,0};
+
+  assert(trps!=NULL);
+  trps_set_rview_notify_cb(trps, count_notify, NULL);
+  assert(trps_acquire_rview(trps)==NULL);
+
+  /* the new route table needs a first view */
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  view=trps_acquire_rview(trps);
+  assert((view!=NULL) && (trp_rview_get_generation(view)==1) && (trp_rview_size(view)==0));
+  trp_rview_release(view);
+
+  /* nothing changed */
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trp_rview_get_generation(trps->rview)==1);
+
+  /* a route that is not selected yet does not change the view */
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 2, 0));
+  assert(n_notified==0);
+  assert(!trps->rview_dirty);
+
+  /* selecting it does, but the notification comes only once */
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(n_notified==1);
+  trps_add_route(trps, new_route("apc0", "realm1", "hop1", 1, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(n_notified==1);
+  assert(trp_rview_get_generation(trps->rview)==1);
+
+  /* both changes go into one view */
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trp_rview_get_generation(trps->rview)==2);
+  assert(trp_rview_size(trps->rview)==2);
+  entry=lookup(trps->rview, "apc0", "realm0");
+  assert(entry!=NULL);
+
+  /* selection unchanged, so no new view */
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(n_notified==1);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trp_rview_get_generation(trps->rview)==2);
+
+  /* expiring a selected route changes the view */
+  route=trps_get_selected_route(trps, trp_rview_entry_get_comm(entry), trp_rview_entry_get_realm(entry));
+  assert(route!=NULL);
+  trp_route_set_expiry(route, &expired);
+  assert(trps_sweep_routes(trps)==TRP_SUCCESS);
+  assert(n_notified==2);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trp_rview_get_generation(trps->rview)==3);
+  assert(trp_rview_size(trps->rview)==1);
+  assert(lookup(trps->rview, "apc0", "realm0")==NULL);
+
+  talloc_free(tmp_ctx);
+}
+
+/* a replaced view stays valid for its readers and is freed by the last of them */
+static void test_retire(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=trps_new(tmp_ctx);
+  TRP_RVIEW *old=NULL;
+  TRP_RVIEW *cur=NULL;
+
+  assert(trps!=NULL);
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 2, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+
+  old=trps_acquire_rview(trps);
+  assert(old!=NULL);
+  assert(g_atomic_int_get(&(old->refcount))==2);
+  n_freed=0;
+  talloc_set_destructor(talloc(old, int), count_free);
+
+  /* replace the route, and with it the view */
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 3, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trps->rview!=old);
+  assert(trps_reclaim_rviews(trps)==0); /* no reader was loading it */
+
+  /* the old view is only held by us now, and is unchanged */
+  assert(n_freed==0);
+  assert(g_atomic_int_get(&(old->refcount))==1);
+  assert(trp_rview_entry_get_metric(lookup(old, "apc0", "realm0"))==2);
+  cur=trps_acquire_rview(trps);
+  assert(trp_rview_entry_get_metric(lookup(cur, "apc0", "realm0"))==3);
+
+  trp_rview_release(old);
+  assert(n_freed==1);
+  trp_rview_release(cur);
+  assert(g_atomic_int_get(&(trps->rview->refcount))==1);
+
+  /* a reader may also outlive the TRP server */
+  cur=trps_acquire_rview(trps);
+  n_freed=0;
+  talloc_set_destructor(talloc(cur, int), count_free);
+  talloc_free(tmp_ctx);
+  assert(n_freed==0);
+  assert(trp_rview_entry_get_metric(lookup(cur, "apc0", "realm0"))==3);
+  trp_rview_release(cur);
+  assert(n_freed==1);
+}
+
+/* publishing does not wait for a reader caught between loading the view and
+ * taking its reference; the old view is dropped on a later pass instead */
+static void test_retire_deferred(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=trps_new(tmp_ctx);
+  TRP_RVIEW *old=NULL;
+  TRP_RVIEW *loaded=NULL;
+  unsigned int slot=0;
+
+  assert(trps!=NULL);
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 2, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  old=trps->rview;
+
+  /* stop a reader halfway through trps_acquire_rview() */
+  slot=tr_reclaim_enter(trps->rview_reclaim);
+  loaded=g_atomic_pointer_get(&(trps->rview));
+  assert(loaded==old);
+
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 3, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trps->rview!=old);
+  assert(g_atomic_int_get(&(old->refcount))==1); /* still the TRP server's */
+  assert(trps_reclaim_rviews(trps)==1);
+
+  /* the reader finishes; now the server lets go */
+  g_atomic_int_inc(&(loaded->refcount));
+  tr_reclaim_exit(trps->rview_reclaim, slot);
+  assert(trps_reclaim_rviews(trps)==0);
+  assert(g_atomic_int_get(&(old->refcount))==1); /* the reader's */
+  n_freed=0;
+  talloc_set_destructor(talloc(old, int), count_free);
+  assert(trp_rview_entry_get_metric(lookup(old, "apc0", "realm0"))==2);
+  trp_rview_release(old);
+  assert(n_freed==1);
+
+  /* views still waiting are dropped with the server */
+  slot=tr_reclaim_enter(trps->rview_reclaim);
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 4, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  assert(trps_reclaim_rviews(trps)==1);
+  tr_reclaim_exit(trps->rview_reclaim, slot);
+  talloc_free(tmp_ctx);
+}
+
+struct reader_data {
+  TRPS_INSTANCE *trps;
+  gint *stop;
+  unsigned int n_acquired;
+};
+
+static void *reader_thread(void *arg)
+{
+  struct reader_data *data=(struct reader_data *)arg;
+  TRP_RVIEW *view=NULL;
+  TRP_RVIEW_ENTRY *entry=NULL;
+  unsigned int last=0;
+  unsigned int metric=0;
+
+  while (!g_atomic_int_get(data->stop)) {
+    view=trps_acquire_rview(data->trps);
+    assert(view!=NULL);
+    assert(trp_rview_get_generation(view)>=last);
+    last=trp_rview_get_generation(view);
+    entry=lookup(view, "apc0", "realm0");
+    assert(entry!=NULL);
+    metric=trp_rview_entry_get_metric(entry);
+    sched_yield();
+    /* still intact, even if a newer view has been published meanwhile */
+    assert(trp_rview_entry_get_metric(entry)==metric);
+    assert(0==strncmp(trp_rview_entry_get_next_hop(entry)->buf, "hop0", 4));
+    trp_rview_release(view);
+    data->n_acquired++;
+  }
+  return NULL;
+}
+
+/* readers look routes up while the main thread keeps publishing new views */
+static void test_retire_threaded(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRPS_INSTANCE *trps=trps_new(tmp_ctx);
+  struct reader_data data[N_READERS];
+  pthread_t threads[N_READERS];
+  gint stop=0;
+  int ii=0;
+
+  assert(trps!=NULL);
+  trps_add_route(trps, new_route("apc0", "realm0", "hop0", 1, 0));
+  assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+  assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  for (ii=0; ii<N_READERS; ii++) {
+    data[ii].trps=trps;
+    data[ii].stop=&stop;
+    data[ii].n_acquired=0;
+    assert(0==pthread_create(&threads[ii], NULL, reader_thread, &data[ii]));
+  }
+
+  for (ii=0; ii<N_PUBLISHES; ii++) {
+    trps_add_route(trps, new_route("apc0", "realm0", "hop0", 1+(ii%10), 0));
+    assert(trps_update_active_routes(trps)==TRP_SUCCESS);
+    assert(trps_publish_rview(trps)==TRP_SUCCESS);
+  }
+
+  g_atomic_int_set(&stop, 1);
+  for (ii=0; ii<N_READERS; ii++) {
+    assert(0==pthread_join(threads[ii], NULL));
+    assert(data[ii].n_acquired>0);
+  }
+  assert(trp_rview_get_generation(trps->rview)==N_PUBLISHES+1); /* plus the first one */
+  assert(trps_reclaim_rviews(trps)==0);
+  assert(g_atomic_int_get(&(trps->rview->refcount))==1);
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  test_lookup();
+  test_publish();
+  test_retire();
+  test_retire_deferred();
+  test_retire_threaded();
+  printf("Success.\n");
+  return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <talloc.h>
+#include <gssapi.h>
+
+#include <trp_internal.h>
+
+/* Tests for the nonblocking message stream used by the event-driven TRP transport */
+
+/*
+ * Stand-ins for the GSS mechanism. "Wrapping" just copies the message, so the
+ * framing and buffering can be tested without credentials. These take the place
+ * of the library's versions when linked into this program.
+ */
+OM_uint32 gss_wrap(OM_uint32 *minor, gss_ctx_id_t ctx, int conf_req, gss_qop_t qop,
+                   gss_buffer_t input, int *conf_state, gss_buffer_t output)
+{
+  output->value=malloc(input->length);
+  assert(output->value!=NULL);
+  memcpy(output->value, input->value, input->length);
+  output->length=input->length;
+  *conf_state=1;
+  return GSS_S_COMPLETE;
+}
+
+OM_uint32 gss_unwrap(OM_uint32 *minor, gss_ctx_id_t ctx, gss_buffer_t input,
+                     gss_buffer_t output, int *conf_state, gss_qop_t *qop)
+{
+  return gss_wrap(minor, ctx, 1, GSS_C_QOP_DEFAULT, input, conf_state, output);
+}
+
+OM_uint32 gss_release_buffer(OM_uint32 *minor, gss_buffer_t buffer)
+{
+  free(buffer->value);
+  buffer->value=NULL;
+  buffer->length=0;
+  return GSS_S_COMPLETE;
+}
+
+static gss_ctx_id_t gssctx=GSS_C_NO_CONTEXT;
+
+/* read one complete message, which must be available now */
+static void expect_msg(TRP_STREAM *stream, const char *expected, size_t len)
+{
+  char *buf=NULL;
+  size_t buflen=0;
+
+  assert(trp_stream_read(stream, &buf, &buflen)==TRP_SUCCESS);
+  assert(buf!=NULL);
+  assert(buflen==len);
+  assert(0==memcmp(buf, expected, len));
+  free(buf);
+}
+
+static void expect_nothing(TRP_STREAM *stream)
+{
+  char *buf=NULL;
+  size_t buflen=0;
+
+  assert(trp_stream_read(stream, &buf, &buflen)==TRP_SUCCESS);
+  assert(buf==NULL);
+}
+
+static void make_pair(TALLOC_CTX *mem_ctx, int *fds, TRP_STREAM **a, TRP_STREAM **b)
+{
+  assert(0==socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  *a=trp_stream_new(mem_ctx, fds[0], &gssctx);
+  *b=trp_stream_new(mem_ctx, fds[1], &gssctx);
+  assert((*a!=NULL) && (*b!=NULL));
+}
+
+/* several queued messages go out in one flush and are read back one at a time */
+static void test_several_messages(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  const char *msgs[]={"first", "second message", "third"};
+  TRP_STREAM *a=NULL, *b=NULL;
+  int fds[2];
+  size_t ii=0;
+
+  make_pair(tmp_ctx, fds, &a, &b);
+  expect_nothing(b);
+  for (ii=0; ii<3; ii++)
+    assert(trp_stream_queue(a, msgs[ii], strlen(msgs[ii]))==TRP_SUCCESS);
+  assert(trp_stream_pending(a)>0);
+  assert(trp_stream_flush(a)==TRP_SUCCESS);
+  assert(trp_stream_pending(a)==0);
+
+  for (ii=0; ii<3; ii++)
+    expect_msg(b, msgs[ii], strlen(msgs[ii]));
+  expect_nothing(b);
+
+  close(fds[0]);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+}
+
+/* a message that arrives a few bytes at a time is only returned once complete */
+static void test_partial_read(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  const char *msg="a message that arrives in pieces";
+  uint32_t hdr=htonl(strlen(msg));
+  TRP_STREAM *a=NULL, *b=NULL;
+  int fds[2];
+
+  make_pair(tmp_ctx, fds, &a, &b);
+  assert(2==write(fds[0], &hdr, 2));
+  expect_nothing(b);
+  assert(2==write(fds[0], ((char *)&hdr)+2, 2));
+  expect_nothing(b);
+  assert(5==write(fds[0], msg, 5));
+  expect_nothing(b);
+  assert(strlen(msg)-5==write(fds[0], msg+5, strlen(msg)-5));
+  expect_msg(b, msg, strlen(msg));
+  expect_nothing(b);
+
+  close(fds[0]);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+}
+
+/* a message too big for the socket buffer is sent over several flushes */
+static void test_partial_write(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  size_t len=4*1024*1024;
+  char *msg=malloc(len);
+  char *buf=NULL;
+  size_t buflen=0;
+  TRP_STREAM *a=NULL, *b=NULL;
+  int fds[2];
+  size_t ii=0;
+  int n_flushes=0;
+
+  assert(msg!=NULL);
+  for (ii=0; ii<len; ii++)
+    msg[ii]=(char)(ii%251);
+
+  make_pair(tmp_ctx, fds, &a, &b);
+  assert(trp_stream_queue(a, msg, len)==TRP_SUCCESS);
+  do {
+    assert(trp_stream_flush(a)==TRP_SUCCESS);
+    n_flushes++;
+    assert(trp_stream_read(b, &buf, &buflen)==TRP_SUCCESS);
+  } while (buf==NULL);
+  assert(n_flushes>1); /* otherwise this did not test anything */
+  assert(trp_stream_pending(a)==0);
+  assert(buflen==len);
+  assert(0==memcmp(buf, msg, len));
+  free(buf);
+  free(msg);
+
+  close(fds[0]);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+}
+
+/* a zero or oversized length header and a closed connection are errors */
+static void test_errors(void)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  uint32_t hdr=0;
+  char *buf=NULL;
+  size_t buflen=0;
+  TRP_STREAM *a=NULL, *b=NULL;
+  int fds[2];
+
+  make_pair(tmp_ctx, fds, &a, &b);
+  assert(sizeof(hdr)==write(fds[0], &hdr, sizeof(hdr)));
+  assert(trp_stream_read(b, &buf, &buflen)!=TRP_SUCCESS);
+  close(fds[0]);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+
+  tmp_ctx=talloc_new(NULL);
+  make_pair(tmp_ctx, fds, &a, &b);
+  hdr=htonl(TRP_STREAM_MAX_TOKEN+1);
+  assert(sizeof(hdr)==write(fds[0], &hdr, sizeof(hdr)));
+  assert(trp_stream_read(b, &buf, &buflen)!=TRP_SUCCESS);
+  close(fds[0]);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+
+  tmp_ctx=talloc_new(NULL);
+  make_pair(tmp_ctx, fds, &a, &b);
+  close(fds[0]);
+  assert(trp_stream_read(b, &buf, &buflen)!=TRP_SUCCESS);
+  close(fds[1]);
+  talloc_free(tmp_ctx);
+}
+
+int main(void)
+{
+  test_several_messages();
+  test_partial_read();
+  test_partial_write();
+  test_errors();
+  printf("Success.\n");
+  return 0;
+}
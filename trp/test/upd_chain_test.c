@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <jansson.h>
+
+#include <tr_name_internal.h>
+#include <tr_msg.h>
+#include <trp_internal.h>
+
+/* Round trip tests for packed TRP update messages. */
+
+struct upd_data {
+  char *comm;
+  char *realm;
+  char *trust_router;
+  unsigned int metric;
+};
+
+static struct upd_data upd_table[]={
+  {"apc.example.com", "realm0.example.com", "tr0.example.com", 1},
+  {"apc.example.com", "realm1.example.com", "tr1.example.com", 2},
+  {"apc.example.com", "realm2.example.com", "tr2.example.com", 3}
+};
+static size_t n_upds=sizeof(upd_table)/sizeof(upd_table[0]);
+
+static TRP_UPD *make_upd(TALLOC_CTX *mem_ctx, struct upd_data *data)
+{
+  TRP_UPD *upd=trp_upd_new(mem_ctx);
+  TRP_INFOREC *rec=NULL;
+
+  assert(upd!=NULL);
+  trp_upd_set_comm(upd, tr_new_name(data->comm));
+  trp_upd_set_realm(upd, tr_new_name(data->realm));
+  rec=trp_inforec_new(upd, TRP_INFOREC_TYPE_ROUTE);
+  assert(rec!=NULL);
+  assert(TRP_SUCCESS==trp_inforec_set_trust_router(rec, tr_new_name(data->trust_router), 12308));
+  assert(TRP_SUCCESS==trp_inforec_set_next_hop(rec, tr_new_name(data->trust_router), 12309));
+  assert(TRP_SUCCESS==trp_inforec_set_metric(rec, data->metric));
+  assert(TRP_SUCCESS==trp_inforec_set_interval(rec, 30));
+  trp_upd_add_inforec(upd, rec);
+  return upd;
+}
+
+/* build a chain from the first n entries of upd_table */
+static TRP_UPD *make_chain(TALLOC_CTX *mem_ctx, size_t n)
+{
+  TRP_UPD *head=NULL;
+  TRP_UPD *tail=NULL;
+  TRP_UPD *upd=NULL;
+  size_t ii=0;
+
+  for (ii=0; ii<n; ii++) {
+    upd=make_upd(mem_ctx, upd_table+ii);
+    if (tail==NULL)
+      head=upd;
+    else
+      trp_upd_set_next(tail, upd);
+    tail=upd;
+  }
+  return head;
+}
+
+static char *encode_chain(TRP_UPD *head)
+{
+  TR_MSG msg; /* not a pointer! */
+  tr_msg_set_trp_upd(&msg, head);
+  return tr_msg_encode(NULL, &msg);
+}
+
+static int name_is(TR_NAME *name, const char *s)
+{
+  return (name!=NULL) && (name->len==strlen(s)) && (0==strncmp(name->buf, s, name->len));
+}
+
+static void check_upd(TRP_UPD *upd, struct upd_data *data)
+{
+  TRP_INFOREC *rec=NULL;
+
+  assert(upd!=NULL);
+  assert(name_is(trp_upd_get_comm(upd), data->comm));
+  assert(name_is(trp_upd_get_realm(upd), data->realm));
+  assert(trp_upd_num_inforecs(upd)==1);
+  rec=trp_upd_get_inforec(upd);
+  assert(trp_inforec_get_type(rec)==TRP_INFOREC_TYPE_ROUTE);
+  assert(name_is(trp_inforec_get_trust_router(rec), data->trust_router));
+  assert(name_is(trp_inforec_get_next_hop(rec), data->trust_router));
+  assert(trp_inforec_get_metric(rec)==data->metric);
+  assert(trp_inforec_get_interval(rec)==30);
+}
+
+/* the decoded chain must hold exactly the entries of upd_table whose bit is set in mask, in order */
+static void check_chain(TRP_UPD *head, unsigned int mask)
+{
+  size_t ii=0;
+
+  for (ii=0; ii<n_upds; ii++) {
+    if (mask & (1<<ii)) {
+      check_upd(head, upd_table+ii);
+      head=trp_upd_get_next(head);
+    }
+  }
+  assert(head==NULL);
+}
+
+/* get the msg_body of an encoded message */
+static json_t *get_body(json_t *jmsg)
+{
+  json_t *jbody=json_object_get(jmsg, "msg_body");
+  assert(jbody!=NULL);
+  return jbody;
+}
+
+static void test_round_trip(size_t n)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_UPD *head=make_chain(tmp_ctx, n);
+  char *encoded=encode_chain(head);
+  json_t *jmsg=NULL;
+  TR_MSG *decoded=NULL;
+
+  assert(encoded!=NULL);
+
+  /* a single update is sent as a bare object for compatibility with older peers */
+  jmsg=json_loads(encoded, 0, NULL);
+  assert(jmsg!=NULL);
+  if (n==1)
+    assert(json_is_object(get_body(jmsg)));
+  else {
+    assert(json_is_array(get_body(jmsg)));
+    assert(json_array_size(get_body(jmsg))==n);
+  }
+  json_decref(jmsg);
+
+  decoded=tr_msg_decode(NULL, encoded, strlen(encoded));
+  assert(decoded!=NULL);
+  assert(tr_msg_get_msg_type(decoded)==TRP_UPDATE);
+  check_chain(tr_msg_get_trp_upd(decoded), (1u<<n)-1);
+
+  tr_msg_free_decoded(decoded);
+  tr_msg_free_encoded(encoded);
+  talloc_free(tmp_ctx);
+}
+
+/* Corrupt the elements of a packed message whose bit is set in bad_mask, then decode it. */
+static TR_MSG *decode_with_bad_elements(unsigned int bad_mask)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  char *encoded=encode_chain(make_chain(tmp_ctx, n_upds));
+  json_t *jmsg=NULL;
+  char *corrupted=NULL;
+  TR_MSG *decoded=NULL;
+  size_t ii=0;
+
+  assert(encoded!=NULL);
+  jmsg=json_loads(encoded, 0, NULL);
+  assert(jmsg!=NULL);
+  for (ii=0; ii<n_upds; ii++) {
+    if (bad_mask & (1<<ii))
+      assert(0==json_object_set_new(json_array_get(get_body(jmsg), ii), "community", json_integer(5)));
+  }
+  corrupted=json_dumps(jmsg, 0);
+  assert(corrupted!=NULL);
+
+  decoded=tr_msg_decode(NULL, corrupted, strlen(corrupted));
+
+  free(corrupted);
+  json_decref(jmsg);
+  tr_msg_free_encoded(encoded);
+  talloc_free(tmp_ctx);
+  return decoded;
+}
+
+static void test_skip_bad_elements(void)
+{
+  TR_MSG *decoded=NULL;
+
+  /* one bad update in the middle does not take the others with it */
+  decoded=decode_with_bad_elements(0x2);
+  assert(decoded!=NULL);
+  check_chain(tr_msg_get_trp_upd(decoded), 0x5);
+  tr_msg_free_decoded(decoded);
+
+  /* nor at either end */
+  decoded=decode_with_bad_elements(0x5);
+  assert(decoded!=NULL);
+  check_chain(tr_msg_get_trp_upd(decoded), 0x2);
+  tr_msg_free_decoded(decoded);
+
+  /* but if nothing could be decoded there is no update at all */
+  decoded=decode_with_bad_elements(0x7);
+  assert((decoded==NULL) || (tr_msg_get_trp_upd(decoded)==NULL));
+  if (decoded!=NULL)
+    tr_msg_free_decoded(decoded);
+}
+
+int main(void)
+{
+  size_t n=0;
+
+  for (n=1; n<=n_upds; n++)
+    test_round_trip(n);
+  test_skip_bad_elements();
+
+  printf("Success.\n");
+  return 0;
+}
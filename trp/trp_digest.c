@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <talloc.h>
+
+#include <tr_name_internal.h>
+#include <trp_internal.h>
+#include <tr_debug.h>
+
+/*
+ * A digest summarizes the routes and community memberships advertised over one
+ * peer link. Entries are partitioned into buckets by a hash of their community
+ * and realm, and each bucket holds the sum of the hashes of its entries, so it
+ * does not depend on the order entries were added. Two routers that compare
+ * digests need only exchange the buckets that differ. The root hash combines
+ * all the buckets and allows a quick check that nothing differs at all.
+ */
+
+#define TRP_DIGEST_FNV_OFFSET 14695981039346656037ULL
+#define TRP_DIGEST_FNV_PRIME 1099511628211ULL
+
+/* 64-bit FNV-1a hash, continuing from hash */
+static uint64_t trp_digest_fnv(uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *p=data;
+  size_t ii=0;
+
+  for (ii=0; ii<len; ii++) {
+    hash ^= p[ii];
+    hash *= TRP_DIGEST_FNV_PRIME;
+  }
+  return hash;
+}
+
+TRP_DIGEST *trp_digest_new(TALLOC_CTX *mem_ctx, size_t n_buckets)
+{
+  TRP_DIGEST *new_digest=NULL;
+
+  if ((n_buckets==0) || (n_buckets>TRP_DIGEST_MAX_BUCKETS))
+    return NULL;
+
+  new_digest=talloc(mem_ctx, TRP_DIGEST);
+  if (new_digest!=NULL) {
+    new_digest->n_buckets=n_buckets;
+    new_digest->buckets=talloc_zero_array(new_digest, uint64_t, n_buckets);
+    if (new_digest->buckets==NULL) {
+      talloc_free(new_digest);
+      return NULL;
+    }
+  }
+  return new_digest;
+}
+
+void trp_digest_free(TRP_DIGEST *digest)
+{
+  if (digest!=NULL)
+    talloc_free(digest);
+}
+
+size_t trp_digest_get_n_buckets(TRP_DIGEST *digest)
+{
+  if (digest!=NULL)
+    return digest->n_buckets;
+  else
+    return 0;
+}
+
+uint64_t trp_digest_get_bucket(TRP_DIGEST *digest, size_t index)
+{
+  if ((digest==NULL) || (index>=digest->n_buckets))
+    return 0;
+  return digest->buckets[index];
+}
+
+void trp_digest_set_bucket(TRP_DIGEST *digest, size_t index, uint64_t value)
+{
+  if ((digest!=NULL) && (index<digest->n_buckets))
+    digest->buckets[index]=value;
+}
+
+/* which bucket holds entries for this community and realm? */
+size_t trp_digest_bucket_index(TRP_DIGEST *digest, TR_NAME *comm, TR_NAME *realm)
+{
+  uint64_t hash=TRP_DIGEST_FNV_OFFSET;
+  const char sep='\0';
+
+  hash=trp_digest_fnv(hash, comm->buf, comm->len);
+  hash=trp_digest_fnv(hash, &sep, 1);
+  hash=trp_digest_fnv(hash, realm->buf, realm->len);
+  return (size_t) (hash % digest->n_buckets);
+}
+
+/**
+ * Add an entry to a digest
+ *
+ * @param digest Digest to add to
+ * @param comm Community of the entry, selects the bucket
+ * @param realm Realm of the entry, selects the bucket
+ * @param key String identifying the entry
+ * @param summary String summarizing the content of the entry
+ */
+void trp_digest_add(TRP_DIGEST *digest, TR_NAME *comm, TR_NAME *realm, const char *key, const char *summary)
+{
+  uint64_t hash=TRP_DIGEST_FNV_OFFSET;
+
+  hash=trp_digest_fnv(hash, key, strlen(key)+1); /* include the null so key and summary cannot run together */
+  hash=trp_digest_fnv(hash, summary, strlen(summary));
+  digest->buckets[trp_digest_bucket_index(digest, comm, realm)] += hash;
+}
+
+/* hash of all the buckets */
+uint64_t trp_digest_root(TRP_DIGEST *digest)
+{
+  uint64_t hash=TRP_DIGEST_FNV_OFFSET;
+  size_t ii=0;
+
+  for (ii=0; ii<digest->n_buckets; ii++)
+    hash=trp_digest_fnv(hash, &(digest->buckets[ii]), sizeof(uint64_t));
+  return hash;
+}
+
+/* do two digests agree on everything? Digests with different numbers of buckets never agree. */
+int trp_digest_equal(TRP_DIGEST *d1, TRP_DIGEST *d2)
+{
+  return (d1->n_buckets==d2->n_buckets) && (trp_digest_root(d1)==trp_digest_root(d2));
+}
+
+/* do two digests agree on one bucket? Digests with different numbers of buckets never agree. */
+int trp_digest_bucket_matches(TRP_DIGEST *d1, TRP_DIGEST *d2, size_t index)
+{
+  return (d1->n_buckets==d2->n_buckets)
+         && (index<d1->n_buckets)
+         && (d1->buckets[index]==d2->buckets[index]);
+}
@@ -32,6 +32,7 @@
  *
  */
 
+#include <string.h>
 #include <time.h>
 #include <talloc.h>
 
@@ -40,6 +41,7 @@
 #include <tr_gss_names.h>
 #include <trp_ptable.h>
 #include <tr_debug.h>
+#include <tr_util.h>
 #include <trp_peer.h>
 
 static int trp_peer_destructor(void *object)
@@ -49,8 +51,43 @@ static int trp_peer_destructor(void *object)
     tr_free_name(peer->label);
   if (peer->servicename!=NULL)
     tr_free_name(peer->servicename);
+  if (peer->sent!=NULL)
+    g_hash_table_destroy(peer->sent);
+  if (peer->received!=NULL)
+    g_hash_table_destroy(peer->received);
   return 0;
 }
+
+/* record of one entry we advertised to a peer */
+typedef struct trp_peer_sent_entry {
+  gchar *summary;
+  unsigned int generation;
+} TRP_PEER_SENT_ENTRY;
+
+static void trp_peer_sent_entry_destroy(gpointer data)
+{
+  TRP_PEER_SENT_ENTRY *entry=(TRP_PEER_SENT_ENTRY *)data;
+  g_free(entry->summary);
+  g_free(entry);
+}
+
+/* record of one entry a peer advertised to us */
+typedef struct trp_peer_rcvd_entry {
+  TR_NAME *comm;
+  TR_NAME *realm;
+  gchar *summary;
+  unsigned int interval;
+  struct timespec expiry;
+} TRP_PEER_RCVD_ENTRY;
+
+static void trp_peer_rcvd_entry_destroy(gpointer data)
+{
+  TRP_PEER_RCVD_ENTRY *entry=(TRP_PEER_RCVD_ENTRY *)data;
+  tr_free_name(entry->comm);
+  tr_free_name(entry->realm);
+  g_free(entry->summary);
+  g_free(entry);
+}
 TRP_PEER *trp_peer_new(TALLOC_CTX *memctx)
 {
   TRP_PEER *peer=talloc(memctx, TRP_PEER);
@@ -68,7 +105,15 @@ TRP_PEER *trp_peer_new(TALLOC_CTX *memctx)
     peer->conn_status_cb=NULL;
     peer->conn_status_cookie=NULL;
     peer->filters=NULL;
+    peer->sent=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, trp_peer_sent_entry_destroy);
+    peer->sent_generation=0;
+    peer->received=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, trp_peer_rcvd_entry_destroy);
+    peer->update_deferred=0;
     talloc_set_destructor((void *)peer, trp_peer_destructor);
+    if ((peer->sent==NULL) || (peer->received==NULL)) {
+      talloc_free(peer);
+      return NULL;
+    }
   }
   return peer;
 }
@@ -208,6 +253,44 @@ void trp_peer_set_conn_status_cb(TRP_PEER *peer, void (*cb)(TRP_PEER *, void *),
   peer->conn_status_cookie=cookie;
 }
 
+/* Is new the same peer as old, i.e., reached at the same place under the same service name? */
+int trp_peer_same(TRP_PEER *peer, TRP_PEER *old)
+{
+  if ((peer==NULL) || (old==NULL))
+    return 0;
+  if ((peer->servicename==NULL) || (old->servicename==NULL)
+      || (0!=tr_name_cmp(peer->servicename, old->servicename)))
+    return 0;
+  if ((peer->server==NULL) || (old->server==NULL) || (0!=strcmp(peer->server, old->server)))
+    return 0;
+  return (peer->port==old->port);
+}
+
+/**
+ * Take over the connection and advertisement state of a peer that a new configuration
+ * replaces with an equivalent one. Old is left with empty state.
+ *
+ * @param peer Peer from the new configuration
+ * @param old Peer it replaces
+ */
+void trp_peer_take_state(TRP_PEER *peer, TRP_PEER *old)
+{
+  GHashTable *tmp=NULL;
+
+  peer->last_conn_attempt=old->last_conn_attempt;
+  peer->outgoing_status=old->outgoing_status;
+  peer->incoming_status=old->incoming_status;
+
+  tmp=peer->sent;
+  peer->sent=old->sent;
+  old->sent=tmp;
+  peer->sent_generation=old->sent_generation;
+
+  tmp=peer->received;
+  peer->received=old->received;
+  old->received=tmp;
+}
+
 /**
  * Set the filter associated with this peer. Any existing filter will be freed. Takes responsibility for
  * freeing the new filter.
@@ -243,6 +326,8 @@ void trp_peer_set_outgoing_status(TRP_PEER *peer, TRP_PEER_CONN_STATUS status)
 {
   TR_NAME *peer_label=trp_peer_get_label(peer);
   int was_connected=trp_peer_is_connected(peer);
+  if (status!=peer->outgoing_status)
+    trp_peer_sent_clear(peer); /* anything queued may have been lost, start over with a full update */
   peer->outgoing_status=status;
   tr_debug("trp_peer_set_outgoing_status: %s: status=%d peer connected was %d now %d.",
            peer_label->buf, status, was_connected, trp_peer_is_connected(peer));
@@ -259,6 +344,8 @@ void trp_peer_set_incoming_status(TRP_PEER *peer, TRP_PEER_CONN_STATUS status)
 {
   TR_NAME *peer_label=trp_peer_get_label(peer);
   int was_connected=trp_peer_is_connected(peer);
+  if (status!=peer->incoming_status)
+    trp_peer_sent_clear(peer); /* peer may have restarted, start over with a full update */
   peer->incoming_status=status;
   tr_debug("trp_peer_set_incoming_status: %s: status=%d peer connected was %d now %d.",
            peer_label->buf, status, was_connected, trp_peer_is_connected(peer));
@@ -275,3 +362,191 @@ int trp_peer_is_connected(TRP_PEER *peer)
 {
   return (peer->outgoing_status==PEER_CONNECTED) && (peer->incoming_status==PEER_CONNECTED);
 }
+
+void trp_peer_set_update_deferred(TRP_PEER *peer, int deferred)
+{
+  peer->update_deferred=deferred;
+}
+
+/* nonzero if an update to this peer was skipped and it still needs a scheduled update */
+int trp_peer_get_update_deferred(TRP_PEER *peer)
+{
+  return peer->update_deferred;
+}
+
+/**
+ * Check whether an entry is unchanged since we last advertised it to this peer
+ *
+ * Does not modify the sent state. Once the entry has actually been queued for the
+ * peer, record it with trp_peer_sent_record().
+ *
+ * @param peer Peer the entry is advertised to
+ * @param key Identifies the entry (e.g., record type, community, and realm)
+ * @param summary Summary of the advertised content, compared as a string
+ * @return 1 if the entry was previously advertised with the same summary, otherwise 0
+ */
+int trp_peer_sent_matches(TRP_PEER *peer, const char *key, const char *summary)
+{
+  TRP_PEER_SENT_ENTRY *entry=g_hash_table_lookup(peer->sent, key);
+
+  return (entry!=NULL) && (0==strcmp(entry->summary, summary));
+}
+
+/**
+ * Record that an entry has been advertised to this peer
+ *
+ * The entry is marked as current so it survives the next call to trp_peer_sent_sweep().
+ *
+ * @param peer Peer the entry was advertised to
+ * @param key Identifies the entry, as for trp_peer_sent_matches()
+ * @param summary Summary of the advertised content
+ */
+void trp_peer_sent_record(TRP_PEER *peer, const char *key, const char *summary)
+{
+  TRP_PEER_SENT_ENTRY *entry=g_hash_table_lookup(peer->sent, key);
+
+  if (entry==NULL) {
+    entry=g_malloc(sizeof(TRP_PEER_SENT_ENTRY));
+    entry->summary=g_strdup(summary);
+    g_hash_table_insert(peer->sent, g_strdup(key), entry);
+  } else if (0!=strcmp(entry->summary, summary)) {
+    g_free(entry->summary);
+    entry->summary=g_strdup(summary);
+  }
+  entry->generation=peer->sent_generation;
+}
+
+static gboolean trp_peer_sent_is_stale(gpointer key, gpointer value, gpointer user_data)
+{
+  TRP_PEER_SENT_ENTRY *entry=(TRP_PEER_SENT_ENTRY *)value;
+  unsigned int *generation=(unsigned int *)user_data;
+  return entry->generation!=*generation;
+}
+
+/**
+ * Forget entries that were not recorded since the previous sweep
+ *
+ * Call after a complete pass over everything advertised to the peer. Entries we
+ * no longer advertise are dropped, so they will be sent in full if they return.
+ *
+ * @param peer Peer to sweep
+ */
+void trp_peer_sent_sweep(TRP_PEER *peer)
+{
+  g_hash_table_foreach_remove(peer->sent, trp_peer_sent_is_stale, &(peer->sent_generation));
+  peer->sent_generation++;
+}
+
+/* forget everything we advertised to this peer, the next update will be a full update */
+void trp_peer_sent_clear(TRP_PEER *peer)
+{
+  g_hash_table_remove_all(peer->sent);
+}
+
+guint trp_peer_sent_size(TRP_PEER *peer)
+{
+  return g_hash_table_size(peer->sent);
+}
+
+/**
+ * Record an entry this peer advertised to us
+ *
+ * Unlike the sent state, this survives loss of the connection. It lets us tell
+ * the peer what we still have from it when we reconnect.
+ *
+ * @param peer Peer that sent the entry
+ * @param key Identifies the entry, as for trp_peer_sent_matches()
+ * @param comm Community of the entry, not stolen
+ * @param realm Realm of the entry, not stolen
+ * @param summary Summary of the advertised content
+ * @param interval Advertised update interval
+ * @param expiry When the entry expires unless it is advertised again
+ */
+void trp_peer_received_set(TRP_PEER *peer,
+                           const char *key,
+                           TR_NAME *comm,
+                           TR_NAME *realm,
+                           const char *summary,
+                           unsigned int interval,
+                           struct timespec *expiry)
+{
+  TRP_PEER_RCVD_ENTRY *entry=g_malloc(sizeof(TRP_PEER_RCVD_ENTRY));
+
+  entry->comm=tr_dup_name(comm);
+  entry->realm=tr_dup_name(realm);
+  entry->summary=g_strdup(summary);
+  entry->interval=interval;
+  entry->expiry=*expiry;
+  g_hash_table_replace(peer->received, g_strdup(key), entry);
+}
+
+/* returns 0 if the entry is unknown */
+unsigned int trp_peer_received_get_interval(TRP_PEER *peer, const char *key)
+{
+  TRP_PEER_RCVD_ENTRY *entry=g_hash_table_lookup(peer->received, key);
+
+  if (entry==NULL)
+    return 0;
+  return entry->interval;
+}
+
+/* extend the life of an entry, does nothing if the entry is unknown */
+void trp_peer_received_set_expiry(TRP_PEER *peer, const char *key, struct timespec *expiry)
+{
+  TRP_PEER_RCVD_ENTRY *entry=g_hash_table_lookup(peer->received, key);
+
+  if (entry!=NULL)
+    entry->expiry=*expiry;
+}
+
+static gboolean trp_peer_received_is_expired(gpointer key, gpointer value, gpointer user_data)
+{
+  TRP_PEER_RCVD_ENTRY *entry=(TRP_PEER_RCVD_ENTRY *)value;
+  struct timespec *now=(struct timespec *)user_data;
+  return tr_cmp_timespec(&(entry->expiry), now) <= 0;
+}
+
+/* forget entries that have expired */
+void trp_peer_received_sweep(TRP_PEER *peer, struct timespec *now)
+{
+  g_hash_table_foreach_remove(peer->received, trp_peer_received_is_expired, now);
+}
+
+guint trp_peer_received_size(TRP_PEER *peer)
+{
+  return g_hash_table_size(peer->received);
+}
+
+/**
+ * Summarize what this peer has advertised to us
+ *
+ * Expired entries are forgotten first.
+ *
+ * @param mem_ctx Talloc context for the result
+ * @param peer Peer whose entries to summarize
+ * @param now Current time, using TRP_CLOCK
+ * @return Digest of the unexpired entries, or NULL if there are none or on error
+ */
+TRP_DIGEST *trp_peer_received_digest(TALLOC_CTX *mem_ctx, TRP_PEER *peer, struct timespec *now)
+{
+  TRP_DIGEST *digest=NULL;
+  TRP_PEER_RCVD_ENTRY *entry=NULL;
+  GHashTableIter iter;
+  gpointer key=NULL;
+  gpointer value=NULL;
+
+  trp_peer_received_sweep(peer, now);
+  if (g_hash_table_size(peer->received)==0)
+    return NULL;
+
+  digest=trp_digest_new(mem_ctx, TRP_DIGEST_N_BUCKETS);
+  if (digest==NULL)
+    return NULL;
+
+  g_hash_table_iter_init(&iter, peer->received);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    entry=(TRP_PEER_RCVD_ENTRY *)value;
+    trp_digest_add(digest, entry->comm, entry->realm, (const char *)key, entry->summary);
+  }
+  return digest;
+}
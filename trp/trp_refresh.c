@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <jansson.h>
+#include <talloc.h>
+
+#include <tr_name_internal.h>
+#include <trp_internal.h>
+#include <tr_debug.h>
+
+/*
+ * A refresh marker tells a peer that the routes and community memberships it
+ * lists are unchanged since we last advertised them. The receiver extends their
+ * expiry as if it had received a full update. Entries that are not listed are
+ * not refreshed and expire as usual.
+ */
+
+static int trp_refresh_item_destructor(void *object)
+{
+  TRP_REFRESH_ITEM *item=talloc_get_type_abort(object, TRP_REFRESH_ITEM);
+
+  /* clean up TR_NAME data, which are not managed by talloc */
+  if (item->comm!=NULL)
+    tr_free_name(item->comm);
+  if (item->realm!=NULL)
+    tr_free_name(item->realm);
+  return 0;
+}
+
+static int trp_refresh_marker_destructor(void *object)
+{
+  TRP_REFRESH_MARKER *marker=talloc_get_type_abort(object, TRP_REFRESH_MARKER);
+
+  if (marker->peer!=NULL)
+    tr_free_name(marker->peer);
+  return 0;
+}
+
+TRP_REFRESH_MARKER *trp_refresh_marker_new(TALLOC_CTX *mem_ctx)
+{
+  TRP_REFRESH_MARKER *new_marker=talloc(mem_ctx, TRP_REFRESH_MARKER);
+
+  if (new_marker!=NULL) {
+    new_marker->peer=NULL;
+    new_marker->items=NULL;
+    new_marker->tail=NULL;
+    new_marker->n_items=0;
+    talloc_set_destructor((void *)new_marker, trp_refresh_marker_destructor);
+  }
+  return new_marker;
+}
+
+void trp_refresh_marker_free(TRP_REFRESH_MARKER *marker)
+{
+  if (marker!=NULL)
+    talloc_free(marker);
+}
+
+TR_NAME *trp_refresh_marker_get_peer(TRP_REFRESH_MARKER *marker)
+{
+  if (marker!=NULL)
+    return marker->peer;
+  else
+    return NULL;
+}
+
+void trp_refresh_marker_set_peer(TRP_REFRESH_MARKER *marker, TR_NAME *peer)
+{
+  if (marker!=NULL) {
+    if (marker->peer!=NULL)
+      tr_free_name(marker->peer);
+    marker->peer=peer;
+  }
+}
+
+/**
+ * Add an entry to a refresh marker
+ *
+ * @param marker Marker to add to
+ * @param type Route or community membership
+ * @param comm Community name, marker takes ownership
+ * @param realm Realm name, marker takes ownership
+ * @return TRP_SUCCESS on success, TRP_NOMEM if allocation failed. On failure, comm and realm are freed.
+ */
+TRP_RC trp_refresh_marker_add(TRP_REFRESH_MARKER *marker, TRP_INFOREC_TYPE type, TR_NAME *comm, TR_NAME *realm)
+{
+  TRP_REFRESH_ITEM *item=NULL;
+
+  if ((marker==NULL) || (comm==NULL) || (realm==NULL)) {
+    if (comm!=NULL)
+      tr_free_name(comm);
+    if (realm!=NULL)
+      tr_free_name(realm);
+    return (marker==NULL)?TRP_BADARG:TRP_NOMEM;
+  }
+
+  item=talloc(marker, TRP_REFRESH_ITEM);
+  if (item==NULL) {
+    tr_free_name(comm);
+    tr_free_name(realm);
+    return TRP_NOMEM;
+  }
+  item->next=NULL;
+  item->type=type;
+  item->comm=comm;
+  item->realm=realm;
+  talloc_set_destructor((void *)item, trp_refresh_item_destructor);
+
+  /* keep items in the order they were added */
+  if (marker->tail==NULL)
+    marker->items=item;
+  else
+    marker->tail->next=item;
+  marker->tail=item;
+  marker->n_items++;
+  return TRP_SUCCESS;
+}
+
+size_t trp_refresh_marker_num_items(TRP_REFRESH_MARKER *marker)
+{
+  if (marker!=NULL)
+    return marker->n_items;
+  else
+    return 0;
+}
+
+TRP_REFRESH_ITEM *trp_refresh_marker_get_items(TRP_REFRESH_MARKER *marker)
+{
+  if (marker!=NULL)
+    return marker->items;
+  else
+    return NULL;
+}
+
+TRP_REFRESH_ITEM *trp_refresh_item_get_next(TRP_REFRESH_ITEM *item)
+{
+  if (item!=NULL)
+    return item->next;
+  else
+    return NULL;
+}
+
+TRP_INFOREC_TYPE trp_refresh_item_get_type(TRP_REFRESH_ITEM *item)
+{
+  if (item!=NULL)
+    return item->type;
+  else
+    return TRP_INFOREC_TYPE_UNKNOWN;
+}
+
+TR_NAME *trp_refresh_item_get_comm(TRP_REFRESH_ITEM *item)
+{
+  if (item!=NULL)
+    return item->comm;
+  else
+    return NULL;
+}
+
+TR_NAME *trp_refresh_item_get_realm(TRP_REFRESH_ITEM *item)
+{
+  if (item!=NULL)
+    return item->realm;
+  else
+    return NULL;
+}
@@ -64,6 +64,7 @@ TRP_REQ *trp_req_new(TALLOC_CTX *mem_ctx)
     new_req->comm=NULL;
     new_req->realm=NULL;
     new_req->peer=NULL;
+    new_req->digest=NULL;
   }
 
   talloc_set_destructor((void *)new_req, trp_req_destructor);
@@ -120,6 +121,26 @@ void trp_req_set_peer(TRP_REQ *req, TR_NAME *peer)
     req->peer=peer;
 }
 
+TRP_DIGEST *trp_req_get_digest(TRP_REQ *req)
+{
+  if (req!=NULL)
+    return req->digest;
+  else
+    return NULL;
+}
+
+/* the request takes ownership of the digest */
+void trp_req_set_digest(TRP_REQ *req, TRP_DIGEST *digest)
+{
+  if (req) {
+    if (req->digest!=NULL)
+      talloc_free(req->digest);
+    req->digest=digest;
+    if (digest!=NULL)
+      talloc_steal(req, digest);
+  }
+}
+
 /* Defines what we use as a wildcard for realm or community name.
  * Must not be a valid name for either of those. Currently, we
  * use the empty string. */
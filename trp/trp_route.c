@@ -87,6 +87,7 @@ TRP_ROUTE *trp_route_new(TALLOC_CTX *mem_ctx)
     *(entry->expiry)=(struct timespec){0,0};
     entry->local=0;
     entry->triggered=0;
+    entry->provisional=0;
     talloc_set_destructor((void *)entry, trp_route_destructor);
   }
   return entry;
@@ -262,6 +263,16 @@ int trp_route_is_triggered(TRP_ROUTE *entry)
   return entry->triggered;
 }
 
+void trp_route_set_provisional(TRP_ROUTE *entry, int provisional)
+{
+  entry->provisional=provisional;
+}
+
+int trp_route_is_provisional(TRP_ROUTE *entry)
+{
+  return entry->provisional;
+}
+
 void trp_route_set_trust_router_port(TRP_ROUTE *entry, int port)
 {
   if (entry)
@@ -141,6 +141,8 @@ void trp_rtable_remove(TRP_RTABLE *rtbl, TRP_ROUTE *entry)
 {
   GHashTable *comm_tbl=NULL;
   GHashTable *realm_tbl=NULL;
+  TR_NAME *comm=NULL;
+  TR_NAME *realm=NULL;
 
   comm_tbl=g_hash_table_lookup(rtbl, entry->comm);
   if (comm_tbl==NULL)
@@ -150,14 +152,21 @@ void trp_rtable_remove(TRP_RTABLE *rtbl, TRP_ROUTE *entry)
   if (realm_tbl==NULL)
     return;
 
+  /* removing the element frees it, so keep copies of the names we still need */
+  comm=tr_dup_name(entry->comm);
+  realm=tr_dup_name(entry->realm);
+
   /* remove the element */
   g_hash_table_remove(realm_tbl, entry->peer);
   /* if that was the last entry in the realm, remove the realm table */
   if (g_hash_table_size(realm_tbl)==0)
-    g_hash_table_remove(comm_tbl, entry->realm);
+    g_hash_table_remove(comm_tbl, realm);
   /* if that was the last realm in the comm, remove the comm table */
   if (g_hash_table_size(comm_tbl)==0)
-    g_hash_table_remove(rtbl, entry->comm);
+    g_hash_table_remove(rtbl, comm);
+
+  tr_free_name(comm);
+  tr_free_name(realm);
 }
 
 void trp_rtable_clear(TRP_RTABLE *rtbl)
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <talloc.h>
+#include <glib.h>
+
+#include <tr_name_internal.h>
+#include <trust_router/trp.h>
+#include <trp_route.h>
+#include <trp_rview.h>
+#include <tr_debug.h>
+
+static int trp_rview_destructor(void *obj)
+{
+  TRP_RVIEW *view=talloc_get_type_abort(obj, TRP_RVIEW);
+  size_t ii=0;
+
+  for (ii=0; ii<view->n_entries; ii++) {
+    if (view->entries[ii].comm!=NULL)
+      tr_free_name(view->entries[ii].comm);
+    if (view->entries[ii].realm!=NULL)
+      tr_free_name(view->entries[ii].realm);
+    if (view->entries[ii].next_hop!=NULL)
+      tr_free_name(view->entries[ii].next_hop);
+  }
+  return 0;
+}
+
+/* order entries by community, then realm */
+static int trp_rview_entry_cmp(const void *a, const void *b)
+{
+  const TRP_RVIEW_ENTRY *e1=(const TRP_RVIEW_ENTRY *)a;
+  const TRP_RVIEW_ENTRY *e2=(const TRP_RVIEW_ENTRY *)b;
+  int cmp=tr_name_cmp(e1->comm, e2->comm);
+
+  if (cmp==0)
+    cmp=tr_name_cmp(e1->realm, e2->realm);
+  return cmp;
+}
+
+/**
+ * Build a view of the selected routes
+ *
+ * Only routes flagged as selected are included. There is at most one of these for
+ * each community/realm pair.
+ *
+ * @param mem_ctx Talloc context for the new view
+ * @param routes Routes to consider, normally every entry in the route table
+ * @param n_routes Number of entries in routes
+ * @param generation Generation number to record in the view
+ * @return The new view, or null on allocation failure
+ */
+TRP_RVIEW *trp_rview_new(TALLOC_CTX *mem_ctx, TRP_ROUTE **routes, size_t n_routes, unsigned int generation)
+{
+  TRP_RVIEW *view=talloc(mem_ctx, TRP_RVIEW);
+  TRP_RVIEW_ENTRY *entry=NULL;
+  size_t ii=0;
+
+  if (view==NULL)
+    return NULL;
+
+  view->generation=generation;
+  view->n_entries=0;
+  view->refcount=1; /* the creator's reference */
+  view->entries=talloc_array(view, TRP_RVIEW_ENTRY, (n_routes>0)?n_routes:1);
+  if (view->entries==NULL) {
+    talloc_free(view);
+    return NULL;
+  }
+  talloc_set_destructor((void *)view, trp_rview_destructor);
+
+  for (ii=0; ii<n_routes; ii++) {
+    /* a retracted route stays selected until its withdrawal is sent, but is not usable */
+    if ((!trp_route_is_selected(routes[ii])) || (!trp_metric_is_finite(trp_route_get_metric(routes[ii]))))
+      continue;
+
+    /* count the entry first so the destructor frees whatever was copied */
+    entry=&(view->entries[view->n_entries++]);
+    entry->comm=trp_route_dup_comm(routes[ii]);
+    entry->realm=trp_route_dup_realm(routes[ii]);
+    entry->next_hop=trp_route_dup_next_hop(routes[ii]);
+    entry->next_hop_port=trp_route_get_next_hop_port(routes[ii]);
+    entry->metric=trp_route_get_metric(routes[ii]);
+    entry->local=trp_route_is_local(routes[ii]);
+    if ((entry->comm==NULL) || (entry->realm==NULL)
+        || ((entry->next_hop==NULL) && (trp_route_get_next_hop(routes[ii])!=NULL))) {
+      tr_debug("trp_rview_new: unable to copy route.");
+      talloc_free(view);
+      return NULL;
+    }
+  }
+
+  qsort(view->entries, view->n_entries, sizeof(TRP_RVIEW_ENTRY), trp_rview_entry_cmp);
+  return view;
+}
+
+void trp_rview_free(TRP_RVIEW *view)
+{
+  if (view!=NULL)
+    talloc_free(view);
+}
+
+/**
+ * Drop a reference to a view
+ *
+ * The view is freed when its last reference is released. This may happen
+ * in any thread.
+ *
+ * @param view View obtained from trps_acquire_rview(), may be null
+ */
+void trp_rview_release(TRP_RVIEW *view)
+{
+  if ((view!=NULL) && g_atomic_int_dec_and_test(&(view->refcount)))
+    trp_rview_free(view);
+}
+
+unsigned int trp_rview_get_generation(TRP_RVIEW *view)
+{
+  return view->generation;
+}
+
+size_t trp_rview_size(TRP_RVIEW *view)
+{
+  return view->n_entries;
+}
+
+/**
+ * Find the selected route for a community/realm pair
+ *
+ * The view is not modified, so this is safe to call from any thread.
+ *
+ * @param view View to search, may be null
+ * @param comm Community
+ * @param realm Realm
+ * @return The entry, or null if there is no selected route
+ */
+TRP_RVIEW_ENTRY *trp_rview_lookup(TRP_RVIEW *view, TR_NAME *comm, TR_NAME *realm)
+{
+  TRP_RVIEW_ENTRY key={0};
+
+  if ((view==NULL) || (view->n_entries==0))
+    return NULL;
+
+  key.comm=comm;
+  key.realm=realm;
+  return bsearch(&key, view->entries, view->n_entries, sizeof(TRP_RVIEW_ENTRY), trp_rview_entry_cmp);
+}
+
+TR_NAME *trp_rview_entry_get_comm(TRP_RVIEW_ENTRY *entry)
+{
+  return entry->comm;
+}
+
+TR_NAME *trp_rview_entry_get_realm(TRP_RVIEW_ENTRY *entry)
+{
+  return entry->realm;
+}
+
+TR_NAME *trp_rview_entry_get_next_hop(TRP_RVIEW_ENTRY *entry)
+{
+  return entry->next_hop;
+}
+
+TR_NAME *trp_rview_entry_dup_next_hop(TRP_RVIEW_ENTRY *entry)
+{
+  return tr_dup_name(entry->next_hop);
+}
+
+int trp_rview_entry_get_next_hop_port(TRP_RVIEW_ENTRY *entry)
+{
+  return entry->next_hop_port;
+}
+
+unsigned int trp_rview_entry_get_metric(TRP_RVIEW_ENTRY *entry)
+{
+  return entry->metric;
+}
+
+int trp_rview_entry_is_local(TRP_RVIEW_ENTRY *entry)
+{
+  return entry->local;
+}
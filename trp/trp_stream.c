@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <talloc.h>
+
+#include <gsscon.h>
+#include <trp_internal.h>
+#include <tr_debug.h>
+
+/*
+ * A TRP_STREAM carries GSS-wrapped messages over an established connection
+ * without blocking. The framing is the same as gsscon_read_encrypted_token()
+ * and gsscon_write_encrypted_token(): a 4-byte length in network byte order
+ * followed by the wrapped token. Partial reads and writes are kept in the
+ * stream until the socket is ready again, so the caller can service many
+ * connections from a single event loop.
+ */
+
+static int trp_stream_destructor(void *object)
+{
+  TRP_STREAM *stream=talloc_get_type_abort(object, TRP_STREAM);
+  if (stream->rx_token!=NULL)
+    free(stream->rx_token);
+  return 0;
+}
+
+/**
+ * Create a stream for an established connection
+ *
+ * Puts the socket into nonblocking mode. The GSS context must remain valid for
+ * the life of the stream.
+ *
+ * @param mem_ctx talloc context for the stream
+ * @param fd connected socket
+ * @param gssctx established GSS context for the connection
+ * @return the new stream, or NULL on error
+ */
+TRP_STREAM *trp_stream_new(TALLOC_CTX *mem_ctx, int fd, gss_ctx_id_t *gssctx)
+{
+  TRP_STREAM *stream=NULL;
+  int flags=0;
+
+  flags=fcntl(fd, F_GETFL);
+  if ((flags==-1) || (fcntl(fd, F_SETFL, flags|O_NONBLOCK)==-1)) {
+    tr_err("trp_stream_new: unable to make socket nonblocking.");
+    return NULL;
+  }
+
+  stream=talloc(mem_ctx, TRP_STREAM);
+  if (stream!=NULL) {
+    stream->fd=fd;
+    stream->gssctx=gssctx;
+    stream->rx_hdr_len=0;
+    stream->rx_token=NULL;
+    stream->rx_token_len=0;
+    stream->rx_len=0;
+    stream->tx_buf=NULL;
+    stream->tx_start=0;
+    stream->tx_end=0;
+    stream->tx_alloc=0;
+    talloc_set_destructor((void *)stream, trp_stream_destructor);
+  }
+  return stream;
+}
+
+void trp_stream_free(TRP_STREAM *stream)
+{
+  if (stream!=NULL)
+    talloc_free(stream);
+}
+
+/* Read up to len bytes into buf. Returns the number read, 0 if
+ * the socket has nothing for us now, or -1 on error or end of file. */
+static ssize_t trp_stream_recv(TRP_STREAM *stream, void *buf, size_t len)
+{
+  ssize_t n=0;
+
+  do {
+    n=read(stream->fd, buf, len);
+  } while ((n<0) && (errno==EINTR));
+
+  if (n>0)
+    return n;
+  if (n==0) {
+    tr_debug("trp_stream_recv: connection closed by peer.");
+    return -1;
+  }
+  if ((errno==EAGAIN) || (errno==EWOULDBLOCK))
+    return 0;
+  tr_debug("trp_stream_recv: read error (%s).", strerror(errno));
+  return -1;
+}
+
+/* Unwrap a received token. Returns a malloc'ed buffer on success. */
+static TRP_RC trp_stream_unwrap(TRP_STREAM *stream, char **buf, size_t *buflen)
+{
+  OM_uint32 major=0, minor=0;
+  gss_buffer_desc input={stream->rx_token_len, stream->rx_token};
+  gss_buffer_desc output={0, NULL};
+  int encrypted=0;
+  TRP_RC rc=TRP_ERROR;
+
+  major=gss_unwrap(&minor, *(stream->gssctx), &input, &output, &encrypted, NULL);
+  if (major!=GSS_S_COMPLETE) {
+    gsscon_print_gss_errors("gss_unwrap", major, minor);
+    goto cleanup;
+  }
+  if (!encrypted) {
+    tr_err("trp_stream_unwrap: mechanism not using encryption.");
+    goto cleanup;
+  }
+
+  *buf=malloc(output.length);
+  if (*buf==NULL) {
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+  memcpy(*buf, output.value, output.length);
+  *buflen=output.length;
+  rc=TRP_SUCCESS;
+
+cleanup:
+  if (output.value!=NULL)
+    gss_release_buffer(&minor, &output);
+  return rc;
+}
+
+/**
+ * Read the next message from the stream, if one is complete
+ *
+ * Reads what is available without blocking. If that completes a message, it is
+ * unwrapped and returned in *buf, which the caller must free(). If more data is
+ * needed, returns TRP_SUCCESS with *buf set to NULL. Call again until that
+ * happens, because a single read event may deliver several messages.
+ *
+ * @param stream stream to read
+ * @param buf (output) the unwrapped message, or NULL if none is complete
+ * @param buflen (output) length of the message
+ * @return TRP_SUCCESS, or an error if the connection failed or closed
+ */
+TRP_RC trp_stream_read(TRP_STREAM *stream, char **buf, size_t *buflen)
+{
+  ssize_t n=0;
+  uint32_t token_len=0;
+  TRP_RC rc=TRP_ERROR;
+
+  *buf=NULL;
+  *buflen=0;
+
+  /* length header */
+  while (stream->rx_hdr_len<sizeof(stream->rx_hdr)) {
+    n=trp_stream_recv(stream,
+                      stream->rx_hdr+stream->rx_hdr_len,
+                      sizeof(stream->rx_hdr)-stream->rx_hdr_len);
+    if (n<=0)
+      return (n==0)?TRP_SUCCESS:TRP_ERROR;
+    stream->rx_hdr_len+=n;
+  }
+
+  if (stream->rx_token==NULL) {
+    memcpy(&token_len, stream->rx_hdr, sizeof(token_len));
+    token_len=ntohl(token_len);
+    if ((token_len==0) || (token_len>TRP_STREAM_MAX_TOKEN)) {
+      tr_notice("trp_stream_read: bad token length (%u).", (unsigned int) token_len);
+      return TRP_ERROR;
+    }
+    stream->rx_token=malloc(token_len);
+    if (stream->rx_token==NULL)
+      return TRP_NOMEM;
+    stream->rx_token_len=token_len;
+    stream->rx_len=0;
+  }
+
+  /* token body */
+  while (stream->rx_len<stream->rx_token_len) {
+    n=trp_stream_recv(stream,
+                      stream->rx_token+stream->rx_len,
+                      stream->rx_token_len-stream->rx_len);
+    if (n<=0)
+      return (n==0)?TRP_SUCCESS:TRP_ERROR;
+    stream->rx_len+=n;
+  }
+
+  rc=trp_stream_unwrap(stream, buf, buflen);
+
+  /* ready for the next message */
+  free(stream->rx_token);
+  stream->rx_token=NULL;
+  stream->rx_token_len=0;
+  stream->rx_len=0;
+  stream->rx_hdr_len=0;
+  return rc;
+}
+
+/* make room for len more bytes at the end of the transmit buffer */
+static TRP_RC trp_stream_tx_reserve(TRP_STREAM *stream, size_t len)
+{
+  size_t pending=stream->tx_end-stream->tx_start;
+  size_t new_alloc=0;
+  char *new_buf=NULL;
+
+  /* discard what has already been sent */
+  if (stream->tx_start>0) {
+    memmove(stream->tx_buf, stream->tx_buf+stream->tx_start, pending);
+    stream->tx_start=0;
+    stream->tx_end=pending;
+  }
+
+  if (pending+len<=stream->tx_alloc)
+    return TRP_SUCCESS;
+
+  new_alloc=(stream->tx_alloc>0)?stream->tx_alloc:4096;
+  while (new_alloc<pending+len)
+    new_alloc*=2;
+  new_buf=talloc_realloc(stream, stream->tx_buf, char, new_alloc);
+  if (new_buf==NULL)
+    return TRP_NOMEM;
+  stream->tx_buf=new_buf;
+  stream->tx_alloc=new_alloc;
+  return TRP_SUCCESS;
+}
+
+/**
+ * Wrap a message for sending over an established connection
+ *
+ * Requires the mechanism to encrypt the message. On success, the caller must release
+ * the token with gss_release_buffer().
+ *
+ * @param gssctx established GSS context for the connection
+ * @param msg message to wrap
+ * @param msglen length of the message
+ * @param token (output) the wrapped token
+ * @return TRP_SUCCESS or TRP_ERROR
+ */
+TRP_RC trp_stream_wrap(gss_ctx_id_t *gssctx, const char *msg, size_t msglen, gss_buffer_t token)
+{
+  OM_uint32 major=0, minor=0;
+  gss_buffer_desc input={msglen, (void *)msg};
+  int encrypted=0;
+
+  token->length=0;
+  token->value=NULL;
+  major=gss_wrap(&minor, *gssctx, 1, GSS_C_QOP_DEFAULT, &input, &encrypted, token);
+  if (major!=GSS_S_COMPLETE) {
+    gsscon_print_gss_errors("gss_wrap", major, minor);
+    return TRP_ERROR;
+  }
+  if (!encrypted) {
+    tr_err("trp_stream_wrap: mechanism does not support encryption.");
+    gss_release_buffer(&minor, token);
+    return TRP_ERROR;
+  }
+  return TRP_SUCCESS;
+}
+
+/**
+ * Wrap a message and queue it for transmission
+ *
+ * Nothing is written to the socket. Call trp_stream_flush() to do that.
+ *
+ * @param stream stream to send on
+ * @param msg message to send
+ * @param msglen length of the message
+ * @return TRP_SUCCESS or an error code
+ */
+TRP_RC trp_stream_queue(TRP_STREAM *stream, const char *msg, size_t msglen)
+{
+  OM_uint32 minor=0;
+  gss_buffer_desc output={0, NULL};
+  uint32_t token_len=0;
+  TRP_RC rc=TRP_ERROR;
+
+  rc=trp_stream_wrap(stream->gssctx, msg, msglen, &output);
+  if (rc!=TRP_SUCCESS)
+    return rc;
+
+  rc=trp_stream_tx_reserve(stream, sizeof(token_len)+output.length);
+  if (rc==TRP_SUCCESS) {
+    token_len=htonl(output.length);
+    memcpy(stream->tx_buf+stream->tx_end, &token_len, sizeof(token_len));
+    memcpy(stream->tx_buf+stream->tx_end+sizeof(token_len), output.value, output.length);
+    stream->tx_end+=sizeof(token_len)+output.length;
+  }
+
+  gss_release_buffer(&minor, &output);
+  return rc;
+}
+
+/**
+ * Write as much queued data as the socket will take without blocking
+ *
+ * @param stream stream to flush
+ * @return TRP_SUCCESS, even if data remains queued, or TRP_ERROR if the connection failed
+ */
+TRP_RC trp_stream_flush(TRP_STREAM *stream)
+{
+  ssize_t n=0;
+
+  while (stream->tx_start<stream->tx_end) {
+    n=write(stream->fd, stream->tx_buf+stream->tx_start, stream->tx_end-stream->tx_start);
+    if (n<0) {
+      if (errno==EINTR)
+        continue;
+      if ((errno==EAGAIN) || (errno==EWOULDBLOCK))
+        break;
+      tr_debug("trp_stream_flush: write error (%s).", strerror(errno));
+      return TRP_ERROR;
+    }
+    stream->tx_start+=n;
+  }
+
+  if (stream->tx_start==stream->tx_end)
+    stream->tx_start=stream->tx_end=0;
+  return TRP_SUCCESS;
+}
+
+/* number of bytes queued but not yet written */
+size_t trp_stream_pending(TRP_STREAM *stream)
+{
+  return stream->tx_end-stream->tx_start;
+}
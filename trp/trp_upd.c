@@ -140,8 +140,7 @@ static int trp_inforec_comm_destructor(void *obj)
     tr_free_name(rec->owner_realm);
   if (rec->owner_contact!=NULL)
     tr_free_name(rec->owner_contact);
-  if (rec->provenance!=NULL)
-    json_decref(rec->provenance);
+  tr_provenance_unref(rec->provenance);
   return 0;
 }
 
@@ -549,8 +548,8 @@ TRP_RC trp_inforec_set_owner_contact(TRP_INFOREC *rec, TR_NAME *name)
   return TRP_ERROR;
 }
 
-/* caller needs to incref the output if they're going to hang on to it */
-json_t *trp_inforec_get_provenance(TRP_INFOREC *rec)
+/* caller needs to tr_provenance_ref() the output if they're going to hang on to it */
+TR_PROVENANCE *trp_inforec_get_provenance(TRP_INFOREC *rec)
 {
   switch (rec->type) {
   case TRP_INFOREC_TYPE_COMMUNITY:
@@ -564,15 +563,14 @@ json_t *trp_inforec_get_provenance(TRP_INFOREC *rec)
 }
 
 /* increments the reference count */
-TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, json_t *prov)
+TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, TR_PROVENANCE *prov)
 {
   switch (rec->type) {
   case TRP_INFOREC_TYPE_COMMUNITY:
     if (rec->data->comm!=NULL) {
-      if (rec->data->comm->provenance!=NULL)
-        json_decref(rec->data->comm->provenance);
+      tr_provenance_ref(prov);
+      tr_provenance_unref(rec->data->comm->provenance);
       rec->data->comm->provenance=prov;
-      json_incref(prov);
       return TRP_SUCCESS;
     }
     break;
@@ -584,27 +582,14 @@ TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, json_t *prov)
 
 static TRP_RC trp_inforec_add_to_provenance(TRP_INFOREC *rec, TR_NAME *name)
 {
-  json_t *jname=NULL;
-
   switch (rec->type) {
   case TRP_INFOREC_TYPE_ROUTE:
     /* no provenance list */
     break;
   case TRP_INFOREC_TYPE_COMMUNITY:
-    jname=tr_name_to_json_string(name);
-    if (jname==NULL)
-      return TRP_ERROR;
-    if (rec->data->comm->provenance==NULL) {
-      rec->data->comm->provenance=json_array();
-      if (rec->data->comm->provenance==NULL) {
-        json_decref(jname);
-        return TRP_ERROR;
-      }
-    }
-    if (0!=json_array_append_new(rec->data->comm->provenance, jname)) {
-      json_decref(jname);
+    /* copies the list first if it is shared */
+    if (0!=tr_provenance_append(&(rec->data->comm->provenance), name))
       return TRP_ERROR;
-    }
     break;
   default:
     break;
@@ -614,20 +599,13 @@ static TRP_RC trp_inforec_add_to_provenance(TRP_INFOREC *rec, TR_NAME *name)
 
 TR_NAME *trp_inforec_dup_origin(TRP_INFOREC *rec)
 {
-  TR_NAME *origin=NULL;
-  json_t *prov=trp_inforec_get_provenance(rec);
-  const char *s=NULL;
+  TR_NAME *origin=tr_provenance_get_origin(trp_inforec_get_provenance(rec));
 
-  if (prov==NULL)
-    return NULL;
-
-  s=json_string_value(json_array_get(prov, 0));
-  if (s==NULL) {
-    tr_debug("trp_inforec_dup_origin: empty origin in provenance list.");
+  if (origin==NULL) {
+    tr_debug("trp_inforec_dup_origin: no origin in provenance list.");
     return NULL;
   }
-  origin=tr_new_name(s);
-  return origin;
+  return tr_dup_name(origin);
 }
 
 /* generic record type */
@@ -680,11 +658,13 @@ TRP_UPD *trp_upd_new(TALLOC_CTX *mem_ctx)
     new_body->comm=NULL;
     new_body->records=NULL;
     new_body->peer=NULL;
+    new_body->next=NULL;
     talloc_set_destructor((void *)new_body, trp_upd_destructor);
   }
   return new_body;
 }
 
+/* does not free any updates chained to this one with trp_upd_set_next() */
 void trp_upd_free(TRP_UPD *update)
 {
   if (update!=NULL)
@@ -838,6 +818,30 @@ void trp_upd_add_to_provenance(TRP_UPD *upd, TR_NAME *name)
   }
 }
 
+/**
+ * Get the next update carried in the same message
+ *
+ * Updates for several community/realm pairs may be packed into a single
+ * TRP update message. These are chained through the next pointer. The chain
+ * does not affect talloc ownership.
+ *
+ * @param upd Update
+ * @return The next update in the chain, or NULL if this is the last
+ */
+TRP_UPD *trp_upd_get_next(TRP_UPD *upd)
+{
+  if (upd!=NULL)
+    return upd->next;
+  else
+    return NULL;
+}
+
+void trp_upd_set_next(TRP_UPD *upd, TRP_UPD *next)
+{
+  if (upd!=NULL)
+    upd->next=next;
+}
+
 /* pretty print */
 static void trp_inforec_route_print(TRP_INFOREC_DATA *data)
 {
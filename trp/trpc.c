@@ -36,6 +36,12 @@
 #include <talloc.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
 
 #include <gsscon.h>
 #include <tr_rp.h>
@@ -63,8 +69,10 @@ TRPC_INSTANCE *trpc_new (TALLOC_CTX *mem_ctx)
     if (trpc->mq==NULL) {
       talloc_free(trpc);
       trpc=NULL;
-    } else
+    } else {
+      tr_mq_set_max_length(trpc->mq, TRPC_SEND_QUEUE_MAX);
       talloc_set_destructor((void *)trpc, trpc_destructor);
+    }
     
   }
   return trpc;
@@ -189,6 +197,22 @@ void trpc_mq_add(TRPC_INSTANCE *trpc, TR_MQ_MSG *msg)
   tr_mq_add(trpc->mq, msg);
 }
 
+/* submit msg to trpc for transmission unless its queue is full */
+TR_MQ_RC trpc_mq_add_bounded(TRPC_INSTANCE *trpc, TR_MQ_MSG *msg)
+{
+  return tr_mq_add_bounded(trpc->mq, msg);
+}
+
+unsigned int trpc_mq_get_length(TRPC_INSTANCE *trpc)
+{
+  return tr_mq_get_length(trpc->mq);
+}
+
+void trpc_mq_get_stats(TRPC_INSTANCE *trpc, TR_MQ_STATS *stats)
+{
+  tr_mq_get_stats(trpc->mq, stats);
+}
+
 TR_MQ_MSG *trpc_mq_pop(TRPC_INSTANCE *trpc, struct timespec *ts_abort)
 {
   return tr_mq_pop(trpc->mq, ts_abort);
@@ -221,3 +245,105 @@ TRP_RC trpc_send_msg (TRPC_INSTANCE *trpc,
   }
   return rc;
 }
+
+/* Write all of iov, waiting for the socket if it is nonblocking. Modifies iov. */
+static TRP_RC trpc_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  struct pollfd pfd={fd, POLLOUT, 0};
+  ssize_t count=0;
+  int poll_rc=0;
+
+  while (iovcnt>0) {
+    count=writev(fd, iov, (iovcnt>IOV_MAX)?IOV_MAX:iovcnt);
+    if (count<0) {
+      if (errno==EINTR)
+        continue;
+      if ((errno!=EAGAIN) && (errno!=EWOULDBLOCK)) {
+        tr_debug("trpc_writev_all: write error (%s).", strerror(errno));
+        return TRP_ERROR;
+      }
+      /* socket is full, wait for it to drain */
+      poll_rc=poll(&pfd, 1, TRPC_SEND_TIMEOUT_MSEC);
+      if (poll_rc==0) {
+        tr_debug("trpc_writev_all: timed out waiting to send.");
+        return TRP_ERROR;
+      }
+      if ((poll_rc<0) && (errno!=EINTR))
+        return TRP_ERROR;
+      continue;
+    }
+
+    /* skip past what was written */
+    while ((iovcnt>0) && ((size_t)count>=iov->iov_len)) {
+      count-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt>0) {
+      iov->iov_base=(char *)(iov->iov_base)+count;
+      iov->iov_len-=count;
+    }
+  }
+  return TRP_SUCCESS;
+}
+
+/**
+ * Send several messages to the peer with a single vectored write
+ *
+ * Each message is wrapped and framed exactly as trpc_send_msg() would, so the
+ * peer cannot tell the difference.
+ *
+ * @param trpc TRPC instance with an established connection
+ * @param msgs null-terminated messages to send, in order
+ * @param n_msgs number of messages
+ * @return TRP_SUCCESS, or an error if any message could not be sent
+ */
+TRP_RC trpc_send_msgs(TRPC_INSTANCE *trpc, const char **msgs, size_t n_msgs)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_CONNECTION *conn=trpc_get_conn(trpc);
+  gss_buffer_desc *tokens=NULL;
+  uint32_t *headers=NULL;
+  struct iovec *iov=NULL;
+  OM_uint32 minor=0;
+  size_t n_wrapped=0;
+  size_t ii=0;
+  TRP_RC rc=TRP_ERROR;
+
+  if (n_msgs==0) {
+    rc=TRP_SUCCESS;
+    goto cleanup;
+  }
+
+  tokens=talloc_array(tmp_ctx, gss_buffer_desc, n_msgs);
+  headers=talloc_array(tmp_ctx, uint32_t, n_msgs);
+  iov=talloc_array(tmp_ctx, struct iovec, 2*n_msgs);
+  if ((tokens==NULL) || (headers==NULL) || (iov==NULL)) {
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  for (n_wrapped=0; n_wrapped<n_msgs; n_wrapped++) {
+    rc=trp_stream_wrap(trp_connection_get_gssctx(conn),
+                       msgs[n_wrapped],
+                       strlen(msgs[n_wrapped]),
+                       &tokens[n_wrapped]);
+    if (rc!=TRP_SUCCESS)
+      goto cleanup;
+    headers[n_wrapped]=htonl(tokens[n_wrapped].length);
+    iov[2*n_wrapped].iov_base=&headers[n_wrapped];
+    iov[2*n_wrapped].iov_len=sizeof(uint32_t);
+    iov[2*n_wrapped+1].iov_base=tokens[n_wrapped].value;
+    iov[2*n_wrapped+1].iov_len=tokens[n_wrapped].length;
+  }
+
+  rc=trpc_writev_all(trp_connection_get_fd(conn), iov, 2*n_msgs);
+  if (rc!=TRP_SUCCESS)
+    tr_err("trpc_send_msgs: Error sending messages over connection.");
+
+cleanup:
+  for (ii=0; ii<n_wrapped; ii++)
+    gss_release_buffer(&minor, &tokens[ii]);
+  talloc_free(tmp_ctx);
+  return rc;
+}
@@ -38,6 +38,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <glib.h>
+#include <inttypes.h>
 #include <string.h>
 #include <poll.h> // for nfds_t
 
@@ -59,11 +60,31 @@
 static int trps_destructor(void *object)
 {
   TRPS_INSTANCE *trps=talloc_get_type_abort(object, TRPS_INSTANCE);
+
   if (trps->rtable!=NULL)
     trp_rtable_free(trps->rtable);
+  /* readers may outlive the instance; the last one frees the view */
+  trp_rview_release(trps->rview);
   return 0;
 }
 
+/* note that the published route view is out of date */
+static void trps_rview_changed(TRPS_INSTANCE *trps)
+{
+  if (trps->rview_dirty)
+    return;
+  trps->rview_dirty=1;
+  if (trps->rview_notify_cb!=NULL)
+    trps->rview_notify_cb(trps, trps->rview_notify_cb_arg);
+}
+
+/* call before changing a route in a way that affects the route view */
+static void trps_route_changed(TRPS_INSTANCE *trps, TRP_ROUTE *route)
+{
+  if (trp_route_is_selected(route))
+    trps_rview_changed(trps);
+}
+
 TRPS_INSTANCE *trps_new (TALLOC_CTX *mem_ctx)
 {
   TRPS_INSTANCE *trps=talloc(mem_ctx, TRPS_INSTANCE);
@@ -75,6 +96,12 @@ TRPS_INSTANCE *trps_new (TALLOC_CTX *mem_ctx)
     trps->trpc=NULL;
     trps->update_interval=(struct timeval){0,0};
     trps->sweep_interval=(struct timeval){0,0};
+    trps->update_max_records=1; /* one update per message unless configured otherwise */
+    trps->update_delta=0; /* full scheduled updates unless configured otherwise */
+    trps->event_transport=0; /* one thread per connection unless configured otherwise */
+    trps->send_coalesce=0; /* one write per message unless configured otherwise */
+    trps->state_file=NULL; /* do not save routing state unless configured */
+    trps->state_saved=(struct timespec){0,0};
     trps->ptable=NULL;
 
     trps->mq=tr_mq_new(trps);
@@ -84,6 +111,16 @@ TRPS_INSTANCE *trps_new (TALLOC_CTX *mem_ctx)
       return NULL;
     }
 
+    trps->rview=NULL;
+    trps->rview_reclaim=tr_reclaim_new(trps);
+    if (trps->rview_reclaim==NULL) {
+      talloc_free(trps);
+      return NULL;
+    }
+    trps->rview_generation=0;
+    trps->rview_dirty=0;
+    trps->rview_notify_cb=NULL;
+    trps->rview_notify_cb_arg=NULL;
     trps->rtable=NULL;
     if (trps_init_rtable(trps) != TRP_SUCCESS) {
       /* failed to allocate rtable */
@@ -108,12 +145,14 @@ TRP_RC trps_init_rtable(TRPS_INSTANCE *trps)
   if (trps->rtable==NULL) {
     return TRP_NOMEM;
   }
+  trps_rview_changed(trps);
   return TRP_SUCCESS;
 }
 
 void trps_clear_rtable(TRPS_INSTANCE *trps)
 {
   trp_rtable_clear(trps->rtable);
+  trps_rview_changed(trps);
 }
 
 void trps_free (TRPS_INSTANCE *trps)
@@ -122,6 +161,12 @@ void trps_free (TRPS_INSTANCE *trps)
     talloc_free(trps);
 }
 
+/* take up to max_msgs messages at once, without waiting */
+size_t trps_mq_pop_batch(TRPS_INSTANCE *trps, TR_MQ_MSG **msgs, size_t max_msgs)
+{
+  return tr_mq_pop_batch(trps->mq, msgs, max_msgs, NULL);
+}
+
 TR_MQ_MSG *trps_mq_pop(TRPS_INSTANCE *trps)
 {
   return tr_mq_pop(trps->mq, 0);
@@ -165,16 +210,339 @@ void trps_set_sweep_interval(TRPS_INSTANCE *trps, unsigned int interval)
   trps->sweep_interval.tv_usec=0;
 }
 
+unsigned int trps_get_update_max_records(TRPS_INSTANCE *trps)
+{
+  return trps->update_max_records;
+}
+
+void trps_set_update_max_records(TRPS_INSTANCE *trps, unsigned int max_records)
+{
+  if (max_records==0)
+    max_records=1;
+  trps->update_max_records=max_records;
+}
+
+int trps_get_update_delta(TRPS_INSTANCE *trps)
+{
+  return trps->update_delta;
+}
+
+void trps_set_update_delta(TRPS_INSTANCE *trps, int update_delta)
+{
+  trps->update_delta=update_delta;
+}
+
+/* Takes effect for connections established after the change. Connection threads read
+ * this while the main thread may be applying a new configuration, so it is accessed
+ * atomically. */
+void trps_set_event_transport(TRPS_INSTANCE *trps, int event_transport)
+{
+  g_atomic_int_set(&(trps->event_transport), event_transport);
+}
+
+int trps_get_event_transport(TRPS_INSTANCE *trps)
+{
+  return g_atomic_int_get(&(trps->event_transport));
+}
+
+/* Outgoing connection threads check this for every message they send, so it is
+ * accessed atomically. */
+void trps_set_send_coalesce(TRPS_INSTANCE *trps, int send_coalesce)
+{
+  g_atomic_int_set(&(trps->send_coalesce), send_coalesce);
+}
+
+int trps_get_send_coalesce(TRPS_INSTANCE *trps)
+{
+  return g_atomic_int_get(&(trps->send_coalesce));
+}
+
+/* Set the file for saving routing state across restarts, NULL to disable. Copies the string. */
+void trps_set_state_file(TRPS_INSTANCE *trps, const char *state_file)
+{
+  if (trps->state_file!=NULL)
+    talloc_free(trps->state_file);
+  trps->state_file=NULL;
+  if (state_file!=NULL)
+    trps->state_file=talloc_strdup(trps, state_file);
+}
+
+const char *trps_get_state_file(TRPS_INSTANCE *trps)
+{
+  return trps->state_file;
+}
+
+/* copy a community learned from a peer, without its memberships */
+static TR_COMM *trps_dup_learned_comm(TALLOC_CTX *mem_ctx, TR_COMM *orig)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_COMM *comm=tr_comm_new(tmp_ctx);
+
+  if (comm==NULL)
+    goto cleanup;
+
+  tr_comm_set_id(comm, tr_comm_dup_id(orig));
+  if (tr_comm_get_id(comm)==NULL) {
+    comm=NULL;
+    goto cleanup;
+  }
+  tr_comm_set_type(comm, tr_comm_get_type(orig));
+  if (tr_comm_get_apcs(orig)!=NULL) {
+    tr_comm_set_apcs(comm, tr_apc_dup(tmp_ctx, tr_comm_get_apcs(orig)));
+    if (tr_comm_get_apcs(comm)==NULL) {
+      comm=NULL;
+      goto cleanup;
+    }
+  }
+  if (tr_comm_get_owner_realm(orig)!=NULL)
+    tr_comm_set_owner_realm(comm, tr_comm_dup_owner_realm(orig));
+  if (tr_comm_get_owner_contact(orig)!=NULL)
+    tr_comm_set_owner_contact(comm, tr_comm_dup_owner_contact(orig));
+  comm->expiration_interval=orig->expiration_interval;
+  talloc_steal(mem_ctx, comm);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return comm;
+}
+
+/* copy an IDP realm learned from a peer, without its memberships */
+static TR_IDP_REALM *trps_dup_learned_idp_realm(TALLOC_CTX *mem_ctx, TR_IDP_REALM *orig)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_IDP_REALM *idp=tr_idp_realm_new(tmp_ctx);
+
+  if (idp==NULL)
+    goto cleanup;
+
+  tr_idp_realm_set_id(idp, tr_idp_realm_dup_id(orig));
+  if (tr_idp_realm_get_id(idp)==NULL) {
+    idp=NULL;
+    goto cleanup;
+  }
+  if (tr_idp_realm_get_apcs(orig)!=NULL) {
+    tr_idp_realm_set_apcs(idp, tr_apc_dup(tmp_ctx, tr_idp_realm_get_apcs(orig)));
+    if (tr_idp_realm_get_apcs(idp)==NULL) {
+      idp=NULL;
+      goto cleanup;
+    }
+  }
+  idp->origin=orig->origin;
+  talloc_steal(mem_ctx, idp);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return idp;
+}
+
+/* copy an RP realm learned from a peer, without its memberships */
+static TR_RP_REALM *trps_dup_learned_rp_realm(TALLOC_CTX *mem_ctx, TR_RP_REALM *orig)
+{
+  TR_RP_REALM *rp=tr_rp_realm_new(mem_ctx);
+
+  if (rp==NULL)
+    return NULL;
+
+  tr_rp_realm_set_id(rp, tr_rp_realm_dup_id(orig));
+  if (tr_rp_realm_get_id(rp)==NULL) {
+    tr_rp_realm_free(rp);
+    return NULL;
+  }
+  return rp;
+}
+
+/**
+ * Copy a membership learned from a peer into another community table
+ *
+ * The community and realm are created in the table if it does not have them yet.
+ * The copy keeps the membership's provenance, interval, expiry and flags.
+ *
+ * @return 0 on success, nonzero on error
+ */
+static int trps_carry_learned_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_COMM *old_comm=tr_comm_memb_get_comm(memb);
+  TR_NAME *realm_id=tr_comm_memb_get_realm_id(memb);
+  TR_COMM *comm=NULL;
+  TR_IDP_REALM *idp=NULL;
+  TR_RP_REALM *rp=NULL;
+  TR_COMM_MEMB *copy=NULL;
+  int retval=1;
+
+  comm=tr_comm_table_find_comm(ctab, tr_comm_get_id(old_comm));
+  if (comm==NULL) {
+    comm=trps_dup_learned_comm(tmp_ctx, old_comm);
+    if ((comm==NULL) || (0!=tr_comm_table_add_comm(ctab, comm)))
+      goto cleanup;
+  }
+
+  switch (tr_comm_memb_get_role(memb)) {
+  case TR_ROLE_IDP:
+    idp=tr_comm_table_find_idp_realm(ctab, realm_id);
+    if (idp==NULL) {
+      idp=trps_dup_learned_idp_realm(tmp_ctx, tr_comm_memb_get_idp_realm(memb));
+      if (idp==NULL)
+        goto cleanup;
+      tr_comm_table_add_idp_realm(ctab, idp);
+    }
+    tr_comm_add_idp_realm(ctab, comm, idp, tr_comm_memb_get_interval(memb),
+                          tr_comm_memb_get_provenance(memb), tr_comm_memb_get_expiry(memb));
+    copy=tr_comm_table_find_idp_memb_origin(ctab, realm_id, tr_comm_get_id(comm),
+                                            tr_comm_memb_get_origin(memb));
+    break;
+
+  case TR_ROLE_RP:
+    rp=tr_comm_table_find_rp_realm(ctab, realm_id);
+    if (rp==NULL) {
+      rp=trps_dup_learned_rp_realm(tmp_ctx, tr_comm_memb_get_rp_realm(memb));
+      if (rp==NULL)
+        goto cleanup;
+      tr_comm_table_add_rp_realm(ctab, rp);
+    }
+    tr_comm_add_rp_realm(ctab, comm, rp, tr_comm_memb_get_interval(memb),
+                         tr_comm_memb_get_provenance(memb), tr_comm_memb_get_expiry(memb));
+    copy=tr_comm_table_find_rp_memb_origin(ctab, realm_id, tr_comm_get_id(comm),
+                                           tr_comm_memb_get_origin(memb));
+    break;
+
+  default:
+    goto cleanup;
+  }
+
+  if (copy==NULL)
+    goto cleanup;
+  tr_comm_memb_set_triggered(copy, tr_comm_memb_is_triggered(memb));
+  tr_comm_memb_set_provisional(copy, tr_comm_memb_is_provisional(memb));
+  retval=0;
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return retval;
+}
+
+/**
+ * Replace the community table
+ *
+ * Memberships learned from peers are copied into the new table, as trps_set_ptable()
+ * keeps per-peer state, so a configuration reload does not forget them until the
+ * peers next advertise them. Configured memberships come from the new table only.
+ * The old table must still be valid; it is not freed here.
+ *
+ * @param trps TRPS instance
+ * @param comm New community table
+ */
 void trps_set_ctable(TRPS_INSTANCE *trps, TR_COMM_TABLE *comm)
 {
+  TR_COMM_ITER *iter=NULL;
+  TR_COMM_MEMB *memb=NULL;
+  size_t n_kept=0;
+  size_t n_failed=0;
+
+  if ((trps->ctable!=NULL) && (comm!=NULL) && (trps->ctable!=comm)) {
+    iter=tr_comm_iter_new(NULL);
+    if (iter==NULL)
+      tr_err("trps_set_ctable: unable to allocate iterator, learned memberships will be relearned.");
+    else {
+      for (memb=tr_comm_memb_iter_all_first(iter, trps->ctable);
+           memb!=NULL;
+           memb=tr_comm_memb_iter_all_next(iter)) {
+        if (tr_comm_memb_get_origin(memb)==NULL)
+          continue; /* configured locally */
+        if (0==trps_carry_learned_memb(comm, memb))
+          n_kept++;
+        else
+          n_failed++;
+      }
+      tr_comm_iter_free(iter);
+    }
+    tr_debug("trps_set_ctable: kept %zu learned memberships, unable to keep %zu.", n_kept, n_failed);
+  }
   trps->ctable=comm;
 }
 
+/* mark a route as retracted */
+static void trps_retract_route(TRPS_INSTANCE *trps, TRP_ROUTE *entry)
+{
+  trps_route_changed(trps, entry);
+  trp_route_set_metric(entry, TRP_METRIC_INFINITY);
+  trp_route_set_triggered(entry, 1);
+}
+
+/* is this route retracted? */
+static int trps_route_retracted(TRPS_INSTANCE *trps, TRP_ROUTE *entry)
+{
+  return (trp_metric_is_infinite(trp_route_get_metric(entry)));
+}
+
+/* is this a route learned from a peer that is no longer in the peer table? */
+static int trps_route_orphaned(TRPS_INSTANCE *trps, TRP_ROUTE *route)
+{
+  return ((!trp_route_is_local(route))
+          && ((trps->ptable==NULL)
+              || (NULL==trp_ptable_find_gss_name(trps->ptable, trp_route_get_peer(route)))));
+}
+
+/* Retract routes learned from peers that are not in the peer table. Returns the number retracted. */
+static size_t trps_retract_orphan_routes(TRPS_INSTANCE *trps)
+{
+  TRP_ROUTE **entry=NULL;
+  size_t n_entry=0;
+  size_t n_retracted=0;
+  size_t ii=0;
+
+  if (trps->rtable==NULL)
+    return 0;
+
+  entry=trp_rtable_get_entries(NULL, trps->rtable, &n_entry); /* must talloc_free *entry */
+  for (ii=0; ii<n_entry; ii++) {
+    if (trps_route_orphaned(trps, entry[ii]) && (!trps_route_retracted(trps, entry[ii]))) {
+      trps_retract_route(trps, entry[ii]);
+      n_retracted++;
+    }
+  }
+  talloc_free(entry);
+  return n_retracted;
+}
+
+/**
+ * Replace the peer table
+ *
+ * Peers that are also in the old table keep their connection status and the record of
+ * what was exchanged with them, so a configuration reload does not look like a reconnect.
+ * Routes learned from peers that are gone are retracted, so the next triggered update
+ * withdraws them; call trps_flush_retracted_routes() after that update.
+ *
+ * @param trps TRPS instance
+ * @param ptable New peer table, frees the old one
+ */
 void trps_set_ptable(TRPS_INSTANCE *trps, TRP_PTABLE *ptable)
 {
+  TRP_PTABLE_ITER *iter=NULL;
+  TRP_PEER *peer=NULL;
+  TRP_PEER *old=NULL;
+  size_t n_kept=0;
+  size_t n_retracted=0;
+
+  if ((trps->ptable!=NULL) && (ptable!=NULL)) {
+    iter=trp_ptable_iter_new(NULL);
+    for (peer=trp_ptable_iter_first(iter, ptable); peer!=NULL; peer=trp_ptable_iter_next(iter)) {
+      old=trp_ptable_find_servicename(trps->ptable, trp_peer_get_servicename(peer));
+      if (trp_peer_same(peer, old)) {
+        trp_peer_take_state(peer, old);
+        n_kept++;
+      }
+    }
+    trp_ptable_iter_free(iter);
+  }
+
   if (trps->ptable!=NULL)
     trp_ptable_free(trps->ptable);
   trps->ptable=ptable;
+
+  n_retracted=trps_retract_orphan_routes(trps);
+  tr_debug("trps_set_ptable: kept state for %zu peers, retracted %zu routes from departed peers.",
+           n_kept, n_retracted);
 }
 
 void trps_set_peer_status_callback(TRPS_INSTANCE *trps, void (*cb)(TRP_PEER *, void *), void *cookie)
@@ -255,11 +623,45 @@ void trps_remove_trpc(TRPS_INSTANCE *trps, TRPC_INSTANCE *remove)
   trps->trpc=trpc_remove(trps->trpc, remove);
 }
 
+/* helper for trps_send_bytes. Releases the GBytes payload of a TR_MQ_MSG. */
+static void trps_mq_payload_unref(void *p)
+{
+  g_bytes_unref((GBytes *)p);
+}
+
 TRP_RC trps_send_msg(TRPS_INSTANCE *trps, TRP_PEER *peer, const char *msg)
+{
+  GBytes *bytes=g_bytes_new(msg, strlen(msg)+1); /* keep the null terminator */
+  TRP_RC rc=TRP_ERROR;
+
+  if (bytes==NULL)
+    return TRP_NOMEM;
+  rc=trps_send_bytes(trps, peer, bytes, NULL);
+  g_bytes_unref(bytes);
+  return rc;
+}
+
+/**
+ * Queue an encoded message for a peer without copying it
+ *
+ * The message must be null terminated. A reference is added to bytes, so the
+ * same buffer may be queued to several peers and the caller keeps its own reference.
+ *
+ * If key is not NULL and a message with the same key is still waiting in the peer's
+ * queue, that message is replaced by this one, keeping its place in the queue. Use
+ * this for messages that make earlier ones obsolete. If the queue is full, the
+ * message is dropped.
+ *
+ * @param trps Server instance
+ * @param peer Peer to send to
+ * @param bytes Encoded message
+ * @param key Key for superseding queued messages, or NULL
+ * @return TRP_SUCCESS if queued, otherwise an error code
+ */
+TRP_RC trps_send_bytes(TRPS_INSTANCE *trps, TRP_PEER *peer, GBytes *bytes, const char *key)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TR_MQ_MSG *mq_msg=NULL;
-  char *msg_dup=NULL;
   TRP_RC rc=TRP_ERROR;
   TRPC_INSTANCE *trpc=NULL;
 
@@ -271,18 +673,48 @@ TRP_RC trps_send_msg(TRPS_INSTANCE *trps, TRP_PEER *peer, const char *msg)
    * its queue periodically, even if it is unable to send the messages
    */
   if (trpc==NULL) {
-    tr_warning("trps_send_msg: skipping message queued for missing TRP client entry.");
+    tr_warning("trps_send_bytes: skipping message queued for missing TRP client entry.");
   } else {
     mq_msg=tr_mq_msg_new(tmp_ctx, TR_MQMSG_TRPC_SEND);
-    msg_dup=talloc_strdup(mq_msg, msg); /* get local copy in mq_msg context */
-    tr_mq_msg_set_payload(mq_msg, msg_dup, NULL); /* no need for a free() func */
-    trpc_mq_add(trpc, mq_msg);
-    rc=TRP_SUCCESS;
+    if (mq_msg==NULL) {
+      rc=TRP_NOMEM;
+      goto cleanup;
+    }
+    tr_mq_msg_set_payload(mq_msg, g_bytes_ref(bytes), trps_mq_payload_unref);
+    if (0!=tr_mq_msg_set_key(mq_msg, key)) {
+      rc=TRP_NOMEM;
+      goto cleanup;
+    }
+    switch (trpc_mq_add_bounded(trpc, mq_msg)) { /* steals or frees mq_msg */
+    case TR_MQ_ADDED:
+    case TR_MQ_SUPERSEDED:
+      rc=TRP_SUCCESS;
+      break;
+    case TR_MQ_FULL:
+      tr_warning("trps_send_bytes: send queue full, dropping message.");
+      rc=TRP_ERROR;
+      break;
+    default:
+      rc=TRP_ERROR;
+      break;
+    }
   }
+
+cleanup:
   talloc_free(tmp_ctx);
   return rc;
 }
 
+/* Has the peer fallen behind? If so, routine updates to it should wait. */
+int trps_peer_backlogged(TRPS_INSTANCE *trps, TRP_PEER *peer)
+{
+  TRPC_INSTANCE *trpc=trps_find_trpc(trps, peer);
+
+  if (trpc==NULL)
+    return 0;
+  return trpc_mq_get_length(trpc) >= TRPC_SEND_QUEUE_BACKLOG;
+}
+
 /* get the currently selected route if available */
 TRP_ROUTE *trps_get_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm, TR_NAME *peer)
 {
@@ -295,6 +727,107 @@ TRP_ROUTE *trps_get_selected_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *
   return trp_rtable_get_selected_entry(trps->rtable, comm, realm);
 }
 
+/**
+ * Publish a new view of the selected routes
+ *
+ * Builds a view from the current route table and replaces the previous one with a
+ * single atomic store. Does nothing unless the selected routes have changed since the
+ * last view was published, so it is cheap to call after every batch of work; the
+ * event loop calls it at most once per pass. Must be called from the thread that owns
+ * the route table.
+ *
+ * The previous view is freed when the last reader holding it lets go. A reader that
+ * loaded the old pointer before the swap may not have taken its reference yet, so
+ * ours is only dropped once none can be left; this does not wait for that, see
+ * trps_reclaim_rviews().
+ *
+ * @param trps TRPS instance
+ * @return TRP_SUCCESS, or an error if the view could not be built (readers keep the old one)
+ */
+TRP_RC trps_publish_rview(TRPS_INSTANCE *trps)
+{
+  TRP_ROUTE **entry=NULL;
+  size_t n_entry=0;
+  TRP_RVIEW *new_view=NULL;
+  TRP_RVIEW *old_view=NULL;
+
+  if (!trps->rview_dirty)
+    return TRP_SUCCESS;
+
+  entry=trp_rtable_get_entries(NULL, trps->rtable, &n_entry); /* must talloc_free *entry */
+  new_view=trp_rview_new(NULL, entry, n_entry, trps->rview_generation+1);
+  talloc_free(entry);
+  if (new_view==NULL) {
+    tr_err("trps_publish_rview: unable to build route view.");
+    return TRP_NOMEM; /* still dirty, so the next call tries again */
+  }
+
+  trps->rview_generation++;
+  trps->rview_dirty=0;
+  old_view=trps->rview; /* only this thread stores to trps->rview */
+  g_atomic_pointer_set(&(trps->rview), new_view);
+  if (old_view!=NULL) {
+    tr_reclaim_retire(trps->rview_reclaim, old_view, (TR_RECLAIM_FREE_FN) trp_rview_release);
+    trps_reclaim_rviews(trps);
+  }
+  tr_debug("trps_publish_rview: published route view generation %u with %zu routes.",
+           trps->rview_generation, trp_rview_size(new_view));
+  return TRP_SUCCESS;
+}
+
+/**
+ * Drop replaced views that no reader can still be loading
+ *
+ * Does not wait. Call from the thread that owns the route table, again later
+ * while this returns nonzero.
+ *
+ * @param trps TRPS instance
+ * @return Number of replaced views still waiting
+ */
+size_t trps_reclaim_rviews(TRPS_INSTANCE *trps)
+{
+  return tr_reclaim_poll(trps->rview_reclaim);
+}
+
+/**
+ * Take a reference to the current view of the selected routes
+ *
+ * Safe to call from any thread without locking. The view stays valid until the
+ * reference is dropped with trp_rview_release(), even if a newer one is published
+ * in the meantime.
+ *
+ * @param trps TRPS instance
+ * @return The current view, or null if none has been published
+ */
+TRP_RVIEW *trps_acquire_rview(TRPS_INSTANCE *trps)
+{
+  TRP_RVIEW *view=NULL;
+  unsigned int slot=tr_reclaim_enter(trps->rview_reclaim);
+
+  view=g_atomic_pointer_get(&(trps->rview));
+  if (view!=NULL)
+    g_atomic_int_inc(&(view->refcount));
+  tr_reclaim_exit(trps->rview_reclaim, slot);
+  return view;
+}
+
+/**
+ * Set a function to call when the selected routes change
+ *
+ * It is called, from the thread that owns the route table, when a change leaves the
+ * published view out of date. Further changes do not call it again until
+ * trps_publish_rview() has caught up.
+ *
+ * @param trps TRPS instance
+ * @param cb Function to call, or null for none
+ * @param arg Passed to cb
+ */
+void trps_set_rview_notify_cb(TRPS_INSTANCE *trps, TRPS_RVIEW_NOTIFY_FN cb, void *arg)
+{
+  trps->rview_notify_cb=cb;
+  trps->rview_notify_cb_arg=arg;
+}
+
 /* copy the result if you want to keep it */
 TR_NAME *trps_get_next_hop(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
 {
@@ -306,77 +839,206 @@ TR_NAME *trps_get_next_hop(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
 }
 
 
-/* mark a route as retracted */
-static void trps_retract_route(TRPS_INSTANCE *trps, TRP_ROUTE *entry)
+/* do two local routes advertise the same thing? */
+static int trps_local_route_same(TRP_ROUTE *r1, TRP_ROUTE *r2)
 {
-  trp_route_set_metric(entry, TRP_METRIC_INFINITY);
-  trp_route_set_triggered(entry, 1);
+  return (trp_route_is_local(r1) && trp_route_is_local(r2)
+          && (trp_route_get_metric(r1)==trp_route_get_metric(r2))
+          && (0==tr_name_cmp(trp_route_get_trust_router(r1), trp_route_get_trust_router(r2)))
+          && (trp_route_get_trust_router_port(r1)==trp_route_get_trust_router_port(r2)));
 }
 
-/* is this route retracted? */
-static int trps_route_retracted(TRPS_INSTANCE *trps, TRP_ROUTE *entry)
+/**
+ * Bring the local routes in the route table in line with a new configuration
+ *
+ * Unchanged local routes are left alone, so they keep their selection and are not
+ * readvertised. New or changed routes are added and marked triggered. Local routes that
+ * are no longer configured are retracted so the next triggered update withdraws them;
+ * call trps_flush_retracted_routes() after that update. Routes learned from peers
+ * are not touched.
+ *
+ * @param trps TRPS instance
+ * @param routes Local routes for the new configuration. Added routes are taken over by the
+ *               route table, others are freed.
+ * @param n_routes Number of routes
+ * @return TRP_SUCCESS or an error code
+ */
+TRP_RC trps_update_local_routes(TRPS_INSTANCE *trps, TRP_ROUTE **routes, size_t n_routes)
 {
-  return (trp_metric_is_infinite(trp_route_get_metric(entry)));
+  GHashTable *current=g_hash_table_new(g_direct_hash, g_direct_equal); /* routes that stay */
+  TRP_ROUTE *old=NULL;
+  TRP_ROUTE **entry=NULL;
+  size_t n_entry=0;
+  size_t n_added=0, n_kept=0, n_retracted=0;
+  size_t ii=0;
+
+  if (current==NULL)
+    return TRP_NOMEM;
+
+  for (ii=0; ii<n_routes; ii++) {
+    old=trp_rtable_get_entry(trps->rtable,
+                             trp_route_get_comm(routes[ii]),
+                             trp_route_get_realm(routes[ii]),
+                             trp_route_get_peer(routes[ii]));
+    if ((old!=NULL) && trps_local_route_same(old, routes[ii])) {
+      g_hash_table_insert(current, old, old);
+      trp_route_free(routes[ii]);
+      n_kept++;
+    } else {
+      trp_route_set_triggered(routes[ii], 1);
+      trps_add_route(trps, routes[ii]); /* replaces and frees any old entry */
+      g_hash_table_insert(current, routes[ii], routes[ii]);
+      n_added++;
+    }
+    routes[ii]=NULL;
+  }
+
+  entry=trp_rtable_get_entries(NULL, trps->rtable, &n_entry); /* must talloc_free *entry */
+  for (ii=0; ii<n_entry; ii++) {
+    if (trp_route_is_local(entry[ii])
+        && (!g_hash_table_contains(current, entry[ii]))
+        && (!trps_route_retracted(trps, entry[ii]))) {
+      trps_retract_route(trps, entry[ii]);
+      n_retracted++;
+    }
+  }
+  talloc_free(entry);
+  g_hash_table_destroy(current);
+
+  tr_debug("trps_update_local_routes: %zu local routes added or changed, %zu unchanged, %zu retracted.",
+           n_added, n_kept, n_retracted);
+  return TRP_SUCCESS;
 }
 
-static TRP_RC trps_read_message(TRPS_INSTANCE *trps, TRP_CONNECTION *conn, TR_MSG **msg)
+/* Remove retracted local routes and retracted routes from departed peers. Call after the
+ * triggered update announcing the retractions. */
+void trps_flush_retracted_routes(TRPS_INSTANCE *trps)
 {
-  int err=0;
-  char *buf=NULL;
-  size_t buflen = 0;
-  TRP_PEER *peer=NULL; /* entry in the peer table */
-  TR_NAME *conn_peer=NULL; /* name from the TRP_CONN, which comes from the gss context */
+  TRP_ROUTE **entry=NULL;
+  size_t n_entry=0;
+  size_t ii=0;
 
-  tr_debug("trps_read_message: started");
-  if (err = gsscon_read_encrypted_token(trp_connection_get_fd(conn),
-                                       *(trp_connection_get_gssctx(conn)), 
-                                       &buf,
-                                       &buflen)) {
-    tr_debug("trps_read_message: error");
-    if (buf)
-      free(buf);
-    return TRP_ERROR;
+  entry=trp_rtable_get_entries(NULL, trps->rtable, &n_entry); /* must talloc_free *entry */
+  for (ii=0; ii<n_entry; ii++) {
+    if ((trp_route_is_local(entry[ii]) || trps_route_orphaned(trps, entry[ii]))
+        && trps_route_retracted(trps, entry[ii]))
+      trp_rtable_remove(trps->rtable, entry[ii]); /* entry[ii] is no longer valid */
   }
+  talloc_free(entry);
+}
 
-  tr_debug("trps_read_message: message received, %u bytes.", (unsigned) buflen);
-  tr_debug("trps_read_message: %.*s", buflen, buf);
+/* Decode a message received on conn and label it with the peer it came from. */
+static TRP_RC trps_decode_message(TRPS_INSTANCE *trps,
+                                  TRP_CONNECTION *conn,
+                                  const char *buf,
+                                  size_t buflen,
+                                  TR_MSG **msg)
+{
+  TRP_PEER *peer=NULL; /* entry in the peer table */
+  TR_NAME *conn_peer=NULL; /* name from the TRP_CONN, which comes from the gss context */
+  TRP_UPD *upd=NULL;
+
+  tr_debug_hot("trps_decode_message: message received, %u bytes.", (unsigned) buflen);
+  tr_debug_hot("trps_decode_message: %.*s", buflen, buf);
 
   *msg= tr_msg_decode(NULL, buf, buflen);
-  free(buf);
   if (*msg==NULL)
     return TRP_NOPARSE;
 
   conn_peer=trp_connection_get_peer(conn);
   if (conn_peer==NULL) {
-    tr_err("trps_read_message: connection has no peer name");
+    tr_err("trps_decode_message: connection has no peer name");
+    tr_msg_free_decoded(*msg);
+    *msg=NULL;
     return TRP_ERROR;
   }
 
   peer=trps_get_peer_by_gssname(trps, conn_peer);
   if (peer==NULL) {
-    tr_err("trps_read_message: could not find peer with gssname=%s", trp_connection_get_gssname(conn));
+    tr_err("trps_decode_message: could not find peer with gssname=%s", trp_connection_get_gssname(conn));
+    tr_msg_free_decoded(*msg);
+    *msg=NULL;
     return TRP_ERROR;
   }
 
   /* verify we received a message we support, otherwise drop it now */
   switch (tr_msg_get_msg_type(*msg)) {
   case TRP_UPDATE:
-    trp_upd_set_peer(tr_msg_get_trp_upd(*msg), tr_dup_name(conn_peer));
-    /* update provenance if necessary */
-    trp_upd_add_to_provenance(tr_msg_get_trp_upd(*msg), trp_peer_get_label(peer));
+    /* a single message may carry several updates */
+    for (upd=tr_msg_get_trp_upd(*msg); upd!=NULL; upd=trp_upd_get_next(upd)) {
+      trp_upd_set_peer(upd, tr_dup_name(conn_peer));
+      /* update provenance if necessary */
+      trp_upd_add_to_provenance(upd, trp_peer_get_label(peer));
+    }
+    break;
+
+  case TRP_REQUEST:
+    trp_req_set_peer(tr_msg_get_trp_req(*msg), tr_dup_name(conn_peer));
     break;
 
-  case TRP_REQUEST:
-    trp_req_set_peer(tr_msg_get_trp_req(*msg), tr_dup_name(conn_peer));
-    break;
+  case TRP_REFRESH:
+    trp_refresh_marker_set_peer(tr_msg_get_trp_refresh(*msg), tr_dup_name(conn_peer));
+    break;
+
+  default:
+    tr_debug("trps_decode_message: received unsupported message from %.*s", conn_peer->len, conn_peer->buf);
+    tr_msg_free_decoded(*msg);
+    *msg=NULL;
+    return TRP_UNSUPPORTED;
+  }
+  
+  return TRP_SUCCESS;
+}
+
+static TRP_RC trps_read_message(TRPS_INSTANCE *trps, TRP_CONNECTION *conn, TR_MSG **msg)
+{
+  int err=0;
+  char *buf=NULL;
+  size_t buflen = 0;
+  TRP_RC rc=TRP_ERROR;
+
+  tr_debug("trps_read_message: started");
+  if (err = gsscon_read_encrypted_token(trp_connection_get_fd(conn),
+                                       *(trp_connection_get_gssctx(conn)), 
+                                       &buf,
+                                       &buflen)) {
+    tr_debug("trps_read_message: error");
+    if (buf)
+      free(buf);
+    return TRP_ERROR;
+  }
+
+  rc=trps_decode_message(trps, conn, buf, buflen, msg);
+  free(buf);
+  return rc;
+}
+
+/**
+ * Handle a message received on a connection serviced by the event loop
+ *
+ * Unlike messages read by trps_handle_connection(), these are already on the
+ * main thread, so they are processed immediately rather than passed through the
+ * message queue.
+ *
+ * @param trps TRPS instance
+ * @param conn connection the message arrived on
+ * @param buf unwrapped message
+ * @param buflen length of the message
+ * @return TRP_SUCCESS if the message was decoded, TRP_ERROR if the connection should be
+ *         dropped, or another error code if only this message was unusable
+ */
+TRP_RC trps_deliver_message(TRPS_INSTANCE *trps, TRP_CONNECTION *conn, const char *buf, size_t buflen)
+{
+  TR_MSG *msg=NULL;
+  TRP_RC rc=TRP_ERROR;
 
-  default:
-    tr_debug("trps_read_message: received unsupported message from %.*s", conn_peer->len, conn_peer->buf);
-    tr_msg_free_decoded(*msg);
-    *msg=NULL;
-    return TRP_UNSUPPORTED;
-  }
-  
+  rc=trps_decode_message(trps, conn, buf, buflen, &msg);
+  if (rc!=TRP_SUCCESS)
+    return rc;
+
+  if (trps_handle_tr_msg(trps, msg)!=TRP_SUCCESS)
+    tr_err("trps_deliver_message: error handling message.");
+  tr_msg_free_decoded(msg);
   return TRP_SUCCESS;
 }
 
@@ -658,6 +1320,9 @@ static TRP_RC trps_accept_update(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC
    * route (we never accept retractions as new routes), so there is no risk of leaving the expiry
    * time unset on a new route entry. */
   tr_debug("trps_accept_update: accepting route update.");
+  trp_route_set_provisional(entry, 0); /* confirmed by the peer */
+  if (trp_route_get_metric(entry)!=trp_inforec_get_metric(rec))
+    trps_route_changed(trps, entry);
   trp_route_set_metric(entry, trp_inforec_get_metric(rec));
   trp_route_set_interval(entry, trp_inforec_get_interval(rec));
 
@@ -731,37 +1396,6 @@ static TRP_RC trps_handle_inforec_route(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_I
   return TRP_SUCCESS;
 }
 
-static int trps_name_in_provenance(TR_NAME *name, json_t *prov)
-{
-  size_t ii=0;
-  TR_NAME *this_name=NULL;
-  const char *s=NULL;
-
-  if (prov==NULL)
-    return 0; /* no provenance list, so it has no names in it */
-
-  /* now check to see if name is in the provenance */
-  for (ii=0; ii<json_array_size(prov); ii++) {
-    s=json_string_value(json_array_get(prov, ii));
-    if (s==NULL) {
-      tr_debug("trps_name_in_provenance: empty entry in provenance list.");
-      continue;
-    }
-
-    this_name=tr_new_name(s);
-    if (this_name==NULL) {
-      tr_debug("trps_name_in_provenance: unable to allocate name.");
-      return -1;
-    }
-    if (0==tr_name_cmp(name, this_name)) {
-      tr_free_name(this_name);
-      return 1;
-    }
-    tr_free_name(this_name);
-  }
-  return 0;
-}
-
 static TR_COMM *trps_create_new_comm(TALLOC_CTX *mem_ctx, TR_NAME *comm_id, TRP_INFOREC *rec)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -936,7 +1570,7 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
     goto cleanup;
   }
 
-  if (trps_name_in_provenance(our_peer_label, trp_inforec_get_provenance(rec)))
+  if (tr_provenance_contains(trp_inforec_get_provenance(rec), our_peer_label))
     tr_debug("trps_handle_inforec_comm: rejecting community inforec to avoid provenance loop.");
   else {
     /* no loop occurring, accept the update */
@@ -963,7 +1597,7 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
 
     switch (trp_inforec_get_role(rec)) {
     case TR_ROLE_RP:
-      rp_realm=tr_rp_realm_lookup(trps->ctable->rp_realms, realm_id);
+      rp_realm=tr_comm_table_find_rp_realm(trps->ctable, realm_id);
       if (rp_realm==NULL) {
         tr_debug("trps_handle_inforec_comm: unknown RP realm %.*s in inforec, creating it.",
                  realm_id->len, realm_id->buf);
@@ -984,7 +1618,7 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
                origin_id->len, origin_id->buf);
       break;
     case TR_ROLE_IDP:
-      idp_realm=tr_idp_realm_lookup(trps->ctable->idp_realms, realm_id);
+      idp_realm=tr_comm_table_find_idp_realm(trps->ctable, realm_id);
       if (idp_realm==NULL) {
         tr_debug("trps_handle_inforec_comm: unknown IDP realm %.*s in inforec, creating it.",
                  realm_id->len, realm_id->buf);
@@ -1071,9 +1705,104 @@ static int trps_filter_inbound_inforec(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
 }
 
 
+/* append a length-prefixed name to a summary string so that names cannot run together */
+static void trps_summary_append_name(GString *summary, TR_NAME *name)
+{
+  if (name==NULL)
+    g_string_append(summary, "-;");
+  else
+    g_string_append_printf(summary, "%u:%.*s;", (unsigned) name->len, (int) name->len, name->buf);
+}
+
+/* Summarize everything advertised in an update so that two advertisements can be compared.
+ * If received is nonzero, the update came from a peer and the last provenance hop, which we
+ * added on receipt, is left out. Caller must g_free() the result. */
+static gchar *trps_upd_summary(TRP_UPD *upd, int received)
+{
+  GString *summary=g_string_new(NULL);
+  TRP_INFOREC *rec=NULL;
+  TR_APC *apc=NULL;
+  TR_PROVENANCE *prov=NULL;
+  size_t n_prov=0;
+  size_t ii=0;
+
+  for (rec=trp_upd_get_inforec(upd); rec!=NULL; rec=trp_inforec_get_next(rec)) {
+    switch (trp_inforec_get_type(rec)) {
+    case TRP_INFOREC_TYPE_ROUTE:
+      g_string_append_printf(summary, "r%u,%u,", trp_inforec_get_metric(rec), trp_inforec_get_interval(rec));
+      trps_summary_append_name(summary, trp_inforec_get_trust_router(rec));
+      g_string_append_printf(summary, "%d,", trp_inforec_get_trust_router_port(rec));
+      trps_summary_append_name(summary, trp_inforec_get_next_hop(rec));
+      g_string_append_printf(summary, "%d;", trp_inforec_get_next_hop_port(rec));
+      break;
+    case TRP_INFOREC_TYPE_COMMUNITY:
+      g_string_append_printf(summary, "c%d,%d,%u,%ld,",
+                             trp_inforec_get_comm_type(rec),
+                             trp_inforec_get_role(rec),
+                             trp_inforec_get_interval(rec),
+                             (long) trp_inforec_get_exp_interval(rec));
+      for (apc=trp_inforec_get_apcs(rec); apc!=NULL; apc=apc->next)
+        trps_summary_append_name(summary, tr_apc_get_id(apc));
+      g_string_append_c(summary, '|');
+      trps_summary_append_name(summary, trp_inforec_get_owner_realm(rec));
+      trps_summary_append_name(summary, trp_inforec_get_owner_contact(rec));
+      prov=trp_inforec_get_provenance(rec);
+      n_prov=tr_provenance_len(prov);
+      if (received && (n_prov>0))
+        n_prov--;
+      for (ii=0; ii<n_prov; ii++)
+        trps_summary_append_name(summary, tr_provenance_get_hop(prov, ii));
+      g_string_append_c(summary, '|');
+      break;
+    default:
+      g_string_append_c(summary, '?');
+      break;
+    }
+  }
+  return g_string_free(summary, FALSE);
+}
+
+/* Key identifying an entry in a peer's sent or received state. Caller must g_free() the result. */
+static gchar *trps_entry_key(TRP_INFOREC_TYPE type, TR_NAME *comm, TR_NAME *realm)
+{
+  return g_strdup_printf("%s/%u:%.*s/%u:%.*s",
+                         trp_inforec_type_to_string(type),
+                         (unsigned) comm->len, (int) comm->len, comm->buf,
+                         (unsigned) realm->len, (int) realm->len, realm->buf);
+}
+
+/* Key for the entry carried by an update. Caller must g_free() the result. */
+static gchar *trps_upd_sent_key(TRP_UPD *upd)
+{
+  return trps_entry_key(trp_inforec_get_type(trp_upd_get_inforec(upd)),
+                        trp_upd_get_comm(upd),
+                        trp_upd_get_realm(upd));
+}
+
+/* remember what a peer advertised to us so we can summarize it when we reconnect */
+static void trps_record_received(TRPS_INSTANCE *trps, TRP_UPD *upd)
+{
+  TRP_PEER *peer=trps_get_peer_by_gssname(trps, trp_upd_get_peer(upd));
+  unsigned int interval=trp_inforec_get_interval(trp_upd_get_inforec(upd));
+  struct timespec expiry={0,0};
+  gchar *key=NULL;
+  gchar *summary=NULL;
+
+  if (peer==NULL)
+    return;
+
+  key=trps_upd_sent_key(upd);
+  summary=trps_upd_summary(upd, 1);
+  trps_compute_expiry(trps, interval, &expiry);
+  trp_peer_received_set(peer, key, trp_upd_get_comm(upd), trp_upd_get_realm(upd), summary, interval, &expiry);
+  g_free(key);
+  g_free(summary);
+}
+
 static TRP_RC trps_handle_update(TRPS_INSTANCE *trps, TRP_UPD *upd)
 {
   TRP_INFOREC *rec=NULL;
+  int n_accepted=0;
 
   if (trps_validate_update(trps, upd) != TRP_SUCCESS) {
     tr_notice("trps_handle_update: received invalid TRP update.");
@@ -1099,18 +1828,126 @@ static TRP_RC trps_handle_update(TRPS_INSTANCE *trps, TRP_UPD *upd)
       tr_debug("trps_handle_update: handling route inforec.");
       if (TRP_SUCCESS!=trps_handle_inforec_route(trps, upd, rec))
         tr_notice("trps_handle_update: error handling route inforec.");
+      else
+        n_accepted++;
       break;
     case TRP_INFOREC_TYPE_COMMUNITY:
       tr_debug("trps_handle_update: handling community inforec.");
       if (TRP_SUCCESS!=trps_handle_inforec_comm(trps, upd, rec))
         tr_notice("trps_handle_update: error handling community inforec.");
-
+      else
+        n_accepted++;
       break;
     default:
       tr_notice("trps_handle_update: unsupported inforec in TRP update.");
       break;
     }
   }
+
+  /* Remember the update, as the peer sent it, only if we took something from it.
+   * Anything we rejected is left out of our digest so the peer sends it again. */
+  if (n_accepted>0)
+    trps_record_received(trps, upd);
+  return TRP_SUCCESS;
+}
+
+/* mark a route restored from saved state, unless one already existed */
+static void trps_restore_route(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC *rec, struct timespec *expiry)
+{
+  TRP_ROUTE *route=NULL;
+
+  if (NULL!=trps_get_route(trps, trp_upd_get_comm(upd), trp_upd_get_realm(upd), trp_upd_get_peer(upd)))
+    return; /* never overwrite what we learned since starting */
+
+  if (TRP_SUCCESS!=trps_handle_inforec_route(trps, upd, rec))
+    return;
+
+  route=trps_get_route(trps, trp_upd_get_comm(upd), trp_upd_get_realm(upd), trp_upd_get_peer(upd));
+  if (route!=NULL) {
+    trp_route_set_provisional(route, 1);
+    trp_route_set_expiry(route, expiry);
+  }
+}
+
+/* find the membership for the comm/realm/role/origin in an update and inforec */
+static TR_COMM_MEMB *trps_find_inforec_memb(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC *rec, TR_NAME *origin)
+{
+  switch (trp_inforec_get_role(rec)) {
+  case TR_ROLE_IDP:
+    return tr_comm_table_find_idp_memb_origin(trps->ctable, trp_upd_get_realm(upd), trp_upd_get_comm(upd), origin);
+  case TR_ROLE_RP:
+    return tr_comm_table_find_rp_memb_origin(trps->ctable, trp_upd_get_realm(upd), trp_upd_get_comm(upd), origin);
+  default:
+    return NULL;
+  }
+}
+
+/* mark a community membership restored from saved state, unless one already existed */
+static void trps_restore_memb(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC *rec, struct timespec *expiry)
+{
+  TR_NAME *origin=trp_inforec_dup_origin(rec);
+  TR_COMM_MEMB *memb=NULL;
+
+  if (origin==NULL)
+    return;
+
+  if (NULL!=trps_find_inforec_memb(trps, upd, rec, origin))
+    goto cleanup; /* never overwrite what we learned since starting */
+
+  if (TRP_SUCCESS!=trps_handle_inforec_comm(trps, upd, rec))
+    goto cleanup;
+
+  memb=trps_find_inforec_memb(trps, upd, rec, origin);
+  if (memb!=NULL) {
+    tr_comm_memb_set_provisional(memb, 1);
+    tr_comm_memb_set_expiry(memb, expiry);
+  }
+
+cleanup:
+  tr_free_name(origin);
+}
+
+/**
+ * Apply an update restored from saved routing state
+ *
+ * The update is validated and passed through the inbound filters as though its
+ * peer had just sent it, but it is not recorded as received from that peer.
+ * Routes and memberships it adds are marked provisional: they are used for
+ * forwarding but not advertised until the peer confirms them, and they lapse
+ * at the given expiry otherwise. Entries already in the tables are left alone.
+ *
+ * @param trps Server instance
+ * @param upd Update with its peer set
+ * @param expiry When the restored entries expire, by TRP_CLOCK
+ * @return TRP_SUCCESS if the update was applied, otherwise an error code
+ */
+TRP_RC trps_restore_update(TRPS_INSTANCE *trps, TRP_UPD *upd, struct timespec *expiry)
+{
+  TRP_INFOREC *rec=NULL;
+
+  if (trps_validate_update(trps, upd) != TRP_SUCCESS)
+    return TRP_ERROR;
+
+  for (rec=trp_upd_get_inforec(upd); rec!=NULL; rec=trp_inforec_get_next(rec)) {
+    if (trps_validate_inforec(trps, rec) != TRP_SUCCESS)
+      return TRP_ERROR;
+  }
+
+  for (rec=trp_upd_get_inforec(upd); rec!=NULL; rec=trp_inforec_get_next(rec)) {
+    if (!trps_filter_inbound_inforec(trps, upd, rec))
+      continue;
+
+    switch (trp_inforec_get_type(rec)) {
+    case TRP_INFOREC_TYPE_ROUTE:
+      trps_restore_route(trps, upd, rec, expiry);
+      break;
+    case TRP_INFOREC_TYPE_COMMUNITY:
+      trps_restore_memb(trps, upd, rec, expiry);
+      break;
+    default:
+      break;
+    }
+  }
   return TRP_SUCCESS;
 }
 
@@ -1213,12 +2050,20 @@ TRP_RC trps_update_active_routes(TRPS_INSTANCE *trps)
         cur_metric=trp_route_get_metric(cur_route);
         if ((best_metric < cur_metric) && (trp_metric_is_finite(best_metric))) {
           /* The new route has a lower metric than the previous, and is finite. Accept. */
+          if (trp_route_is_triggered(cur_route))
+            trp_route_set_triggered(best_route, 1); /* announce the replacement with the retraction */
           trp_route_set_selected(cur_route, 0);
           trp_route_set_selected(best_route, 1);
-        } else if (!trp_metric_is_finite(cur_metric)) /* rejects infinite or invalid metrics */
+          trps_rview_changed(trps);
+        } else if ((!trp_metric_is_finite(cur_metric)) && (!trp_route_is_triggered(cur_route))) {
+          /* Rejects infinite or invalid metrics. A route retracted since the last triggered
+           * update stays selected until that update has announced the retraction. It is
+           * already left out of the view. */
           trp_route_set_selected(cur_route, 0);
+        }
       } else if (trp_metric_is_finite(best_metric)) {
         trp_route_set_selected(best_route, 1);
+        trps_rview_changed(trps);
       }
     }
     if (realm!=NULL)
@@ -1238,6 +2083,25 @@ static int trps_expired(struct timespec *expiry, struct timespec *curtime)
   return (tr_cmp_timespec(curtime, expiry) >= 0);
 }
 
+/* forget expired entries in what each peer advertised to us */
+static void trps_sweep_received(TRPS_INSTANCE *trps, struct timespec *now)
+{
+  TRP_PTABLE_ITER *iter=NULL;
+  TRP_PEER *peer=NULL;
+
+  if (trps->ptable==NULL)
+    return;
+
+  iter=trp_ptable_iter_new(NULL);
+  if (iter==NULL) {
+    tr_err("trps_sweep_received: unable to allocate peer table iterator.");
+    return;
+  }
+  for (peer=trp_ptable_iter_first(iter, trps->ptable); peer!=NULL; peer=trp_ptable_iter_next(iter))
+    trp_peer_received_sweep(peer, now);
+  trp_ptable_iter_free(iter);
+}
+
 /* Sweep for expired routes. For each expired route, if its metric is infinite, the route is flushed.
  * If its metric is finite, the metric is set to infinite and the route's expiration time is updated. */
 TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps)
@@ -1262,13 +2126,14 @@ TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps)
     if (!trp_route_is_local(entry[ii]) && trps_expired(trp_route_get_expiry(entry[ii]), &sweep_time)) {
       tr_debug("trps_sweep_routes: route expired.");
       if (!trp_metric_is_finite(trp_route_get_metric(entry[ii]))) {
-        /* flush route */
+        /* flush route; with an infinite metric it was not in the view */
         tr_debug("trps_sweep_routes: metric was infinity, flushing route.");
         trp_rtable_remove(trps->rtable, entry[ii]); /* entry[ii] is no longer valid */
         entry[ii]=NULL;
       } else {
         /* set metric to infinity and reset timer */
         tr_debug("trps_sweep_routes: setting metric to infinity and resetting expiry.");
+        trps_route_changed(trps, entry[ii]);
         trp_route_set_metric(entry[ii], TRP_METRIC_INFINITY);
         trp_route_set_expiry(entry[ii], trps_compute_expiry(trps,
                                                              trp_route_get_interval(entry[ii]),
@@ -1278,6 +2143,7 @@ TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps)
   }
 
   talloc_free(entry);
+  trps_sweep_received(trps, &sweep_time);
   return TRP_SUCCESS;
 }
 
@@ -1290,6 +2156,7 @@ TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps)
   struct timespec tmp = {0};
   TR_COMM_MEMB *memb=NULL;
   TR_COMM_ITER *iter=NULL;
+  GPtrArray *flushed=NULL;
   TRP_RC rc=TRP_ERROR;
 
   /* use a single time for the entire sweep */
@@ -1307,6 +2174,9 @@ TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps)
     rc=TRP_NOMEM;
     goto cleanup;
   }
+  /* Memberships are freed after the loop. The iterator may still pass through one
+   * that has been removed from the table, but not through one that has been freed. */
+  flushed=g_ptr_array_new_with_free_func((GDestroyNotify) tr_comm_memb_free);
   for (memb=tr_comm_memb_iter_all_first(iter, trps->ctable);
        memb!=NULL;
        memb=tr_comm_memb_iter_all_next(iter)) {
@@ -1322,7 +2192,7 @@ TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps)
                  tr_comm_memb_get_origin(memb)->len, tr_comm_memb_get_origin(memb)->buf,
                  timespec_to_str(tr_comm_memb_get_expiry_realtime(memb, &tmp)));
         tr_comm_table_remove_memb(trps->ctable, memb);
-        tr_comm_memb_free(memb);
+        g_ptr_array_add(flushed, memb);
       } else {
         /* This is the first expiration. Note this and reset the expiry time. */
         tr_comm_memb_expire(memb);
@@ -1337,8 +2207,11 @@ TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps)
     }
   }
 
+  g_ptr_array_free(flushed, TRUE);
+
   /* get rid of any unreferenced realms, etc */
   tr_comm_table_sweep(trps->ctable);
+  rc=TRP_SUCCESS;
 
 cleanup:
   talloc_free(tmp_ctx);
@@ -1455,6 +2328,14 @@ static TRP_ROUTE *trps_select_realm_update(TRPS_INSTANCE *trps, TR_NAME *comm, T
     return NULL;
   }
 
+  /* Do not pass on routes restored from saved state until the peer confirms them. */
+  if (trp_route_is_provisional(route)) {
+    tr_debug("trps_select_realm_update: selected route for %.*s/%.*s is provisional, not advertising",
+             realm->len, realm->buf,
+             comm->len, comm->buf);
+    return NULL;
+  }
+
   /* Check whether it's local. */
   if (trp_route_is_local(route)) {
     /* It is always ok to announce a local route */
@@ -1469,6 +2350,10 @@ static TRP_ROUTE *trps_select_realm_update(TRPS_INSTANCE *trps, TR_NAME *comm, T
              realm->len, realm->buf,
              comm->len, comm->buf);
     route_peer = trp_ptable_find_gss_name(trps->ptable, trp_route_get_peer(route));
+    if ((route_peer == NULL) && trps_route_retracted(trps, route)) {
+      /* the peer has been removed from the configuration, withdraw its route */
+      return route;
+    }
     if (route_peer == NULL) {
       tr_err("trps_select_realm_update: unknown peer GSS name (%.*s) for selected route for %.*s/%.*s",
              trp_route_get_peer(route)->len, trp_route_get_peer(route)->buf,
@@ -1505,12 +2390,15 @@ static TRP_ROUTE *trps_select_realm_update(TRPS_INSTANCE *trps, TR_NAME *comm, T
   return route;
 }
 
-/* Add TRP_UPD msgs to the updates GPtrArray. Caller needs to arrange for these to be freed. */
+/* Add TRP_UPD msgs to the updates GPtrArray. Caller needs to arrange for these to be freed.
+ * If exclusions is not NULL, a record of every route withheld or replaced by the split
+ * horizon rule is appended to it. */
 static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
                                                  GPtrArray *updates,
                                                  TRPS_INSTANCE *trps,
                                                  TR_NAME *peer_label,
-                                                 int triggered)
+                                                 int triggered,
+                                                 GString *exclusions)
 {
   size_t n_comm=0;
   TR_NAME **comm=trp_rtable_get_comms(trps->rtable, &n_comm);
@@ -1518,6 +2406,7 @@ static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
   size_t n_realm=0;
   size_t ii=0, jj=0;
   TRP_ROUTE *best=NULL;
+  TRP_ROUTE *selected=NULL;
   TRP_UPD *upd=NULL;
 
   if (updates==NULL)
@@ -1527,6 +2416,11 @@ static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
     realm=trp_rtable_get_comm_realms(trps->rtable, comm[ii], &n_realm);
     for (jj=0; jj<n_realm; jj++) {
       best=trps_select_realm_update(trps, comm[ii], realm[jj], peer_label);
+      if (exclusions!=NULL) {
+        selected=trp_rtable_get_selected_entry(trps->rtable, comm[ii], realm[jj]);
+        if (best!=selected)
+          g_string_append_printf(exclusions, "%p>%p;", (void *)selected, (void *)best);
+      }
       /* If we found a route, add it to the list. If triggered!=0, then only
        * add triggered routes. */
       if ((best!=NULL) && ((!triggered) || trp_route_is_triggered(best))) {
@@ -1551,7 +2445,7 @@ static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
   return TRP_SUCCESS;
 }
 
-static TRP_INFOREC *trps_memb_to_inforec(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_COMM_MEMB *memb)
+TRP_INFOREC *trps_memb_to_inforec(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_COMM_MEMB *memb)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TRP_INFOREC *rec=NULL;
@@ -1662,6 +2556,8 @@ static TRP_UPD *trps_comm_update(TALLOC_CTX *mem_ctx,
     for (memb=tr_comm_memb_iter_first(iter, memb);
          memb!=NULL;
          memb=tr_comm_memb_iter_next(iter)) {
+      if (tr_comm_memb_is_provisional(memb))
+        continue; /* restored from saved state, wait for the peer to confirm it */
       rec=trps_memb_to_inforec(tmp_ctx, trps, memb);
       if (rec==NULL) {
         tr_err("trps_comm_update: unable to allocate inforec.");
@@ -1735,84 +2631,477 @@ static TRP_RC trps_select_comm_updates_for_peer(TALLOC_CTX *mem_ctx,
 
 cleanup:
   talloc_free(tmp_ctx);
-  return rc;
+  return rc;
+}
+
+/**
+ * Filter the inforecs in a single update
+ *
+ * @param filt The filter to apply
+ * @param upd The update to filter
+ */
+static void trps_filter_one_outbound_update(TR_FILTER *filt, TRP_UPD *upd)
+{
+  TRP_INFOREC *this=NULL, *next=NULL;
+  TR_FILTER_ACTION action=TR_FILTER_ACTION_REJECT;
+  TR_FILTER_TARGET *target=NULL;
+
+  for(this=trp_upd_get_inforec(upd); this!=NULL; this=next) {
+    next=this->next;
+    target= tr_filter_target_trp_inforec(NULL, upd, this);
+    if (target==NULL) {
+      /* TODO: signal that filtering failed. Until then, just filter everything and give an error message. */
+      tr_crit("trps_filter_one_outbound_update: Unable to allocate filter target, cannot apply filter!");
+    }
+    if ((target==NULL)
+        || (TR_FILTER_NO_MATCH==tr_filter_apply(target, filt, NULL, &action))
+        || (action!=TR_FILTER_ACTION_ACCEPT)) {
+      /* Either no filter matched or one matched and rejected this record.
+       * Also filter out record if we were unable to allocate a target. */
+      trp_upd_remove_inforec(upd, this); /* "this" is now invalid */
+    }
+    if (target!=NULL)
+      tr_filter_target_free(target);
+  }
+}
+
+/**
+ * May shuffle the update list.
+ *
+ * @param filters The filter set for the relevant TRP peer
+ * @param updates GPtrArray of updates to filter
+ */
+static void trps_filter_outbound_updates(TR_FILTER_SET *filters, GPtrArray *updates)
+{
+  TRP_UPD *upd=NULL;
+  guint ii=0;
+
+  /* Walk backward through the array so we can remove elements. Careful about loop
+   * termination - remember that ii is unsigned. */
+  for (ii=updates->len; ii>0; ii--) {
+    upd=g_ptr_array_index(updates, ii-1);
+    trps_filter_one_outbound_update(tr_filter_set_get(filters, TR_FILTER_TYPE_TRP_OUTBOUND), upd);
+    /* see if we removed all the records from this update */
+    if (trp_upd_num_inforecs(upd)==0)
+      g_ptr_array_remove_index_fast(updates, ii-1); /* does not preserve order at index ii or higher */
+  }
+}
+
+/* helper for trps_update_one_peer. Frees the TRP_UPD pointed to by a GPtrArray element */
+static void trps_trp_upd_destroy(gpointer data)
+{
+  trp_upd_free((TRP_UPD *)data);
+}
+
+/* helper for trps_encode_updates. Encodes a chain of updates as a single message. */
+static GBytes *trps_encode_upd_chain(TRP_UPD *head)
+{
+  TR_MSG msg; /* not a pointer! */
+  char *encoded=NULL;
+  GBytes *bytes=NULL;
+
+  tr_msg_set_trp_upd(&msg, head);
+  encoded=tr_msg_encode(NULL, &msg);
+  if (encoded==NULL) {
+    tr_err("trps_encode_upd_chain: error encoding update.");
+    return NULL;
+  }
+  bytes=g_bytes_new(encoded, strlen(encoded)+1); /* keep the null terminator */
+  tr_msg_free_encoded(encoded);
+  return bytes;
+}
+
+/* encode a refresh marker as a message */
+static GBytes *trps_encode_refresh(TRP_REFRESH_MARKER *refresh)
+{
+  TR_MSG msg; /* not a pointer! */
+  char *encoded=NULL;
+  GBytes *bytes=NULL;
+
+  tr_msg_set_trp_refresh(&msg, refresh);
+  encoded=tr_msg_encode(NULL, &msg);
+  if (encoded==NULL) {
+    tr_err("trps_encode_refresh: error encoding refresh marker.");
+    return NULL;
+  }
+  bytes=g_bytes_new(encoded, strlen(encoded)+1); /* keep the null terminator */
+  tr_msg_free_encoded(encoded);
+  return bytes;
+}
+
+/**
+ * Drop updates that the peer already has from an array of (filtered) updates
+ *
+ * Each update is compared with what was last advertised to the peer. Unchanged updates
+ * are removed from the array and, if refresh is not NULL, listed in it instead. If full
+ * is nonzero, nothing is removed. The indices of the updates kept are recorded in kept,
+ * which identifies the result for the update cache.
+ *
+ * The peer's sent state is not modified here. Every update considered, kept or not, is
+ * added to pending so that the caller can record it with trps_record_sent() once the
+ * messages have actually been queued.
+ *
+ * @param peer Peer the updates are for
+ * @param updates Array of TRP_UPD pointers, modified in place
+ * @param full Keep every update if nonzero
+ * @param refresh Refresh marker to add unchanged entries to, or NULL
+ * @param kept String to append kept indices to
+ * @param pending Hash table from sent key to summary, both g_malloc'ed, added to
+ */
+static void trps_select_changed_updates(TRP_PEER *peer,
+                                        GPtrArray *updates,
+                                        int full,
+                                        TRP_REFRESH_MARKER *refresh,
+                                        GString *kept,
+                                        GHashTable *pending)
+{
+  TRP_UPD *upd=NULL;
+  gchar *key=NULL;
+  gchar *summary=NULL;
+  int unchanged=0;
+  guint n_before=updates->len;
+  guint ii=0;
+
+  /* Walk backward so we can remove elements. Remember that ii is unsigned. */
+  for (ii=updates->len; ii>0; ii--) {
+    upd=g_ptr_array_index(updates, ii-1);
+    key=trps_upd_sent_key(upd);
+    summary=trps_upd_summary(upd, 0);
+    unchanged=trp_peer_sent_matches(peer, key, summary);
+    g_hash_table_replace(pending, key, summary); /* pending now owns key and summary */
+
+    if (unchanged && !full) {
+      if (refresh!=NULL) {
+        trp_refresh_marker_add(refresh,
+                               trp_inforec_get_type(trp_upd_get_inforec(upd)),
+                               trp_upd_dup_comm(upd),
+                               trp_upd_dup_realm(upd));
+      }
+      g_ptr_array_remove_index(updates, ii-1); /* preserves order, frees the update */
+    } else
+      g_string_append_printf(kept, "%u,", ii-1);
+  }
+  tr_debug("trps_select_changed_updates: %u of %u updates changed.", updates->len, n_before);
+}
+
+/* Record the entries collected by trps_select_changed_updates() as sent to the peer */
+static void trps_record_sent(TRP_PEER *peer, GHashTable *pending)
+{
+  GHashTableIter iter;
+  gpointer key=NULL;
+  gpointer summary=NULL;
+
+  g_hash_table_iter_init(&iter, pending);
+  while (g_hash_table_iter_next(&iter, &key, &summary))
+    trp_peer_sent_record(peer, (const char *)key, (const char *)summary);
+}
+
+/**
+ * Drop updates in digest buckets where the peer already agrees with us
+ *
+ * The peer's digest summarizes what it holds from us. We summarize the (filtered)
+ * updates we would send it in the same way and keep only updates in buckets that
+ * differ. If the peer's digest is malformed or uses a different number of buckets,
+ * nothing matches and everything is kept.
+ *
+ * @param updates Array of TRP_UPD pointers, modified in place
+ * @param peer_digest Digest received from the peer
+ */
+static void trps_prune_by_digest(GPtrArray *updates, TRP_DIGEST *peer_digest)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_DIGEST *our_digest=NULL;
+  TRP_UPD *upd=NULL;
+  gchar *key=NULL;
+  gchar *summary=NULL;
+  guint n_before=updates->len;
+  guint ii=0;
+
+  our_digest=trp_digest_new(tmp_ctx, trp_digest_get_n_buckets(peer_digest));
+  if (our_digest==NULL) {
+    tr_debug("trps_prune_by_digest: unable to allocate digest, sending everything.");
+    goto cleanup;
+  }
+
+  for (ii=0; ii<updates->len; ii++) {
+    upd=g_ptr_array_index(updates, ii);
+    key=trps_upd_sent_key(upd);
+    summary=trps_upd_summary(upd, 0);
+    trp_digest_add(our_digest, trp_upd_get_comm(upd), trp_upd_get_realm(upd), key, summary);
+    g_free(key);
+    g_free(summary);
+  }
+
+  if (trp_digest_equal(our_digest, peer_digest)) {
+    g_ptr_array_set_size(updates, 0); /* frees the updates */
+  } else {
+    /* Walk backward so we can remove elements. Remember that ii is unsigned. */
+    for (ii=updates->len; ii>0; ii--) {
+      upd=g_ptr_array_index(updates, ii-1);
+      if (trp_digest_bucket_matches(our_digest,
+                                    peer_digest,
+                                    trp_digest_bucket_index(our_digest,
+                                                            trp_upd_get_comm(upd),
+                                                            trp_upd_get_realm(upd))))
+        g_ptr_array_remove_index(updates, ii-1);
+    }
+  }
+  tr_debug("trps_prune_by_digest: peer is missing or out of date for %u of %u updates.", updates->len, n_before);
+
+cleanup:
+  talloc_free(tmp_ctx);
+}
+
+/* supersede key for refresh markers, a newer marker makes an unsent one obsolete */
+#define TRPS_REFRESH_KEY "refresh"
+
+/* an encoded message ready to queue to one or more peers */
+typedef struct trps_encoded_msg {
+  GBytes *bytes;
+  gchar *key; /* supersede key, NULL if the message does not make earlier ones obsolete */
+} TRPS_ENCODED_MSG;
+
+/* steals bytes and key */
+static TRPS_ENCODED_MSG *trps_encoded_msg_new(GBytes *bytes, gchar *key)
+{
+  TRPS_ENCODED_MSG *msg=g_malloc(sizeof(TRPS_ENCODED_MSG));
+  msg->bytes=bytes;
+  msg->key=key;
+  return msg;
+}
+
+/* helper for trps_encode_updates. Frees the TRPS_ENCODED_MSG pointed to by a GPtrArray element */
+static void trps_encoded_msg_free(gpointer data)
+{
+  TRPS_ENCODED_MSG *msg=(TRPS_ENCODED_MSG *)data;
+  g_bytes_unref(msg->bytes);
+  g_free(msg->key);
+  g_free(msg);
 }
 
 /**
- * Filter the inforecs in a single update
+ * Encode a chain of updates as one or more messages
  *
- * @param filt The filter to apply
- * @param upd The update to filter
+ * If the encoded message would be larger than TRPS_UPDATE_MAX_MSG_BYTES, the chain is
+ * split in half and each half is encoded separately, so only oversized chains are
+ * encoded more than once. A single update is always sent, however large it is. The
+ * chain may be left split.
+ *
+ * @param msgs Array of TRPS_ENCODED_MSG to append the messages to
+ * @param head First update in the chain
+ * @param n_upds Number of updates in the chain
+ * @return 0 on success, -1 on error
  */
-static void trps_filter_one_outbound_update(TR_FILTER *filt, TRP_UPD *upd)
+static int trps_encode_upd_chain_bounded(GPtrArray *msgs, TRP_UPD *head, guint n_upds)
 {
-  TRP_INFOREC *this=NULL, *next=NULL;
-  TR_FILTER_ACTION action=TR_FILTER_ACTION_REJECT;
-  TR_FILTER_TARGET *target=NULL;
+  GBytes *bytes=NULL;
+  TRP_UPD *last=NULL;
+  TRP_UPD *second=NULL;
+  guint n_first=n_upds/2;
+  guint ii=0;
 
-  for(this=trp_upd_get_inforec(upd); this!=NULL; this=next) {
-    next=this->next;
-    target= tr_filter_target_trp_inforec(NULL, upd, this);
-    if (target==NULL) {
-      /* TODO: signal that filtering failed. Until then, just filter everything and give an error message. */
-      tr_crit("trps_filter_one_outbound_update: Unable to allocate filter target, cannot apply filter!");
-    }
-    if ((target==NULL)
-        || (TR_FILTER_NO_MATCH==tr_filter_apply(target, filt, NULL, &action))
-        || (action!=TR_FILTER_ACTION_ACCEPT)) {
-      /* Either no filter matched or one matched and rejected this record.
-       * Also filter out record if we were unable to allocate a target. */
-      trp_upd_remove_inforec(upd, this); /* "this" is now invalid */
-    }
-    if (target!=NULL)
-      tr_filter_target_free(target);
+  bytes=trps_encode_upd_chain(head);
+  if (bytes==NULL)
+    return -1;
+
+  if ((n_upds<=1) || (g_bytes_get_size(bytes)<=TRPS_UPDATE_MAX_MSG_BYTES)) {
+    g_ptr_array_add(msgs, trps_encoded_msg_new(bytes, (n_upds==1)?trps_upd_sent_key(head):NULL));
+    return 0;
   }
+
+  tr_debug("trps_encode_upd_chain_bounded: %zu byte message for %u updates is too large, splitting.",
+           g_bytes_get_size(bytes), n_upds);
+  g_bytes_unref(bytes);
+  for (last=head, ii=1; ii<n_first; ii++)
+    last=trp_upd_get_next(last);
+  second=trp_upd_get_next(last);
+  trp_upd_set_next(last, NULL);
+  if (0!=trps_encode_upd_chain_bounded(msgs, head, n_first))
+    return -1;
+  return trps_encode_upd_chain_bounded(msgs, second, n_upds-n_first);
 }
 
 /**
- * May shuffle the update list.
+ * Encode an array of updates, packing several updates into each message
  *
- * @param filters The filter set for the relevant TRP peer
- * @param updates GPtrArray of updates to filter
+ * Updates are taken in order and chained together until adding the next one would
+ * put more than trps->update_max_records inforecs in the message. An update that
+ * exceeds the limit on its own is encoded in a message by itself. Chains whose
+ * encoding is larger than TRPS_UPDATE_MAX_MSG_BYTES are split further. The chains are
+ * broken again before returning so the array elements can be freed individually.
+ *
+ * A message carrying a single update gets a supersede key naming its route or
+ * community membership, so a newer update replaces it if it is still queued.
+ *
+ * @param trps Server instance
+ * @param updates Array of TRP_UPD pointers
+ * @return Array of TRPS_ENCODED_MSG holding the encoded messages, or NULL on error
  */
-static void trps_filter_outbound_updates(TR_FILTER_SET *filters, GPtrArray *updates)
+static GPtrArray *trps_encode_updates(TRPS_INSTANCE *trps, GPtrArray *updates)
 {
+  GPtrArray *msgs=g_ptr_array_new_with_free_func(trps_encoded_msg_free);
+  TRP_UPD *head=NULL;
+  TRP_UPD *tail=NULL;
   TRP_UPD *upd=NULL;
+  size_t n_recs=0;
+  size_t upd_recs=0;
+  guint n_upds=0;
   guint ii=0;
 
-  /* Walk backward through the array so we can remove elements. Careful about loop
-   * termination - remember that ii is unsigned. */
-  for (ii=updates->len; ii>0; ii--) {
-    upd=g_ptr_array_index(updates, ii-1);
-    trps_filter_one_outbound_update(tr_filter_set_get(filters, TR_FILTER_TYPE_TRP_OUTBOUND), upd);
-    /* see if we removed all the records from this update */
-    if (trp_upd_num_inforecs(upd)==0)
-      g_ptr_array_remove_index_fast(updates, ii-1); /* does not preserve order at index ii or higher */
+  if (msgs==NULL)
+    return NULL;
+
+  for (ii=0; ii<=updates->len; ii++) {
+    if (ii<updates->len) {
+      upd=(TRP_UPD *) g_ptr_array_index(updates, ii);
+      upd_recs=trp_upd_num_inforecs(upd);
+    } else {
+      upd=NULL; /* flush whatever remains */
+    }
+
+    /* encode the pending chain if this update will not fit */
+    if ((head!=NULL) && ((upd==NULL) || (n_recs+upd_recs > trps->update_max_records))) {
+      if (0!=trps_encode_upd_chain_bounded(msgs, head, n_upds)) {
+        g_ptr_array_unref(msgs);
+        msgs=NULL;
+        break;
+      }
+      head=NULL;
+    }
+
+    if (upd==NULL)
+      break;
+
+    trp_upd_set_next(upd, NULL);
+    if (head==NULL) {
+      head=upd;
+      n_recs=0;
+      n_upds=0;
+    } else
+      trp_upd_set_next(tail, upd);
+    tail=upd;
+    n_recs+=upd_recs;
+    n_upds++;
   }
+
+  /* unlink the chains */
+  for (ii=0; ii<updates->len; ii++)
+    trp_upd_set_next((TRP_UPD *) g_ptr_array_index(updates, ii), NULL);
+
+  if (msgs!=NULL)
+    tr_debug("trps_encode_updates: encoded %u updates in %u messages.", updates->len, msgs->len);
+  return msgs;
 }
 
-/* helper for trps_update_one_peer. Frees the TRP_UPD pointed to by a GPtrArray element */
-static void trps_trp_upd_destroy(gpointer data)
+/**
+ * Cache of encoded update messages, valid for a single update cycle
+ *
+ * Within one call to trps_update() the route and community tables do not change.
+ * The messages sent to a peer are then determined entirely by the update type,
+ * the peer's outbound filters, and which selected routes were withheld or replaced
+ * for that peer by the split horizon rule. When sending deltas, they also depend
+ * on which entries changed since the last update to the peer. Peers that agree on
+ * all of these get byte-identical messages, so those are encoded once and shared
+ * by reference.
+ */
+typedef struct trps_upd_cache {
+  GHashTable *msgs; /* key string -> GPtrArray of TRPS_ENCODED_MSG */
+  unsigned int hits;
+  unsigned int misses;
+} TRPS_UPD_CACHE;
+
+static int trps_upd_cache_destructor(void *object)
 {
-  trp_upd_free((TRP_UPD *)data);
+  TRPS_UPD_CACHE *cache=talloc_get_type_abort(object, TRPS_UPD_CACHE);
+  if (cache->msgs!=NULL)
+    g_hash_table_destroy(cache->msgs);
+  return 0;
+}
+
+static void trps_msgs_unref(gpointer data)
+{
+  g_ptr_array_unref((GPtrArray *)data);
+}
+
+static TRPS_UPD_CACHE *trps_upd_cache_new(TALLOC_CTX *mem_ctx)
+{
+  TRPS_UPD_CACHE *cache=talloc(mem_ctx, TRPS_UPD_CACHE);
+  if (cache!=NULL) {
+    cache->hits=0;
+    cache->misses=0;
+    cache->msgs=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, trps_msgs_unref);
+    if (cache->msgs==NULL) {
+      talloc_free(cache);
+      return NULL;
+    }
+    talloc_set_destructor((void *)cache, trps_upd_cache_destructor);
+  }
+  return cache;
+}
+
+/* Build the cache key for a peer. Caller must g_free() the result. */
+static gchar *trps_upd_cache_key(TRP_PEER *peer,
+                                 TRP_UPDATE_TYPE update_type,
+                                 GString *exclusions,
+                                 GString *kept)
+{
+  const char *filt_id=tr_filter_set_get_id(peer->filters);
+
+  /* The filter set's id is a digest of its contents, so peers with identically
+   * configured filters share a key. kept is only set when sending deltas, it
+   * identifies which of the filtered updates survive. */
+  return g_strdup_printf("%d|%s|%s|%s",
+                         update_type,
+                         (filt_id==NULL)?"":filt_id,
+                         exclusions->str,
+                         (kept==NULL)?"*":kept->str);
+}
+
+/* Queue each encoded message to the peer. Returns TRP_ERROR if any could not be queued. */
+static TRP_RC trps_send_encoded_updates(TRPS_INSTANCE *trps, TRP_PEER *peer, GPtrArray *msgs)
+{
+  TRPS_ENCODED_MSG *msg=NULL;
+  TRP_RC rc=TRP_SUCCESS;
+  guint ii=0;
+
+  for (ii=0; ii<msgs->len; ii++) {
+    msg=(TRPS_ENCODED_MSG *) g_ptr_array_index(msgs, ii);
+    if (trps_send_bytes(trps, peer, msg->bytes, msg->key)!=TRP_SUCCESS) {
+      tr_err("trps_send_encoded_updates: error queueing update.");
+      rc=TRP_ERROR;
+    }
+  }
+  return rc;
 }
 
-/* all routes/communities to a single peer, unless comm/realm are specified (both or neither must be NULL) */
+/* all routes/communities to a single peer, unless comm/realm are specified (both or neither must be NULL).
+ * If digest is not NULL, it summarizes what the peer already has from us and only entries that differ
+ * are sent. If cache is not NULL, encoded messages are shared with other peers through it. The digest
+ * and cache are only used when comm/realm are NULL. */
 static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
                                    TRP_PEER *peer,
                                    TRP_UPDATE_TYPE update_type,
                                    TR_NAME *realm,
-                                   TR_NAME *comm)
+                                   TR_NAME *comm,
+                                   TRP_DIGEST *digest,
+                                   TRPS_UPD_CACHE *cache)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  TR_MSG msg; /* not a pointer! */
   TRP_UPD *upd=NULL;
   TRP_ROUTE *route=NULL;
-  size_t ii=0;
-  char *encoded=NULL;
   TRP_RC rc=TRP_ERROR;
   TR_NAME *peer_label=trp_peer_get_label(peer);
   GPtrArray *updates=g_ptr_array_new_with_free_func(trps_trp_upd_destroy);
+  GString *exclusions=NULL;
+  GString *kept=NULL;
+  gchar *key=NULL;
+  GPtrArray *msgs=NULL;
+  GBytes *bytes=NULL;
+  TRP_REFRESH_MARKER *refresh=NULL;
+  GHashTable *pending=NULL;
+  int delta=trps->update_delta && (comm==NULL) && (realm==NULL);
+  int filtered=0;
+  int sent=1;
 
   if (updates==NULL) {
     tr_err("trps_update_one_peer: unable to allocate updates array.");
@@ -1839,15 +3128,44 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
     goto cleanup;
   }
 
+  /* Hold off on routine updates to a peer that is not keeping up. Nothing is recorded
+   * as sent, and the peer is flagged so that it gets a scheduled update once it catches
+   * up. The triggered flags are cleared after every pass, so a deferred triggered update
+   * could not be repeated as such. */
+  if ((update_type!=TRP_UPDATE_REQUESTED) && trps_peer_backlogged(trps, peer)) {
+    tr_notice("trps_update_one_peer: send queue to %.*s is backed up, deferring update.",
+              peer_label->len, peer_label->buf);
+    trp_peer_set_update_deferred(peer, 1);
+    rc=TRP_SUCCESS;
+    goto cleanup;
+  }
+
+  if (trp_peer_get_update_deferred(peer) && (update_type==TRP_UPDATE_TRIGGERED)) {
+    tr_debug("trps_update_one_peer: an earlier update to %.*s was deferred, sending scheduled update instead.",
+             peer_label->len, peer_label->buf);
+    update_type=TRP_UPDATE_SCHEDULED;
+  }
+  if ((update_type!=TRP_UPDATE_TRIGGERED) && (comm==NULL) && (realm==NULL))
+    trp_peer_set_update_deferred(peer, 0); /* this update covers everything */
+
   /* First, gather route updates. */
   tr_debug("trps_update_one_peer: selecting route updates for %.*s.", peer_label->len, peer_label->buf);
   if ((comm==NULL) && (realm==NULL)) {
     /* do all realms */
+    if (cache!=NULL) {
+      exclusions=g_string_new(NULL);
+      if (exclusions==NULL) {
+        tr_err("trps_update_one_peer: unable to allocate exclusions string.");
+        rc=TRP_NOMEM;
+        goto cleanup;
+      }
+    }
     rc=trps_select_route_updates_for_peer(tmp_ctx,
                                           updates,
                                           trps,
                                           peer_label,
-                                          update_type==TRP_UPDATE_TRIGGERED);
+                                          update_type==TRP_UPDATE_TRIGGERED,
+                                          exclusions);
   } else if ((comm!=NULL) && (realm!=NULL)) {
     /* a single community/realm was requested */
     route=trps_select_realm_update(trps, comm, realm, peer_label);
@@ -1880,42 +3198,114 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
   rc=trps_select_comm_updates_for_peer(tmp_ctx, updates, trps, peer_label, update_type==TRP_UPDATE_TRIGGERED);
 
   /* see if we have anything to send */
-  if (updates->len<=0)
+  if (updates->len<=0) {
     tr_debug("trps_update_one_peer: no updates for %.*s", peer_label->len, peer_label->buf);
-  else {
-    /* Apply outbound TRP filters for this peer */
+    if (delta && (update_type==TRP_UPDATE_SCHEDULED))
+      trp_peer_sent_sweep(peer); /* we advertise nothing to this peer now */
+    rc=TRP_SUCCESS;
+    goto cleanup;
+  }
+
+  /* When sending deltas, drop anything the peer already has. Scheduled updates list the
+   * unchanged entries in a refresh marker so the peer knows they are still valid. Triggered
+   * and requested updates are always sent in full. Either way, the sent state is only
+   * updated once the messages have been queued. */
+  if (delta) {
+    /* filter first so the sent state reflects what the peer actually receives */
     trps_filter_outbound_updates(peer->filters, updates);
+    filtered=1;
 
-    if (updates->len<=0)
-      tr_debug("trps_update_one_peer: no updates for %.*s after filtering.", peer_label->len, peer_label->buf);
-    else {
-      tr_debug("trps_update_one_peer: sending %d update messages.", updates->len);
-      for (ii=0; ii<updates->len; ii++) {
-        upd = (TRP_UPD *) g_ptr_array_index(updates, ii);
-        /* now encode the update message */
-        tr_msg_set_trp_upd(&msg, upd);
-        encoded = tr_msg_encode(NULL, &msg);
-        if (encoded == NULL) {
-          tr_err("trps_update_one_peer: error encoding update.");
-          rc = TRP_ERROR;
-          goto cleanup;
-        }
+    if (update_type==TRP_UPDATE_SCHEDULED) {
+      refresh=trp_refresh_marker_new(tmp_ctx);
+      if (refresh==NULL) {
+        tr_err("trps_update_one_peer: unable to allocate refresh marker.");
+        rc=TRP_NOMEM;
+        goto cleanup;
+      }
+    }
+    kept=g_string_new(NULL);
+    pending=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    trps_select_changed_updates(peer, updates, update_type!=TRP_UPDATE_SCHEDULED, refresh, kept, pending);
+  }
 
-        tr_debug("trps_update_one_peer: adding message to queue.");
-        if (trps_send_msg(trps, peer, encoded) != TRP_SUCCESS)
-          tr_err("trps_update_one_peer: error queueing update.");
-        else
-          tr_debug("trps_update_one_peer: update queued successfully.");
+  /* After a reconnect, the peer may already have most of what we would send it */
+  if ((digest!=NULL) && (comm==NULL) && (realm==NULL)) {
+    if (!filtered) {
+      trps_filter_outbound_updates(peer->filters, updates);
+      filtered=1;
+    }
+    trps_prune_by_digest(updates, digest);
+  }
+
+  /* See if another peer already needed the same messages this cycle */
+  if (exclusions!=NULL) {
+    key=trps_upd_cache_key(peer, update_type, exclusions, kept);
+    msgs=g_hash_table_lookup(cache->msgs, key);
+    if (msgs!=NULL) {
+      tr_debug("trps_update_one_peer: reusing encoded updates for %.*s.", peer_label->len, peer_label->buf);
+      g_ptr_array_ref(msgs);
+      cache->hits++;
+    }
+  }
 
-        tr_msg_free_encoded(encoded);
-        encoded = NULL;
+  if (msgs==NULL) {
+    /* Apply outbound TRP filters for this peer */
+    if (!filtered)
+      trps_filter_outbound_updates(peer->filters, updates);
+    msgs=trps_encode_updates(trps, updates);
+    if (msgs==NULL) {
+      tr_err("trps_update_one_peer: error encoding updates for %.*s.", peer_label->len, peer_label->buf);
+      rc=TRP_ERROR;
+      goto cleanup;
+    }
+    if (trp_refresh_marker_num_items(refresh)>0) {
+      bytes=trps_encode_refresh(refresh);
+      if (bytes==NULL) {
+        tr_err("trps_update_one_peer: error encoding refresh marker for %.*s.", peer_label->len, peer_label->buf);
+        rc=TRP_ERROR;
+        goto cleanup;
       }
+      g_ptr_array_add(msgs, trps_encoded_msg_new(bytes, g_strdup(TRPS_REFRESH_KEY))); /* array now owns bytes */
+    }
+    if (key!=NULL) {
+      g_hash_table_insert(cache->msgs, key, g_ptr_array_ref(msgs));
+      key=NULL; /* now belongs to the cache */
+      cache->misses++;
+    }
+  }
+
+  if (msgs->len<=0)
+    tr_debug("trps_update_one_peer: no updates for %.*s after filtering.", peer_label->len, peer_label->buf);
+  else {
+    tr_debug("trps_update_one_peer: sending %d update messages.", msgs->len);
+    if (trps_send_encoded_updates(trps, peer, msgs)!=TRP_SUCCESS) {
+      tr_err("trps_update_one_peer: error sending updates to %.*s.", peer_label->len, peer_label->buf);
+      sent=0;
     }
   }
 
+  if (pending!=NULL) {
+    if (sent) {
+      trps_record_sent(peer, pending);
+      if (update_type==TRP_UPDATE_SCHEDULED)
+        trp_peer_sent_sweep(peer); /* forget anything we no longer advertise */
+    } else
+      trp_peer_sent_clear(peer); /* we do not know what the peer has, send everything next time */
+  }
+
   rc=TRP_SUCCESS;
 
 cleanup:
+  if (msgs!=NULL)
+    g_ptr_array_unref(msgs);
+  if (key!=NULL)
+    g_free(key);
+  if (exclusions!=NULL)
+    g_string_free(exclusions, TRUE);
+  if (kept!=NULL)
+    g_string_free(kept, TRUE);
+  if (pending!=NULL)
+    g_hash_table_destroy(pending);
   if (updates!=NULL)
     g_ptr_array_free(updates, TRUE); /* frees any TRP_UPD records */
   talloc_free(tmp_ctx);
@@ -1928,10 +3318,13 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TRP_PTABLE_ITER *iter=trp_ptable_iter_new(tmp_ctx);
   TRP_PEER *peer=NULL;
+  TRPS_UPD_CACHE *cache=NULL;
   TRP_RC rc=TRP_SUCCESS;
 
-  if (trps->ptable==NULL)
+  if (trps->ptable==NULL) {
+    talloc_free(tmp_ctx);
     return TRP_SUCCESS; /* no peers, nothing to do */
+  }
 
   if (iter==NULL) {
     tr_err("trps_update: failed to allocate peer table iterator.");
@@ -1939,6 +3332,11 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
     return TRP_NOMEM;
   }
 
+  /* Share encoded messages between peers for this cycle. If allocation fails, just do without. */
+  cache=trps_upd_cache_new(tmp_ctx);
+  if (cache==NULL)
+    tr_warning("trps_update: unable to allocate update cache, encoding separately for each peer.");
+
   for (peer=trp_ptable_iter_first(iter, trps->ptable);
        (peer!=NULL) && (rc==TRP_SUCCESS);
        peer=trp_ptable_iter_next(iter))
@@ -1949,9 +3347,11 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
                peer_label->len, peer_label->buf);
       continue;
     }
-    rc=trps_update_one_peer(trps, peer, update_type, NULL, NULL);
+    rc=trps_update_one_peer(trps, peer, update_type, NULL, NULL, NULL, cache);
   }
 
+  if (cache!=NULL)
+    tr_debug("trps_update: encoded %u distinct update sets, reused %u.", cache->misses, cache->hits);
   tr_debug("trps_update: rc=%u after attempting update.", rc);
   trp_ptable_iter_free(iter);
   trp_rtable_clear_triggered(trps->rtable); /* don't re-send triggered updates */
@@ -1959,8 +3359,45 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
   return rc;
 }        
 
+/* Send scheduled updates to connected peers whose earlier updates were deferred because
+ * their send queues were backed up, if they have caught up since. */
+TRP_RC trps_update_deferred(TRPS_INSTANCE *trps)
+{
+  TRP_PTABLE_ITER *iter=NULL;
+  TRP_PEER *peer=NULL;
+  TRP_RC rc=TRP_SUCCESS;
+
+  if (trps->ptable==NULL)
+    return TRP_SUCCESS; /* no peers, nothing to do */
+
+  iter=trp_ptable_iter_new(NULL);
+  if (iter==NULL) {
+    tr_err("trps_update_deferred: failed to allocate peer table iterator.");
+    return TRP_NOMEM;
+  }
+
+  for (peer=trp_ptable_iter_first(iter, trps->ptable); peer!=NULL; peer=trp_ptable_iter_next(iter)) {
+    if (!trp_peer_get_update_deferred(peer)
+        || !trps_peer_connected(trps, peer)
+        || trps_peer_backlogged(trps, peer))
+      continue;
+
+    if (trps_update_one_peer(trps, peer, TRP_UPDATE_SCHEDULED, NULL, NULL, NULL, NULL)!=TRP_SUCCESS)
+      rc=TRP_ERROR;
+  }
+  trp_ptable_iter_free(iter);
+  return rc;
+}
+
 TRP_RC trps_add_route(TRPS_INSTANCE *trps, TRP_ROUTE *route)
 {
+  TRP_ROUTE *old=trp_rtable_get_entry(trps->rtable,
+                                      trp_route_get_comm(route),
+                                      trp_route_get_realm(route),
+                                      trp_route_get_peer(route));
+
+  if (old!=NULL)
+    trps_route_changed(trps, old); /* about to be replaced by an unselected route */
   trp_rtable_add(trps->rtable, route); /* should return status */
   return TRP_SUCCESS; 
 }
@@ -2030,19 +3467,174 @@ static TRP_RC trps_handle_request(TRPS_INSTANCE *trps, TRP_REQ *req)
                               trps_get_peer_by_gssname(trps, trp_req_get_peer(req)),
                               TRP_UPDATE_REQUESTED,
                               realm,
-                              comm);
+                              comm,
+                              trp_req_get_digest(req),
+                              NULL);
+}
+
+
+/* is the last hop in a membership's provenance the named peer? */
+static int trps_memb_last_hop_is(TR_COMM_MEMB *memb, TR_NAME *peer_label)
+{
+  TR_NAME *last_hop=tr_provenance_get_last_hop(tr_comm_memb_get_provenance(memb));
+
+  return (last_hop!=NULL) && (0==tr_name_cmp(last_hop, peer_label));
+}
+
+/* extend the expiry of routes to comm/realm learned from peer_gssname */
+static void trps_refresh_routes(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm, TR_NAME *peer_gssname)
+{
+  TRP_ROUTE **routes=NULL;
+  size_t n_routes=0;
+  size_t ii=0;
+
+  routes=trp_rtable_get_realm_entries(trps->rtable, comm, realm, &n_routes);
+  for (ii=0; ii<n_routes; ii++) {
+    if ((0==tr_name_cmp(trp_route_get_peer(routes[ii]), peer_gssname))
+        && (!trps_route_retracted(trps, routes[ii]))) {
+      trp_route_set_provisional(routes[ii], 0);
+      trp_route_set_expiry(routes[ii], trps_compute_expiry(trps,
+                                                           trp_route_get_interval(routes[ii]),
+                                                           trp_route_get_expiry(routes[ii])));
+    }
+  }
+  if (routes!=NULL)
+    talloc_free(routes);
+}
+
+/* extend the expiry of memberships of realm in comm learned from the peer labeled peer_label */
+static void trps_refresh_membs(TRPS_INSTANCE *trps,
+                               TR_COMM_ITER *iter,
+                               TR_NAME *comm,
+                               TR_NAME *realm,
+                               TR_NAME *peer_label)
+{
+  TR_COMM_MEMB *first[2]={NULL, NULL};
+  TR_COMM_MEMB *memb=NULL;
+  size_t ii=0;
+
+  first[0]=tr_comm_table_find_idp_memb(trps->ctable, realm, comm);
+  first[1]=tr_comm_table_find_rp_memb(trps->ctable, realm, comm);
+  for (ii=0; ii<2; ii++) {
+    if (first[ii]==NULL)
+      continue;
+    for (memb=tr_comm_memb_iter_first(iter, first[ii]);
+         memb!=NULL;
+         memb=tr_comm_memb_iter_next(iter)) {
+      if ((tr_comm_memb_get_origin(memb)!=NULL) && trps_memb_last_hop_is(memb, peer_label)) {
+        tr_comm_memb_set_provisional(memb, 0);
+        tr_comm_memb_reset_times_expired(memb);
+        trps_compute_expiry(trps, tr_comm_memb_get_interval(memb), tr_comm_memb_get_expiry(memb));
+      }
+    }
+  }
 }
 
+/**
+ * Handle a refresh marker from a peer
+ *
+ * Every route and community membership listed in the marker that we learned from
+ * the sending peer has its expiry extended as though we had received the full update.
+ *
+ * @param trps Server instance
+ * @param marker Refresh marker, with its peer set
+ * @return TRP_SUCCESS on success, otherwise an error code
+ */
+static TRP_RC trps_handle_refresh(TRPS_INSTANCE *trps, TRP_REFRESH_MARKER *marker)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_NAME *peer_gssname=trp_refresh_marker_get_peer(marker);
+  TRP_PEER *peer=NULL;
+  TR_NAME *peer_label=NULL;
+  TRP_REFRESH_ITEM *item=NULL;
+  TR_COMM_ITER *iter=NULL;
+  gchar *key=NULL;
+  unsigned int interval=0;
+  struct timespec expiry={0,0};
+  TRP_RC rc=TRP_ERROR;
+
+  if (peer_gssname==NULL) {
+    tr_notice("trps_handle_refresh: received invalid refresh marker.");
+    goto cleanup;
+  }
+
+  peer=trps_get_peer_by_gssname(trps, peer_gssname);
+  if (peer==NULL) {
+    tr_notice("trps_handle_refresh: refresh marker from unknown peer.");
+    goto cleanup;
+  }
+  peer_label=trp_peer_get_label(peer);
+
+  iter=tr_comm_iter_new(tmp_ctx);
+  if (iter==NULL) {
+    tr_err("trps_handle_refresh: unable to allocate iterator.");
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  tr_debug("trps_handle_refresh: refreshing %u entries from %.*s.",
+           (unsigned) trp_refresh_marker_num_items(marker),
+           peer_label->len, peer_label->buf);
+  for (item=trp_refresh_marker_get_items(marker); item!=NULL; item=trp_refresh_item_get_next(item)) {
+    switch (trp_refresh_item_get_type(item)) {
+    case TRP_INFOREC_TYPE_ROUTE:
+      trps_refresh_routes(trps,
+                          trp_refresh_item_get_comm(item),
+                          trp_refresh_item_get_realm(item),
+                          peer_gssname);
+      break;
+    case TRP_INFOREC_TYPE_COMMUNITY:
+      trps_refresh_membs(trps,
+                         iter,
+                         trp_refresh_item_get_comm(item),
+                         trp_refresh_item_get_realm(item),
+                         peer_label);
+      break;
+    default:
+      break;
+    }
+
+    /* keep our record of what the peer advertised alive as well */
+    key=trps_entry_key(trp_refresh_item_get_type(item),
+                       trp_refresh_item_get_comm(item),
+                       trp_refresh_item_get_realm(item));
+    interval=trp_peer_received_get_interval(peer, key);
+    if (interval>0)
+      trp_peer_received_set_expiry(peer, key, trps_compute_expiry(trps, interval, &expiry));
+    g_free(key);
+  }
+  rc=TRP_SUCCESS;
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return rc;
+}
 
 TRP_RC trps_handle_tr_msg(TRPS_INSTANCE *trps, TR_MSG *tr_msg)
 {
   TRP_RC rc=TRP_ERROR;
+  TRP_UPD *upd=NULL;
+  int n_handled=0;
 
   switch (tr_msg_get_msg_type(tr_msg)) {
   case TRP_UPDATE:
-    rc=trps_handle_update(trps, tr_msg_get_trp_upd(tr_msg));
-    if (rc==TRP_SUCCESS) {
-      rc=trps_update_active_routes(trps);
+    upd=tr_msg_get_trp_upd(tr_msg);
+    if (upd==NULL)
+      return TRP_ERROR;
+
+    /* Handle every update in the message. One bad update does not spoil the rest. */
+    rc=TRP_SUCCESS;
+    for ( ; upd!=NULL; upd=trp_upd_get_next(upd)) {
+      if (trps_handle_update(trps, upd)==TRP_SUCCESS)
+        n_handled++;
+      else
+        rc=TRP_ERROR;
+    }
+
+    /* recompute routes and send triggered updates once for the whole message */
+    if (n_handled>0) {
+      if (trps_update_active_routes(trps)!=TRP_SUCCESS)
+        rc=TRP_ERROR;
       trps_update(trps, TRP_UPDATE_TRIGGERED); /* send any triggered routes */
     }
     return rc;
@@ -2051,6 +3643,10 @@ TRP_RC trps_handle_tr_msg(TRPS_INSTANCE *trps, TR_MSG *tr_msg)
     rc=trps_handle_request(trps, tr_msg_get_trp_req(tr_msg));
     return rc;
 
+  case TRP_REFRESH:
+    rc=trps_handle_refresh(trps, tr_msg_get_trp_refresh(tr_msg));
+    return rc;
+
   default:
     /* unknown error or one we don't care about (e.g., TID messages) */
     return TRP_ERROR;
@@ -2064,6 +3660,8 @@ TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename)
   TRP_PEER *peer=trps_get_peer_by_servicename(trps, peer_servicename);
   TR_MSG msg; /* not a pointer */
   TRP_REQ *req=trp_req_new(tmp_ctx);
+  TRP_DIGEST *digest=NULL;
+  struct timespec now={0,0};
   char *encoded=NULL;
   TRP_RC rc=TRP_ERROR;
 
@@ -2078,6 +3676,18 @@ TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename)
     goto cleanup;
   }
 
+  /* If we still hold routes from this peer, summarize them so it only needs to
+   * send what differs. Peers that do not understand the digest send everything. */
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_wildcard_route_req: could not read clock, requesting full update.");
+  } else {
+    digest=trp_peer_received_digest(tmp_ctx, peer, &now);
+    if (digest!=NULL) {
+      tr_debug("trps_wildcard_route_req: including digest, root=%016" PRIx64 ".", trp_digest_root(digest));
+      trp_req_set_digest(req, digest);
+    }
+  }
+
   tr_msg_set_trp_req(&msg, req);
   encoded= tr_msg_encode(NULL, &msg);
   if (encoded==NULL) {
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2018, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <jansson.h>
+#include <talloc.h>
+
+#include <tr_comm.h>
+#include <tr_msg.h>
+#include <tr_name_internal.h>
+#include <tr_provenance.h>
+#include <trp_internal.h>
+#include <trp_peer.h>
+#include <trp_ptable.h>
+#include <trp_route.h>
+#include <trp_rtable.h>
+#include <tr_debug.h>
+#include <tr_util.h>
+
+/*
+ * Routing state for warm restarts
+ *
+ * The routes and community memberships learned from peers are saved as the TRP
+ * updates that would recreate them, each with the peer it came from and the time
+ * it had left before expiring:
+ *
+ *   {"version": 1, "saved": <unix time>,
+ *    "updates": [{"peer": <gss name>, "expires_in": <seconds>, "message": <encoded TRP update>}, ...]}
+ *
+ * On start, the updates are replayed through trps_restore_update(), so they are
+ * checked against the current peers and filters just as a live update would be.
+ */
+#define TRPS_STATE_VERSION 1
+
+/* seconds from now until expiry, both by TRP_CLOCK; 0 if already expired */
+static time_t trps_state_remaining(struct timespec *expiry, struct timespec *now)
+{
+  if (tr_cmp_timespec(expiry, now) <= 0)
+    return 0;
+  return expiry->tv_sec - now->tv_sec;
+}
+
+/* append one saved update to the updates array */
+static TRP_RC trps_state_add_upd(json_t *jupds, TRP_UPD *upd, TR_NAME *peer, time_t remaining)
+{
+  TR_MSG msg; /* not a pointer! */
+  json_t *jentry=NULL;
+  char *encoded=NULL;
+  char *peer_str=NULL;
+  TRP_RC rc=TRP_NOMEM;
+
+  tr_msg_set_trp_upd(&msg, upd);
+  encoded=tr_msg_encode(NULL, &msg);
+  peer_str=tr_name_strdup(peer);
+  if ((encoded==NULL) || (peer_str==NULL))
+    goto cleanup;
+
+  jentry=json_object();
+  if ((jentry==NULL)
+      || (0!=json_object_set_new(jentry, "peer", json_string(peer_str)))
+      || (0!=json_object_set_new(jentry, "expires_in", json_integer(remaining)))
+      || (0!=json_object_set_new(jentry, "message", json_string(encoded)))
+      || (0!=json_array_append_new(jupds, jentry))) {
+    if (jentry!=NULL)
+      json_decref(jentry);
+    goto cleanup;
+  }
+  rc=TRP_SUCCESS;
+
+cleanup:
+  if (encoded!=NULL)
+    tr_msg_free_encoded(encoded);
+  if (peer_str!=NULL)
+    free(peer_str);
+  return rc;
+}
+
+/* an update recreating a route as its peer sent it to us */
+static TRP_UPD *trps_state_route_upd(TALLOC_CTX *mem_ctx, TRP_ROUTE *route)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_UPD *upd=trp_upd_new(tmp_ctx);
+  TRP_INFOREC *rec=trp_inforec_new(tmp_ctx, TRP_INFOREC_TYPE_ROUTE);
+
+  if ((upd==NULL) || (rec==NULL)) {
+    upd=NULL;
+    goto cleanup;
+  }
+
+  trp_upd_set_comm(upd, trp_route_dup_comm(route));
+  trp_upd_set_realm(upd, trp_route_dup_realm(route));
+  if ((trp_upd_get_comm(upd)==NULL)
+      || (trp_upd_get_realm(upd)==NULL)
+      || (TRP_SUCCESS!=trp_inforec_set_trust_router(rec,
+                                                    trp_route_dup_trust_router(route),
+                                                    trp_route_get_trust_router_port(route)))
+      || (TRP_SUCCESS!=trp_inforec_set_next_hop(rec,
+                                                trp_route_dup_next_hop(route),
+                                                trp_route_get_next_hop_port(route)))
+      || (TRP_SUCCESS!=trp_inforec_set_metric(rec, trp_route_get_metric(route)))
+      || (TRP_SUCCESS!=trp_inforec_set_interval(rec, trp_route_get_interval(route)))) {
+    upd=NULL;
+    goto cleanup;
+  }
+  trp_upd_add_inforec(upd, rec);
+  talloc_steal(mem_ctx, upd);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return upd;
+}
+
+/* an update recreating a community membership as the peer it came from sent it to us */
+static TRP_UPD *trps_state_memb_upd(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_COMM_MEMB *memb)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_UPD *upd=trp_upd_new(tmp_ctx);
+  TRP_INFOREC *rec=trps_memb_to_inforec(tmp_ctx, trps, memb);
+
+  if ((upd==NULL) || (rec==NULL)) {
+    upd=NULL;
+    goto cleanup;
+  }
+
+  trp_upd_set_comm(upd, tr_comm_dup_id(tr_comm_memb_get_comm(memb)));
+  trp_upd_set_realm(upd, tr_dup_name(tr_comm_memb_get_realm_id(memb)));
+  if ((trp_upd_get_comm(upd)==NULL)
+      || (trp_upd_get_realm(upd)==NULL)
+      || (TRP_SUCCESS!=trp_inforec_set_interval(rec, tr_comm_memb_get_interval(memb)))) {
+    upd=NULL;
+    goto cleanup;
+  }
+  trp_upd_add_inforec(upd, rec);
+  talloc_steal(mem_ctx, upd);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return upd;
+}
+
+/* find a GSS name for the peer a membership was learned from, NULL if it is not a peer */
+static TR_NAME *trps_state_memb_peer(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_COMM_MEMB *memb)
+{
+  TR_NAME *last_hop=tr_provenance_get_last_hop(tr_comm_memb_get_provenance(memb));
+  TRP_PTABLE_ITER *iter=NULL;
+  TRP_PEER *peer=NULL;
+  TR_NAME *gssname=NULL;
+
+  if ((last_hop==NULL) || (trps->ptable==NULL))
+    return NULL;
+
+  iter=trp_ptable_iter_new(mem_ctx);
+  if (iter==NULL)
+    return NULL;
+  for (peer=trp_ptable_iter_first(iter, trps->ptable); peer!=NULL; peer=trp_ptable_iter_next(iter)) {
+    if (0==tr_name_cmp(trp_peer_get_label(peer), last_hop)) {
+      if ((trp_peer_get_gss_names(peer)!=NULL) && (tr_gss_names_length(trp_peer_get_gss_names(peer))>0))
+        gssname=tr_gss_names_index(trp_peer_get_gss_names(peer), 0);
+      break;
+    }
+  }
+  trp_ptable_iter_free(iter);
+  return gssname;
+}
+
+/* add the non-local routes that have not been retracted */
+static TRP_RC trps_state_add_routes(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, json_t *jupds, struct timespec *now, size_t *n_saved)
+{
+  TRP_ROUTE **routes=NULL;
+  size_t n_routes=0;
+  size_t ii=0;
+  TRP_UPD *upd=NULL;
+  time_t remaining=0;
+  TRP_RC rc=TRP_SUCCESS;
+
+  routes=trp_rtable_get_entries(mem_ctx, trps->rtable, &n_routes);
+  for (ii=0; ii<n_routes; ii++) {
+    if (trp_route_is_local(routes[ii]) || (!trp_metric_is_finite(trp_route_get_metric(routes[ii]))))
+      continue;
+
+    remaining=trps_state_remaining(trp_route_get_expiry(routes[ii]), now);
+    if (remaining==0)
+      continue;
+
+    upd=trps_state_route_upd(mem_ctx, routes[ii]);
+    if ((upd==NULL) || (TRP_SUCCESS!=trps_state_add_upd(jupds, upd, trp_route_get_peer(routes[ii]), remaining))) {
+      rc=TRP_NOMEM;
+      break;
+    }
+    (*n_saved)++;
+  }
+  return rc;
+}
+
+/* add the memberships learned from peers that have not expired */
+static TRP_RC trps_state_add_membs(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, json_t *jupds, struct timespec *now, size_t *n_saved)
+{
+  TR_COMM_ITER *iter=tr_comm_iter_new(mem_ctx);
+  TR_COMM_MEMB *memb=NULL;
+  TR_NAME *peer=NULL;
+  TRP_UPD *upd=NULL;
+  time_t remaining=0;
+
+  if (iter==NULL)
+    return TRP_NOMEM;
+
+  for (memb=tr_comm_memb_iter_all_first(iter, trps->ctable);
+       memb!=NULL;
+       memb=tr_comm_memb_iter_all_next(iter)) {
+    if ((tr_comm_memb_get_origin(memb)==NULL) || (tr_comm_memb_get_times_expired(memb)>0))
+      continue;
+
+    remaining=trps_state_remaining(tr_comm_memb_get_expiry(memb), now);
+    if (remaining==0)
+      continue;
+
+    peer=trps_state_memb_peer(mem_ctx, trps, memb);
+    if (peer==NULL)
+      continue;
+
+    upd=trps_state_memb_upd(mem_ctx, trps, memb);
+    if ((upd==NULL) || (TRP_SUCCESS!=trps_state_add_upd(jupds, upd, peer, remaining)))
+      return TRP_NOMEM;
+    (*n_saved)++;
+  }
+  return TRP_SUCCESS;
+}
+
+static int trps_state_write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t n=0;
+
+  while (len>0) {
+    n=write(fd, buf, len);
+    if (n<0) {
+      if (errno==EINTR)
+        continue;
+      return -1;
+    }
+    buf+=n;
+    len-=(size_t)n;
+  }
+  return 0;
+}
+
+/**
+ * Check whether the routing state should be saved again
+ *
+ * The state is saved periodically in case we do not get to save it on exit. Writing
+ * it costs a pass over both tables, so this limits the saves to one every
+ * TRPS_STATE_SAVE_INTERVAL seconds.
+ *
+ * @param trps Server instance
+ * @return nonzero if a state file is configured and the interval has passed since the last save
+ */
+int trps_state_save_due(TRPS_INSTANCE *trps)
+{
+  struct timespec now={0,0};
+
+  if (trps->state_file==NULL)
+    return 0;
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_state_save_due: could not read clock.");
+    return 0;
+  }
+  return (now.tv_sec - trps->state_saved.tv_sec) >= TRPS_STATE_SAVE_INTERVAL;
+}
+
+/**
+ * Save the routing state learned from peers
+ *
+ * Writes the routes and community memberships learned from peers, with the time each
+ * has left before it expires, to the state file. The file is written under a temporary
+ * name and renamed into place, so a reader never sees a partial file. Does nothing if
+ * no state file is configured.
+ *
+ * @param trps Server instance
+ * @return TRP_SUCCESS on success, otherwise an error code
+ */
+TRP_RC trps_save_state(TRPS_INSTANCE *trps)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  struct timespec now={0,0};
+  json_t *jstate=NULL;
+  json_t *jupds=NULL;
+  char *json=NULL;
+  char *tmp_file=NULL;
+  size_t n_saved=0;
+  int fd=-1;
+  TRP_RC rc=TRP_ERROR;
+
+  if (trps->state_file==NULL) {
+    rc=TRP_SUCCESS;
+    goto cleanup;
+  }
+
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_save_state: could not read clock.");
+    goto cleanup;
+  }
+
+  jstate=json_object();
+  jupds=json_array();
+  if ((jstate==NULL) || (jupds==NULL)) {
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+  json_object_set_new(jstate, "version", json_integer(TRPS_STATE_VERSION));
+  json_object_set_new(jstate, "saved", json_integer(time(NULL)));
+  json_object_set(jstate, "updates", jupds);
+
+  if ((TRP_SUCCESS!=trps_state_add_routes(tmp_ctx, trps, jupds, &now, &n_saved))
+      || (TRP_SUCCESS!=trps_state_add_membs(tmp_ctx, trps, jupds, &now, &n_saved))) {
+    tr_err("trps_save_state: unable to encode routing state.");
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  json=json_dumps(jstate, JSON_COMPACT);
+  tmp_file=talloc_asprintf(tmp_ctx, "%s.tmp", trps->state_file);
+  if ((json==NULL) || (tmp_file==NULL)) {
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  fd=open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd<0) {
+    tr_err("trps_save_state: unable to create %s (%s).", tmp_file, strerror(errno));
+    goto cleanup;
+  }
+  if ((0!=trps_state_write_all(fd, json, strlen(json)))
+      || (0!=fsync(fd))) {
+    tr_err("trps_save_state: error writing %s (%s).", tmp_file, strerror(errno));
+    unlink(tmp_file);
+    goto cleanup;
+  }
+  close(fd);
+  fd=-1;
+  if (0!=rename(tmp_file, trps->state_file)) {
+    tr_err("trps_save_state: unable to rename %s to %s (%s).", tmp_file, trps->state_file, strerror(errno));
+    unlink(tmp_file);
+    goto cleanup;
+  }
+
+  tr_debug("trps_save_state: saved %u routes and memberships to %s.", (unsigned) n_saved, trps->state_file);
+  trps->state_saved=now;
+  rc=TRP_SUCCESS;
+
+cleanup:
+  if (fd>=0)
+    close(fd);
+  if (json!=NULL)
+    free(json);
+  if (jupds!=NULL)
+    json_decref(jupds);
+  if (jstate!=NULL)
+    json_decref(jstate);
+  talloc_free(tmp_ctx);
+  return rc;
+}
+
+/* replay one saved update, returns 1 if it was applied */
+static int trps_state_restore_one(TRPS_INSTANCE *trps, json_t *jentry, time_t elapsed, struct timespec *now)
+{
+  json_t *jpeer=json_object_get(jentry, "peer");
+  json_t *jexpires=json_object_get(jentry, "expires_in");
+  json_t *jmsg=json_object_get(jentry, "message");
+  TR_NAME *peer=NULL;
+  TR_MSG *msg=NULL;
+  TRP_UPD *upd=NULL;
+  struct timespec expiry={0,0};
+  int applied=0;
+
+  if ((!json_is_string(jpeer)) || (!json_is_integer(jexpires)) || (!json_is_string(jmsg))) {
+    tr_notice("trps_load_state: skipping malformed entry.");
+    goto cleanup;
+  }
+
+  if (json_integer_value(jexpires) <= elapsed)
+    goto cleanup; /* expired while we were not running */
+
+  peer=tr_new_name(json_string_value(jpeer));
+  if (peer==NULL)
+    goto cleanup;
+  if (trps_get_peer_by_gssname(trps, peer)==NULL) {
+    tr_debug("trps_load_state: %.*s is no longer a peer, skipping its entry.", peer->len, peer->buf);
+    goto cleanup;
+  }
+
+  msg=tr_msg_decode(NULL, json_string_value(jmsg), strlen(json_string_value(jmsg)));
+  if ((msg==NULL) || (tr_msg_get_msg_type(msg)!=TRP_UPDATE)) {
+    tr_notice("trps_load_state: skipping entry that is not a TRP update.");
+    goto cleanup;
+  }
+
+  expiry.tv_sec=now->tv_sec + (json_integer_value(jexpires) - elapsed);
+  expiry.tv_nsec=now->tv_nsec;
+  for (upd=tr_msg_get_trp_upd(msg); upd!=NULL; upd=trp_upd_get_next(upd)) {
+    trp_upd_set_peer(upd, tr_dup_name(peer));
+    if (TRP_SUCCESS==trps_restore_update(trps, upd, &expiry))
+      applied=1;
+  }
+
+cleanup:
+  if (msg!=NULL)
+    tr_msg_free_decoded(msg);
+  if (peer!=NULL)
+    tr_free_name(peer);
+  return applied;
+}
+
+/**
+ * Restore the routing state saved by trps_save_state()
+ *
+ * Call after the configuration, including the peer table and local routes, is in place.
+ * Entries that would have expired by now, and entries from peers that are no longer
+ * configured, are skipped. The rest are restored as provisional until their peers
+ * confirm them. Does nothing if no state file is configured or it does not exist.
+ *
+ * @param trps Server instance
+ * @return TRP_SUCCESS if the state was loaded or there was none, otherwise an error code
+ */
+TRP_RC trps_load_state(TRPS_INSTANCE *trps)
+{
+  json_t *jstate=NULL;
+  json_t *jupds=NULL;
+  json_t *jsaved=NULL;
+  json_error_t err;
+  struct timespec now={0,0};
+  time_t elapsed=0;
+  size_t n_restored=0;
+  size_t ii=0;
+  TRP_RC rc=TRP_ERROR;
+
+  if (trps->state_file==NULL)
+    return TRP_SUCCESS;
+
+  if (0!=access(trps->state_file, F_OK)) {
+    tr_debug("trps_load_state: no saved routing state in %s.", trps->state_file);
+    return TRP_SUCCESS;
+  }
+
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_load_state: could not read clock.");
+    return TRP_ERROR;
+  }
+
+  jstate=json_load_file(trps->state_file, JSON_DISABLE_EOF_CHECK, &err);
+  if (jstate==NULL) {
+    tr_notice("trps_load_state: unable to parse %s (line %d), ignoring it.", trps->state_file, err.line);
+    goto cleanup;
+  }
+
+  if ((!json_is_integer(json_object_get(jstate, "version")))
+      || (json_integer_value(json_object_get(jstate, "version"))!=TRPS_STATE_VERSION)) {
+    tr_notice("trps_load_state: %s has an unsupported version, ignoring it.", trps->state_file);
+    goto cleanup;
+  }
+
+  jsaved=json_object_get(jstate, "saved");
+  jupds=json_object_get(jstate, "updates");
+  if ((!json_is_integer(jsaved)) || (!json_is_array(jupds))) {
+    tr_notice("trps_load_state: %s is malformed, ignoring it.", trps->state_file);
+    goto cleanup;
+  }
+
+  /* time that passed while we were not running counts against the saved expiry times */
+  elapsed=time(NULL) - (time_t) json_integer_value(jsaved);
+  if (elapsed<0)
+    elapsed=0;
+
+  for (ii=0; ii<json_array_size(jupds); ii++)
+    n_restored+=trps_state_restore_one(trps, json_array_get(jupds, ii), elapsed, &now);
+
+  trps_update_active_routes(trps);
+  tr_notice("trps_load_state: restored %u saved updates from %s.", (unsigned) n_restored, trps->state_file);
+  rc=TRP_SUCCESS;
+
+cleanup:
+  if (jstate!=NULL)
+    json_decref(jstate);
+  return rc;
+}